@@ -6,6 +6,7 @@
 #include <numeric>
 #include <vector>
 #include "bits.h"
+#include "static_rans.h"
 
 namespace ans {
 
@@ -50,12 +51,27 @@ namespace ans {
     Encoder() { }
   };
 
+  // Everything a decoder needs that only depends on the Options: normalized
+  // frequencies and a slot-to-symbol lookup table. Building it is the expensive
+  // part of creating a decoder, so decoders that share Options (e.g. all of the
+  // streams of an interleaved decode) should share a single table.
+  class DecodeTable {
+   public:
+     virtual ~DecodeTable() { }
+     virtual uint32_t b() const = 0;
+     static std::shared_ptr<const DecodeTable> Create(const Options &opts);
+  protected:
+    DecodeTable() { }
+  };
+
   class Decoder {
    public:
      virtual ~Decoder() { }
      virtual uint32_t Decode(BitReader *r) = 0;
      virtual uint32_t GetState() const = 0;
      static std::unique_ptr<Decoder> Create(uint32_t state, const Options &opts);
+     static std::unique_ptr<Decoder> Create(uint32_t state,
+                                            const std::shared_ptr<const DecodeTable> &table);
   protected:
     Decoder() { }
   };
@@ -67,6 +83,17 @@ namespace ans {
                                          size_t num_symbols,
                                          const Options &opts, size_t num_streams);
 
+  std::vector<uint8_t> DecodeInterleaved(const std::vector<uint8_t> &data,
+                                         size_t num_symbols,
+                                         const std::shared_ptr<const DecodeTable> &table,
+                                         size_t num_streams);
+
+  // Decodes directly out of the given bytes without copying them.
+  std::vector<uint8_t> DecodeInterleaved(const uint8_t *data, size_t data_sz,
+                                         size_t num_symbols,
+                                         const std::shared_ptr<const DecodeTable> &table,
+                                         size_t num_streams);
+
   // If we expect our symbol frequency to have 1 << 11 precision, we only have 1 << 4
   // available for state-precision
   namespace ocl {
@@ -74,8 +101,38 @@ namespace ans {
     static const size_t kNumEncodedSymbols = 256;
     static const size_t kThreadsPerEncodingGroup = 32;
 
+    // The codec matching GetOpenCLOptions. Encoder::Create, Decoder::Create
+    // and the interleaved coders use it whenever they're given those options.
+    typedef StaticRansCodec<1 << 16, 1 << 4, kANSTableSize> Codec;
+
     std::vector<uint32_t> NormalizeFrequencies(const std::vector<uint32_t> &F);
     ans::Options GetOpenCLOptions(const std::vector<uint32_t> &F);
+    bool IsOpenCLOptions(const ans::Options &opts);
+
+    // Builds the slot-to-symbol table used by DecodeGroup from frequencies that
+    // are already normalized to kANSTableSize. Each entry packs the frequency
+    // (12 bits), the cumulative frequency (11 bits) and the symbol (8 bits) so
+    // that a single 32-bit load or gather fetches all three.
+    std::vector<uint32_t> BuildDecodeTable(const std::vector<uint32_t> &F);
+
+    enum EDecodeImpl {
+      eDecodeImpl_Best,
+      eDecodeImpl_Scalar,
+      eDecodeImpl_SSE41,
+      eDecodeImpl_AVX2
+    };
+
+    bool IsDecodeImplSupported(EDecodeImpl impl);
+
+    // Decodes one group of kThreadsPerEncodingGroup interleaved streams with
+    // kNumEncodedSymbols symbols each, i.e. the output of EncodeInterleaved with
+    // the OpenCL options. data points to the start of the group's words and
+    // data_sz includes the states at the end. The result is bit-exact with the
+    // ans_decode kernel and is written to the
+    // kThreadsPerEncodingGroup * kNumEncodedSymbols bytes at out. Returns
+    // false if the group is malformed, in which case out is left untouched.
+    bool DecodeGroup(const uint32_t *table, const uint8_t *data, size_t data_sz,
+                     uint8_t *out, EDecodeImpl impl = eDecodeImpl_Best);
   }
 
 }  // namespace ans
@@ -0,0 +1,396 @@
+#include "ans.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define ANS_HAVE_X86_SIMD 1
+#  define ANS_TARGET(x) __attribute__((target(x)))
+#  include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  define ANS_HAVE_X86_SIMD 1
+#  define ANS_TARGET(x)
+#  include <intrin.h>
+#  include <immintrin.h>
+#endif
+
+namespace {
+
+static const uint32_t kTableSizeLog = 11;
+static const uint32_t kDecoderL = (1 << 4) * ans::ocl::kANSTableSize;
+static const size_t kNumLanes = ans::ocl::kThreadsPerEncodingGroup;
+static const size_t kNumSymbols = ans::ocl::kNumEncodedSymbols;
+
+// Layout of a decode table entry
+static const uint32_t kFreqMask = (1 << 12) - 1;
+static const uint32_t kCumFreqShift = 12;
+static const uint32_t kCumFreqMask = (1 << 11) - 1;
+static const uint32_t kSymbolShift = 23;
+
+static_assert((1 << kTableSizeLog) == ans::ocl::kANSTableSize,
+              "Table size log must match the OpenCL table size!");
+static_assert(ans::ocl::kANSTableSize <= kFreqMask,
+              "Frequencies must fit in the decode table entries!");
+static_assert(kNumLanes == 32, "SIMD decoders assume 32 lanes per group!");
+
+// All of the decoders below write the symbols decoded at step i for each lane
+// into symbols[i * kNumLanes + lane]. This keeps the stores contiguous, and we
+// transpose into the output layout at the end. Each one starts reading words
+// backwards from *next, leaves the index of the next (unread) 16-bit word
+// there, and returns false if the group runs out of words.
+
+static bool DecodeGroupScalar(const uint32_t *table, const uint16_t *words, size_t *next,
+                              uint32_t *state, uint8_t *symbols) {
+  for (size_t i = 0; i < kNumSymbols; ++i) {
+    for (size_t lane = 0; lane < kNumLanes; ++lane) {
+      const uint32_t slot = state[lane] & (ans::ocl::kANSTableSize - 1);
+      const uint32_t entry = table[slot];
+      const uint32_t freq = entry & kFreqMask;
+      const uint32_t cum_freq = (entry >> kCumFreqShift) & kCumFreqMask;
+      state[lane] = (state[lane] >> kTableSizeLog) * freq - cum_freq + slot;
+      symbols[i * kNumLanes + lane] = static_cast<uint8_t>(entry >> kSymbolShift);
+    }
+
+    // Lanes with larger IDs read words closer to the end of the stream, see
+    // ans_decode_single.
+    for (size_t lane = kNumLanes; lane > 0; --lane) {
+      if (state[lane - 1] < kDecoderL) {
+        if (0 == *next) {
+          return false;
+        }
+        state[lane - 1] = (state[lane - 1] << 16) | words[--(*next)];
+      }
+    }
+  }
+
+  return true;
+}
+
+#ifdef ANS_HAVE_X86_SIMD
+
+// For each mask of lanes that need to renormalize, the index of the word that
+// each of those lanes reads, relative to the first word read by the register.
+struct ExpandTables {
+  uint32_t avx2_perm[256][8];
+  uint8_t sse_shuffle[16][16];
+  uint8_t count[256];
+
+  ExpandTables() {
+    for (uint32_t mask = 0; mask < 256; ++mask) {
+      uint32_t rank = 0;
+      for (uint32_t lane = 0; lane < 8; ++lane) {
+        avx2_perm[mask][lane] = rank;
+        if (mask & (1 << lane)) {
+          rank++;
+        }
+      }
+      count[mask] = static_cast<uint8_t>(rank);
+    }
+
+    // Zero extend each 16-bit word into its 32-bit lane
+    for (uint32_t mask = 0; mask < 16; ++mask) {
+      for (uint32_t lane = 0; lane < 4; ++lane) {
+        const uint8_t word = static_cast<uint8_t>(avx2_perm[mask][lane]);
+        sse_shuffle[mask][4 * lane + 0] = 2 * word;
+        sse_shuffle[mask][4 * lane + 1] = 2 * word + 1;
+        sse_shuffle[mask][4 * lane + 2] = 0x80;
+        sse_shuffle[mask][4 * lane + 3] = 0x80;
+      }
+    }
+  }
+};
+
+static const ExpandTables &GetExpandTables() {
+  static const ExpandTables tables;
+  return tables;
+}
+
+ANS_TARGET("sse4.1")
+static bool DecodeGroupSSE41(const uint32_t *table, const uint16_t *words, size_t *next,
+                             uint32_t *state, uint8_t *symbols) {
+  static const size_t kNumRegs = kNumLanes / 4;
+  const ExpandTables &expand = GetExpandTables();
+
+  __m128i s[kNumRegs];
+  for (size_t r = 0; r < kNumRegs; ++r) {
+    s[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state) + r);
+  }
+
+  const __m128i slot_mask = _mm_set1_epi32(ans::ocl::kANSTableSize - 1);
+  const __m128i freq_mask = _mm_set1_epi32(kFreqMask);
+  const __m128i cum_freq_mask = _mm_set1_epi32(kCumFreqMask);
+  const __m128i L = _mm_set1_epi32(kDecoderL);
+
+  for (size_t i = 0; i < kNumSymbols; ++i) {
+    __m128i syms[kNumRegs];
+    for (size_t r = 0; r < kNumRegs; ++r) {
+      const __m128i slot = _mm_and_si128(s[r], slot_mask);
+
+      // No gathers before AVX2...
+      uint32_t slots[4];
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(slots), slot);
+      const __m128i entry = _mm_setr_epi32(table[slots[0]], table[slots[1]],
+                                           table[slots[2]], table[slots[3]]);
+
+      const __m128i freq = _mm_and_si128(entry, freq_mask);
+      const __m128i cum_freq = _mm_and_si128(_mm_srli_epi32(entry, kCumFreqShift), cum_freq_mask);
+      const __m128i x = _mm_mullo_epi32(_mm_srli_epi32(s[r], kTableSizeLog), freq);
+      s[r] = _mm_add_epi32(_mm_sub_epi32(x, cum_freq), slot);
+      syms[r] = _mm_srli_epi32(entry, kSymbolShift);
+    }
+
+    for (size_t r = 0; r < kNumRegs; r += 4) {
+      const __m128i lo = _mm_packus_epi32(syms[r + 0], syms[r + 1]);
+      const __m128i hi = _mm_packus_epi32(syms[r + 2], syms[r + 3]);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(symbols + i * kNumLanes + 4 * r),
+                       _mm_packus_epi16(lo, hi));
+    }
+
+    for (size_t r = kNumRegs; r > 0; --r) {
+      // States are always less than 2^31, so a signed compare is fine.
+      const __m128i needs_bits = _mm_cmpgt_epi32(L, s[r - 1]);
+      const int mask = _mm_movemask_ps(_mm_castsi128_ps(needs_bits));
+
+      // The loads below read past the words we need, but never past the
+      // states at the end of the group.
+      if (*next < expand.count[mask]) {
+        return false;
+      }
+      *next -= expand.count[mask];
+
+      const __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(words + *next));
+      const __m128i shuffle =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(expand.sse_shuffle[mask]));
+      const __m128i w = _mm_shuffle_epi8(packed, shuffle);
+      const __m128i renormalized = _mm_or_si128(_mm_slli_epi32(s[r - 1], 16), w);
+      s[r - 1] = _mm_blendv_epi8(s[r - 1], renormalized, needs_bits);
+    }
+  }
+
+  for (size_t r = 0; r < kNumRegs; ++r) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state) + r, s[r]);
+  }
+
+  return true;
+}
+
+ANS_TARGET("avx2")
+static bool DecodeGroupAVX2(const uint32_t *table, const uint16_t *words, size_t *next,
+                            uint32_t *state, uint8_t *symbols) {
+  static const size_t kNumRegs = kNumLanes / 8;
+  const ExpandTables &expand = GetExpandTables();
+
+  __m256i s[kNumRegs];
+  for (size_t r = 0; r < kNumRegs; ++r) {
+    s[r] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(state) + r);
+  }
+
+  const __m256i slot_mask = _mm256_set1_epi32(ans::ocl::kANSTableSize - 1);
+  const __m256i freq_mask = _mm256_set1_epi32(kFreqMask);
+  const __m256i cum_freq_mask = _mm256_set1_epi32(kCumFreqMask);
+  const __m256i L = _mm256_set1_epi32(kDecoderL);
+
+  // _mm256_packus_* work within 128-bit halves, this puts the bytes back in order.
+  const __m256i unpack_perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  const int *int_table = reinterpret_cast<const int *>(table);
+
+  for (size_t i = 0; i < kNumSymbols; ++i) {
+    __m256i syms[kNumRegs];
+    for (size_t r = 0; r < kNumRegs; ++r) {
+      const __m256i slot = _mm256_and_si256(s[r], slot_mask);
+      const __m256i entry = _mm256_i32gather_epi32(int_table, slot, 4);
+
+      const __m256i freq = _mm256_and_si256(entry, freq_mask);
+      const __m256i cum_freq =
+        _mm256_and_si256(_mm256_srli_epi32(entry, kCumFreqShift), cum_freq_mask);
+      const __m256i x = _mm256_mullo_epi32(_mm256_srli_epi32(s[r], kTableSizeLog), freq);
+      s[r] = _mm256_add_epi32(_mm256_sub_epi32(x, cum_freq), slot);
+      syms[r] = _mm256_srli_epi32(entry, kSymbolShift);
+    }
+
+    const __m256i lo = _mm256_packus_epi32(syms[0], syms[1]);
+    const __m256i hi = _mm256_packus_epi32(syms[2], syms[3]);
+    const __m256i packed_syms =
+      _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), unpack_perm);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(symbols + i * kNumLanes), packed_syms);
+
+    for (size_t r = kNumRegs; r > 0; --r) {
+      // States are always less than 2^31, so a signed compare is fine.
+      const __m256i needs_bits = _mm256_cmpgt_epi32(L, s[r - 1]);
+      const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(needs_bits));
+
+      // The loads below read past the words we need, but never past the
+      // states at the end of the group.
+      if (*next < expand.count[mask]) {
+        return false;
+      }
+      *next -= expand.count[mask];
+
+      const __m256i packed = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + *next)));
+      const __m256i perm =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(expand.avx2_perm[mask]));
+      const __m256i w = _mm256_permutevar8x32_epi32(packed, perm);
+      const __m256i renormalized = _mm256_or_si256(_mm256_slli_epi32(s[r - 1], 16), w);
+      s[r - 1] = _mm256_blendv_epi8(s[r - 1], renormalized, needs_bits);
+    }
+  }
+
+  for (size_t r = 0; r < kNumRegs; ++r) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state) + r, s[r]);
+  }
+
+  return true;
+}
+
+static bool CPUSupports(ans::ocl::EDecodeImpl impl) {
+#if defined(__GNUC__)
+  switch (impl) {
+  case ans::ocl::eDecodeImpl_SSE41: return __builtin_cpu_supports("sse4.1") != 0;
+  case ans::ocl::eDecodeImpl_AVX2: return __builtin_cpu_supports("avx2") != 0;
+  default: return true;
+  }
+#else
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+
+  __cpuid(info, 1);
+  const bool has_sse41 = (info[2] & (1 << 19)) != 0;
+  const bool has_osxsave_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+
+  bool has_avx2 = false;
+  if (has_osxsave_avx && max_leaf >= 7 && (_xgetbv(0) & 0x6) == 0x6) {
+    __cpuidex(info, 7, 0);
+    has_avx2 = (info[1] & (1 << 5)) != 0;
+  }
+
+  switch (impl) {
+  case ans::ocl::eDecodeImpl_SSE41: return has_sse41;
+  case ans::ocl::eDecodeImpl_AVX2: return has_avx2;
+  default: return true;
+  }
+#endif
+}
+
+#endif  // ANS_HAVE_X86_SIMD
+
+static ans::ocl::EDecodeImpl BestDecodeImpl() {
+#ifdef ANS_HAVE_X86_SIMD
+  if (CPUSupports(ans::ocl::eDecodeImpl_AVX2)) {
+    return ans::ocl::eDecodeImpl_AVX2;
+  }
+
+  if (CPUSupports(ans::ocl::eDecodeImpl_SSE41)) {
+    return ans::ocl::eDecodeImpl_SSE41;
+  }
+#endif
+  return ans::ocl::eDecodeImpl_Scalar;
+}
+
+}  // namespace
+
+namespace ans {
+namespace ocl {
+
+std::vector<uint32_t> BuildDecodeTable(const std::vector<uint32_t> &F) {
+  assert(F.size() <= kNumEncodedSymbols);
+
+  std::vector<uint32_t> table(kANSTableSize, 0);
+  uint32_t cum_freq = 0;
+  for (uint32_t symbol = 0; symbol < F.size(); ++symbol) {
+    assert(cum_freq + F[symbol] <= kANSTableSize);
+    for (uint32_t slot = cum_freq; slot < cum_freq + F[symbol]; ++slot) {
+      table[slot] = F[symbol] | (cum_freq << kCumFreqShift) | (symbol << kSymbolShift);
+    }
+    cum_freq += F[symbol];
+  }
+
+  assert(cum_freq == kANSTableSize || !"Frequencies must be normalized!");
+  return std::move(table);
+}
+
+bool IsDecodeImplSupported(EDecodeImpl impl) {
+  switch (impl) {
+  case eDecodeImpl_Best:
+  case eDecodeImpl_Scalar:
+    return true;
+
+#ifdef ANS_HAVE_X86_SIMD
+  case eDecodeImpl_SSE41:
+  case eDecodeImpl_AVX2:
+    return CPUSupports(impl);
+#endif
+
+  default:
+    return false;
+  }
+}
+
+bool DecodeGroup(const uint32_t *table, const uint8_t *data, size_t data_sz,
+                 uint8_t *out, EDecodeImpl impl) {
+  static const size_t kStatesSz = kNumLanes * sizeof(uint32_t);
+  if (data_sz < kStatesSz || (data_sz % 2) != 0) {
+    return false;
+  }
+
+  // Every state has to be normalized, otherwise the SIMD decoders' signed
+  // compares stop working.
+  uint32_t state[kNumLanes];
+  memcpy(state, data + data_sz - kStatesSz, kStatesSz);
+  for (size_t lane = 0; lane < kNumLanes; ++lane) {
+    if (state[lane] < kDecoderL || state[lane] >= (kDecoderL << 16)) {
+      return false;
+    }
+  }
+
+  const uint16_t *words = reinterpret_cast<const uint16_t *>(data);
+  const size_t num_words = (data_sz - kStatesSz) / 2;
+
+  static const EDecodeImpl kBestImpl = BestDecodeImpl();
+  if (eDecodeImpl_Best == impl) {
+    impl = kBestImpl;
+  } else if (!IsDecodeImplSupported(impl)) {
+    assert(!"Requested decoder isn't supported on this CPU!");
+    impl = eDecodeImpl_Scalar;
+  }
+
+  uint8_t symbols[kNumSymbols * kNumLanes];
+  size_t words_left = num_words;
+  bool ok = false;
+  switch (impl) {
+#ifdef ANS_HAVE_X86_SIMD
+  case eDecodeImpl_AVX2:
+    ok = DecodeGroupAVX2(table, words, &words_left, state, symbols);
+    break;
+
+  case eDecodeImpl_SSE41:
+    ok = DecodeGroupSSE41(table, words, &words_left, state, symbols);
+    break;
+#endif
+
+  default:
+    ok = DecodeGroupScalar(table, words, &words_left, state, symbols);
+    break;
+  }
+
+  // The only thing left over should be the padding that ByteEncoder uses to
+  // align groups to four bytes.
+  if (!ok || words_left > 1) {
+    return false;
+  }
+
+  // Symbols for each lane are stored in reverse.
+  for (size_t lane = 0; lane < kNumLanes; ++lane) {
+    uint8_t *lane_out = out + lane * kNumSymbols;
+    for (size_t i = 0; i < kNumSymbols; ++i) {
+      lane_out[kNumSymbols - 1 - i] = symbols[i * kNumLanes + lane];
+    }
+  }
+
+  return true;
+}
+
+}  // namespace ocl
+}  // namespace ans
@@ -16,5 +16,10 @@ namespace ocl {
     opts.type = eType_rANS;
     return opts;
   }
+
+  bool IsOpenCLOptions(const ans::Options &opts) {
+    return opts.type == eType_rANS && opts.b == (1 << 16) && opts.k == (1 << 4) &&
+      opts.M == kANSTableSize;
+  }
 }  // namespace ocl
 }  // namespace ans
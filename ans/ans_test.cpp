@@ -1,8 +1,10 @@
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <numeric>
 
 #include "ans.h"
+#include "histogram.h"
 #include "gtest/gtest.h"
 
 TEST(Codec, CanEncodeValues) {
@@ -449,3 +451,378 @@ TEST(Codec, CanInterleaveStreamsWithDifferentSymbolsFromDistributions) {
     }
   }
 }
+
+TEST(Codec, CanInterleaveWithSharedTableAndLargeDenominator) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+  const int num_symbols = 1024;
+  const size_t num_cases = 32;
+
+  // Denominators above 1 << 15 use the bucketed lookup rather than
+  // one table entry per slot.
+  for (uint32_t M : { 1U << 11, 1U << 17, 100003U }) {
+    ans::Options opts;
+    opts.b = 1 << 8;
+    opts.k = 1 << 4;
+    opts.M = M;
+    opts.Fs = { 80, 15, 10, 7, 5, 3, 3, 0, 3, 3, 2, 2, 2, 2, 1 };
+
+    const uint32_t total = std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0U);
+    std::vector<uint8_t> symbols;
+    symbols.reserve(num_symbols * num_cases);
+
+    for (size_t i = 0; i < num_symbols * num_cases; ++i) {
+      uint32_t r = rand() % total;
+      int symbol = 0;
+      uint32_t freq = 0;
+      for (auto f : opts.Fs) {
+        freq += f;
+        if (r < freq) {
+          break;
+        }
+        symbol++;
+      }
+      ASSERT_LT(symbol, opts.Fs.size());
+      symbols.push_back(symbol);
+    }
+
+    std::vector<uint8_t> encoded =
+      ans::EncodeInterleaved(symbols, opts, num_cases);
+
+    std::shared_ptr<const ans::DecodeTable> table = ans::DecodeTable::Create(opts);
+    ASSERT_NE(table, nullptr);
+
+    std::vector<uint8_t> decoded =
+      ans::DecodeInterleaved(encoded, num_symbols * num_cases, table, num_cases);
+
+    ASSERT_EQ(decoded.size(), symbols.size());
+    for (size_t i = 0; i < symbols.size(); ++i) {
+      EXPECT_EQ(decoded[i], symbols[i]) << "M: " << M << ", index: " << i;
+    }
+  }
+}
+
+TEST(Codec, DecodeGroupMatchesInterleavedDecoding) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+  const size_t num_streams = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t num_symbols = num_streams * ans::ocl::kNumEncodedSymbols;
+
+  std::vector<uint32_t> F(256, 0);
+  for (size_t i = 0; i < 64; ++i) {
+    F[i] = 1 + (rand() % 1000) / (1 + i);
+  }
+  F[200] = 3;
+
+  const std::vector<uint32_t> counts = ans::ocl::NormalizeFrequencies(F);
+  const ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+
+  std::vector<uint8_t> symbols;
+  symbols.reserve(num_symbols);
+  const uint32_t total = std::accumulate(F.begin(), F.end(), 0U);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    uint32_t r = rand() % total;
+    uint32_t symbol = 0;
+    for (uint32_t freq = F[0]; freq <= r; freq += F[++symbol]) { }
+    symbols.push_back(static_cast<uint8_t>(symbol));
+  }
+
+  std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+  std::vector<uint8_t> expected =
+    ans::DecodeInterleaved(encoded, num_symbols, opts, num_streams);
+  ASSERT_EQ(expected, symbols);
+
+  std::vector<uint32_t> table = ans::ocl::BuildDecodeTable(counts);
+  for (auto impl : { ans::ocl::eDecodeImpl_Best, ans::ocl::eDecodeImpl_Scalar,
+                     ans::ocl::eDecodeImpl_SSE41, ans::ocl::eDecodeImpl_AVX2 }) {
+    if (!ans::ocl::IsDecodeImplSupported(impl)) {
+      continue;
+    }
+
+    std::vector<uint8_t> decoded(num_symbols, 0);
+    EXPECT_TRUE(ans::ocl::DecodeGroup(table.data(), encoded.data(), encoded.size(),
+                                      decoded.data(), impl));
+    EXPECT_EQ(decoded, symbols) << "Decoder implementation: " << impl;
+
+    // Dropping words from the front of the group means that the decoder runs
+    // out of them before it's done.
+    for (size_t dropped : { 2, 8, 64 }) {
+      EXPECT_FALSE(ans::ocl::DecodeGroup(table.data(), encoded.data() + dropped,
+                                         encoded.size() - dropped, decoded.data(), impl))
+        << "Decoder implementation: " << impl << ", dropped bytes: " << dropped;
+    }
+
+    // Too short to even hold the states
+    EXPECT_FALSE(ans::ocl::DecodeGroup(table.data(), encoded.data() + encoded.size() - 64,
+                                       64, decoded.data(), impl));
+  }
+}
+
+TEST(Codec, OpenCLInterleavedEncodingMatchesGenericEncoder) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+  const size_t num_streams = ans::ocl::kThreadsPerEncodingGroup;
+  const size_t symbols_per_stream = ans::ocl::kNumEncodedSymbols;
+  const size_t num_symbols = num_streams * symbols_per_stream;
+
+  // Cover symbols with a frequency of one, as well as ones that take up
+  // almost all of the table.
+  std::vector<std::vector<uint32_t> > distributions = {
+    { 1, 1, 1, 1, 100000 },
+    { 5, 3, 1, 1, 1, 1, 1, 2, 7, 11, 13 },
+    std::vector<uint32_t>(256, 1),
+  };
+
+  std::vector<uint32_t> random_F(200, 0);
+  for (auto &f : random_F) {
+    f = 1 + rand() % 5000;
+  }
+  distributions.push_back(random_F);
+
+  for (const auto &F : distributions) {
+    const std::vector<uint32_t> counts = ans::ocl::NormalizeFrequencies(F);
+    const ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+
+    std::vector<uint8_t> symbols;
+    symbols.reserve(num_symbols);
+    const uint32_t total = std::accumulate(F.begin(), F.end(), 0U);
+    for (size_t i = 0; i < num_symbols; ++i) {
+      // Mix in uniformly random symbols so that rare ones show up, too.
+      uint32_t symbol = 0;
+      if (rand() % 4 == 0) {
+        symbol = rand() % F.size();
+      } else {
+        uint32_t r = rand() % total;
+        for (uint32_t freq = F[0]; freq <= r; freq += F[++symbol]) { }
+      }
+      symbols.push_back(static_cast<uint8_t>(symbol));
+    }
+
+    std::vector<std::unique_ptr<ans::Encoder> > encoders;
+    for (size_t i = 0; i < num_streams; ++i) {
+      encoders.push_back(ans::Encoder::Create(opts));
+    }
+
+    ans::ContainedBitWriter w;
+    for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
+      for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
+        encoders[strm_idx]->Encode(symbols[strm_idx * symbols_per_stream + sym_idx], &w);
+      }
+    }
+
+    std::vector<uint8_t> expected = w.GetData();
+    for (size_t i = 0; i < num_streams; ++i) {
+      const uint32_t state = encoders[i]->GetState();
+      const uint8_t *state_bytes = reinterpret_cast<const uint8_t *>(&state);
+      expected.insert(expected.end(), state_bytes, state_bytes + 4);
+    }
+
+    std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+    EXPECT_EQ(encoded, expected);
+
+    std::vector<uint8_t> decoded =
+      ans::DecodeInterleaved(encoded, num_symbols, opts, num_streams);
+    EXPECT_EQ(decoded, symbols);
+  }
+}
+
+template<uint32_t B, uint32_t K, uint32_t M>
+static void TestStaticRansCodec(const std::vector<uint32_t> &F) {
+  const size_t num_streams = 16;
+  const size_t num_symbols = num_streams * 300;
+
+  // Same parameters, but not the OpenCL ones, so these use the generic coders.
+  ans::Options opts;
+  opts.type = ans::eType_rANS;
+  opts.b = B;
+  opts.k = K;
+  opts.M = M;
+  opts.Fs = F;
+  ASSERT_FALSE(ans::ocl::IsOpenCLOptions(opts));
+
+  std::vector<uint8_t> symbols;
+  symbols.reserve(num_symbols);
+  const uint32_t total = std::accumulate(F.begin(), F.end(), 0U);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    uint32_t r = rand() % total;
+    uint32_t symbol = 0;
+    for (uint32_t freq = F[0]; freq <= r; freq += F[++symbol]) { }
+    symbols.push_back(static_cast<uint8_t>(symbol));
+  }
+
+  const ans::StaticRansCodec<B, K, M> codec(ans::GenerateHistogram(F, M));
+  std::vector<uint8_t> encoded = codec.EncodeBlock(symbols.data(), num_symbols, num_streams);
+  EXPECT_EQ(encoded, ans::EncodeInterleaved(symbols, opts, num_streams));
+
+  std::vector<uint8_t> decoded(num_symbols, 0);
+  ASSERT_TRUE(codec.DecodeBlock(encoded.data(), encoded.size(), num_streams,
+                                decoded.data(), num_symbols));
+  EXPECT_EQ(decoded, symbols);
+  EXPECT_EQ(ans::DecodeInterleaved(encoded, num_symbols, opts, num_streams), symbols);
+
+  // Truncated data should be rejected rather than read out of bounds.
+  EXPECT_FALSE(codec.DecodeBlock(encoded.data() + ans::StaticRansCodec<B, K, M>::kWordBytes,
+                                 encoded.size() - ans::StaticRansCodec<B, K, M>::kWordBytes,
+                                 num_streams, decoded.data(), num_symbols));
+}
+
+TEST(Codec, StaticRansCodecMatchesGenericCoders) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+
+  std::vector<uint32_t> F(40, 0);
+  for (size_t i = 0; i < F.size(); ++i) {
+    F[i] = 1 + (rand() % 1000) / (1 + i);
+  }
+
+  TestStaticRansCodec<1 << 8, 1 << 2, 1 << 6>(F);
+  TestStaticRansCodec<1 << 16, 1 << 3, 1 << 12>(F);
+  TestStaticRansCodec<1 << 16, 1 << 1, 1 << 14>(F);
+}
+
+TEST(Codec, CanDecodeTANSBitStreams) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+  const size_t num_symbols = 256;
+  const size_t num_streams = 32;
+
+  struct TestCase {
+    uint32_t b;
+    uint32_t k;
+    uint32_t M;
+  };
+
+  // With b == 2 and L a power of two up to 1 << 16, tANS decodes with packed
+  // transitions.
+  // The others exercise the generic path for streams that don't end on a
+  // byte boundary.
+  const TestCase test_cases[] = {
+    { 2, 1, 1 << 11 },
+    { 2, 2, 1 << 10 },
+    { 2, 1, 1000 },
+    { 2, 1, 1 << 17 },
+    { 8, 2, 1 << 11 },
+  };
+
+  for (const auto &test : test_cases) {
+    ans::Options opts;
+    opts.type = ans::eType_tANS;
+    opts.b = test.b;
+    opts.k = test.k;
+    opts.M = test.M;
+    opts.Fs = { 80, 15, 10, 7, 5, 3, 3, 0, 3, 3, 2, 2, 2, 2, 1 };
+
+    const uint32_t total = std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0U);
+    std::vector<uint8_t> symbols;
+    symbols.reserve(num_symbols * num_streams);
+    for (size_t i = 0; i < num_symbols * num_streams; ++i) {
+      uint32_t r = rand() % total;
+      uint32_t symbol = 0;
+      for (uint32_t freq = opts.Fs[0]; freq <= r; freq += opts.Fs[++symbol]) { }
+      symbols.push_back(static_cast<uint8_t>(symbol));
+    }
+
+    std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+    std::vector<uint8_t> decoded =
+      ans::DecodeInterleaved(encoded, symbols.size(), opts, num_streams);
+    EXPECT_EQ(decoded, symbols) << "b: " << test.b << ", k: " << test.k << ", M: " << test.M;
+
+    // Decode a single stream one bit at a time, too. Reversing the bits only
+    // works as a stream for the decoder if they were emitted one at a time.
+    if (2 != test.b) {
+      continue;
+    }
+
+    std::unique_ptr<ans::Encoder> enc = ans::Encoder::Create(opts);
+    ans::ContainedBitWriter w;
+    for (size_t i = 0; i < num_symbols; ++i) {
+      enc->Encode(symbols[i], &w);
+    }
+
+    // Flip the order of all of the bits so that the decoder reads the last
+    // ones first.
+    const std::vector<uint8_t> bits = w.GetData();
+    std::vector<uint8_t> reversed(bits.size(), 0);
+    const int num_bits = w.BitsWritten();
+    for (int i = 0; i < num_bits; ++i) {
+      const int bit = (bits[i / 8] >> (i % 8)) & 1;
+      const int j = num_bits - i - 1;
+      reversed[j / 8] |= static_cast<uint8_t>(bit << (j % 8));
+    }
+
+    std::unique_ptr<ans::Decoder> dec = ans::Decoder::Create(enc->GetState(), opts);
+    ans::BitReader r(reversed.data());
+    for (size_t i = 0; i < num_symbols; ++i) {
+      ASSERT_EQ(dec->Decode(&r), symbols[num_symbols - i - 1])
+        << "b: " << test.b << ", k: " << test.k << ", M: " << test.M << ", index: " << i;
+    }
+    EXPECT_EQ(dec->GetState(), test.k * test.M);
+  }
+}
+
+TEST(Codec, RejectsMalformedInterleavedStreams) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+  const size_t num_streams = 8;
+  const size_t num_symbols = num_streams * 256;
+
+  struct TestCase {
+    ans::EType type;
+    uint32_t b;
+  };
+
+  // The last one decodes with packed tANS transitions.
+  const TestCase tests[] = {
+    { ans::eType_rANS, 256 },
+    { ans::eType_tANS, 256 },
+    { ans::eType_tANS, 2 },
+  };
+
+  for (const auto &test : tests) {
+    ans::Options opts;
+    opts.type = test.type;
+    opts.b = test.b;
+    opts.k = 4;
+    opts.Fs = { 80, 15, 10, 7, 5, 3, 3, 3, 3, 2, 2, 2, 2, 1 };
+    opts.M = std::accumulate(opts.Fs.begin(), opts.Fs.end(), 0);
+
+    std::vector<uint8_t> symbols;
+    symbols.reserve(num_symbols);
+    for (size_t i = 0; i < num_symbols; ++i) {
+      symbols.push_back(static_cast<uint8_t>(rand() % opts.Fs.size()));
+    }
+
+    const std::vector<uint8_t> encoded = ans::EncodeInterleaved(symbols, opts, num_streams);
+    ASSERT_EQ(symbols, ans::DecodeInterleaved(encoded, num_symbols, opts, num_streams));
+
+    std::vector<std::vector<uint8_t> > malformed;
+
+    // The renormalization bits come first, so cutting some of them off means
+    // that the decoders run out before they're done.
+    for (size_t dropped : { 1, 4, 64 }) {
+      malformed.push_back(std::vector<uint8_t>(encoded.begin() + dropped, encoded.end()));
+    }
+
+    // States that aren't normalized
+    std::vector<uint8_t> bad_state = encoded;
+    memset(bad_state.data() + bad_state.size() - 4, 0, 4);
+    malformed.push_back(bad_state);
+    memset(bad_state.data() + bad_state.size() - 4, 0xFF, 4);
+    malformed.push_back(bad_state);
+
+    for (const auto &data : malformed) {
+      std::vector<uint8_t> decoded;
+      EXPECT_DEBUG_DEATH(decoded = ans::DecodeInterleaved(data, num_symbols, opts, num_streams), "")
+        << "Type: " << test.type << ", b: " << test.b;
+#ifdef NDEBUG
+      EXPECT_TRUE(decoded.empty()) << "Type: " << test.type << ", b: " << test.b;
+#endif
+    }
+  }
+}
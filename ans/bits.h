@@ -2,11 +2,206 @@
 #define __ANS_BITS_H__
 
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
 namespace ans {
 
+  // BitWriter and BitReader pack bits starting with the least significant bit
+  // of each byte. Packed images start with the most significant bit instead.
+  enum EBitOrder {
+    eBitOrder_LSBFirst,
+    eBitOrder_MSBFirst
+  };
+
+  namespace detail {
+    inline uint64_t ByteSwap64(uint64_t x) {
+#ifdef _MSC_VER
+      return _byteswap_uint64(x);
+#else
+      return __builtin_bswap64(x);
+#endif
+    }
+
+    // Returns the eight bytes at ptr as if the first one were the least
+    // significant (LSB first) or the most significant (MSB first).
+    template<EBitOrder Order>
+    inline uint64_t LoadWord(const uint8_t *ptr) {
+      uint64_t word;
+      memcpy(&word, ptr, sizeof(word));
+      return (eBitOrder_MSBFirst == Order) ? ByteSwap64(word) : word;
+    }
+
+    template<EBitOrder Order>
+    inline void StoreWord(uint8_t *ptr, uint64_t word) {
+      word = (eBitOrder_MSBFirst == Order) ? ByteSwap64(word) : word;
+      memcpy(ptr, &word, sizeof(word));
+    }
+
+    // Same as LoadWord and StoreWord for LSB first, but only touch the first
+    // num_bytes bytes at ptr. The rest of the word is zero when loading.
+    inline uint64_t LoadBytes(const uint8_t *ptr, size_t num_bytes) {
+      assert(num_bytes <= sizeof(uint64_t));
+      uint8_t bytes[sizeof(uint64_t)] = { 0 };
+      memcpy(bytes, ptr, num_bytes);
+      return LoadWord<eBitOrder_LSBFirst>(bytes);
+    }
+
+    inline void StoreBytes(uint8_t *ptr, uint64_t word, size_t num_bytes) {
+      assert(num_bytes <= sizeof(uint64_t));
+      uint8_t bytes[sizeof(uint64_t)];
+      StoreWord<eBitOrder_LSBFirst>(bytes, word);
+      memcpy(ptr, bytes, num_bytes);
+    }
+  }  // namespace detail
+
+  // Writes bits into a growing buffer through a 64-bit accumulator. Every write
+  // stores the whole accumulator and then advances past the bytes that are
+  // complete, so there is no per-bit or per-byte loop and no branch on how
+  // many bits are pending. The buffer always keeps eight bytes of slack for
+  // this and grows geometrically.
+  template<EBitOrder Order>
+  class BufferedBitWriter {
+   public:
+    BufferedBitWriter() : _out(kSlack, 0), _bytes(0), _accum(0), _num_bits(0) { }
+
+    // Makes sure that num_bits more bits can be written without reallocating.
+    void Reserve(size_t num_bits) {
+      const size_t needed = _bytes + (_num_bits + num_bits + 7) / 8 + kSlack;
+      if (_out.size() < needed) {
+        _out.resize(needed, 0);
+      }
+    }
+
+    void WriteBits(uint64_t val, int num_bits) {
+      assert(0 <= num_bits && num_bits <= 64);
+      if (0 == num_bits) {
+        return;
+      } else if (num_bits <= 32) {
+        Write32(static_cast<uint32_t>(val), num_bits);
+      } else if (eBitOrder_MSBFirst == Order) {
+        Write32(static_cast<uint32_t>(val >> 32), num_bits - 32);
+        Write32(static_cast<uint32_t>(val), 32);
+      } else {
+        Write32(static_cast<uint32_t>(val), 32);
+        Write32(static_cast<uint32_t>(val >> 32), num_bits - 32);
+      }
+    }
+
+    size_t BitsWritten() const { return 8 * _bytes + _num_bits; }
+    size_t BytesWritten() const { return _bytes + (_num_bits + 7) / 8; }
+
+    // Unused bits in the last byte are zero.
+    std::vector<uint8_t> GetData() const {
+      return std::vector<uint8_t>(_out.begin(), _out.begin() + BytesWritten());
+    }
+
+   private:
+    static const size_t kSlack = sizeof(uint64_t);
+
+    // num_bits must be in [1, 32].
+    void Write32(uint32_t val, int num_bits) {
+      // At most seven bits are pending and at least one bit is written, so
+      // these never shift by 64.
+      const uint64_t bits = static_cast<uint64_t>(val) & ((1ULL << num_bits) - 1);
+      if (eBitOrder_MSBFirst == Order) {
+        _accum |= bits << (64 - _num_bits - num_bits);
+      } else {
+        _accum |= bits << _num_bits;
+      }
+      _num_bits += num_bits;
+
+      if (_out.size() < _bytes + kSlack) {
+        _out.resize(2 * _out.size(), 0);
+      }
+
+      detail::StoreWord<Order>(_out.data() + _bytes, _accum);
+
+      const int num_bytes = _num_bits >> 3;
+      _bytes += num_bytes;
+      _num_bits &= 7;
+      if (eBitOrder_MSBFirst == Order) {
+        _accum <<= 8 * num_bytes;
+      } else {
+        _accum >>= 8 * num_bytes;
+      }
+    }
+
+    std::vector<uint8_t> _out;
+    size_t _bytes;
+    uint64_t _accum;
+    int _num_bits;
+  };
+
+  // Reads bits written by a BufferedBitWriter (or BitWriter, for LSB first).
+  // Each read is a single unaligned 64-bit load and a shift, except within
+  // the last eight bytes of the data. Bits past the end read as zero.
+  template<EBitOrder Order>
+  class BufferedBitReader {
+   public:
+    BufferedBitReader(const uint8_t *in, size_t num_bytes, size_t bit_offset = 0)
+      : _in(in), _num_bytes(num_bytes), _bit_offset(bit_offset) { }
+
+    uint64_t ReadBits(int num_bits) {
+      assert(0 <= num_bits && num_bits <= 64);
+      if (num_bits <= 32) {
+        return Read32(num_bits);
+      }
+
+      if (eBitOrder_MSBFirst == Order) {
+        const uint64_t hi = Read32(num_bits - 32);
+        return (hi << 32) | Read32(32);
+      }
+
+      const uint64_t lo = Read32(32);
+      return lo | (static_cast<uint64_t>(Read32(num_bits - 32)) << 32);
+    }
+
+    size_t BitsRead() const { return _bit_offset; }
+
+   private:
+    uint32_t Read32(int num_bits) {
+      const size_t byte = _bit_offset >> 3;
+      const int shift = static_cast<int>(_bit_offset & 7);
+      _bit_offset += num_bits;
+
+      uint64_t word;
+      if (byte + sizeof(word) <= _num_bytes) {
+        word = detail::LoadWord<Order>(_in + byte);
+      } else {
+        uint8_t tail[sizeof(word)] = { 0 };
+        if (byte < _num_bytes) {
+          memcpy(tail, _in + byte, _num_bytes - byte);
+        }
+        word = detail::LoadWord<Order>(tail);
+      }
+
+      if (0 == num_bits) {
+        return 0;
+      }
+
+      if (eBitOrder_MSBFirst == Order) {
+        return static_cast<uint32_t>((word << shift) >> (64 - num_bits));
+      }
+
+      return static_cast<uint32_t>((word >> shift) & ((1ULL << num_bits) - 1));
+    }
+
+    const uint8_t *_in;
+    const size_t _num_bytes;
+    size_t _bit_offset;
+  };
+
+  // Writes bits in place into memory that the caller owns and whose size we
+  // don't know, e.g. a single uint32_t. That's why this doesn't sit on top of
+  // BufferedBitWriter, which stores whole 64-bit words into a buffer of its
+  // own. Each write still only touches the (at most five) bytes that hold
+  // its bits, and leaves the other bits of those bytes alone.
   class BitWriter {
    public:
     BitWriter(unsigned char* out)
@@ -39,21 +234,25 @@ namespace ans {
     }
 
     virtual void WriteBits(int val, int num_bits) {
-      // If we're outputting bytes, then we can just write to memory
-      if (8 == _bits_left && (num_bits & 7) == 0) {
-        assert(reinterpret_cast<unsigned char*>(&num_bits)[0] == num_bits ||
-               !"Must be little endian!");
-        const int num_bytes = num_bits / 8;
-        memcpy(_out, reinterpret_cast<const void*>(&val), num_bytes);
-        _bytes_written += num_bytes;
-        _bits_written += num_bytes * 8;
-        _out += num_bytes;
-      } else {
-        for (int i = 0; i < num_bits; ++i) {
-          WriteBit(val & 1);
-          val >>= 1;
-        }
+      assert(0 <= num_bits && num_bits <= 32);
+      if (0 == num_bits) {
+        return;
       }
+
+      const int shift = 8 - _bits_left;
+      const int end_bit = shift + num_bits;
+      const size_t num_bytes = static_cast<size_t>((end_bit + 7) / 8);
+
+      const uint64_t mask = ((1ULL << num_bits) - 1) << shift;
+      const uint64_t bits = static_cast<uint64_t>(static_cast<uint32_t>(val)) << shift;
+      const uint64_t word = detail::LoadBytes(_out, num_bytes);
+      detail::StoreBytes(_out, (word & ~mask) | (bits & mask), num_bytes);
+
+      // The first byte was already counted unless we started on it.
+      _bytes_written += static_cast<int>(num_bytes) - ((0 == shift) ? 0 : 1);
+      _bits_written += num_bits;
+      _out += end_bit / 8;
+      _bits_left = 8 - (end_bit % 8);
     }
 
   protected:
@@ -69,44 +268,25 @@ namespace ans {
     ContainedBitWriter() : BitWriter(NULL) { }
 
     virtual void WriteBit(int bit) override {
-      if ((_bits_written % 8) == 0) {
-        _out.push_back(0);
-        BitWriter w(_out.data() + _bytes_written);
-        w.WriteBit(bit);
-      } else {
-        BitWriter w(_out.data() + _bytes_written - 1, _bits_written % 8);
-        w.WriteBit(bit);
-      }
-
-      if ((_bits_written % 8) == 0) {
-        ++_bytes_written;
-      }
-      ++_bits_written;
+      WriteBits(!!bit, 1);
     }
 
     virtual void WriteBits(int val, int num_bits) override {
       assert(num_bits > 0);
-      size_t target_bytes = (_bits_written + num_bits + 7) / 8;
-      _out.resize(target_bytes, 0);
-
-      if ((_bits_written % 8) == 0) {
-        BitWriter w(_out.data() + _bytes_written);
-        w.WriteBits(val, num_bits);
-      } else {
-        BitWriter w(_out.data() + _bytes_written - 1, _bits_written % 8);
-        w.WriteBits(val, num_bits);
-      }
-
-      _bits_written += num_bits;
-      _bytes_written = static_cast<int>(target_bytes);
+      _writer.WriteBits(static_cast<uint32_t>(val), num_bits);
+      _bits_written = static_cast<int>(_writer.BitsWritten());
+      _bytes_written = static_cast<int>(_writer.BytesWritten());
     }
 
-    std::vector<uint8_t> GetData() const { return _out; }
+    std::vector<uint8_t> GetData() const { return _writer.GetData(); }
 
    private:
-    std::vector<uint8_t> _out;
+    BufferedBitWriter<eBitOrder_LSBFirst> _writer;
   };
 
+  // Reads bits written by a BitWriter. Like BitWriter it doesn't know how
+  // much data there is, so instead of BufferedBitReader's 64-bit loads each
+  // read only loads the bytes that hold its bits.
   class BitReader {
    public:
     BitReader(const unsigned char* in)
@@ -129,21 +309,22 @@ namespace ans {
     }
 
     int ReadBits(int num_bits) {
-      // If we're outputting bytes, then we can just write to memory
-      int result = 0;
-      if (8 == _bits_left && (num_bits & 7) == 0) {
-        assert(reinterpret_cast<unsigned char*>(&num_bits)[0] == num_bits ||
-               !"Must be little endian!");
-        const int num_bytes = num_bits / 8;
-        memcpy(reinterpret_cast<void*>(&result), _in, num_bytes);
-        _bytes_read += num_bytes;
-        _in += num_bytes;
-      } else {
-        for (int i = 0; i < num_bits; ++i) {
-          result |= (ReadBit() << i);
-        }
+      assert(0 <= num_bits && num_bits <= 32);
+      if (0 == num_bits) {
+        return 0;
       }
-      return result;
+
+      const int shift = 8 - _bits_left;
+      const int end_bit = shift + num_bits;
+      const size_t num_bytes = static_cast<size_t>((end_bit + 7) / 8);
+      const uint64_t word = detail::LoadBytes(_in, num_bytes);
+
+      // The first byte was already counted unless we started on it.
+      _bytes_read += static_cast<int>(num_bytes) - ((0 == shift) ? 0 : 1);
+      _in += end_bit / 8;
+      _bits_left = 8 - (end_bit % 8);
+
+      return static_cast<int>((word >> shift) & ((1ULL << num_bits) - 1));
     }
 
   private:
@@ -152,6 +333,84 @@ namespace ans {
     int _bits_left;
   };
 
+  // Reads back fixed-width chunks written by a BitWriter in the reverse order
+  // that they were written, directly from the written bytes. This is what ANS
+  // decoders want, since they consume renormalization bits last-in first-out.
+  // Malformed data may ask for more chunks than there are, so callers should
+  // check ChunksLeft(). Reading past the start anyway never touches memory
+  // before it, and returns zero.
+  class ReverseChunkReader {
+   public:
+    ReverseChunkReader(const unsigned char* in, size_t num_bytes, int chunk_bits)
+      : _in(in)
+      , _num_bytes(num_bytes)
+      , _chunk_bits(chunk_bits)
+      , _chunks_left((num_bytes * 8 + chunk_bits - 1) / chunk_bits) {
+      assert(0 < chunk_bits && chunk_bits <= 32);
+    }
+
+    size_t ChunksLeft() const { return _chunks_left; }
+
+    uint32_t ReadChunk() {
+      if (0 == _chunks_left) {
+        return 0;
+      }
+      _chunks_left--;
+
+      // With an odd number of bytes, the last 16-bit chunk hangs off the end
+      const size_t bit_offset = _chunks_left * _chunk_bits;
+      if (16 == _chunk_bits && bit_offset / 8 + 2 <= _num_bytes) {
+        uint16_t result;
+        memcpy(&result, _in + bit_offset / 8, sizeof(result));
+        return result;
+      }
+
+      if (8 == _chunk_bits) {
+        return _in[bit_offset / 8];
+      }
+
+      return ReadField(bit_offset, _chunk_bits);
+    }
+
+    // Reads the next num_chunks chunks at once. The first chunk read ends up
+    // in the most significant bits, i.e. the result is the same as shifting
+    // in ReadChunk() num_chunks times.
+    uint32_t ReadChunks(int num_chunks) {
+      assert(0 <= num_chunks && num_chunks * _chunk_bits <= 32);
+      if (0 == num_chunks) {
+        return 0;
+      }
+
+      if (static_cast<size_t>(num_chunks) > _chunks_left) {
+        _chunks_left = 0;
+        return 0;
+      }
+
+      _chunks_left -= num_chunks;
+      return ReadField(_chunks_left * _chunk_bits, num_chunks * _chunk_bits);
+    }
+
+   private:
+    // Gather all of the bytes that the field touches. A trailing chunk may
+    // hang off of the end of the data, so treat those bits as zero.
+    uint32_t ReadField(size_t bit_offset, int num_bits) const {
+      const size_t first_byte = bit_offset / 8;
+      const size_t last_byte = (bit_offset + num_bits - 1) / 8;
+      uint64_t bits = 0;
+      for (size_t i = first_byte; i <= last_byte && i < _num_bytes; ++i) {
+        bits |= static_cast<uint64_t>(_in[i]) << (8 * (i - first_byte));
+      }
+
+      bits >>= bit_offset % 8;
+      return static_cast<uint32_t>(bits & ((1ULL << num_bits) - 1));
+    }
+
+    const unsigned char* _in;
+    const size_t _num_bytes;
+    const int _chunk_bits;
+    size_t _chunks_left;
+  };
+
 }  // namespace ans
 
 #endif  // __ANS_BITS_H__
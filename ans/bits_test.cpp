@@ -172,3 +172,116 @@ TEST(Bits, CanWriteThenReadSameValues_ContainedBitWriter) {
     EXPECT_EQ(i - 1, r.ReadBits(i));
   }
 }
+
+TEST(Bits, CanReadChunksInReverse) {
+  for (int chunk_bits : { 1, 2, 4, 8, 12, 16 }) {
+    ans::ContainedBitWriter w;
+    const int num_chunks = 37;
+    for (int i = 0; i < num_chunks; ++i) {
+      w.WriteBits((i * 7) & ((1 << chunk_bits) - 1), chunk_bits);
+    }
+
+    std::vector<uint8_t> data = std::move(w.GetData());
+    ans::ReverseChunkReader r(data.data(), data.size(), chunk_bits);
+
+    // The writer pads out to a full byte, so we may see zero chunks first.
+    while (static_cast<int>(r.ChunksLeft()) > num_chunks) {
+      EXPECT_EQ(0U, r.ReadChunk());
+    }
+
+    for (int i = num_chunks - 1; i >= 0; --i) {
+      EXPECT_EQ(static_cast<uint32_t>((i * 7) & ((1 << chunk_bits) - 1)), r.ReadChunk())
+        << "Chunk bits: " << chunk_bits << ", chunk: " << i;
+    }
+    EXPECT_EQ(0U, r.ChunksLeft());
+  }
+}
+
+TEST(Bits, CanReadSeveralChunksInReverse) {
+  ans::ContainedBitWriter w;
+  for (int i = 0; i < 40; ++i) {
+    w.WriteBits(i & 1, 1);
+  }
+
+  std::vector<uint8_t> data = std::move(w.GetData());
+  ans::ReverseChunkReader r(data.data(), data.size(), 1);
+
+  // The last bits written come out first, in the most significant bits.
+  EXPECT_EQ(0x5U, r.ReadChunks(3));
+  EXPECT_EQ(0U, r.ReadChunks(0));
+  EXPECT_EQ(0x15555U, r.ReadChunks(18));
+  EXPECT_EQ(0U, r.ReadChunk());
+  EXPECT_EQ(0x2AAAAU, r.ReadChunks(18));
+  EXPECT_EQ(0U, r.ChunksLeft());
+}
+
+template<ans::EBitOrder Order>
+static void TestBufferedBits() {
+  const int widths[] = { 1, 5, 6, 7, 3, 16, 32, 2, 64, 13, 0, 33, 8 };
+  const int num_widths = sizeof(widths) / sizeof(widths[0]);
+
+  ans::BufferedBitWriter<Order> w;
+  size_t total_bits = 0;
+  for (int i = 0; i < 1000; ++i) {
+    const int n = widths[i % num_widths];
+    const uint64_t val = 0x9E3779B97F4A7C15ULL * static_cast<uint64_t>(i + 1);
+    w.WriteBits(val, n);
+    total_bits += n;
+  }
+
+  EXPECT_EQ(total_bits, w.BitsWritten());
+  std::vector<uint8_t> data = w.GetData();
+  EXPECT_EQ((total_bits + 7) / 8, data.size());
+
+  ans::BufferedBitReader<Order> r(data.data(), data.size());
+  for (int i = 0; i < 1000; ++i) {
+    const int n = widths[i % num_widths];
+    const uint64_t val = 0x9E3779B97F4A7C15ULL * static_cast<uint64_t>(i + 1);
+    const uint64_t mask = (64 == n) ? ~0ULL : ((1ULL << n) - 1);
+    ASSERT_EQ(val & mask, r.ReadBits(n)) << "Index: " << i << ", width: " << n;
+  }
+  EXPECT_EQ(total_bits, r.BitsRead());
+}
+
+TEST(Bits, CanWriteAndReadBufferedBits) {
+  TestBufferedBits<ans::eBitOrder_LSBFirst>();
+  TestBufferedBits<ans::eBitOrder_MSBFirst>();
+}
+
+TEST(Bits, BufferedBitOrders) {
+  ans::BufferedBitWriter<ans::eBitOrder_MSBFirst> msb;
+  msb.WriteBits(0x5, 3);
+  msb.WriteBits(0x1F, 5);
+  msb.WriteBits(0x1, 2);
+  EXPECT_EQ(std::vector<uint8_t>({ 0xBF, 0x40 }), msb.GetData());
+
+  // LSB first matches BitWriter
+  uint32_t x = 0;
+  ans::BitWriter bw(reinterpret_cast<unsigned char*>(&x));
+  ans::BufferedBitWriter<ans::eBitOrder_LSBFirst> lsb;
+  for (int i = 0; i < 6; ++i) {
+    bw.WriteBits(i, 5);
+    lsb.WriteBits(i, 5);
+  }
+
+  std::vector<uint8_t> expected(reinterpret_cast<uint8_t*>(&x), reinterpret_cast<uint8_t*>(&x) + 4);
+  EXPECT_EQ(expected, lsb.GetData());
+}
+
+TEST(Bits, BufferedWritesOfZeroBits) {
+  // Nothing is pending at the start or after a whole byte, which is where
+  // writing zero bits used to shift by 64.
+  ans::BufferedBitWriter<ans::eBitOrder_MSBFirst> msb;
+  msb.WriteBits(~0ULL, 0);
+  msb.WriteBits(0xA5, 8);
+  msb.WriteBits(~0ULL, 0);
+  EXPECT_EQ(8U, msb.BitsWritten());
+  EXPECT_EQ(std::vector<uint8_t>({ 0xA5 }), msb.GetData());
+
+  ans::BufferedBitWriter<ans::eBitOrder_LSBFirst> lsb;
+  lsb.WriteBits(~0ULL, 0);
+  lsb.WriteBits(0xA5, 8);
+  lsb.WriteBits(~0ULL, 0);
+  EXPECT_EQ(8U, lsb.BitsWritten());
+  EXPECT_EQ(std::vector<uint8_t>({ 0xA5 }), lsb.GetData());
+}
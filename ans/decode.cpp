@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <random>
 #include <numeric>
 
@@ -8,20 +9,33 @@
 
 namespace ans {
 
-// rANS decode.
-class rANS_Decoder : public Decoder {
+// rANS decode table. Maps each slot in [0, M) to the symbol whose cumulative
+// frequency range contains it, so decoding doesn't need to search the Bs.
+class rANS_DecodeTable : public DecodeTable {
 public:
-  // The constructor initializes M to be the sum of all Fs. It uses k
-  // to determine the proper normalization interval for encoding. It uses
-  // b to know how many bytes/bits etc to emit at a time.
-  rANS_Decoder(uint32_t state, const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k)
+  // Packed the same way as the AnsTableEntry built by build_table.cl
+  struct Entry {
+    uint16_t freq;
+    uint16_t cum_freq;
+    uint16_t symbol;
+  };
+
+  // Tables with more slots than this use a bucketed lookup instead of one
+  // entry per slot: it keeps the entries packed into 16 bits and the table
+  // small enough to stay in cache.
+  static const uint32_t kMaxDirectTableSize = (1 << 15);
+  static const int kLogNumBuckets = 12;
+
+  rANS_DecodeTable(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k)
     : _F(Fs)
     , _B(CumulativeSum(Fs))
     , _M(_B.back() + _F.back())
     , _k(k)
     , _b(b)
     , _log_b(IntLog2(b))
-    , _state(state)
+    , _log_M(IntLog2(_M))
+    , _M_is_pow2((_M & (_M - 1)) == 0)
+    , _bucket_shift(0)
   {
     assert((b & (_b - 1)) == 0 || "rANS encoder may only emit powers-of-two for renormalization!");
     assert((k & (_k - 1)) == 0 || "rANS encoder must have power-of-two multiple of precision!");
@@ -29,28 +43,66 @@ public:
     assert((static_cast<uint64_t>(b) *
             static_cast<uint64_t>(_k) *
             static_cast<uint64_t>(_M)) < (1ULL << 32));
+
+    if (_M <= kMaxDirectTableSize) {
+      _entries.resize(_M);
+      for (uint32_t s = 0; s < _F.size(); ++s) {
+        for (uint32_t x = _B[s]; x < _B[s] + _F[s]; ++x) {
+          _entries[x].freq = static_cast<uint16_t>(_F[s]);
+          _entries[x].cum_freq = static_cast<uint16_t>(_B[s]);
+          _entries[x].symbol = static_cast<uint16_t>(s);
+        }
+      }
+    } else {
+      // Each bucket stores the symbol that owns its first slot. Decoding
+      // starts there and walks forward over the (few) symbols that start
+      // within the bucket.
+      _bucket_shift = std::max(0, IntLog2(_M - 1) + 1 - kLogNumBuckets);
+      const uint32_t num_buckets = ((_M - 1) >> _bucket_shift) + 1;
+      _bucket_start.resize(num_buckets);
+
+      uint32_t s = 0;
+      for (uint32_t bucket = 0; bucket < num_buckets; ++bucket) {
+        const uint32_t x = bucket << _bucket_shift;
+        while (_B[s] + _F[s] <= x) {
+          s++;
+        }
+        _bucket_start[bucket] = s;
+      }
+    }
   }
 
-  virtual uint32_t Decode(BitReader *r) override {
-    assert(_k * _M <= _state && _state < (_b * _k * _M));
+  uint32_t M() const { return _M; }
+  uint32_t k() const { return _k; }
+  virtual uint32_t b() const override { return _b; }
+  int LogB() const { return _log_b; }
+
+  // Performs the decoding step x -> (s, x') and returns x'
+  uint32_t Decode(uint32_t state, uint32_t *symbol) const {
+    uint32_t slot, quotient;
+    if (_M_is_pow2) {
+      slot = state & (_M - 1);
+      quotient = state >> _log_M;
+    } else {
+      slot = state % _M;
+      quotient = state / _M;
+    }
 
-    // Decode
-    uint32_t symbol = FindSymbol(_state % _M);
-    _state = (_state / _M) * _F[symbol] - _B[symbol] + (_state % _M);
+    if (!_entries.empty()) {
+      const Entry &e = _entries[slot];
+      *symbol = e.symbol;
+      return quotient * e.freq - e.cum_freq + slot;
+    }
 
-    // Renormalize
-    while (_state < _k * _M) {
-      int new_bits = r->ReadBits(_log_b);
-      assert(new_bits < (1 << _log_b));
-      _state <<= _log_b;
-      _state |= new_bits;
+    uint32_t s = _bucket_start[slot >> _bucket_shift];
+    while (_B[s] + _F[s] <= slot) {
+      s++;
     }
 
-    return symbol;
+    *symbol = s;
+    return quotient * _F[s] - _B[s] + slot;
   }
 
-  uint32_t GetState() const override { return _state; }
-
 private:
   const std::vector<uint32_t> _F;
   const std::vector<uint32_t> _B;
@@ -58,79 +110,59 @@ private:
   const uint32_t _M;
   const uint32_t _k;
   const uint32_t _b;
-  const uint32_t _log_b;
+  const int _log_b;
+  const int _log_M;
+  const bool _M_is_pow2;
 
-  uint32_t _state;
+  std::vector<Entry> _entries;
 
-  uint32_t FindSymbol(uint32_t x) {
-    uint32_t low = 0;
-    uint32_t high = static_cast<uint32_t>(_B.size());
+  int _bucket_shift;
+  std::vector<uint32_t> _bucket_start;
+};
 
-    // !SPEED! it might be better to unroll this table for small M...
-    // Search for symbol in Bs...
-    for (;;) {
-      uint32_t midpoint = (high + low) >> 1;
-      assert(midpoint >= 0);
-      assert(midpoint < _F.size());
+// rANS decode.
+class rANS_Decoder : public Decoder {
+public:
+  rANS_Decoder(uint32_t state, const std::shared_ptr<const rANS_DecodeTable> &table)
+    : _table(table)
+    , _L(table->k() * table->M())
+    , _log_b(table->LogB())
+    , _state(state)
+  { }
 
-      if (_B[midpoint] <= x) {
-        if (midpoint >= (_B.size() - 1) || _B[midpoint + 1] > x) {
-          return midpoint;
-        }
+  virtual uint32_t Decode(BitReader *r) override {
+    assert(_L <= _state && _state < (_table->b() * _L));
 
-        low = midpoint;
-      }
-      else {
-        if (midpoint == 0 || _B[midpoint - 1] <= x) {
-          midpoint = midpoint - 1;
-          return midpoint;
-        }
+    // Decode
+    uint32_t symbol;
+    _state = _table->Decode(_state, &symbol);
 
-        high = midpoint;
-      }
+    // Renormalize
+    while (_state < _L) {
+      int new_bits = r->ReadBits(_log_b);
+      assert(new_bits < (1 << _log_b));
+      _state <<= _log_b;
+      _state |= new_bits;
     }
-  }
-};
-
-////////////////////////////////////////////////////////////////////////////////
-//
-// tANS
-//
 
-class tANS_Decoder : public Decoder {
-public:
-  // The constructor initializes M to be the sum of all Fs. It uses k
-  // to determine the proper normalization interval for encoding. It uses
-  // b to know how many bytes/bits etc to emit at a time.
-  tANS_Decoder(uint32_t state, const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k);
+    return symbol;
+  }
 
-  virtual uint32_t Decode(BitReader *r) override;
-  virtual uint32_t GetState() const override { return _state; }
+  uint32_t GetState() const override { return _state; }
 
 private:
-  const std::vector<uint32_t> _F;
-  const std::vector<uint32_t> _B;
-
-  const uint32_t _M;
-  const uint32_t _b;
-  const uint32_t _k;
+  const std::shared_ptr<const rANS_DecodeTable> _table;
+  const uint32_t _L;
   const int _log_b;
 
-  // See tANS encoder for more details.
-  //
-  // If our encoding step is thus:
-  // x' = (x / Fs) * M + _enc_table[Bs + (x % Fs)];
-  //
-  // Then our decoding step is:
-  // s = _dec_table[x' % M]
-  // offset = _offset_table[x' % M];
-  // x = Fs * (x / M) + offset
-  const std::vector<uint32_t> _dec_table;
-  const std::vector<uint32_t> _offset_table;
-
   uint32_t _state;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// tANS
+//
+
 static std::vector<uint32_t> BuildDecTable(const std::vector<uint32_t> &Fs, const uint32_t M) {
   // Collect symbols...
   std::vector<uint32_t> dec_table = std::vector<uint32_t>(M);
@@ -149,47 +181,152 @@ static std::vector<uint32_t> BuildDecTable(const std::vector<uint32_t> &Fs, cons
   return std::move(dec_table);
 }
 
-static std::vector<uint32_t> BuildOffsetTable(const std::vector<uint32_t> &Fs,
-                                              const std::vector<uint32_t> &symbols, const uint32_t M) {
-  std::vector<uint32_t> offset_table;
-  offset_table.reserve(M);
+class tANS_DecodeTable : public DecodeTable {
+public:
+  // Packed the same way as FSE's decoding table: when bits are emitted one at
+  // a time (b == 2) and L is a power of two, every state x in [L, 2L) maps to
+  // a symbol, the number of bits to read, and the state that those bits are
+  // added to.
+  static const uint32_t kMaxPackedStates = (1 << 16);
+  static const uint32_t kMaxPackedSymbols = (1 << 8);
+  static const int kPackedNumBitsShift = 8;
+  static const int kPackedBaseShift = 13;
+
+  tANS_DecodeTable(const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k)
+    : _F(Fs)
+    , _M(std::accumulate(Fs.begin(), Fs.end(), 0U))
+    , _b(b)
+    , _k(k)
+    , _log_b(IntLog2(b))
+  {
+    assert((b & (_b - 1)) == 0 || "rANS encoder may only emit powers-of-two for renormalization!");
+    assert((k & (_k - 1)) == 0 || "rANS encoder must have power-of-two multiple of precision!");
+    assert(static_cast<uint64_t>(_k) * static_cast<uint64_t>(_M) < (1ULL << 32));
+    assert((static_cast<uint64_t>(b) *
+            static_cast<uint64_t>(_k) *
+            static_cast<uint64_t>(_M)) < (1ULL << 32));
 
-  std::vector<uint32_t> idx(Fs.size(), 0);
-  for (auto symbol : symbols) {
-    offset_table.push_back(idx[symbol]++);
+    // The slots are assigned to symbols in the same (shuffled) order that the
+    // tANS encoder uses.
+    const std::vector<uint32_t> symbols = std::move(BuildDecTable(Fs, _M));
+    std::vector<uint32_t> next_offset(Fs.size(), 0);
+
+    _entries.resize(_M);
+    for (uint32_t x = 0; x < _M; ++x) {
+      _entries[x].symbol = symbols[x];
+      _entries[x].offset = next_offset[symbols[x]]++;
+    }
+
+    const uint32_t L = _k * _M;
+    // The number of bits to read only depends on the state if L is a power
+    // of two, otherwise it may also depend on the bits themselves.
+    const bool L_is_pow2 = (L & (L - 1)) == 0;
+    if (2 == _b && L_is_pow2 && L <= kMaxPackedStates && Fs.size() <= kMaxPackedSymbols) {
+      _packed.resize(L);
+      for (uint32_t x = L; x < 2 * L; ++x) {
+        uint32_t symbol;
+        const uint32_t next = Decode(x, &symbol);
+
+        int num_bits = 0;
+        while ((next << num_bits) < L) {
+          num_bits++;
+        }
+
+        const uint32_t base = next << num_bits;
+        assert(L <= base && base < 2 * L);
+        _packed[x - L] = symbol
+          | (static_cast<uint32_t>(num_bits) << kPackedNumBitsShift)
+          | ((base - L) << kPackedBaseShift);
+      }
+    }
   }
 
-  return std::move(offset_table);
-}
+  uint32_t M() const { return _M; }
+  uint32_t k() const { return _k; }
+  virtual uint32_t b() const override { return _b; }
+  int LogB() const { return _log_b; }
 
-tANS_Decoder::tANS_Decoder(uint32_t state, const std::vector<uint32_t> &Fs, uint32_t b, uint32_t k)
-  : _F(Fs)
-  , _B(CumulativeSum(Fs))
-  , _M(_B.back() + _F.back())
-  , _b(b)
-  , _k(k)
-  , _log_b(IntLog2(b))
-  , _dec_table(std::move(BuildDecTable(Fs, _M)))
-  , _offset_table(std::move(BuildOffsetTable(Fs, _dec_table, _M)))
-  , _state(state)
-{
-  assert((b & (_b - 1)) == 0 || "rANS encoder may only emit powers-of-two for renormalization!");
-  assert((k & (_k - 1)) == 0 || "rANS encoder must have power-of-two multiple of precision!");
-  assert(static_cast<uint64_t>(_k) * static_cast<uint64_t>(_M) < (1ULL << 32));
-  assert((static_cast<uint64_t>(b) *
-          static_cast<uint64_t>(_k) *
-          static_cast<uint64_t>(_M)) < (1ULL << 32));
-}
+  // See tANS encoder for more details.
+  //
+  // If our encoding step is thus:
+  // x' = (x / Fs) * M + _enc_table[Bs + (x % Fs)];
+  //
+  // Then our decoding step is:
+  // s = _entries[x' % M].symbol
+  // offset = _entries[x' % M].offset;
+  // x = Fs * (x / M) + offset
+  uint32_t Decode(uint32_t state, uint32_t *symbol) const {
+    const Entry &e = _entries[state % _M];
+    *symbol = e.symbol;
+    return (state / _M) * _F[e.symbol] + e.offset;
+  }
+
+  // Returns the packed transitions for states in [L, 2L), or NULL if the
+  // options don't allow for them.
+  const uint32_t *Packed() const { return _packed.empty() ? NULL : _packed.data(); }
+
+  static uint32_t PackedSymbol(uint32_t e) { return e & 0xFF; }
+  static int PackedNumBits(uint32_t e) { return static_cast<int>((e >> kPackedNumBitsShift) & 0x1F); }
+  static uint32_t PackedBase(uint32_t e) { return e >> kPackedBaseShift; }
+
+private:
+  struct Entry {
+    uint32_t symbol;
+    uint32_t offset;
+  };
+
+  const std::vector<uint32_t> _F;
+
+  const uint32_t _M;
+  const uint32_t _b;
+  const uint32_t _k;
+  const int _log_b;
+
+  std::vector<Entry> _entries;
+  std::vector<uint32_t> _packed;
+};
+
+class tANS_Decoder : public Decoder {
+public:
+  tANS_Decoder(uint32_t state, const std::shared_ptr<const tANS_DecodeTable> &table)
+    : _table(table)
+    , _L(table->k() * table->M())
+    , _log_b(table->LogB())
+    , _state(state)
+  { }
+
+  virtual uint32_t Decode(BitReader *r) override;
+  virtual uint32_t GetState() const override { return _state; }
+
+private:
+  const std::shared_ptr<const tANS_DecodeTable> _table;
+  const uint32_t _L;
+  const int _log_b;
+
+  uint32_t _state;
+};
 
 uint32_t tANS_Decoder::Decode(BitReader *r) {
-  assert(_k * _M <= _state && _state < (_b * _k * _M));
+  assert(_L <= _state && _state < (_table->b() * _L));
+
+  const uint32_t *packed = _table->Packed();
+  if (NULL != packed) {
+    const uint32_t e = packed[_state - _L];
+    uint32_t bits = 0;
+    for (int i = 0; i < tANS_DecodeTable::PackedNumBits(e); ++i) {
+      bits = (bits << 1) | r->ReadBits(1);
+    }
+
+    _state = _L + tANS_DecodeTable::PackedBase(e) + bits;
+    return tANS_DecodeTable::PackedSymbol(e);
+  }
 
   // Decode
-  uint32_t symbol = _dec_table[_state % _M];
-  _state = (_state / _M) * _F[symbol] + _offset_table[_state % _M];
+  uint32_t symbol;
+  _state = _table->Decode(_state, &symbol);
 
   // Renormalize
-  while (_state < _k * _M) {
+  while (_state < _L) {
     int new_bits = r->ReadBits(_log_b);
     assert(new_bits < (1 << _log_b));
     _state <<= _log_b;
@@ -199,29 +336,81 @@ uint32_t tANS_Decoder::Decode(BitReader *r) {
   return symbol;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Static rANS
+//
+
+template<typename CodecTy>
+class StaticRans_DecodeTable : public DecodeTable {
+public:
+  StaticRans_DecodeTable(const std::vector<uint32_t> &Fs) : _codec(Fs) { }
+
+  virtual uint32_t b() const override { return 1U << CodecTy::kLogB; }
+  const CodecTy &Codec() const { return _codec; }
+
+private:
+  const CodecTy _codec;
+};
+
+template<typename CodecTy>
+class StaticRans_Decoder : public Decoder {
+public:
+  StaticRans_Decoder(uint32_t state, const std::shared_ptr<const StaticRans_DecodeTable<CodecTy> > &table)
+    : _table(table)
+    , _state(state)
+  { }
+
+  virtual uint32_t Decode(BitReader *r) override {
+    uint32_t symbol;
+    _state = _table->Codec().Decode(_state, &symbol);
+
+    // Renormalize
+    if (_state < CodecTy::kL) {
+      _state = (_state << CodecTy::kLogB) | r->ReadBits(CodecTy::kLogB);
+    }
+
+    return symbol;
+  }
+
+  uint32_t GetState() const override { return _state; }
+
+private:
+  const std::shared_ptr<const StaticRans_DecodeTable<CodecTy> > _table;
+  uint32_t _state;
+};
+
+typedef StaticRans_DecodeTable<ocl::Codec> OpenCL_DecodeTable;
+typedef StaticRans_Decoder<ocl::Codec> OpenCL_Decoder;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // ANS Factory
 //
 
-std::unique_ptr<Decoder> Decoder::Create(uint32_t state, const Options &_opts) {
+std::shared_ptr<const DecodeTable> DecodeTable::Create(const Options &_opts) {
   Options opts(_opts);
 
-  std::unique_ptr<Decoder> dec;
+  std::shared_ptr<const DecodeTable> table;
   if (!FixInvalidOptions(&opts)) {
     assert(!"Invalid options!");
-    return std::move(dec);
+    return table;
   }
 
   int denom = static_cast<int>(opts.M);
   std::vector<uint32_t> normalized_fs = ans::GenerateHistogram(opts.Fs, denom);
 
+  if (ocl::IsOpenCLOptions(opts)) {
+    table = std::make_shared<OpenCL_DecodeTable>(normalized_fs);
+    return table;
+  }
+
   switch (opts.type) {
   case eType_rANS:
-    dec.reset(new rANS_Decoder(state, normalized_fs, opts.b, opts.k));
+    table = std::make_shared<rANS_DecodeTable>(normalized_fs, opts.b, opts.k);
     break;
   case eType_tANS:
-    dec.reset(new tANS_Decoder(state, normalized_fs, opts.b, opts.k));
+    table = std::make_shared<tANS_DecodeTable>(normalized_fs, opts.b, opts.k);
     break;
 
   default:
@@ -229,6 +418,36 @@ std::unique_ptr<Decoder> Decoder::Create(uint32_t state, const Options &_opts) {
     break;
   }
 
+  return table;
+}
+
+std::unique_ptr<Decoder> Decoder::Create(uint32_t state, const Options &opts) {
+  return std::move(Create(state, DecodeTable::Create(opts)));
+}
+
+std::unique_ptr<Decoder> Decoder::Create(uint32_t state,
+                                         const std::shared_ptr<const DecodeTable> &table) {
+  std::unique_ptr<Decoder> dec;
+
+  auto ocl_table = std::dynamic_pointer_cast<const OpenCL_DecodeTable>(table);
+  if (nullptr != ocl_table) {
+    dec.reset(new OpenCL_Decoder(state, ocl_table));
+    return std::move(dec);
+  }
+
+  auto rans_table = std::dynamic_pointer_cast<const rANS_DecodeTable>(table);
+  if (nullptr != rans_table) {
+    dec.reset(new rANS_Decoder(state, rans_table));
+    return std::move(dec);
+  }
+
+  auto tans_table = std::dynamic_pointer_cast<const tANS_DecodeTable>(table);
+  if (nullptr != tans_table) {
+    dec.reset(new tANS_Decoder(state, tans_table));
+    return std::move(dec);
+  }
+
+  assert(!"Unknown decode table!");
   return std::move(dec);
 }
 
@@ -237,55 +456,145 @@ std::unique_ptr<Decoder> Decoder::Create(uint32_t state, const Options &_opts) {
 // Interleaved decoding
 //
 
+// Decodes the streams in the reverse order that EncodeInterleaved encoded
+// them, pulling renormalization chunks from the back of the data as we go.
+// Returns false if a state is out of range or the chunks run out.
+template<typename TableTy>
+static bool DecodeInterleavedStreams(const TableTy &table, const uint8_t *data, size_t data_sz,
+                                     size_t num_streams, std::vector<uint8_t> *symbols) {
+  const size_t encoded_data_size = data_sz - num_streams * 4;
+  std::vector<uint32_t> states(num_streams);
+  memcpy(states.data(), data + encoded_data_size, num_streams * 4);
+
+  const int log_b = IntLog2(table.b());
+  const uint32_t L = table.k() * table.M();
+  ReverseChunkReader reader(data, encoded_data_size, log_b);
+
+  const size_t symbols_per_stream = symbols->size() / num_streams;
+  for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
+    for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
+      const size_t decoder_idx = num_streams - strm_idx - 1;
+      const size_t idx = (decoder_idx + 1) * symbols_per_stream - sym_idx - 1;
+
+      uint32_t state = states[decoder_idx];
+      if (state < L || state >= (table.b() * L)) {
+        return false;
+      }
+
+      uint32_t symbol;
+      state = table.Decode(state, &symbol);
+      while (state < L) {
+        if (0 == reader.ChunksLeft()) {
+          return false;
+        }
+        state = (state << log_b) | reader.ReadChunk();
+      }
+
+      states[decoder_idx] = state;
+      (*symbols)[idx] = static_cast<uint8_t>(symbol);
+    }
+  }
+
+  return true;
+}
+
+// Same as DecodeInterleavedStreams, but every step is a lookup into the packed
+// tANS transitions, a single read of that many bits, and an add.
+static bool DecodeInterleavedPackedStreams(const tANS_DecodeTable &table, const uint8_t *data,
+                                           size_t data_sz, size_t num_streams,
+                                           std::vector<uint8_t> *symbols) {
+  const size_t encoded_data_size = data_sz - num_streams * 4;
+  std::vector<uint32_t> states(num_streams);
+  memcpy(states.data(), data + encoded_data_size, num_streams * 4);
+
+  const uint32_t *packed = table.Packed();
+  const uint32_t L = table.k() * table.M();
+  ReverseChunkReader reader(data, encoded_data_size, 1);
+
+  const size_t symbols_per_stream = symbols->size() / num_streams;
+  for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
+    for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
+      const size_t decoder_idx = num_streams - strm_idx - 1;
+      const size_t idx = (decoder_idx + 1) * symbols_per_stream - sym_idx - 1;
+
+      const uint32_t state = states[decoder_idx];
+      if (state < L || state >= 2 * L) {
+        return false;
+      }
+
+      const uint32_t e = packed[state - L];
+      const int num_bits = tANS_DecodeTable::PackedNumBits(e);
+      if (static_cast<size_t>(num_bits) > reader.ChunksLeft()) {
+        return false;
+      }
+
+      const uint32_t bits = reader.ReadChunks(num_bits);
+      states[decoder_idx] = L + tANS_DecodeTable::PackedBase(e) + bits;
+      (*symbols)[idx] = static_cast<uint8_t>(tANS_DecodeTable::PackedSymbol(e));
+    }
+  }
+
+  return true;
+}
+
 std::vector<uint8_t> DecodeInterleaved(const std::vector<uint8_t> &data, size_t num_symbols,
                                        const Options &opts, size_t num_streams) {
+  return std::move(DecodeInterleaved(data.data(), data.size(), num_symbols,
+                                     DecodeTable::Create(opts), num_streams));
+}
+
+std::vector<uint8_t> DecodeInterleaved(const std::vector<uint8_t> &data, size_t num_symbols,
+                                       const std::shared_ptr<const DecodeTable> &table,
+                                       size_t num_streams) {
+  return std::move(DecodeInterleaved(data.data(), data.size(), num_symbols, table, num_streams));
+}
+
+std::vector<uint8_t> DecodeInterleaved(const uint8_t *data, size_t data_sz, size_t num_symbols,
+                                       const std::shared_ptr<const DecodeTable> &table,
+                                       size_t num_streams) {
   if ((num_symbols % num_streams) != 0) {
     assert(!"Number of symbols does not divide requested number of streams.");
     return std::vector<uint8_t>();
   }
 
-  // Initialize decoders
-  std::vector<std::unique_ptr<Decoder>> decoders;
-  decoders.reserve(num_streams);
-  assert(data.size() >= num_streams * 4
-         || "Data size not large enough to hold state values for decoders!");
-  const uint32_t *states =
-    reinterpret_cast<const uint32_t *>(data.data() + data.size()) - num_streams;
-  for (size_t i = 0; i < num_streams; ++i) {
-    decoders.push_back(Decoder::Create(states[i], opts));
+  if (nullptr == table) {
+    assert(!"Invalid decode table!");
+    return std::vector<uint8_t>();
   }
 
-  const int bits_per_normalization = IntLog2(opts.b);
-  const size_t encoded_data_size = data.size() - num_streams * 4;
-
-  std::vector<uint32_t> normalization_stream;
-  BitReader data_reader(data.data());
-  for (size_t i = 0; i < encoded_data_size * 8; i += bits_per_normalization) {
-    uint32_t norm = data_reader.ReadBits(bits_per_normalization);
-    normalization_stream.push_back(norm);
+  if (data_sz < num_streams * 4) {
+    assert(!"Data size not large enough to hold state values for decoders!");
+    return std::vector<uint8_t>();
   }
 
-  std::reverse(normalization_stream.begin(), normalization_stream.end());
+  std::vector<uint8_t> symbols(num_symbols, 0);
 
-  // Pack it in again...
-  ContainedBitWriter encoded_writer;
-  for (const auto &renorm : normalization_stream) {
-    encoded_writer.WriteBits(renorm, bits_per_normalization);
+  auto ocl_table = std::dynamic_pointer_cast<const OpenCL_DecodeTable>(table);
+  if (nullptr != ocl_table) {
+    if (!ocl_table->Codec().DecodeBlock(data, data_sz, num_streams, symbols.data(), num_symbols)) {
+      assert(!"Malformed rANS data!");
+      return std::vector<uint8_t>();
+    }
+    return std::move(symbols);
   }
 
-  std::vector<uint8_t> encoded_data = std::move(encoded_writer.GetData());
-  BitReader encoded_reader(encoded_data.data());
-
-  const size_t symbols_per_stream = num_symbols / num_streams;
-  assert(symbols_per_stream * num_streams == num_symbols);
+  bool decoded = false;
+  auto rans_table = std::dynamic_pointer_cast<const rANS_DecodeTable>(table);
+  auto tans_table = std::dynamic_pointer_cast<const tANS_DecodeTable>(table);
+  if (nullptr != rans_table) {
+    decoded = DecodeInterleavedStreams(*rans_table, data, data_sz, num_streams, &symbols);
+  } else if (nullptr != tans_table && NULL != tans_table->Packed()) {
+    decoded = DecodeInterleavedPackedStreams(*tans_table, data, data_sz, num_streams, &symbols);
+  } else if (nullptr != tans_table) {
+    decoded = DecodeInterleavedStreams(*tans_table, data, data_sz, num_streams, &symbols);
+  } else {
+    assert(!"Unknown decode table!");
+    return std::vector<uint8_t>();
+  }
 
-  std::vector<uint8_t> symbols(num_symbols, 0);
-  for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
-    for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
-      size_t decoder_idx = num_streams - strm_idx - 1;
-      size_t idx = (decoder_idx + 1) * symbols_per_stream - sym_idx - 1;
-      symbols[idx] = decoders[decoder_idx]->Decode(&encoded_reader);
-    }
+  if (!decoded) {
+    assert(!"Malformed ANS data!");
+    return std::vector<uint8_t>();
   }
 
   return std::move(symbols);
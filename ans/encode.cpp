@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <random>
 #include <vector>
 
@@ -184,6 +185,39 @@ void tANS_Encoder::Encode(uint32_t symbol, BitWriter *w) {
   _state = ((_state / _F[symbol]) * _M) + _enc_table[_B[symbol] + (_state % _F[symbol])];
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Static rANS
+//
+
+template<typename CodecTy>
+class StaticRans_Encoder : public Encoder {
+public:
+  StaticRans_Encoder(const std::vector<uint32_t> &Fs)
+    : Encoder()
+    , _codec(Fs)
+    , _state(CodecTy::kL)
+  { }
+
+  virtual void Encode(uint32_t symbol, BitWriter *w) override {
+    uint8_t word[4];
+    uint8_t *out = word;
+    _state = _codec.Encode(_state, symbol, &out);
+
+    if (out != word) {
+      uint32_t bits = 0;
+      memcpy(&bits, word, CodecTy::kWordBytes);
+      w->WriteBits(bits, CodecTy::kLogB);
+    }
+  }
+
+  virtual uint32_t GetState() const override { return _state; }
+
+private:
+  const CodecTy _codec;
+  uint32_t _state;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // ANS Factory
@@ -201,6 +235,11 @@ std::unique_ptr<Encoder> Encoder::Create(const Options &_opts) {
   int denom = static_cast<int>(opts.M);
   std::vector<uint32_t> normalized_fs = ans::GenerateHistogram(opts.Fs, denom);
 
+  if (ocl::IsOpenCLOptions(opts)) {
+    enc.reset(new StaticRans_Encoder<ocl::Codec>(normalized_fs));
+    return std::move(enc);
+  }
+
   switch (opts.type) {
     case eType_rANS:
       enc.reset(new rANS_Encoder(normalized_fs, opts.b, opts.k));
@@ -228,6 +267,11 @@ std::vector<uint8_t> EncodeInterleaved(const std::vector<uint8_t> &symbols,
     return std::vector<uint8_t>();
   }
 
+  if (ocl::IsOpenCLOptions(opts)) {
+    const ocl::Codec codec(ans::GenerateHistogram(opts.Fs, static_cast<int>(opts.M)));
+    return std::move(codec.EncodeBlock(symbols.data(), symbols.size(), num_streams));
+  }
+
   std::vector<std::unique_ptr<Encoder>> encoders;
   encoders.reserve(num_streams);
   for (size_t i = 0; i < num_streams; ++i) {
@@ -247,6 +291,18 @@ std::vector<uint8_t> EncodeInterleaved(const std::vector<uint8_t> &symbols,
 
   std::vector<uint8_t> result = std::move(w.GetData());
 
+  // Decoders read the renormalization bits back starting from the end of the
+  // stream. If b doesn't emit whole bytes, the last byte may only be partially
+  // filled, so move the padding bits to the front of the stream instead.
+  const int num_pad_bits = (8 - (w.BitsWritten() % 8)) % 8;
+  if (0 != num_pad_bits) {
+    for (size_t i = result.size() - 1; i > 0; --i) {
+      result[i] = static_cast<uint8_t>((result[i] << num_pad_bits) |
+                                       (result[i - 1] >> (8 - num_pad_bits)));
+    }
+    result[0] = static_cast<uint8_t>(result[0] << num_pad_bits);
+  }
+
   // Write the states at the end of the stream...
   const size_t end_of_stream = result.size();
   result.resize(end_of_stream + num_streams * 4);
@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 #include <functional>
 #include <numeric>
@@ -24,19 +25,24 @@ namespace ans {
   }
 #endif
 
-  static double GetFreqChange(int count, int new_count, int correction_sign) {
+  static double GetFreqChange(uint32_t count, uint32_t new_count, int correction_sign) {
     return log2(static_cast<double>(new_count) /
-                static_cast<double>(new_count + correction_sign)) *
+                static_cast<double>(static_cast<int64_t>(new_count) + correction_sign)) *
       static_cast<double>(count);
   }
 
-  static int fold_sum(const std::vector<uint32_t> &v) {
-    return static_cast<int>(std::accumulate(v.begin(), v.end(), 0, std::plus<uint32_t>()));
+  static uint64_t fold_sum(const std::vector<uint32_t> &v) {
+    return std::accumulate(v.begin(), v.end(), static_cast<uint64_t>(0));
   }
 
   // This normalization technique is taken from the discussion presented
   // on Charles Bloom's blog:
   // http://cbloomrants.blogspot.com/2014/02/02-11-14-understanding-ans-10.html
+  //
+  // Every scaled count is computed exactly in 64 bits, so large planes (e.g.
+  // more than 2^21 occurrences of a symbol with M = 2^11) don't overflow. Each
+  // scaled count is within one of its exact value, so the correction below
+  // touches fewer than counts.size() units and runs in O(n log n).
   std::vector<uint32_t> GenerateHistogram(const std::vector<uint32_t> &counts,
                                           const int M) {
     if (M <= 0) {
@@ -48,30 +54,41 @@ namespace ans {
     histogram.clear();
     histogram.reserve(counts.size());
 
-    int sum = fold_sum(counts);
+    const uint64_t sum = fold_sum(counts);
     for (size_t i = 0; i < counts.size(); ++i) {
       if (counts[i] == 0) {
         histogram.push_back(0);
         continue;
       }
 
-      double from_scaled = static_cast<float>(counts[i] * M) / static_cast<float>(sum);      
-      int down = static_cast<int>(from_scaled);
+      // counts[i] < 2^32 and M < 2^31, so this can't overflow.
+      const uint64_t scaled = static_cast<uint64_t>(counts[i]) * static_cast<uint64_t>(M);
+      const uint64_t down = scaled / sum;
+      if (down * sum == scaled) {
+        histogram.push_back(static_cast<uint32_t>(down));
+        continue;
+      }
 
-      histogram.push_back(std::max(1, (from_scaled * from_scaled <= down * (down + 1))? down : down + 1));
+      // Round to whichever neighbor is closer in the geometric sense, i.e.
+      // compare against sqrt(down * (down + 1)).
+      const double from_scaled = static_cast<double>(scaled) / static_cast<double>(sum);
+      const double d = static_cast<double>(down);
+      const uint64_t rounded = (from_scaled * from_scaled <= d * (d + 1.0)) ? down : down + 1;
+      histogram.push_back(static_cast<uint32_t>(std::max<uint64_t>(1, rounded)));
+    }
+
+    const int64_t hist_sum = static_cast<int64_t>(fold_sum(histogram));
+    if (hist_sum == 0) {
+      assert(!"No symbols have any frequency!");
+      return std::move(std::vector<uint32_t>());
     }
 
-    int correction = M - fold_sum(histogram);
+    int correction = static_cast<int>(static_cast<int64_t>(M) - hist_sum);
     if (correction == 0) {
       // No work to do, averaging was exact.
       return std::move(histogram);
     }
 
-    if (correction == M) {
-      assert(!"No symbols have any frequency!");
-      return std::move(std::vector<uint32_t>());
-    }
-
     std::vector<Symbol> symbols;
     symbols.reserve(counts.size());
 
@@ -116,8 +133,44 @@ namespace ans {
       }
     }
 
-    assert(fold_sum(histogram) == M);
+    assert(fold_sum(histogram) == static_cast<uint64_t>(M));
     return std::move(histogram);
   }
 
+  std::vector<uint32_t> CountSymbols(const uint8_t *symbols, size_t num_symbols) {
+    // Consecutive equal bytes would otherwise serialize on the same counter,
+    // so spread every four bytes across separate banks and merge at the end.
+    static const size_t kNumBanks = 4;
+    std::vector<uint32_t> banks(kNumBanks * 256, 0);
+    uint32_t *bank0 = banks.data();
+    uint32_t *bank1 = bank0 + 256;
+    uint32_t *bank2 = bank1 + 256;
+    uint32_t *bank3 = bank2 + 256;
+
+    size_t i = 0;
+    for (; i + 16 <= num_symbols; i += 16) {
+      uint32_t words[4];
+      memcpy(words, symbols + i, sizeof(words));
+
+      for (size_t j = 0; j < 4; ++j) {
+        const uint32_t w = words[j];
+        bank0[w & 0xFF]++;
+        bank1[(w >> 8) & 0xFF]++;
+        bank2[(w >> 16) & 0xFF]++;
+        bank3[w >> 24]++;
+      }
+    }
+
+    for (; i < num_symbols; ++i) {
+      bank0[symbols[i]]++;
+    }
+
+    std::vector<uint32_t> counts(256);
+    for (size_t s = 0; s < 256; ++s) {
+      counts[s] = bank0[s] + bank1[s] + bank2[s] + bank3[s];
+    }
+
+    return std::move(counts);
+  }
+
 } // namespace ans
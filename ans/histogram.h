@@ -1,6 +1,7 @@
 #ifndef __HISTOGRAM_H__
 #define __HISTOGRAM_H__
 
+#include <cstddef>
 #include <cstdint>
 #include <limits>
 #include <vector>
@@ -26,6 +27,14 @@ namespace ans {
 
     return std::move(counts);
   }
+
+  // Same as CountSymbols, but for bytes: counts into several banks at a
+  // time, which is considerably faster for long runs of the same symbol.
+  std::vector<uint32_t> CountSymbols(const uint8_t *symbols, size_t num_symbols);
+
+  inline std::vector<uint32_t> CountSymbols(const std::vector<uint8_t> &symbols) {
+    return std::move(CountSymbols(symbols.data(), symbols.size()));
+  }
 } // namespace ans
 
 #endif // __HISTOGRAM_H__
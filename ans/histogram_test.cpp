@@ -101,3 +101,41 @@ TEST(Histogram, ProperlyDistributesFreqsNPOT) {
   std::vector<uint32_t> expected(expected_vec, expected_vec + (sizeof(expected_vec) / sizeof(expected_vec[0])));
   EXPECT_TRUE(VectorsAreEqual(hist, expected));
 }
+
+TEST(Histogram, HandlesLargeCounts) {
+  // counts[i] * M doesn't fit into 32 bits here, and neither does the sum.
+  const uint32_t counts_vec[4] = { 3000000, 5000000, 1, 4000000000U };
+  std::vector<uint32_t> counts(counts_vec, counts_vec + (sizeof(counts_vec) / sizeof(counts_vec[0])));
+  std::vector<uint32_t> hist = ans::GenerateHistogram(counts, 2048);
+
+  const uint32_t expected_vec[4] = { 2, 3, 1, 2042 };
+  std::vector<uint32_t> expected(expected_vec, expected_vec + (sizeof(expected_vec) / sizeof(expected_vec[0])));
+  EXPECT_TRUE(VectorsAreEqual(hist, expected));
+
+  const uint32_t scaled_vec[3] = { 3000000, 5000000, 8000000 };
+  counts.assign(scaled_vec, scaled_vec + (sizeof(scaled_vec) / sizeof(scaled_vec[0])));
+  hist = ans::GenerateHistogram(counts, 2048);
+
+  const uint32_t expected_scaled_vec[3] = { 384, 640, 1024 };
+  expected.assign(expected_scaled_vec, expected_scaled_vec + (sizeof(expected_scaled_vec) / sizeof(expected_scaled_vec[0])));
+  EXPECT_TRUE(VectorsAreEqual(hist, expected));
+}
+
+TEST(Histogram, CountsBytes) {
+  std::vector<uint8_t> symbols;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    symbols.push_back(static_cast<uint8_t>((i * i) % 251));
+  }
+  symbols.insert(symbols.end(), 37, 7);
+
+  // Make sure that we handle sizes that aren't a multiple of the unroll factor.
+  for (size_t sz = 990; sz <= symbols.size(); ++sz) {
+    std::vector<uint8_t> prefix(symbols.begin(), symbols.begin() + sz);
+    std::vector<uint32_t> expected(256, 0);
+    for (auto s : prefix) {
+      expected[s]++;
+    }
+
+    EXPECT_TRUE(VectorsAreEqual(ans::CountSymbols(prefix), expected));
+  }
+}
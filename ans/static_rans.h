@@ -0,0 +1,234 @@
+#ifndef __ANS_STATIC_RANS_H__
+#define __ANS_STATIC_RANS_H__
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace ans {
+
+  namespace detail {
+    constexpr int ConstLog2(uint32_t x) {
+      return x <= 1 ? 0 : 1 + ConstLog2(x >> 1);
+    }
+
+    constexpr bool IsPow2(uint32_t x) {
+      return x != 0 && (x & (x - 1)) == 0;
+    }
+  }  // namespace detail
+
+  // An rANS codec whose parameters (see ans::Options) are known at compile time.
+  // All of the divisions and renormalization loops of the generic rANS encoder
+  // and decoder turn into shifts, masks and a single branch:
+  //
+  //   - M is a power of two, so the decoder splits states with a shift/mask.
+  //   - b >= L = k*M, so a state renormalizes at most once per symbol.
+  //   - b*k*M <= 2^31, so the encoder can divide by the frequency using a
+  //     precomputed reciprocal (see "Division by invariant integers using
+  //     multiplication", Granlund & Montgomery, and Fabian Giesen's ryg_rans).
+  //   - b emits whole bytes, so renormalization never straddles a byte.
+  //
+  // EncodeBlock and DecodeBlock produce and consume exactly the same bytes as
+  // EncodeInterleaved and DecodeInterleaved with the same options.
+  template<uint32_t B, uint32_t K, uint32_t M>
+  class StaticRansCodec {
+   public:
+    static const int kLogB = detail::ConstLog2(B);
+    static const int kLogM = detail::ConstLog2(M);
+    static const uint32_t kL = K * M;
+    static const size_t kWordBytes = static_cast<size_t>(kLogB / 8);
+
+    static_assert(detail::IsPow2(B) && detail::IsPow2(K) && detail::IsPow2(M),
+                  "Static rANS parameters must be powers of two!");
+    static_assert(kLogB == 8 || kLogB == 16, "Static rANS must emit bytes or shorts!");
+    static_assert(B >= K * M, "Static rANS requires b >= L for single step renormalization!");
+    static_assert(static_cast<uint64_t>(B) * K * M <= (1ULL << 31),
+                  "Static rANS states must fit into 31 bits!");
+    static_assert(M <= (1 << 15), "Static rANS frequencies must fit into 16 bits!");
+
+    // Fs must already be normalized so that they sum to M.
+    explicit StaticRansCodec(const std::vector<uint32_t> &Fs)
+      : _enc(Fs.size())
+      , _dec(M)
+    {
+      assert(Fs.size() <= (1 << 16));
+
+      uint32_t start = 0;
+      for (size_t i = 0; i < Fs.size(); ++i) {
+        const uint32_t freq = Fs[i];
+        EncSymbol &sym = _enc[i];
+
+        sym.x_max = B * K * freq;
+        sym.cmpl_freq = M - freq;
+        if (freq < 2) {
+          // With freq == 1, we want x' = x * M + Bs. Since mulhi32(x, ~0) = x - 1
+          // for all x > 0, we can fold the difference into the bias.
+          sym.rcp_freq = ~0U;
+          sym.rcp_shift = 0;
+          sym.bias = start + M - 1;
+        } else {
+          uint32_t shift = 0;
+          while (freq > (1U << shift)) {
+            shift++;
+          }
+
+          sym.rcp_freq = static_cast<uint32_t>(((1ULL << (shift + 31)) + freq - 1) / freq);
+          sym.rcp_shift = shift - 1;
+          sym.bias = start;
+        }
+
+        assert(start + freq <= M);
+        for (uint32_t x = start; x < start + freq; ++x) {
+          _dec[x].freq = static_cast<uint16_t>(freq);
+          _dec[x].cum_freq = static_cast<uint16_t>(start);
+          _dec[x].symbol = static_cast<uint16_t>(i);
+        }
+
+        start += freq;
+      }
+
+      assert(start == M);
+    }
+
+    size_t NumSymbols() const { return _enc.size(); }
+
+    // Encodes symbol into state. If the state needs to be renormalized first,
+    // its low kLogB bits are written to *out, which is then advanced.
+    uint32_t Encode(uint32_t state, uint32_t symbol, uint8_t **out) const {
+      assert(kL <= state && state < B * kL);
+      assert(symbol < _enc.size());
+
+      const EncSymbol &sym = _enc[symbol];
+      assert(sym.cmpl_freq < M || !"Encoding symbol with zero frequency!");
+
+      // Renormalize
+      if (state >= sym.x_max) {
+        memcpy(*out, &state, kWordBytes);
+        *out += kWordBytes;
+        state >>= kLogB;
+      }
+
+      // Encode
+      const uint32_t q = static_cast<uint32_t>(
+        (static_cast<uint64_t>(state) * sym.rcp_freq) >> 32) >> sym.rcp_shift;
+      return state + sym.bias + q * sym.cmpl_freq;
+    }
+
+    // Performs the decoding step x -> (s, x') and returns x'. If x' < kL, the
+    // caller needs to shift in the next kLogB bits.
+    uint32_t Decode(uint32_t state, uint32_t *symbol) const {
+      assert(kL <= state && state < B * kL);
+
+      const DecEntry &e = _dec[state & (M - 1)];
+      *symbol = e.symbol;
+      return (state >> kLogM) * e.freq - e.cum_freq + (state & (M - 1));
+    }
+
+    // Encodes num_symbols symbols split evenly across num_streams interleaved
+    // streams. The result has the same layout as EncodeInterleaved: the
+    // renormalization words in the order they were emitted, followed by the
+    // final state of each stream.
+    std::vector<uint8_t> EncodeBlock(const uint8_t *symbols, size_t num_symbols,
+                                     size_t num_streams) const {
+      assert((num_symbols % num_streams) == 0);
+      const size_t symbols_per_stream = num_symbols / num_streams;
+      std::vector<uint32_t> states(num_streams, static_cast<uint32_t>(kL));
+
+      // Since b >= L, each symbol emits at most one word.
+      std::vector<uint8_t> result(kWordBytes * num_symbols + 4 * num_streams);
+      uint8_t *out = result.data();
+
+      for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
+        const uint8_t *sym = symbols + sym_idx;
+        for (size_t strm_idx = 0; strm_idx < num_streams; ++strm_idx) {
+          states[strm_idx] = Encode(states[strm_idx], *sym, &out);
+          sym += symbols_per_stream;
+        }
+      }
+
+      // Write the states at the end of the stream...
+      memcpy(out, states.data(), 4 * num_streams);
+      out += 4 * num_streams;
+
+      result.resize(out - result.data());
+      return std::move(result);
+    }
+
+    // Decodes the output of EncodeBlock into the num_symbols bytes at symbols.
+    // Returns false if the data is malformed.
+    bool DecodeBlock(const uint8_t *data, size_t data_sz, size_t num_streams,
+                     uint8_t *symbols, size_t num_symbols) const {
+      if ((num_symbols % num_streams) != 0 || data_sz < 4 * num_streams) {
+        return false;
+      }
+
+      const size_t words_sz = data_sz - 4 * num_streams;
+      if ((words_sz % kWordBytes) != 0) {
+        return false;
+      }
+
+      std::vector<uint32_t> states(num_streams);
+      memcpy(states.data(), data + words_sz, 4 * num_streams);
+
+      // Words are consumed in the opposite order that they were emitted.
+      const uint8_t *in = data + words_sz;
+      const size_t symbols_per_stream = num_symbols / num_streams;
+      for (size_t sym_idx = 0; sym_idx < symbols_per_stream; ++sym_idx) {
+        uint8_t *out = symbols + num_symbols - sym_idx - 1;
+        for (size_t i = 0; i < num_streams; ++i) {
+          const size_t strm_idx = num_streams - i - 1;
+          uint32_t state = states[strm_idx];
+          if (state < kL || state >= B * kL) {
+            return false;
+          }
+
+          uint32_t symbol;
+          state = Decode(state, &symbol);
+          if (state < kL) {
+            if (in == data) {
+              return false;
+            }
+
+            uint32_t word = 0;
+            in -= kWordBytes;
+            memcpy(&word, in, kWordBytes);
+            state = (state << kLogB) | word;
+          }
+
+          states[strm_idx] = state;
+          *out = static_cast<uint8_t>(symbol);
+          out -= symbols_per_stream;
+        }
+      }
+
+      return true;
+    }
+
+   private:
+    // Per-symbol encoding constants. Instead of dividing by the frequency:
+    //
+    // q = (x / Fs) = mulhi32(x, rcp_freq) >> rcp_shift
+    // x' = q * M + Bs + (x - q * Fs) = x + bias + q * cmpl_freq
+    struct EncSymbol {
+      uint32_t x_max;
+      uint32_t rcp_freq;
+      uint32_t bias;
+      uint32_t cmpl_freq;
+      uint32_t rcp_shift;
+    };
+
+    // Packed the same way as the AnsTableEntry built by build_table.cl
+    struct DecEntry {
+      uint16_t freq;
+      uint16_t cum_freq;
+      uint16_t symbol;
+    };
+
+    std::vector<EncSymbol> _enc;
+    std::vector<DecEntry> _dec;
+  };
+
+}  // namespace ans
+
+#endif  // __ANS_STATIC_RANS_H__
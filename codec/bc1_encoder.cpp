@@ -0,0 +1,471 @@
+#include "bc1_encoder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+static int Expand5(int x) { return (x << 3) | (x >> 2); }
+static int Expand6(int x) { return (x << 2) | (x >> 4); }
+
+static void Decode565(uint16_t c, int out[3]) {
+  out[0] = Expand5((c >> 11) & 0x1F);
+  out[1] = Expand6((c >> 5) & 0x3F);
+  out[2] = Expand5(c & 0x1F);
+}
+
+static uint16_t QuantizeTo565(const float c[3]) {
+  static const float kMax[3] = { 31.0f, 63.0f, 31.0f };
+
+  int q[3];
+  for (int i = 0; i < 3; ++i) {
+    const float x = std::max(0.0f, std::min(255.0f, c[i]));
+    q[i] = static_cast<int>(x * kMax[i] / 255.0f + 0.5f);
+  }
+
+  return static_cast<uint16_t>((q[0] << 11) | (q[1] << 5) | q[2]);
+}
+
+static uint64_t PackBlock(uint16_t c0, uint16_t c1, uint32_t indices) {
+  return static_cast<uint64_t>(c0)
+    | (static_cast<uint64_t>(c1) << 16)
+    | (static_cast<uint64_t>(indices) << 32);
+}
+
+// Decodes the palette of the block the same way that the decoders do
+static void BuildPalette(uint16_t c0, uint16_t c1, int palette[4][3]) {
+  Decode565(c0, palette[0]);
+  Decode565(c1, palette[1]);
+
+  for (int i = 0; i < 3; ++i) {
+    if (c0 > c1) {
+      palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+      palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    } else {
+      palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+      palette[3][i] = 0;
+    }
+  }
+}
+
+// Gives each pixel the index of the closest palette entry and returns the
+// total squared error.
+static uint32_t AssignIndices(const uint8_t pixels[48], uint16_t c0, uint16_t c1,
+                              uint32_t *indices) {
+  int palette[4][3];
+  BuildPalette(c0, c1, palette);
+
+  uint32_t err = 0;
+  *indices = 0;
+  for (int i = 0; i < 16; ++i) {
+    const uint8_t *p = pixels + 3 * i;
+
+    uint32_t best_err = std::numeric_limits<uint32_t>::max();
+    uint32_t best = 0;
+    for (uint32_t j = 0; j < 4; ++j) {
+      uint32_t e = 0;
+      for (int k = 0; k < 3; ++k) {
+        const int d = static_cast<int>(p[k]) - palette[j][k];
+        e += static_cast<uint32_t>(d * d);
+      }
+
+      if (e < best_err) {
+        best_err = e;
+        best = j;
+      }
+    }
+
+    err += best_err;
+    *indices |= best << (2 * i);
+  }
+
+  return err;
+}
+
+struct EncodedBlock {
+  uint64_t block;
+  uint32_t err;
+};
+
+// Quantizes the endpoints and puts the block in four color mode, unless the
+// endpoints are the same after quantization.
+static EncodedBlock EncodeEndpoints(const uint8_t pixels[48], const float e0[3], const float e1[3]) {
+  uint16_t c0 = QuantizeTo565(e0);
+  uint16_t c1 = QuantizeTo565(e1);
+  if (c0 < c1) {
+    std::swap(c0, c1);
+  }
+
+  uint32_t indices;
+  EncodedBlock result;
+  result.err = AssignIndices(pixels, c0, c1, &indices);
+  result.block = PackBlock(c0, c1, indices);
+  return result;
+}
+
+// The weights of each endpoint for each index, ordered along the line from
+// the first endpoint to the second.
+static const float kOrderWeights[4][2] = {
+  { 1.0f, 0.0f }, { 2.0f / 3.0f, 1.0f / 3.0f }, { 1.0f / 3.0f, 2.0f / 3.0f }, { 0.0f, 1.0f }
+};
+
+// Index of each position along the line in four color mode
+static const uint32_t kOrderToIndex[4] = { 0, 2, 3, 1 };
+static const uint32_t kIndexToOrder[4] = { 0, 3, 1, 2 };
+
+// Finds the endpoints that minimize the squared error given the position of
+// each pixel along the line between them. Returns false if they aren't
+// uniquely determined, i.e. every pixel has the same position.
+static bool LeastSquaresEndpoints(const float pts[16][3], const uint32_t orders[16],
+                                  float e0[3], float e1[3]) {
+  float asq = 0.0f, bsq = 0.0f, ab = 0.0f;
+  float ax[3] = { 0.0f, 0.0f, 0.0f };
+  float bx[3] = { 0.0f, 0.0f, 0.0f };
+  for (int i = 0; i < 16; ++i) {
+    const float a = kOrderWeights[orders[i]][0];
+    const float b = kOrderWeights[orders[i]][1];
+    asq += a * a;
+    bsq += b * b;
+    ab += a * b;
+    for (int j = 0; j < 3; ++j) {
+      ax[j] += a * pts[i][j];
+      bx[j] += b * pts[i][j];
+    }
+  }
+
+  const float det = asq * bsq - ab * ab;
+  if (std::fabs(det) < 1e-6f) {
+    return false;
+  }
+
+  const float f = 1.0f / det;
+  for (int j = 0; j < 3; ++j) {
+    e0[j] = f * (ax[j] * bsq - bx[j] * ab);
+    e1[j] = f * (bx[j] * asq - ax[j] * ab);
+  }
+
+  return true;
+}
+
+// Returns false if the pixels don't have a principal axis.
+static bool PrincipalAxis(const float pts[16][3], const float mean[3], float axis[3]) {
+  float cov[3][3] = { { 0.0f } };
+  for (int i = 0; i < 16; ++i) {
+    float d[3];
+    for (int j = 0; j < 3; ++j) {
+      d[j] = pts[i][j] - mean[j];
+    }
+
+    for (int j = 0; j < 3; ++j) {
+      for (int k = 0; k < 3; ++k) {
+        cov[j][k] += d[j] * d[k];
+      }
+    }
+  }
+
+  // Start with the row of the covariance matrix with the largest norm, and
+  // then refine with a few rounds of power iteration.
+  int start = 0;
+  float max_norm = 0.0f;
+  for (int j = 0; j < 3; ++j) {
+    const float n = cov[j][0] * cov[j][0] + cov[j][1] * cov[j][1] + cov[j][2] * cov[j][2];
+    if (n > max_norm) {
+      max_norm = n;
+      start = j;
+    }
+  }
+
+  if (max_norm < 1e-6f) {
+    return false;
+  }
+
+  float v[3] = { cov[start][0], cov[start][1], cov[start][2] };
+  for (int iter = 0; iter < 8; ++iter) {
+    float w[3];
+    for (int j = 0; j < 3; ++j) {
+      w[j] = cov[j][0] * v[0] + cov[j][1] * v[1] + cov[j][2] * v[2];
+    }
+
+    const float len = std::sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+    if (len < 1e-6f) {
+      break;
+    }
+
+    for (int j = 0; j < 3; ++j) {
+      v[j] = w[j] / len;
+    }
+  }
+
+  const float len = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  for (int j = 0; j < 3; ++j) {
+    axis[j] = v[j] / len;
+  }
+
+  return true;
+}
+
+// For each 8-bit value, the pair of 5-bit (or 6-bit) endpoints whose two
+// thirds interpolant is closest to it. Used to encode solid blocks.
+struct SingleColorTable {
+  uint8_t five[256][2];
+  uint8_t six[256][2];
+
+  SingleColorTable() {
+    Build(five, 31, Expand5);
+    Build(six, 63, Expand6);
+  }
+
+ private:
+  static void Build(uint8_t table[256][2], int max_val, int (*expand)(int)) {
+    for (int v = 0; v < 256; ++v) {
+      int best_err = std::numeric_limits<int>::max();
+      for (int a = 0; a <= max_val; ++a) {
+        for (int b = 0; b <= max_val; ++b) {
+          const int interp = (2 * expand(a) + expand(b)) / 3;
+          const int err = std::abs(interp - v);
+          if (err < best_err) {
+            best_err = err;
+            table[v][0] = static_cast<uint8_t>(a);
+            table[v][1] = static_cast<uint8_t>(b);
+          }
+        }
+      }
+    }
+  }
+};
+
+static EncodedBlock EncodeSolidBlock(const uint8_t pixels[48]) {
+  static const SingleColorTable kTable;
+
+  const uint8_t *p = pixels;
+  uint16_t c0 = static_cast<uint16_t>(
+    (kTable.five[p[0]][0] << 11) | (kTable.six[p[1]][0] << 5) | kTable.five[p[2]][0]);
+  uint16_t c1 = static_cast<uint16_t>(
+    (kTable.five[p[0]][1] << 11) | (kTable.six[p[1]][1] << 5) | kTable.five[p[2]][1]);
+  if (c0 < c1) {
+    std::swap(c0, c1);
+  }
+
+  uint32_t indices;
+  EncodedBlock result;
+  result.err = AssignIndices(pixels, c0, c1, &indices);
+  result.block = PackBlock(c0, c1, indices);
+  return result;
+}
+
+// Least squares refinement of the endpoints given the indices of the block.
+static EncodedBlock RefineBlock(const uint8_t pixels[48], const float pts[16][3],
+                                EncodedBlock best, int num_iterations) {
+  for (int iter = 0; iter < num_iterations; ++iter) {
+    const uint16_t c0 = static_cast<uint16_t>(best.block & 0xFFFF);
+    const uint16_t c1 = static_cast<uint16_t>((best.block >> 16) & 0xFFFF);
+    if (c0 <= c1) {
+      // Not in four color mode
+      break;
+    }
+
+    const uint32_t indices = static_cast<uint32_t>(best.block >> 32);
+    uint32_t orders[16];
+    for (int i = 0; i < 16; ++i) {
+      orders[i] = kIndexToOrder[(indices >> (2 * i)) & 0x3];
+    }
+
+    float e0[3], e1[3];
+    if (!LeastSquaresEndpoints(pts, orders, e0, e1)) {
+      break;
+    }
+
+    EncodedBlock refined = EncodeEndpoints(pixels, e0, e1);
+    if (refined.err >= best.err) {
+      break;
+    }
+
+    best = refined;
+  }
+
+  return best;
+}
+
+// Tries every way of splitting the pixels, sorted along the principal axis,
+// into four consecutive clusters, one per palette entry.
+static EncodedBlock ClusterFitBlock(const uint8_t pixels[48], const float pts[16][3],
+                                    const float axis[3]) {
+  int order[16];
+  float proj[16];
+  for (int i = 0; i < 16; ++i) {
+    order[i] = i;
+    proj[i] = pts[i][0] * axis[0] + pts[i][1] * axis[1] + pts[i][2] * axis[2];
+  }
+
+  std::stable_sort(order, order + 16, [&proj](int a, int b) { return proj[a] < proj[b]; });
+
+  // Prefix sums of the sorted pixels
+  float prefix[17][3];
+  prefix[0][0] = prefix[0][1] = prefix[0][2] = 0.0f;
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      prefix[i + 1][j] = prefix[i][j] + pts[order[i]][j];
+    }
+  }
+
+  static const float kGrid[3] = { 31.0f, 63.0f, 31.0f };
+
+  float best_err = std::numeric_limits<float>::max();
+  float best_e0[3] = { 0.0f, 0.0f, 0.0f };
+  float best_e1[3] = { 0.0f, 0.0f, 0.0f };
+
+  for (int i = 0; i <= 16; ++i) {
+    for (int j = i; j <= 16; ++j) {
+      for (int k = j; k <= 16; ++k) {
+        const float n[4] = {
+          static_cast<float>(i), static_cast<float>(j - i),
+          static_cast<float>(k - j), static_cast<float>(16 - k)
+        };
+
+        const float asq = n[0] + n[1] * (4.0f / 9.0f) + n[2] * (1.0f / 9.0f);
+        const float bsq = n[1] * (1.0f / 9.0f) + n[2] * (4.0f / 9.0f) + n[3];
+        const float ab = (n[1] + n[2]) * (2.0f / 9.0f);
+        const float det = asq * bsq - ab * ab;
+        if (std::fabs(det) < 1e-6f) {
+          continue;
+        }
+
+        const float f = 1.0f / det;
+        float e0[3], e1[3], ax[3], bx[3];
+        for (int c = 0; c < 3; ++c) {
+          const float x0 = prefix[i][c];
+          const float x1 = prefix[j][c] - prefix[i][c];
+          const float x2 = prefix[k][c] - prefix[j][c];
+          const float x3 = prefix[16][c] - prefix[k][c];
+          ax[c] = x0 + x1 * (2.0f / 3.0f) + x2 * (1.0f / 3.0f);
+          bx[c] = x1 * (1.0f / 3.0f) + x2 * (2.0f / 3.0f) + x3;
+
+          // Snap the endpoints to the grid that they'll be quantized to, so
+          // that the error accounts for the quantization.
+          const float s = 255.0f / kGrid[c];
+          e0[c] = std::max(0.0f, std::min(255.0f, f * (ax[c] * bsq - bx[c] * ab)));
+          e1[c] = std::max(0.0f, std::min(255.0f, f * (bx[c] * asq - ax[c] * ab)));
+          e0[c] = std::floor(e0[c] / s + 0.5f) * s;
+          e1[c] = std::floor(e1[c] / s + 0.5f) * s;
+        }
+
+        // Squared error, without the constant sum of the squared pixels
+        float err = 0.0f;
+        for (int c = 0; c < 3; ++c) {
+          err += e0[c] * e0[c] * asq + e1[c] * e1[c] * bsq
+            + 2.0f * (e0[c] * e1[c] * ab - e0[c] * ax[c] - e1[c] * bx[c]);
+        }
+
+        if (err < best_err) {
+          best_err = err;
+          std::copy(e0, e0 + 3, best_e0);
+          std::copy(e1, e1 + 3, best_e1);
+        }
+      }
+    }
+  }
+
+  return EncodeEndpoints(pixels, best_e0, best_e1);
+}
+
+}  // namespace
+
+namespace GenTC {
+
+uint64_t CompressBC1Block(const uint8_t pixels[48], EBC1Quality quality) {
+  assert(quality < kNumBC1Qualities);
+
+  float pts[16][3];
+  float mean[3] = { 0.0f, 0.0f, 0.0f };
+  bool solid = true;
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      pts[i][j] = static_cast<float>(pixels[3 * i + j]);
+      mean[j] += pts[i][j];
+      solid = solid && pixels[3 * i + j] == pixels[j];
+    }
+  }
+
+  if (solid) {
+    return EncodeSolidBlock(pixels).block;
+  }
+
+  for (int j = 0; j < 3; ++j) {
+    mean[j] /= 16.0f;
+  }
+
+  float axis[3];
+  if (!PrincipalAxis(pts, mean, axis)) {
+    return EncodeSolidBlock(pixels).block;
+  }
+
+  // Range fit: use the pixels at the extremes of the principal axis
+  int min_idx = 0, max_idx = 0;
+  float min_proj = std::numeric_limits<float>::max();
+  float max_proj = -std::numeric_limits<float>::max();
+  for (int i = 0; i < 16; ++i) {
+    const float p = pts[i][0] * axis[0] + pts[i][1] * axis[1] + pts[i][2] * axis[2];
+    if (p < min_proj) {
+      min_proj = p;
+      min_idx = i;
+    }
+
+    if (p > max_proj) {
+      max_proj = p;
+      max_idx = i;
+    }
+  }
+
+  EncodedBlock best = EncodeEndpoints(pixels, pts[max_idx], pts[min_idx]);
+  if (eBC1Quality_RangeFit == quality) {
+    return best.block;
+  }
+
+  best = RefineBlock(pixels, pts, best, 3);
+  if (eBC1Quality_PCA == quality) {
+    return best.block;
+  }
+
+  EncodedBlock cluster = RefineBlock(pixels, pts, ClusterFitBlock(pixels, pts, axis), 1);
+  if (cluster.err < best.err) {
+    best = cluster;
+  }
+
+  return best.block;
+}
+
+std::vector<uint64_t> CompressBC1(const uint8_t *rgb, int width, int height,
+                                  EBC1Quality quality, ThreadPool *pool) {
+  assert((width % 4) == 0);
+  assert((height % 4) == 0);
+
+  const int blocks_x = width / 4;
+  const int blocks_y = height / 4;
+  std::vector<uint64_t> result(static_cast<size_t>(blocks_x) * blocks_y);
+
+  auto compress_rows = [&](size_t begin, size_t end) {
+    uint8_t pixels[48];
+    for (size_t by = begin; by < end; ++by) {
+      for (int bx = 0; bx < blocks_x; ++bx) {
+        for (int row = 0; row < 4; ++row) {
+          const uint8_t *src = rgb + ((by * 4 + row) * width + bx * 4) * 3;
+          std::copy(src, src + 12, pixels + 12 * row);
+        }
+
+        result[by * blocks_x + bx] = CompressBC1Block(pixels, quality);
+      }
+    }
+  };
+
+  if (nullptr == pool) {
+    compress_rows(0, static_cast<size_t>(blocks_y));
+  } else {
+    ParallelFor(*pool, static_cast<size_t>(blocks_y), compress_rows);
+  }
+
+  return std::move(result);
+}
+
+}  // namespace GenTC
@@ -0,0 +1,40 @@
+#ifndef __TCAR_BC1_ENCODER_H__
+#define __TCAR_BC1_ENCODER_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace GenTC {
+
+  enum EBC1Quality {
+    // Endpoints at the extremes of the pixels along their principal axis
+    eBC1Quality_RangeFit,
+
+    // Range fit followed by a few rounds of least squares refinement of the
+    // endpoints, roughly what stb_dxt does with STB_DXT_HIGHQUAL
+    eBC1Quality_PCA,
+
+    // Searches every ordered partition of the pixels along the principal
+    // axis into the four palette entries (as in squish's ClusterFit)
+    eBC1Quality_ClusterFit,
+
+    kNumBC1Qualities
+  };
+
+  // Compresses one 4x4 block given as 16 RGB pixels in row major order into
+  // a BC1 (DXT1) block with the endpoints first, followed by the 2-bit
+  // indices of each pixel, starting with the lowest bits. Only the four color
+  // mode is used unless both endpoints are the same.
+  uint64_t CompressBC1Block(const uint8_t pixels[48], EBC1Quality quality);
+
+  // Compresses a width x height RGB image, where both dimensions must be
+  // multiples of four, into BC1 blocks in row major order. Rows of blocks
+  // are spread across the threads in the pool, if there is one.
+  std::vector<uint64_t> CompressBC1(const uint8_t *rgb, int width, int height,
+                                    EBC1Quality quality, ThreadPool *pool = nullptr);
+
+}  // namespace GenTC
+
+#endif  // __TCAR_BC1_ENCODER_H__
@@ -17,7 +17,10 @@ int main(int argc, char **argv) {
   const char *cmp_fn = (argc == 3) ? NULL : argv[2];
   const char *dst_fn = (argc == 4) ? argv[3] : argv[2];
 
-  std::vector<uint8_t> cmp_img = std::move(GenTC::CompressDXT(orig_fn, cmp_fn));
+  GenTC::EncoderOptions opts;
+  opts.verbose = true;
+
+  std::vector<uint8_t> cmp_img = std::move(GenTC::CompressDXT(orig_fn, cmp_fn, opts));
   std::ofstream out (dst_fn, std::ofstream::binary);
   out.write(reinterpret_cast<const char *>(cmp_img.data()), cmp_img.size());
   out.close();
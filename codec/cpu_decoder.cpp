@@ -0,0 +1,291 @@
+#include "cpu_decoder.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+
+#include "ans.h"
+#include "wavelet.h"
+
+namespace {
+
+// Y planes, chroma planes, palette and palette index deltas
+static const size_t kNumANSStreams = 4;
+static const size_t kFreqTableBytes = 512;
+
+static const size_t kSymbolsPerGroup =
+  ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+static uint32_t LoadUint32(const uint8_t *ptr) {
+  uint32_t result;
+  memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+
+// Returns an empty table if the frequencies don't add up to the table size.
+static std::vector<uint32_t> BuildTable(const uint8_t *freq_data) {
+  std::vector<uint32_t> F(ans::ocl::kNumEncodedSymbols);
+  uint32_t total = 0;
+  for (size_t symbol = 0; symbol < F.size(); ++symbol) {
+    uint16_t freq;
+    memcpy(&freq, freq_data + 2 * symbol, sizeof(freq));
+    F[symbol] = freq;
+    total += freq;
+  }
+
+  if (total != ans::ocl::kANSTableSize) {
+    return std::vector<uint32_t>();
+  }
+
+  return std::move(ans::ocl::BuildDecodeTable(F));
+}
+
+// The data of each stream starts with one offset per group, each pointing to
+// the end of that group's data. Makes sure that they stay within the stream
+// and never go backwards.
+static bool ValidateGroupOffsets(const uint8_t *data, size_t data_sz, size_t num_groups) {
+  size_t last_offset = 4 * num_groups;
+  if (last_offset > data_sz) {
+    return false;
+  }
+
+  for (size_t group_idx = 0; group_idx < num_groups; ++group_idx) {
+    const size_t offset = LoadUint32(data + 4 * group_idx);
+    if (offset <= last_offset || offset > data_sz) {
+      return false;
+    }
+    last_offset = offset;
+  }
+
+  return true;
+}
+
+// Decodes one group of interleaved rANS streams whose offsets have already
+// been validated. Returns false if the group itself is malformed.
+static bool DecodeANSGroup(const uint32_t *table, const uint8_t *data, size_t num_groups,
+                           size_t group_idx, uint8_t *out) {
+  const uint32_t start = (0 == group_idx)
+    ? static_cast<uint32_t>(4 * num_groups)
+    : LoadUint32(data + 4 * (group_idx - 1));
+  const uint32_t end = LoadUint32(data + 4 * group_idx);
+  return ans::ocl::DecodeGroup(table, data + start, end - start,
+                               out + group_idx * kSymbolsPerGroup);
+}
+
+// Undoes every level of FWavelet2D on one kWaveletBlockDim^2 block, just like
+// the inv_wavelet kernel does in local memory.
+static void InverseWaveletBlock(const uint8_t *block_data, int16_t *block) {
+  static const size_t kBlockSz = GenTC::kWaveletBlockDim * GenTC::kWaveletBlockDim;
+  static const size_t kRowBytes = GenTC::kWaveletBlockDim * sizeof(int16_t);
+
+  for (size_t i = 0; i < kBlockSz; ++i) {
+    block[i] = static_cast<int16_t>(block_data[i]) - 128;
+  }
+
+  int16_t scratch[kBlockSz + GenTC::kWaveletBlockDim];
+  assert(GenTC::WaveletScratchSize(GenTC::kWaveletBlockDim) <= sizeof(scratch) / sizeof(scratch[0]));
+
+  for (size_t len = 2; len <= GenTC::kWaveletBlockDim; len *= 2) {
+    GenTC::InverseWavelet2D(block, kRowBytes, block, kRowBytes, len, scratch);
+  }
+}
+
+// Same conversion that assemble.cl does in GetPixel
+static uint16_t YCoCgToRGB565(int y, int co, int cg) {
+  const int t = y - (cg / 2);
+  const int g = cg + t;
+  const int b = (t - co) / 2;
+  const int r = b + co;
+
+  uint32_t pixel = 0;
+  pixel |= static_cast<uint32_t>(r) << 11;
+  pixel |= static_cast<uint32_t>(g) << 5;
+  pixel |= static_cast<uint32_t>(b);
+  return static_cast<uint16_t>(pixel);
+}
+
+}  // namespace
+
+namespace GenTC {
+
+std::vector<uint8_t> DecompressDXTBufferCPU(const std::vector<uint8_t> &cmp_data,
+                                            ThreadPool &pool) {
+  GenTCHeader hdr;
+  if (cmp_data.size() < sizeof(hdr) + kNumANSStreams * kFreqTableBytes) {
+    return std::vector<uint8_t>();
+  }
+  hdr.LoadFrom(cmp_data.data());
+
+  if (0 == hdr.width || 0 == hdr.height || (hdr.width % 128) != 0 || (hdr.height % 128) != 0) {
+    return std::vector<uint8_t>();
+  }
+
+  const size_t blocks_x = hdr.width / 4;
+  const size_t blocks_y = hdr.height / 4;
+  const size_t num_vals = blocks_x * blocks_y;
+
+  // Setup ANS input offsets, relative to the end of the frequency tables
+  const uint32_t input_sizes[kNumANSStreams] = {
+    hdr.y_cmp_sz, hdr.chroma_cmp_sz, hdr.palette_sz, hdr.indices_sz
+  };
+
+  // Setup ANS output offsets
+  const size_t output_sizes[kNumANSStreams] = {
+    2 * num_vals, // Y planes
+    4 * num_vals, // Chroma planes
+    hdr.palette_bytes, // Palette
+    num_vals // Indices
+  };
+
+  const uint8_t *freqs = cmp_data.data() + sizeof(hdr);
+  const uint8_t *ans_input = freqs + kNumANSStreams * kFreqTableBytes;
+
+  // Everything in the header comes straight from the file, so make sure that
+  // it all fits into the data before we allocate or read anything. Every
+  // group needs at least its offset and the final states of its streams,
+  // which also keeps huge dimensions from allocating huge outputs.
+  static const size_t kMinGroupSz = 4 + 4 * ans::ocl::kThreadsPerEncodingGroup;
+  const size_t ans_input_sz = cmp_data.size() - (ans_input - cmp_data.data());
+
+  size_t input_offsets[kNumANSStreams];
+  size_t output_offsets[kNumANSStreams];
+  size_t group_offsets[kNumANSStreams + 1];
+  size_t input_offset = 0;
+  size_t output_offset = 0;
+  group_offsets[0] = 0;
+  for (size_t i = 0; i < kNumANSStreams; ++i) {
+    const size_t num_groups = output_sizes[i] / kSymbolsPerGroup;
+    if (output_sizes[i] % kSymbolsPerGroup != 0 || input_sizes[i] < num_groups * kMinGroupSz) {
+      return std::vector<uint8_t>();
+    }
+
+    input_offsets[i] = input_offset;
+    output_offsets[i] = output_offset;
+    group_offsets[i + 1] = group_offsets[i] + num_groups;
+
+    input_offset += input_sizes[i];
+    output_offset += output_sizes[i];
+  }
+
+  if (input_offset > ans_input_sz) {
+    return std::vector<uint8_t>();
+  }
+
+  for (size_t i = 0; i < kNumANSStreams; ++i) {
+    if (!ValidateGroupOffsets(ans_input + input_offsets[i], input_sizes[i],
+                              group_offsets[i + 1] - group_offsets[i])) {
+      return std::vector<uint8_t>();
+    }
+  }
+
+  // Build the tables
+  std::vector<uint32_t> tables[kNumANSStreams];
+  for (size_t i = 0; i < kNumANSStreams; ++i) {
+    tables[i] = std::move(BuildTable(freqs + i * kFreqTableBytes));
+    if (tables[i].empty()) {
+      return std::vector<uint8_t>();
+    }
+  }
+
+  // Decode all of the rANS groups...
+  std::vector<uint8_t> decmp(output_offset);
+  std::atomic<bool> malformed(false);
+  ParallelFor(pool, group_offsets[kNumANSStreams], [&](size_t begin, size_t end) {
+    size_t stream = 0;
+    for (size_t group = begin; group < end; ++group) {
+      while (group >= group_offsets[stream + 1]) {
+        stream++;
+      }
+
+      if (!DecodeANSGroup(tables[stream].data(), ans_input + input_offsets[stream],
+                          group_offsets[stream + 1] - group_offsets[stream],
+                          group - group_offsets[stream], decmp.data() + output_offsets[stream])) {
+        malformed = true;
+        return;
+      }
+    }
+  });
+
+  if (malformed) {
+    return std::vector<uint8_t>();
+  }
+
+  // Run the inverse wavelet on each block of each endpoint plane. The planes
+  // are ordered Y1, Y2, Co1, Cg1, Co2, Cg2 since the chroma planes directly
+  // follow the luma planes.
+  static const size_t kNumPlanes = 6;
+  const size_t wavelet_blocks_x = blocks_x / kWaveletBlockDim;
+  const size_t wavelet_blocks_y = blocks_y / kWaveletBlockDim;
+  const size_t num_wavelet_blocks = wavelet_blocks_x * wavelet_blocks_y;
+
+  std::vector<int8_t> endpoint_planes(kNumPlanes * num_vals);
+  ParallelFor(pool, kNumPlanes * num_wavelet_blocks, [&](size_t begin, size_t end) {
+    int16_t block[kWaveletBlockDim * kWaveletBlockDim];
+    for (size_t job = begin; job < end; ++job) {
+      const size_t plane = job / num_wavelet_blocks;
+      const size_t block_idx = job % num_wavelet_blocks;
+
+      const uint8_t *block_data = decmp.data() + output_offsets[0] + plane * num_vals
+        + block_idx * kWaveletBlockDim * kWaveletBlockDim;
+      InverseWaveletBlock(block_data, block);
+
+      const size_t block_x = (block_idx % wavelet_blocks_x) * kWaveletBlockDim;
+      const size_t block_y = (block_idx / wavelet_blocks_x) * kWaveletBlockDim;
+      int8_t *out = endpoint_planes.data() + plane * num_vals;
+      for (size_t y = 0; y < kWaveletBlockDim; ++y) {
+        for (size_t x = 0; x < kWaveletBlockDim; ++x) {
+          const size_t idx = (block_y + y) * blocks_x + block_x + x;
+          out[idx] = static_cast<int8_t>(block[y * kWaveletBlockDim + x]);
+        }
+      }
+    }
+  });
+
+  // Decode the palette indices: they're stored as (biased) deltas from the
+  // previous block, so this is just an inclusive prefix sum. Every index has
+  // to point into the palette.
+  const size_t num_palette_entries = hdr.palette_bytes / 4;
+  std::vector<uint32_t> indices(num_vals);
+  {
+    const uint8_t *index_deltas = decmp.data() + output_offsets[3];
+    int64_t last_index = 0;
+    for (size_t i = 0; i < num_vals; ++i) {
+      last_index += static_cast<int64_t>(index_deltas[i]) - 128;
+      if (last_index < 0 || static_cast<uint64_t>(last_index) >= num_palette_entries) {
+        return std::vector<uint8_t>();
+      }
+      indices[i] = static_cast<uint32_t>(last_index);
+    }
+  }
+
+  // Assemble the final DXT blocks
+  const uint8_t *palette = decmp.data() + output_offsets[2];
+  std::vector<uint8_t> result(num_vals * sizeof(PhysicalDXTBlock));
+  ParallelFor(pool, num_vals, [&](size_t begin, size_t end) {
+    const int8_t *planes = endpoint_planes.data();
+    for (size_t i = begin; i < end; ++i) {
+      PhysicalDXTBlock blk;
+      blk.ep1 = YCoCgToRGB565(planes[i], planes[2 * num_vals + i], planes[3 * num_vals + i]);
+      blk.ep2 = YCoCgToRGB565(planes[num_vals + i], planes[4 * num_vals + i], planes[5 * num_vals + i]);
+
+      blk.interpolation = LoadUint32(palette + 4 * indices[i]);
+
+      memcpy(result.data() + i * sizeof(blk), &blk.dxt_block, sizeof(blk));
+    }
+  });
+
+  return std::move(result);
+}
+
+DXTImage DecompressDXTCPU(const std::vector<uint8_t> &cmp_data, ThreadPool &pool) {
+  std::vector<uint8_t> decmp_data = std::move(DecompressDXTBufferCPU(cmp_data, pool));
+  if (decmp_data.empty()) {
+    return DXTImage(0, 0, decmp_data);
+  }
+
+  GenTCHeader hdr;
+  hdr.LoadFrom(cmp_data.data());
+  return DXTImage(hdr.width, hdr.height, decmp_data);
+}
+
+}  // namespace GenTC
@@ -0,0 +1,24 @@
+#ifndef __TCAR_CPU_DECODER_H__
+#define __TCAR_CPU_DECODER_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "codec_base.h"
+#include "dxt_image.h"
+#include "thread_pool.h"
+
+namespace GenTC {
+  // Decompresses a GenTC stream on the host without OpenCL. Every stage mirrors
+  // its kernel counterpart (build_table, ans_decode_multiple, inv_wavelet,
+  // decode_indices/collect_indices and assemble_dxt) and the result is bit-exact
+  // with DecompressDXT. The work is split across the threads in the pool.
+  //
+  // The stream is validated against its own size before anything is decoded.
+  // Malformed or truncated streams produce an empty buffer or a 0x0 image.
+  std::vector<uint8_t> DecompressDXTBufferCPU(const std::vector<uint8_t> &cmp_data,
+                                              ThreadPool &pool);
+  DXTImage DecompressDXTCPU(const std::vector<uint8_t> &cmp_data, ThreadPool &pool);
+}  // namespace GenTC
+
+#endif  // __TCAR_CPU_DECODER_H__
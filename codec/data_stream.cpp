@@ -1,5 +1,6 @@
 #include "data_stream.h"
 
+#include <cassert>
 #include <cstring>
 
 namespace GenTC {
@@ -17,6 +18,7 @@ static void WriteBytes(std::vector<uint8_t> *buf, const uint8_t *bytes, size_t n
 #endif
 #define DATA_STREAM_WRITE_TYPE(ty) \
   do { \
+    assert(NULL == _view || !"Cannot write to a read-only stream!"); \
     WriteBytes(&_data, reinterpret_cast<const uint8_t *>(&x), sizeof(ty)); \
   } while(0)
 
@@ -42,7 +44,8 @@ void DataStream::WriteLong(uint64_t x) {
 #define DATA_STREAM_READ_TYPE(ty) \
   do { \
     ty x; \
-    memcpy(&x, _data.data() + _read_idx, sizeof(ty)); \
+    assert(_read_idx + sizeof(ty) <= ReadSize()); \
+    memcpy(&x, ReadPtr() + _read_idx, sizeof(ty)); \
     _read_idx += sizeof(ty); \
     return x; \
   } while(0)
@@ -9,8 +9,14 @@ namespace GenTC {
 
 class DataStream {
  public:
-   DataStream() : _read_idx(0) { }
-   explicit DataStream(const std::vector<uint8_t> &d) : _read_idx(0), _data(d) { }
+   DataStream() : _read_idx(0), _view(NULL), _view_sz(0) { }
+   explicit DataStream(const std::vector<uint8_t> &d)
+     : _read_idx(0), _data(d), _view(NULL), _view_sz(0) { }
+
+   // Reads from the given memory without copying it. The memory must outlive
+   // the stream, and the stream cannot be written to.
+   DataStream(const uint8_t *d, size_t sz) : _read_idx(0), _view(d), _view_sz(sz) { }
+
    const std::vector<uint8_t> &GetData() const { return _data; }
    size_t BytesRead() const { return _read_idx; }
 
@@ -27,6 +33,12 @@ class DataStream {
  private:
    size_t _read_idx;
    std::vector<uint8_t> _data;
+
+   const uint8_t *_view;
+   size_t _view_sz;
+
+   const uint8_t *ReadPtr() const { return _view ? _view : _data.data(); }
+   size_t ReadSize() const { return _view ? _view_sz : _data.size(); }
 };
 
 }  // namespace codec
@@ -1,13 +1,16 @@
 #include "dxt_image.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
-#include <chrono>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <functional>
 #include <random>
+#include <unordered_map>
 
 #ifndef _MSC_VER
 #pragma GCC diagnostic push
@@ -20,8 +23,6 @@
 #pragma warning(disable : 4312)
 #endif
 
-#define STB_DXT_IMPLEMENTATION
-#include "stb_dxt.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "crn_decomp.h"
@@ -33,8 +34,12 @@
 #pragma warning(default : 4312)
 #endif
 
-#include "vptree/vptree.hh"
-#define PREDICT_VPTREE
+#include "index_nn.h"
+#include "thread_pool.h"
+
+// Predict each block's indices from the nearest of a set of clustered index
+// words, rather than from the colors of the neighboring pixels.
+#define PREDICT_NEAREST_INDEX
 
 template <typename T>
 static inline T AbsDiff(T a, T b) {
@@ -214,16 +219,6 @@ PhysicalDXTBlock LogicalToPhysical(const LogicalDXTBlock &b) {
   return result;
 }
 
-static void Deinterleave(uint32_t x, uint16_t *i, uint16_t *j) {
-  uint64_t w = (static_cast<uint64_t>(x & 0xAAAAAAAA) << 31) | (x & 0x55555555);
-  w = (w | (w >> 1)) & 0x3333333333333333ULL;
-  w = (w | (w >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
-  w = (w | (w >> 4)) & 0x00FF00FF00FF00FFULL;
-  w = (w | (w >> 8)) & 0x0000FFFF0000FFFFULL;
-  *i = static_cast<uint16_t>(w & 0xFFFF);
-  *j = static_cast<uint16_t>((w >> 32) & 0xFFFF);
-}
-
 static void ChunkBy(int chunk_sz_x, int chunk_sz_y, int sz_x, int sz_y,
   std::function<void(int x, int y)> func) {
   for (int y = 0; y < sz_y; y += chunk_sz_y) {
@@ -247,22 +242,9 @@ static std::vector<LogicalDXTBlock>
   return std::move(out);
 }
 
-static std::vector<PhysicalDXTBlock>
-  LogicalToPhysicalBlocks(const std::vector<LogicalDXTBlock> &blocks) {
-  std::vector<PhysicalDXTBlock> out;
-  out.reserve(blocks.size());
-
-  for (const LogicalDXTBlock &b : blocks) {
-    PhysicalDXTBlock pb = LogicalToPhysical(b);
-    assert(PhysicalToLogical(pb) == b);
-    out.push_back(pb);
-  }
-
-  return std::move(out);
-}
-
 struct CompressedBlock {
-  std::vector<uint8_t> _uncompressed;
+  // RGB values of the 16 pixels in the block
+  uint8_t _uncompressed[48];
   LogicalDXTBlock _logical;
 
   size_t Error() const {
@@ -307,7 +289,7 @@ struct CompressedBlock {
     float ax[3] = { 0.0f, 0.0f, 0.0f };
     float bx[3] = { 0.0f, 0.0f, 0.0f };
     for (size_t i = 0; i < 16; i++) {
-      const uint8_t *orig_pixel = _uncompressed.data() + i * 3;
+      const uint8_t *orig_pixel = _uncompressed + i * 3;
 
       static const float idx_to_order[4] = { 0.f, 3.f, 1.f, 2.f };
       const float order = idx_to_order[_logical.indices[i]];
@@ -359,32 +341,220 @@ struct CompressedBlock {
   }
 };
 
-static uint64_t CompressRGB(const uint8_t *img, int width) {
-  unsigned char block[64];
-  memset(block, 0, sizeof(block));
+// Scores candidate index words for a single block. For each candidate this
+// computes the same thing as AssignIndices, RecalculateEndpoints and Error on
+// a copy of the block, but it evaluates kBatchSize candidates at once without
+// touching the heap: the least squares fit is done with the candidates in
+// separate lanes, so that every lane performs exactly the same floating point
+// operations in the same order as the scalar code and the compiler is free to
+// vectorize across them.
+class CandidateEvaluator {
+ public:
+  static const size_t kBatchSize = 8;
+
+  explicit CandidateEvaluator(const uint8_t pixels[48]) {
+    memcpy(_pixels, pixels, sizeof(_pixels));
+    for (size_t i = 0; i < 48; ++i) {
+      _fpixels[i] = static_cast<float>(pixels[i]);
+    }
+  }
+
+  // Writes the error of each candidate into errors. If the endpoints fit to
+  // a candidate would have to be swapped, which flips its indices, then the
+  // candidate can't be used as is and its error is -1 unless allow_flipped
+  // is set.
+  void Evaluate(const uint32_t candidates[kBatchSize], int errors[kBatchSize],
+                bool allow_flipped = false) const {
+    // Same weights as RecalculateEndpoints, indexed by the two bit index
+    static const float kOrder[4] = { 0.f, 3.f, 1.f, 2.f };
+    static const float kA[4] = {
+      (3.0f - kOrder[0]) / 3.0f, (3.0f - kOrder[1]) / 3.0f,
+      (3.0f - kOrder[2]) / 3.0f, (3.0f - kOrder[3]) / 3.0f
+    };
+    static const float kB[4] = {
+      kOrder[0] / 3.0f, kOrder[1] / 3.0f, kOrder[2] / 3.0f, kOrder[3] / 3.0f
+    };
+
+    float asq[kBatchSize], bsq[kBatchSize], ab[kBatchSize];
+    float ax[3][kBatchSize], bx[3][kBatchSize];
+    for (size_t lane = 0; lane < kBatchSize; ++lane) {
+      asq[lane] = bsq[lane] = ab[lane] = 0.0f;
+      for (size_t j = 0; j < 3; ++j) {
+        ax[j][lane] = bx[j][lane] = 0.0f;
+      }
+    }
+
+    for (size_t i = 0; i < 16; ++i) {
+      const float *orig_pixel = _fpixels + i * 3;
 
-  for (int j = 0; j < 4; ++j) {
-    for (int i = 0; i < 4; ++i) {
-      int src_idx = (j * width + i) * 3;
-      int dst_idx = (j * 4 + i) * 4;
+      float a[kBatchSize], b[kBatchSize];
+      for (size_t lane = 0; lane < kBatchSize; ++lane) {
+        const uint32_t idx = (candidates[lane] >> (2 * i)) & 0x3;
+        a[lane] = kA[idx];
+        b[lane] = kB[idx];
+      }
 
-      unsigned char *block_pixel = block + dst_idx;
-      const unsigned char *img_pixel = img + src_idx;
+      for (size_t lane = 0; lane < kBatchSize; ++lane) {
+        asq[lane] += a[lane] * a[lane];
+        bsq[lane] += b[lane] * b[lane];
+        ab[lane] += a[lane] * b[lane];
+      }
 
-      block_pixel[0] = img_pixel[0];
-      block_pixel[1] = img_pixel[1];
-      block_pixel[2] = img_pixel[2];
-      block_pixel[3] = 0xFF;
+      for (size_t j = 0; j < 3; ++j) {
+        for (size_t lane = 0; lane < kBatchSize; ++lane) {
+          ax[j][lane] += orig_pixel[j] * a[lane];
+          bx[j][lane] += orig_pixel[j] * b[lane];
+        }
+      }
+    }
+
+    float p1[3][kBatchSize], p2[3][kBatchSize];
+    for (size_t lane = 0; lane < kBatchSize; ++lane) {
+      const float f = 1.0f / (asq[lane] * bsq[lane] - ab[lane] * ab[lane]);
+      for (size_t j = 0; j < 3; ++j) {
+        p1[j][lane] = f * (ax[j][lane] * bsq[lane] - bx[j][lane] * ab[lane]);
+        p2[j][lane] = f * (bx[j][lane] * asq[lane] - ax[j][lane] * ab[lane]);
+      }
+    }
+
+    for (size_t lane = 0; lane < kBatchSize; ++lane) {
+      uint8_t palette[4][4];
+      for (int j = 0; j < 3; ++j) {
+        palette[0][j] = std::max(0, std::min(255, static_cast<int32_t>(p1[j][lane] + 0.5f)));
+        palette[1][j] = std::max(0, std::min(255, static_cast<int32_t>(p2[j][lane] + 0.5f)));
+      }
+
+      palette[0][0] = ToFiveBits(palette[0][0]);
+      palette[1][0] = ToFiveBits(palette[1][0]);
+      palette[0][1] = ToSixBits(palette[0][1]);
+      palette[1][1] = ToSixBits(palette[1][1]);
+      palette[0][2] = ToFiveBits(palette[0][2]);
+      palette[1][2] = ToFiveBits(palette[1][2]);
+
+      // RecalculateEndpoints always produces a four color block, so the
+      // indices survive LogicalToPhysical only if the endpoints are ordered.
+      if (!allow_flipped && Pack565(palette[0]) <= Pack565(palette[1])) {
+        errors[lane] = -1;
+        continue;
+      }
+
+      LerpChannels(palette[0], palette[1], palette[2], 1, 3);
+      LerpChannels(palette[0], palette[1], palette[3], 2, 3);
+
+      size_t err = 0;
+      for (size_t i = 0; i < 16; ++i) {
+        const uint8_t *pixel = palette[(candidates[lane] >> (2 * i)) & 0x3];
+        for (size_t j = 0; j < 3; ++j) {
+          const size_t diff = AbsDiff(_pixels[i * 3 + j], pixel[j]);
+          err += diff * diff;
+        }
+      }
+
+      errors[lane] = static_cast<int>(err / (16 * 3));
     }
   }
 
-  PhysicalDXTBlock result;
-  stb_compress_dxt_block(reinterpret_cast<unsigned char *>(&result.dxt_block),
-    block, 0, STB_DXT_HIGHQUAL);
-  return result.dxt_block;
+ private:
+  uint8_t _pixels[48];
+  float _fpixels[48];
+};
+
+#ifndef NDEBUG
+// The original, one candidate at a time, version of the evaluation above
+static int ScalarCandidateError(const CompressedBlock &blk, uint32_t indices) {
+  CompressedBlock blk2 = blk;
+  blk2.AssignIndices(indices);
+  blk2.RecalculateEndpoints();
+
+  PhysicalDXTBlock maybe_blk = LogicalToPhysical(blk2._logical);
+  bool ok = maybe_blk.interpolation == indices;
+  ok = ok && blk2._logical.palette[3][3] == 0xFF;
+  if (!ok) {
+    return -1;
+  }
+
+  return static_cast<int>(blk2.Error());
 }
+#endif
+
+// A lower bound on the squared error of a block for any endpoints, given
+// only its indices: all of the pixels that share an index are mapped to the
+// same color, so the error is at least the sum of squared distances of each
+// pixel to the mean of the pixels that share its index. The bound is kept
+// exact by scaling it by the least common multiple of all group sizes.
+class IndexPartitionBound {
+ public:
+  static const uint64_t kScale = 720720;  // lcm(1, 2, ..., 16)
+
+  explicit IndexPartitionBound(const uint8_t pixels[48]) {
+    // Sums of the pixels selected by each 4-bit mask in each row
+    for (int row = 0; row < 4; ++row) {
+      for (uint32_t mask = 0; mask < 16; ++mask) {
+        for (int c = 0; c < 3; ++c) {
+          uint32_t sum = 0;
+          for (int p = 0; p < 4; ++p) {
+            if ((mask >> p) & 0x1) {
+              sum += pixels[(row * 4 + p) * 3 + c];
+            }
+          }
+          _row_sums[row][mask][c] = sum;
+        }
+      }
+    }
 
-DXTImage::DXTImage(const char *orig_fn, const char *cmp_fn) {
+    uint64_t sum_sq = 0;
+    for (size_t i = 0; i < 48; ++i) {
+      sum_sq += static_cast<uint64_t>(pixels[i]) * pixels[i];
+    }
+    _scaled_sum_sq = sum_sq * kScale;
+  }
+
+  // Returns the bound on the squared error for indices, times kScale.
+  uint64_t ScaledBound(uint32_t indices) const {
+    const uint32_t lo = indices & 0x55555555;
+    const uint32_t hi = (indices >> 1) & 0x55555555;
+    const uint32_t groups[4] = {
+      ~(lo | hi) & 0x55555555, lo & ~hi, hi & ~lo, lo & hi
+    };
+
+    uint64_t explained = 0;
+    for (int g = 0; g < 4; ++g) {
+      const uint32_t mask = CompactEvenBits(groups[g]);
+      const uint32_t n = PopCount32(mask);
+      if (0 == n) {
+        continue;
+      }
+
+      for (int c = 0; c < 3; ++c) {
+        const uint64_t sum = _row_sums[0][mask & 0xF][c] + _row_sums[1][(mask >> 4) & 0xF][c]
+          + _row_sums[2][(mask >> 8) & 0xF][c] + _row_sums[3][(mask >> 12) & 0xF][c];
+        explained += sum * sum * (kScale / n);
+      }
+    }
+
+    assert(explained <= _scaled_sum_sq);
+    return _scaled_sum_sq - explained;
+  }
+
+ private:
+  // Moves bit 2i of x to bit i
+  static uint32_t CompactEvenBits(uint32_t x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0F0F0F0F;
+    x = (x | (x >> 4)) & 0x00FF00FF;
+    x = (x | (x >> 8)) & 0x0000FFFF;
+    return x;
+  }
+
+  uint32_t _row_sums[4][16][3];
+  uint64_t _scaled_sum_sq;
+};
+
+DXTImage::DXTImage(const char *orig_fn, const char *cmp_fn, EBC1Quality quality,
+                   ThreadPool *pool)
+  : _bc1_quality(quality)
+{
   std::string cmp_fname(cmp_fn ? cmp_fn : "");
   if (cmp_fname.substr(cmp_fname.find_last_of(".") + 1) == "crn") {
     std::ifstream ifs(cmp_fname.c_str(), std::ifstream::binary | std::ifstream::ate);
@@ -438,21 +608,23 @@ DXTImage::DXTImage(const char *orig_fn, const char *cmp_fn) {
   memcpy(_src_img.data(), data, src_img_sz);
 
   // Optimize it...
-  Reencode();
+  Reencode(pool);
 }
 
-DXTImage::DXTImage(int width, int height, const uint8_t *rgb_data)
+DXTImage::DXTImage(int width, int height, const uint8_t *rgb_data, EBC1Quality quality,
+                   ThreadPool *pool)
   : _width(width)
   , _height(height)
   , _blocks_width((width + 3) / 4)
   , _blocks_height((height + 3) / 4)
   , _src_img(rgb_data, rgb_data + width * height * 3)
+  , _bc1_quality(quality)
 {
-  Reencode();
+  Reencode(pool);
 }
 
 DXTImage::DXTImage(int width, int height, const std::vector<uint8_t> &rgb_data,
-                   const std::vector<uint8_t> &dxt_data)
+                   const std::vector<uint8_t> &dxt_data, ThreadPool *pool)
   : _width(width)
   , _height(height)
   , _blocks_width((width + 3) / 4)
@@ -463,8 +635,9 @@ DXTImage::DXTImage(int width, int height, const std::vector<uint8_t> &rgb_data,
     + (_blocks_width * _blocks_height))
   , _logical_blocks(PhysicalToLogicalBlocks(_physical_blocks))
   , _src_img(rgb_data)
+  , _bc1_quality(eBC1Quality_PCA)
 {
-  Reencode();
+  Reencode(pool);
 }
 
 DXTImage::DXTImage(int width, int height, const std::vector<uint8_t> &dxt_data)
@@ -477,6 +650,7 @@ DXTImage::DXTImage(int width, int height, const std::vector<uint8_t> &dxt_data)
     reinterpret_cast<const PhysicalDXTBlock *>(dxt_data.data())
     + (_blocks_width * _blocks_height))
   , _logical_blocks(PhysicalToLogicalBlocks(_physical_blocks))
+  , _bc1_quality(eBC1Quality_PCA)
 { }
 
 double DXTImage::PSNR() const {
@@ -509,39 +683,25 @@ double DXTImage::PSNR() const {
 
 static const int kErrThreshold = 35;
 static const size_t kNumPrevLookup = 128;
-void DXTImage::Reencode() {
-  _blocks_width = (_width + 3) / 4;
-  _blocks_height = (_height + 3) / 4;
-  const int num_blocks = _blocks_width * _blocks_height;
 
-  if (_physical_blocks.size() == 0) {
-    // Compress the DXT data
-    _physical_blocks.resize(num_blocks);
-    for (int physical_idx = 0; physical_idx < num_blocks; ++physical_idx) {
-      uint16_t i, j;
-      i = static_cast<uint16_t>(physical_idx % _blocks_width);
-      j = static_cast<uint16_t>(physical_idx / _blocks_width);
-
-      int block_idx = j * _blocks_width + i;
-      const unsigned char *offset_data = _src_img.data() + (j * 4 * _width + i * 4) * 3;
-      _physical_blocks[block_idx].dxt_block = CompressRGB(offset_data, _width);
-    }
-  }
+// Number of block rows in each band that Reencode processes independently.
+// This is fixed, rather than derived from the number of threads, so that the
+// encoded palette doesn't depend on the machine that produced it.
+static const int kReencodeBandHeight = 32;
 
-  _logical_blocks = std::move(PhysicalToLogicalBlocks(_physical_blocks));
-  std::cout << "DXT Compressed PSNR: " << PSNR() << std::endl;
-
-  assert((_width & 0x3) == 0);
-  assert((_height & 0x3) == 0);
+void DXTImage::ReencodeBand(int first_row, int end_row, std::vector<uint32_t> *palette,
+                            std::vector<int> *palette_indices) {
+  const int first_block = first_row * _blocks_width;
+  const int end_block = end_row * _blocks_width;
+  palette_indices->reserve(end_block - first_block);
 
-  // Now do the dxt compression...
-  int last_index = 0;
+  // Most recent palette slot of every index word in this band. Re-adding a
+  // word that fell out of the lookup window moves it back to the front.
+  std::unordered_map<uint32_t, int> palette_slots;
 
-  for (int physical_idx = 0; physical_idx < num_blocks; ++physical_idx) {
-    uint16_t i, j;
-    Deinterleave(static_cast<uint32_t>(physical_idx), &i, &j);
-    i = static_cast<uint16_t>(physical_idx % _blocks_width);
-    j = static_cast<uint16_t>(physical_idx / _blocks_width);
+  for (int physical_idx = first_block; physical_idx < end_block; ++physical_idx) {
+    const int i = physical_idx % _blocks_width;
+    const int j = physical_idx / _blocks_width;
 
     int block_idx = j * _blocks_width + i;
     assert(block_idx == physical_idx);
@@ -549,76 +709,157 @@ void DXTImage::Reencode() {
 
     CompressedBlock blk;
     blk._logical = _logical_blocks[block_idx];
-    blk._uncompressed = std::vector<uint8_t>(48, 0);
 
     for (int row = 0; row < 4; ++row) {
-      uint8_t block_row[12];
-      for (int p = 0; p < 4; ++p) {
-        block_row[3 * p + 0] = offset_data[(row * _width + p) * 3 + 0];
-        block_row[3 * p + 1] = offset_data[(row * _width + p) * 3 + 1];
-        block_row[3 * p + 2] = offset_data[(row * _width + p) * 3 + 2];
-      }
-
-      memcpy(blk._uncompressed.data() + 12 * row, block_row, sizeof(block_row));
+      memcpy(blk._uncompressed + 12 * row, offset_data + row * _width * 3, 12);
     }
 
     const int orig_err = static_cast<int>(blk.Error());
+
+    // If this block's own indices are already within reach in the palette,
+    // then it can use them without searching: either with its original
+    // endpoints, or with refit ones if those happen to be better.
+    const uint32_t block_indices = _physical_blocks[block_idx].interpolation;
+    auto slot = palette_slots.find(block_indices);
+    if (slot != palette_slots.end() &&
+        palette->size() - slot->second < kNumPrevLookup) {
+      CompressedBlock refit = blk;
+      refit.AssignIndices(block_indices);
+      refit.RecalculateEndpoints();
+
+      PhysicalDXTBlock refit_blk = LogicalToPhysical(refit._logical);
+      if (refit_blk.interpolation == block_indices &&
+          static_cast<int>(refit.Error()) < orig_err) {
+        _logical_blocks[block_idx] = refit._logical;
+        _physical_blocks[block_idx] = refit_blk;
+      }
+
+      palette_indices->push_back(slot->second);
+      continue;
+    }
     int min_err = std::numeric_limits<int>::max();
     size_t min_err_idx = 0;
 
-    for (size_t idx = 0; idx < std::min<size_t>(kNumPrevLookup - 1, _index_palette.size()); ++idx) {
-      uint32_t indices = *(_index_palette.crbegin() + idx);
-      CompressedBlock blk2 = blk;
-      blk2.AssignIndices(indices);
-      blk2.RecalculateEndpoints();
-
-      // !HACK! Check if it flips the indices... There has to be a
-      // better way to deal with this... In principle we can just leave
-      // them flipped and then reflip them back to the proper value
-      // in the decompressor...
-      PhysicalDXTBlock maybe_blk = LogicalToPhysical(blk2._logical);
-      bool ok = maybe_blk.interpolation == indices;
-      ok = ok && blk2._logical.palette[3][3] == 0xFF;
-      if (!ok) {
-        continue;
+    // !HACK! The evaluator rejects candidates whose endpoints would flip the
+    // indices... There has to be a better way to deal with this... In
+    // principle we can just leave them flipped and then reflip them back to
+    // the proper value in the decompressor...
+    static const size_t kBatchSize = CandidateEvaluator::kBatchSize;
+    const CandidateEvaluator evaluator(blk._uncompressed);
+    const size_t num_candidates = std::min<size_t>(kNumPrevLookup - 1, palette->size());
+
+    bool found = false;
+    for (size_t batch = 0; !found && batch < num_candidates; batch += kBatchSize) {
+      const size_t batch_sz = std::min(kBatchSize, num_candidates - batch);
+
+      uint32_t candidates[kBatchSize];
+      int errors[kBatchSize];
+      for (size_t k = 0; k < kBatchSize; ++k) {
+        candidates[k] = k < batch_sz ? *(palette->crbegin() + batch + k) : 0;
       }
+      evaluator.Evaluate(candidates, errors);
+
+      for (size_t k = 0; k < batch_sz; ++k) {
+        assert(ScalarCandidateError(blk, candidates[k]) == errors[k]);
+        if (errors[k] < 0) {
+          continue;
+        }
 
-      int err = static_cast<int>(blk2.Error());
-      int err_diff = err - orig_err;
-      if (err_diff < min_err) {
-        min_err = err_diff;
-        min_err_idx = idx;
-        if (err_diff <= 0) {
-          break;
+        int err_diff = errors[k] - orig_err;
+        if (err_diff < min_err) {
+          min_err = err_diff;
+          min_err_idx = batch + k;
+          if (err_diff <= 0) {
+            found = true;
+            break;
+          }
         }
       }
     }
 
     int this_index = -1;
     if (min_err < kErrThreshold) {
-      blk.AssignIndices(*(_index_palette.crbegin() + min_err_idx));
+      blk.AssignIndices(*(palette->crbegin() + min_err_idx));
       blk.RecalculateEndpoints();
       assert(static_cast<int>(blk.Error()) - orig_err == min_err);
       _logical_blocks[block_idx] = blk._logical;
       _physical_blocks[block_idx] = LogicalToPhysical(blk._logical);
-      this_index = static_cast<int>(_index_palette.size() - min_err_idx - 1);
+      this_index = static_cast<int>(palette->size() - min_err_idx - 1);
     } else {
-      this_index = static_cast<int>(_index_palette.size());
-      _index_palette.push_back(_physical_blocks[block_idx].interpolation);
+      this_index = static_cast<int>(palette->size());
+      palette->push_back(_physical_blocks[block_idx].interpolation);
+      palette_slots[palette->back()] = this_index;
+    }
+
+    // The first block in a band has nothing to look back at...
+    assert(physical_idx != first_block || 0 == this_index);
+    palette_indices->push_back(this_index);
+  }
+}
+
+void DXTImage::Reencode(ThreadPool *pool) {
+  _blocks_width = (_width + 3) / 4;
+  _blocks_height = (_height + 3) / 4;
+  const int num_blocks = _blocks_width * _blocks_height;
+
+  if (_physical_blocks.size() == 0) {
+    // Compress the DXT data
+    const std::vector<uint64_t> blocks =
+      CompressBC1(_src_img.data(), _width, _height, _bc1_quality, pool);
+    _physical_blocks.resize(num_blocks);
+    for (int block_idx = 0; block_idx < num_blocks; ++block_idx) {
+      _physical_blocks[block_idx].dxt_block = blocks[block_idx];
     }
+  }
 
-    int idx_diff = this_index - last_index;
-    assert(-128 <= idx_diff && idx_diff < 128);
+  _logical_blocks = std::move(PhysicalToLogicalBlocks(_physical_blocks));
+  std::cout << "DXT Compressed PSNR: " << PSNR() << std::endl;
 
-    // The first index... everyone knows it's zero...
-    assert(physical_idx != 0 || 0 == this_index);
-    assert(physical_idx != 0 || 0 == last_index);
-    assert(physical_idx != 0 || 0 == idx_diff);
+  assert((_width & 0x3) == 0);
+  assert((_height & 0x3) == 0);
+
+  // Now do the dxt compression. Each band of block rows only looks back
+  // into its own palette, so the bands only touch their own blocks and can
+  // be searched in parallel.
+  const int num_bands = (_blocks_height + kReencodeBandHeight - 1) / kReencodeBandHeight;
+  std::vector<std::vector<uint32_t> > band_palettes(num_bands);
+  std::vector<std::vector<int> > band_indices(num_bands);
+  ParallelFor(pool, num_bands, [&](size_t begin, size_t end) {
+    for (size_t band = begin; band < end; ++band) {
+      const int first_row = static_cast<int>(band) * kReencodeBandHeight;
+      const int end_row = std::min(_blocks_height, first_row + kReencodeBandHeight);
+      ReencodeBand(first_row, end_row, &band_palettes[band], &band_indices[band]);
+    }
+  });
+
+  // Merge the palettes in band order and rewrite the indices as deltas into
+  // the merged palette. Every band starts by appending a new palette entry
+  // and always refers to one of its last kNumPrevLookup entries, so the
+  // deltas across band boundaries stay within [-128, 128) as well.
+  _index_palette.clear();
+  _indices.clear();
+  _indices.reserve(num_blocks);
+
+  int last_index = 0;
+  for (int band = 0; band < num_bands; ++band) {
+    const int palette_offset = static_cast<int>(_index_palette.size());
+    _index_palette.insert(_index_palette.end(),
+                          band_palettes[band].begin(), band_palettes[band].end());
 
-    _indices.push_back(idx_diff + 128);
-    last_index = this_index;
+    for (int local_index : band_indices[band]) {
+      int this_index = palette_offset + local_index;
+      int idx_diff = this_index - last_index;
+      assert(-128 <= idx_diff && idx_diff < 128);
+
+      // The first index... everyone knows it's zero...
+      assert(!_indices.empty() || 0 == idx_diff);
+
+      _indices.push_back(idx_diff + 128);
+      last_index = this_index;
+    }
   }
 
+  assert(_indices.size() == static_cast<size_t>(num_blocks));
   std::cout << "Unique index blocks: " << _index_palette.size() << std::endl;
   std::cout << "DXT Optimized PSNR: " << PSNR() << std::endl;
 }
@@ -916,43 +1157,69 @@ uint8_t compute_prediction_delta(uint8_t idx, uint8_t orig_idx) {
   return ((orig_order + 4) - pred_order) % 4;
 }
 
-#ifdef PREDICT_VPTREE
-
-static double BlockDist(const LogicalDXTBlock &p1, const LogicalDXTBlock &p2) {
-  // The indices are ordered like 0, 3, 1, 2
-  static const uint8_t idx_to_order[4] = { 0, 3, 1, 2 };
+std::vector<std::pair<uint32_t, size_t> > CountBlocks(
+  const std::vector<PhysicalDXTBlock> &blocks, ThreadPool *pool) {
+  typedef std::pair<uint32_t, size_t> Res;
 
-  double dist = 0.0;
-  for (size_t i = 0; i < 16; ++i) {
-    double x = static_cast<double>(idx_to_order[p1.indices[i]]);
-    double y = static_cast<double>(idx_to_order[p2.indices[i]]);
+  // Position of the first block with a given interpolation word and the
+  // number of blocks that have it.
+  struct Count {
+    size_t first;
+    size_t count;
+  };
+  typedef std::unordered_map<uint32_t, Count> CountMap;
+
+  // Count each range of blocks separately...
+  static const size_t kBlocksPerRange = 1 << 16;
+  const size_t num_ranges = (blocks.size() + kBlocksPerRange - 1) / kBlocksPerRange;
+  std::vector<CountMap> range_counts(num_ranges);
+
+  ParallelFor(pool, num_ranges, [&](size_t begin, size_t end) {
+    for (size_t range = begin; range < end; ++range) {
+      const size_t first_block = range * kBlocksPerRange;
+      const size_t end_block = std::min(blocks.size(), first_block + kBlocksPerRange);
+
+      CountMap &counts = range_counts[range];
+      for (size_t i = first_block; i < end_block; ++i) {
+        auto it = counts.insert(std::make_pair(blocks[i].interpolation, Count { i, 0 })).first;
+        it->second.count++;
+      }
+    }
+  });
 
-    double err = x - y;
-    dist += err * err;
+  // ... and merge them. Since the ranges are in order, the first range that
+  // has a word also has its first occurrence.
+  CountMap counts;
+  if (!range_counts.empty()) {
+    counts = std::move(range_counts[0]);
   }
 
-  return dist;
-}
-
-static std::vector<std::pair<uint32_t, size_t> > CountBlocks(
-  const std::vector<PhysicalDXTBlock> &blocks) {
-  typedef std::pair<uint32_t, size_t> Res;
-  std::vector<Res> result;
-  result.reserve(blocks.size());
-
-  for (const auto &b : blocks) {
-    bool found = false;
-    for (auto &r : result) {
-      if (r.first == b.interpolation) {
-        r.second++;
-        found = true;
-        break;
+  for (size_t range = 1; range < num_ranges; ++range) {
+    for (const auto &c : range_counts[range]) {
+      auto inserted = counts.insert(c);
+      if (!inserted.second) {
+        inserted.first->second.count += c.second.count;
       }
     }
+  }
 
-    if (!found) {
-      result.push_back(std::make_pair(b.interpolation, 1));
-    }
+  // Put the words in the order that they first appear before sorting so that
+  // ties come out the same as counting them one block at a time.
+  std::vector<std::pair<size_t, Res> > ordered;
+  ordered.reserve(counts.size());
+  for (const auto &c : counts) {
+    ordered.push_back(std::make_pair(c.second.first, Res(c.first, c.second.count)));
+  }
+
+  std::sort(ordered.begin(), ordered.end(),
+            [](const std::pair<size_t, Res> &a, const std::pair<size_t, Res> &b) {
+    return a.first < b.first;
+  });
+
+  std::vector<Res> result;
+  result.reserve(ordered.size());
+  for (const auto &o : ordered) {
+    result.push_back(o.second);
   }
 
   std::sort(result.begin(), result.end(), [](const Res &a, const Res &b) {
@@ -962,172 +1229,287 @@ static std::vector<std::pair<uint32_t, size_t> > CountBlocks(
   return std::move(result);
 }
 
-static std::vector<LogicalDXTBlock> KMeansBlocks(const std::vector<PhysicalDXTBlock> &blocks,
-                                                 size_t num_clusters) {
-  // Generate num_clusters random logical blocks
-  std::vector<LogicalDXTBlock> clusters;
-  clusters.reserve(num_clusters);
+// Each index word is treated as a point in 16 dimensions with one coordinate
+// per pixel: the position of its index along the line between the endpoints.
+typedef std::array<float, 16> IndexPoint;
 
-  std::default_random_engine gen(
-    static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count()));
-  std::uniform_int_distribution<unsigned> dist(0, static_cast<unsigned>(blocks.size() - 1));
+static IndexPoint IndexWordToPoint(uint32_t word) {
+  // The indices are ordered like 0, 3, 1, 2
+  static const float kIdxToOrder[4] = { 0.f, 3.f, 1.f, 2.f };
 
-  std::vector<std::pair<uint32_t, size_t> > counted_indices = CountBlocks(blocks);
-  std::cout << "Num unique index blocks: " << counted_indices.size() << std::endl;
+  IndexPoint p;
+  for (size_t i = 0; i < 16; ++i) {
+    p[i] = kIdxToOrder[(word >> (2 * i)) & 0x3];
+  }
+  return p;
+}
 
-  size_t num_duplicated = counted_indices.size();
-  for (size_t i = 0; i < counted_indices.size(); ++i) {
-    if (counted_indices[i].second == 1) {
-      num_duplicated = i;
-      break;
-    }
+static uint32_t PointToIndexWord(const IndexPoint &p) {
+  static const uint32_t kOrderToIdx[4] = { 0, 2, 3, 1 };
+
+  uint32_t word = 0;
+  for (size_t i = 0; i < 16; ++i) {
+    const int order = std::max(0, std::min(3, static_cast<int>(p[i] + 0.5f)));
+    word |= kOrderToIdx[order] << (2 * i);
   }
+  return word;
+}
 
-  std::cout << "Num duplicated indices: " << num_duplicated << std::endl;
-
-  while (clusters.size() < num_clusters) {
-
-    LogicalDXTBlock blk;
-    memset(&blk, 0, sizeof(blk));
-
-    //////////
-    /// Choose cluster samples as first most-used 
-    ///
-    PhysicalDXTBlock pblk;
-    pblk.interpolation = counted_indices[clusters.size()].first;
-    memcpy(blk.indices, PhysicalToLogical(pblk).indices, sizeof(blk.indices));
-
-    //////////
-    /// Choose cluster samples as sampling of existing index values
-    ///
-    // memcpy(blk.indices, PhysicalToLogical(blocks[dist(gen)]).indices, sizeof(blk.indices));
-
-    //////////
-    /// Choose a stratified initial distribution of clusters
-    ///
-    //for (int i = 0; i < 8; ++i) {
-    //  uint8_t blk0[2] = { 0xFF, 0x00 };
-    //  uint8_t blk1[2] = { 0x00, 0xFF };
-
-    //  if ((clusters.size() >> i) & 0x1) {
-    //    blk.indices[2 * i + 0] = blk0[0];
-    //    blk.indices[2 * i + 1] = blk0[1];
-    //  } else {
-    //    blk.indices[2 * i + 0] = blk1[0];
-    //    blk.indices[2 * i + 1] = blk1[1];
-    //  }
-    //}
-
-    //////////
-    /// Choose a random initial distribution of clusters
-    ///
-    //for (int i = 0; i < 16; ++i) {
-    //  blk.indices[i] = dist(gen);
-    //  assert(blk.indices[i] < 4);
-    //}
-
-    //// If we already have this seeded cluster, then generate a new one...
-    //if (std::find(clusters.begin(), clusters.end(), blk) != clusters.end()) {
-    //  continue;
-    //}
-
-    clusters.push_back(blk);
+static float PointDistance(const IndexPoint &a, const IndexPoint &b) {
+  float d = 0.0f;
+  for (size_t i = 0; i < 16; ++i) {
+    const float diff = a[i] - b[i];
+    d += diff * diff;
   }
+  return sqrtf(d);
+}
 
-  // Allocate data for k-means
-  std::vector<std::vector<double> > old_clusters
-    (clusters.size(), std::vector<double>(16, 0.0));
-  std::vector<std::vector<double> > new_clusters
-    (clusters.size(), std::vector<double>(16, 0.0));
-  std::vector<size_t> cluster_idx(blocks.size(), 0);
-  std::vector<double> tmp(16, 0.0);
-
-  // Get old clusters from initial clusters...
-  for (size_t i = 0; i < num_clusters; ++i) {
-    for (size_t j = 0; j < 16; ++j) {
-      old_clusters[i][j] = static_cast<double>(clusters[i].indices[j]);
-    }
+struct IndexClusters {
+  // Cluster of each counted index word
+  std::vector<uint32_t> assignment;
+
+  // Index word nearest to the center of each cluster
+  std::vector<uint32_t> centroids;
+};
+
+// Runs k-means over the unique index words, weighted by their counts. This
+// uses Hamerly's bounds ("Making k-means even faster", SDM 2010) so that most
+// points skip the search over all of the centers once the clusters settle.
+// The initial centers are the most common words and empty clusters are
+// reseeded from a generator seeded with seed, so the result is deterministic
+// no matter how many threads of the pool, if any, do the assignment.
+static IndexClusters ClusterIndexWords(
+  const std::vector<std::pair<uint32_t, size_t> > &counted_indices,
+  size_t num_clusters, uint32_t seed, ThreadPool *pool) {
+  static const size_t kMaxIterations = 64;
+
+  const size_t num_points = counted_indices.size();
+  const size_t k = std::min(num_clusters, num_points);
+
+  std::vector<IndexPoint> points;
+  points.reserve(num_points);
+  for (const auto &c : counted_indices) {
+    points.push_back(IndexWordToPoint(c.first));
   }
 
-  // Do until fixed point...
-  for (;;) {
+  // counted_indices is sorted from most to least common
+  std::vector<IndexPoint> centers(points.begin(), points.begin() + k);
 
-    // Assign each block to a cluster
-    EuclideanVPTree vp_tree;
-    vp_tree.addMany(old_clusters.begin(), old_clusters.end());
+  std::vector<uint32_t> assignment(num_points, 0);
+  std::vector<float> upper(num_points, std::numeric_limits<float>::max());
+  std::vector<float> lower(num_points, 0.0f);
 
-    for (size_t i = 0; i < blocks.size(); ++i) {
-      for (size_t j = 0; j < 16; ++j) {
-        tmp[j] = static_cast<double>(PhysicalToLogical(blocks[i]).indices[j]);
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<size_t> random_point(0, num_points > 0 ? num_points - 1 : 0);
+
+  for (size_t iteration = 0; k > 0 && iteration < kMaxIterations; ++iteration) {
+    // Half of the distance from each center to the closest other center
+    std::vector<float> half_dist(k, std::numeric_limits<float>::max());
+    for (size_t i = 0; i < k; ++i) {
+      for (size_t j = i + 1; j < k; ++j) {
+        const float d = 0.5f * PointDistance(centers[i], centers[j]);
+        half_dist[i] = std::min(half_dist[i], d);
+        half_dist[j] = std::min(half_dist[j], d);
       }
+    }
 
-      const std::vector<double> *closest = vp_tree.nearestNeighbors(tmp)[0];
+    // Assign each point to a cluster
+    std::atomic<size_t> num_changed(0);
+    ParallelFor(pool, num_points, [&](size_t begin, size_t end) {
+      size_t changed = 0;
+      for (size_t i = begin; i < end; ++i) {
+        const uint32_t a = assignment[i];
+        const float m = std::max(half_dist[a], lower[i]);
+        if (upper[i] <= m) {
+          continue;
+        }
 
-      auto closest_itr = std::find(old_clusters.begin(), old_clusters.end(), *closest);
-      size_t idx = closest_itr - old_clusters.begin();
-      assert(idx < blocks.size());
-      cluster_idx[i] = idx;
-    }
+        upper[i] = PointDistance(points[i], centers[a]);
+        if (upper[i] <= m) {
+          continue;
+        }
 
-    // Generate new clusters based on the index of each cluster...
-    size_t cidx = 0;
-    for (size_t c = 0; c < clusters.size(); ++c) {
-      tmp.assign(16, 0.0);
-      double cluster_sz = 0.0;
-      for (size_t b = 0; b < blocks.size(); ++b) {
-        if (cluster_idx[b] == c) {
-          for (size_t i = 0; i < 16; ++i) {
-            tmp[i] += static_cast<double>(PhysicalToLogical(blocks[b]).indices[i]);
+        float d1 = std::numeric_limits<float>::max();
+        float d2 = std::numeric_limits<float>::max();
+        uint32_t best = 0;
+        for (size_t c = 0; c < k; ++c) {
+          const float d = PointDistance(points[i], centers[c]);
+          if (d < d1) {
+            d2 = d1;
+            d1 = d;
+            best = static_cast<uint32_t>(c);
+          } else if (d < d2) {
+            d2 = d;
           }
+        }
 
-          cluster_sz += 1.0;
+        if (best != a) {
+          changed++;
         }
+
+        assignment[i] = best;
+        upper[i] = d1;
+        lower[i] = d2;
       }
 
-      if (0.0 != cluster_sz) {
-        for (size_t i = 0; i < 16; ++i) {
-          tmp[i] /= cluster_sz;
-        }
+      num_changed += changed;
+    });
+
+    if (iteration > 0 && 0 == num_changed) {
+      break;
+    }
 
-        new_clusters[cidx].assign(tmp.begin(), tmp.end());
-        cidx++;
+    // Move each center to the weighted mean of its points
+    std::vector<std::array<double, 16> > sums(k);
+    std::vector<double> weights(k, 0.0);
+    for (auto &sum : sums) {
+      sum.fill(0.0);
+    }
+
+    for (size_t i = 0; i < num_points; ++i) {
+      const double w = static_cast<double>(counted_indices[i].second);
+      for (size_t j = 0; j < 16; ++j) {
+        sums[assignment[i]][j] += w * static_cast<double>(points[i][j]);
       }
+      weights[assignment[i]] += w;
     }
 
-    bool fixed_point = cidx == old_clusters.size();
-    for (size_t i = 0; i < cidx && fixed_point; ++i) {
-      fixed_point = old_clusters[i] == new_clusters[i];
+    std::vector<float> moved(k, 0.0f);
+    for (size_t c = 0; c < k; ++c) {
+      IndexPoint center;
+      if (0.0 == weights[c]) {
+        center = points[random_point(gen)];
+      } else {
+        for (size_t j = 0; j < 16; ++j) {
+          center[j] = static_cast<float>(sums[c][j] / weights[c]);
+        }
+      }
+
+      moved[c] = PointDistance(center, centers[c]);
+      centers[c] = center;
     }
 
-    if (fixed_point) {
-      break;
+    // Loosen the bounds by how far the centers moved
+    size_t max_moved_idx = 0;
+    for (size_t c = 1; c < k; ++c) {
+      if (moved[c] > moved[max_moved_idx]) {
+        max_moved_idx = c;
+      }
     }
 
-    // Not fixed point, so set each old cluster to a new cluster...
-    for (size_t i = 0; i < cidx; ++i) {
-      old_clusters[i].assign(new_clusters[i].begin(), new_clusters[i].end());
+    float second_max_moved = 0.0f;
+    for (size_t c = 0; c < k; ++c) {
+      if (c != max_moved_idx) {
+        second_max_moved = std::max(second_max_moved, moved[c]);
+      }
     }
-    old_clusters.resize(cidx);
-  }
 
-  // Create discrete clusters by rounding continuous clusters
-  for (size_t i = 0; i < old_clusters.size(); ++i) {
-    for (size_t j = 0; j < 16; ++j) {
-      clusters[i].indices[j] = static_cast<uint8_t>(old_clusters[i][j] + 0.5);
-      assert(0 <= clusters[i].indices[j] && clusters[i].indices[j] < 4);
+    for (size_t i = 0; i < num_points; ++i) {
+      const uint32_t a = assignment[i];
+      upper[i] += moved[a];
+      lower[i] -= (a == max_moved_idx) ? second_max_moved : moved[max_moved_idx];
     }
   }
 
-  clusters.resize(old_clusters.size());
-  return std::move(clusters);
+  IndexClusters result;
+  result.centroids.reserve(k);
+  for (const auto &center : centers) {
+    result.centroids.push_back(PointToIndexWord(center));
+  }
+
+  // Rounding the centers can move them around a bit, so reassign each word to
+  // the closest rounded center.
+  result.assignment = std::move(assignment);
+  if (k > 0) {
+    const IndexNearestNeighbors nn(result.centroids);
+    ParallelFor(pool, num_points, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        result.assignment[i] = static_cast<uint32_t>(nn.Nearest(counted_indices[i].first));
+      }
+    });
+  }
+
+  return std::move(result);
 }
 
-class IndexVPTree : public VPTree<LogicalDXTBlock> {
- protected:
-  double distance(const LogicalDXTBlock &p1, const LogicalDXTBlock &p2) override {
-    return BlockDist(p1, p2);
+void DXTImage::QuantizeIndexPalette(size_t num_entries, uint32_t seed, ThreadPool *pool) {
+  if (_src_img.size() == 0) {
+    std::cout << "WARNING: Cannot quantize DXT indices without source data" << std::endl;
+    assert(false);
+    return;
+  }
+
+  std::vector<std::pair<uint32_t, size_t> > counted_indices = CountBlocks(_physical_blocks, pool);
+  if (counted_indices.size() <= num_entries) {
+    return;
+  }
+
+  IndexClusters clusters = ClusterIndexWords(counted_indices, num_entries, seed, pool);
+
+  std::unordered_map<uint32_t, uint32_t> quantized;
+  for (size_t i = 0; i < counted_indices.size(); ++i) {
+    quantized[counted_indices[i].first] = clusters.centroids[clusters.assignment[i]];
   }
-};
+
+  // Give each block the indices of its cluster and refit its endpoints. If
+  // the new endpoints would flip the indices then we leave the block alone.
+  ParallelFor(pool, _physical_blocks.size(), [&](size_t begin, size_t end) {
+    for (size_t block_idx = begin; block_idx < end; ++block_idx) {
+      const uint32_t indices = quantized.at(_physical_blocks[block_idx].interpolation);
+      if (indices == _physical_blocks[block_idx].interpolation) {
+        continue;
+      }
+
+      const int x = static_cast<int>(block_idx % _blocks_width) * 4;
+      const int y = static_cast<int>(block_idx / _blocks_width) * 4;
+
+      CompressedBlock blk;
+      blk._logical = _logical_blocks[block_idx];
+      for (int row = 0; row < 4; ++row) {
+        memcpy(blk._uncompressed + 12 * row, _src_img.data() + ((y + row) * _width + x) * 3, 12);
+      }
+
+      blk.AssignIndices(indices);
+      blk.RecalculateEndpoints();
+
+      PhysicalDXTBlock pblk = LogicalToPhysical(blk._logical);
+      if (pblk.interpolation == indices) {
+        _physical_blocks[block_idx] = pblk;
+      }
+    }
+  });
+
+  // Rebuild the palette and the index deltas from the new blocks
+  Reencode(pool);
+}
+
+#ifdef PREDICT_NEAREST_INDEX
+
+// Returns the index words at the centers of num_clusters clusters of the
+// blocks' index words.
+static std::vector<uint32_t> KMeansBlocks(const std::vector<PhysicalDXTBlock> &blocks,
+                                          size_t num_clusters) {
+  std::vector<std::pair<uint32_t, size_t> > counted_indices = CountBlocks(blocks);
+  std::cout << "Num unique index blocks: " << counted_indices.size() << std::endl;
+
+  IndexClusters clusters = ClusterIndexWords(counted_indices, num_clusters, 0, nullptr);
+
+  // Only keep the clusters that something was assigned to
+  std::vector<bool> used(clusters.centroids.size(), false);
+  for (uint32_t c : clusters.assignment) {
+    used[c] = true;
+  }
+
+  std::vector<uint32_t> result;
+  result.reserve(clusters.centroids.size());
+  for (size_t c = 0; c < clusters.centroids.size(); ++c) {
+    if (used[c]) {
+      result.push_back(clusters.centroids[c]);
+    }
+  }
+
+  return std::move(result);
+}
 
 std::vector<uint8_t>
 DXTImage::PredictIndices(int chunk_width, int chunk_height) const {
@@ -1135,11 +1517,15 @@ DXTImage::PredictIndices(int chunk_width, int chunk_height) const {
   assert(Width() % 16 == 0);
   assert(Height() % 16 == 0);
 
-  std::vector<LogicalDXTBlock> blocks = std::move(KMeansBlocks(PhysicalBlocks(), 256));
-  std::cout << "Number of block clusters: " << blocks.size() << std::endl;
+  std::vector<uint32_t> clusters = std::move(KMeansBlocks(PhysicalBlocks(), 256));
+  std::cout << "Number of block clusters: " << clusters.size() << std::endl;
 
-  IndexVPTree vptree;
-  vptree.addMany(blocks.begin(), blocks.end());
+  // The closest cluster of each block
+  const IndexNearestNeighbors nn(clusters);
+  std::vector<uint32_t> predicted_blocks(_physical_blocks.size());
+  for (size_t i = 0; i < _physical_blocks.size(); ++i) {
+    predicted_blocks[i] = clusters[nn.Nearest(_physical_blocks[i].interpolation)];
+  }
 
   std::vector<uint8_t> symbols;
   symbols.reserve(Height() * Width());
@@ -1149,7 +1535,8 @@ DXTImage::PredictIndices(int chunk_width, int chunk_height) const {
       const LogicalDXTBlock &blk = LogicalBlockAt(px, py);
 
       int local_idx = (py % 4) * 4 + (px % 4);
-      uint8_t predicted_index = vptree.nearestNeighbors(blk)[0]->indices[local_idx];
+      uint32_t predicted_block = predicted_blocks[BlockAt(px, py)];
+      uint8_t predicted_index = (predicted_block >> (2 * local_idx)) & 0x3;
       uint8_t predicted_delta = compute_prediction_delta(predicted_index, blk.indices[local_idx]);
 
       symbols.push_back(predicted_delta);
@@ -1226,19 +1613,89 @@ DXTImage::PredictIndicesLinearize(int chunk_width, int chunk_height) const {
   return std::move(symbols);
 }
 
-void DXTImage::ReassignIndices(int mse_threshold) {
+// Returns the position in counted_indices of the word that gives the block
+// the lowest error, as long as that error is below mse_threshold. Words that
+// no block uses anymore and the block's own word are skipped. Returns
+// counted_indices.size() if no word is good enough.
+static size_t FindBestReassignment(const CompressedBlock &block, uint32_t own_indices,
+                                   const std::vector<std::pair<uint32_t, size_t> > &counted_indices,
+                                   size_t mse_threshold) {
+  static const size_t kBatchSize = CandidateEvaluator::kBatchSize;
+  const CandidateEvaluator evaluator(block._uncompressed);
+  const IndexPartitionBound bound(block._uncompressed);
+
+  size_t min_MSE = mse_threshold;
+  size_t best = counted_indices.size();
+
+  uint32_t candidates[kBatchSize];
+  size_t positions[kBatchSize];
+  size_t num_candidates = 0;
+
+  auto evaluate_batch = [&]() {
+    for (size_t k = num_candidates; k < kBatchSize; ++k) {
+      candidates[k] = 0;
+    }
+
+    int errors[kBatchSize];
+    evaluator.Evaluate(candidates, errors, true);
+    for (size_t k = 0; k < num_candidates; ++k) {
+      assert(errors[k] >= 0);
+      const size_t mse = static_cast<size_t>(errors[k]);
+      if (mse < min_MSE) {
+        min_MSE = mse;
+        best = positions[k];
+      }
+    }
+
+    num_candidates = 0;
+  };
+
+  for (size_t i = 0; i < counted_indices.size(); ++i) {
+    const std::pair<uint32_t, size_t> &cnt = counted_indices[i];
+    if (cnt.second == 0 || cnt.first == own_indices) {
+      continue;
+    }
+
+    // The error is the squared error divided by 48, rounded down, so this
+    // candidate can't beat the best one if the bound is at least 48 * min_MSE
+    const uint64_t scaled_max = static_cast<uint64_t>(48 * min_MSE) * IndexPartitionBound::kScale;
+    if (bound.ScaledBound(cnt.first) >= scaled_max) {
+      continue;
+    }
+
+    candidates[num_candidates] = cnt.first;
+    positions[num_candidates] = i;
+    if (++num_candidates == kBatchSize) {
+      evaluate_batch();
+    }
+  }
+
+  if (num_candidates > 0) {
+    evaluate_batch();
+  }
+
+  return best;
+}
+
+void DXTImage::ReassignIndices(int mse_threshold, ThreadPool *pool) {
   if (_src_img.size() == 0) {
     std::cout << "WARNING: Cannot reassign DXT indices without source data" << std::endl;
     assert(false);
     return;
   }
 
-  std::vector<std::pair<uint32_t, size_t> > counted_indices = CountBlocks(PhysicalBlocks());
+  std::vector<std::pair<uint32_t, size_t> > counted_indices = CountBlocks(PhysicalBlocks(), pool);
+
+  std::unordered_map<uint32_t, size_t> positions;
+  for (size_t i = 0; i < counted_indices.size(); ++i) {
+    positions[counted_indices[i].first] = i;
+  }
 
   // Collect compressed blocks
   std::vector<CompressedBlock> blocks;
   blocks.resize(LogicalBlocks().size());
 
+  std::vector<uint32_t> own_indices(blocks.size());
   for (int y = 0; y < _blocks_height; ++y) {
     for (int x = 0; x < _blocks_width; ++x) {
       int block_idx = y * _blocks_width + x;
@@ -1246,69 +1703,62 @@ void DXTImage::ReassignIndices(int mse_threshold) {
 
       for (int row = 0; row < 4; ++row) {
         int row_idx = ((4 * y + row) * _width + (4 * x)) * 3;
-        blk._uncompressed.insert(
-          blk._uncompressed.end(),
-          _src_img.begin() + row_idx,
-          _src_img.begin() + row_idx + 12);
+        memcpy(blk._uncompressed + 12 * row, _src_img.data() + row_idx, 12);
       }
 
-      blk._logical = LogicalBlocks()[block_idx];
+      // Start from the blocks as they'll be decoded: the logical blocks may
+      // still have the unquantized endpoints from refitting.
+      blk._logical = PhysicalToLogical(_physical_blocks[block_idx]);
+      own_indices[block_idx] = _physical_blocks[block_idx].interpolation;
     }
   }
 
   // For each block, see if we can reassign its index: search through
   // all of the other indices and measure it against the current index. If we
-  // find one that's not as bad w.r.t. the current one, then switch the index...
-
-  int idx = 0;
-  for (auto &block : blocks) {
-    idx++;
-    size_t min_MSE = mse_threshold;
-    std::pair<uint32_t, size_t> *cnt_ptr = nullptr;
-    std::pair<uint32_t, size_t> *orig_cnt_ptr = nullptr;
-
-    PhysicalDXTBlock pb = LogicalToPhysical(block._logical);
-    assert(PhysicalToLogical(pb) == block._logical);
-    
-    for (auto &cnt : counted_indices) {
-      if (cnt.second == 0) {
-        continue;
-      }
-
-      if (pb.interpolation == cnt.first) {
-        orig_cnt_ptr = &cnt;
-        continue;
-      }
+  // find one that's not as bad w.r.t. the current one, then switch the index.
+  //
+  // Blocks are processed in order, and a block can't move to an index that
+  // no other block uses anymore. Since the counts only ever drop to zero and
+  // never come back, every block first proposes its best index using the
+  // initial counts, which can be done in parallel. Then we commit them in
+  // order: if the proposed index is still in use, it's also the best one
+  // among the indices that are still in use. Otherwise, we search again.
+  const size_t threshold = static_cast<size_t>(mse_threshold);
+  std::vector<size_t> proposals(blocks.size());
+
+  ParallelFor(pool, blocks.size(), [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      proposals[i] = FindBestReassignment(blocks[i], own_indices[i], counted_indices, threshold);
+    }
+  });
 
-      PhysicalDXTBlock npb = pb;
-      npb.interpolation = cnt.first;
-      LogicalDXTBlock lb = PhysicalToLogical(npb);
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    size_t best = proposals[i];
+    if (best == counted_indices.size()) {
+      continue;
+    }
 
-      size_t mse = block.CompareAgainst(lb);
-      if (mse < min_MSE) {
-        block._logical = lb;
-        min_MSE = mse;
-        cnt_ptr = &cnt;
+    if (counted_indices[best].second == 0) {
+      best = FindBestReassignment(blocks[i], own_indices[i], counted_indices, threshold);
+      if (best == counted_indices.size()) {
+        continue;
       }
     }
 
-    assert(orig_cnt_ptr);
-
-    if (min_MSE < static_cast<size_t>(mse_threshold)) {
-      assert(cnt_ptr);
+    std::pair<uint32_t, size_t> &orig_cnt = counted_indices[positions.at(own_indices[i])];
+    assert(orig_cnt.second > 0);
+    orig_cnt.second--;
+    counted_indices[best].second++;
 
-      orig_cnt_ptr->second--;
-      cnt_ptr->second++;
-      block.RecalculateEndpoints();
-    }
+    blocks[i].AssignIndices(counted_indices[best].first);
+    blocks[i].RecalculateEndpoints();
   }
 
   // Reassign blocks
   for (size_t i = 0; i < _logical_blocks.size(); ++i) {
-    _logical_blocks[i] = blocks[i]._logical;
+    _physical_blocks[i] = LogicalToPhysical(blocks[i]._logical);
+    _logical_blocks[i] = PhysicalToLogical(_physical_blocks[i]);
   }
-
-  _physical_blocks = LogicalToPhysicalBlocks(_logical_blocks);
 }
 
 }  // namespace GenTC
@@ -5,9 +5,12 @@
 #include <cstring>
 #include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 
+#include "bc1_encoder.h"
 #include "image.h"
+#include "thread_pool.h"
 
 namespace GenTC {
 
@@ -36,12 +39,23 @@ namespace GenTC {
     }
   };
 
+  // Returns each unique interpolation word in blocks along with the number of
+  // blocks that use it, sorted from most to least common. The blocks are
+  // counted on the threads of the pool, if there is one.
+  std::vector<std::pair<uint32_t, size_t> > CountBlocks(
+    const std::vector<PhysicalDXTBlock> &blocks, ThreadPool *pool = nullptr);
+
+  // The methods that take a ThreadPool split their work across its threads,
+  // or do everything on the calling thread if it's null. The results are the
+  // same either way.
   class DXTImage {
    public:
-    DXTImage(const char *orig_fn, const char *cmp_fn);
-    DXTImage(int width, int height, const uint8_t *rgb_data);
+    DXTImage(const char *orig_fn, const char *cmp_fn,
+             EBC1Quality quality = eBC1Quality_PCA, ThreadPool *pool = nullptr);
+    DXTImage(int width, int height, const uint8_t *rgb_data,
+             EBC1Quality quality = eBC1Quality_PCA, ThreadPool *pool = nullptr);
     DXTImage(int width, int height, const std::vector<uint8_t> &rgb_data,
-             const std::vector<uint8_t> &dxt_data);
+             const std::vector<uint8_t> &dxt_data, ThreadPool *pool = nullptr);
     DXTImage(int width, int height, const std::vector<uint8_t> &dxt_data);
 
     int Width() const { return _width;  }
@@ -91,7 +105,15 @@ namespace GenTC {
     std::vector<uint8_t> PredictIndices(int chunk_width, int chunk_height) const;
     std::vector<uint8_t> PredictIndicesLinearize(int chunk_width, int chunk_height) const;
 
-    void ReassignIndices(int mse_threshold);
+    void ReassignIndices(int mse_threshold, ThreadPool *pool = nullptr);
+
+    // Clusters the index words of all blocks into at most num_entries groups
+    // using k-means, gives each block the indices of its cluster and refits
+    // its endpoints. The palette is rebuilt afterwards. Blocks whose refit
+    // endpoints would flip their indices keep their original words, so the
+    // palette can still end up with a few more unique entries.
+    void QuantizeIndexPalette(size_t num_entries, uint32_t seed = 0,
+                              ThreadPool *pool = nullptr);
 
     std::vector<uint8_t> PaletteData() const;
     const std::vector<uint8_t> &IndexDiffs() const { return _indices; }
@@ -101,7 +123,9 @@ namespace GenTC {
       return (y / 4) * _blocks_width + (x / 4);
     }
 
-    void Reencode();
+    void Reencode(ThreadPool *pool);
+    void ReencodeBand(int first_row, int end_row, std::vector<uint32_t> *palette,
+                      std::vector<int> *palette_indices);
     double PSNR() const;
 
     int _width;
@@ -116,6 +140,9 @@ namespace GenTC {
     std::vector<uint8_t> _indices;
 
     std::vector<uint8_t> _src_img;
+
+    // Quality of the initial BC1 compression of _src_img
+    EBC1Quality _bc1_quality;
   };
 
 }  // namespace GenTC
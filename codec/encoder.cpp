@@ -8,17 +8,27 @@
 #include "image_processing.h"
 #include "image_utils.h"
 #include "pipeline.h"
+#include "tiled_pipeline.h"
 #include "entropy.h"
 
+#include <algorithm>
 #include <atomic>
+#include <future>
 #include <iostream>
+#include <thread>
 
 #include "ans.h"
 
 namespace GenTC {
 
+// Every unit of the endpoint pipeline only looks at one wavelet block at a
+// time, so each block goes through the whole pipeline while it's still in
+// cache, with the blocks spread across the threads of pool. The blocks are
+// read straight out of the plane that img views. Intermediate buffers come
+// from and go back to ctx.
 template <typename T> std::unique_ptr<std::vector<uint8_t> >
-RunDXTEndpointPipeline(const std::unique_ptr<Image<T> > &img) {
+RunDXTEndpointPipeline(std::unique_ptr<ImageView<const T> > &&img, ThreadPool *pool,
+                       const std::shared_ptr<PipelineContext> &ctx) {
   static_assert(PixelTraits::NumChannels<T>::value,
     "This should operate on each DXT endpoing channel separately");
 
@@ -26,17 +36,35 @@ RunDXTEndpointPipeline(const std::unique_ptr<Image<T> > &img) {
   typedef typename WaveletResultTy<T, kIsSixBits>::DstTy WaveletSignedTy;
   typedef typename PixelTraits::UnsignedForSigned<WaveletSignedTy>::Ty WaveletUnsignedTy;
 
-  auto pipeline = Pipeline<Image<T>, Image<WaveletSignedTy> >
+  auto tiled = TiledPipeline<Image<T>, Image<WaveletSignedTy> >
     ::Create(FWavelet2D<T, kWaveletBlockDim>::New())
     ->Chain(MakeUnsigned<WaveletSignedTy>::New())
     ->Chain(Linearize<WaveletUnsignedTy>::New())
     ->Chain(RearrangeStream<WaveletUnsignedTy>::New(img->Width(), kWaveletBlockDim))
     ->Chain(ReducePrecision<WaveletUnsignedTy, uint8_t>::New());
+  assert(tiled->IsTiled());
 
-  return std::move(pipeline->Run(img));
+  auto pipeline = Pipeline<ImageView<const T>, std::vector<uint8_t> >
+    ::Create(tiled->template Build<ImageView<const T> >(kWaveletBlockDim, pool), ctx);
+  return std::move(pipeline->Run(std::move(img)));
 }
 
-static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img) {
+typedef std::unique_ptr<std::vector<uint8_t> > ByteStream;
+
+// Runs task on the pool, or right away on this thread if there isn't one.
+template<typename F>
+static std::future<ByteStream> PushTask(ThreadPool *pool, const F &task) {
+  if (nullptr == pool) {
+    std::promise<ByteStream> result;
+    result.set_value(task());
+    return result.get_future();
+  }
+
+  return pool->push([task](int) { return task(); });
+}
+
+static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img, bool verbose,
+                                             ThreadPool *pool) {
   // Otherwise we can't really compress this...
   assert((dxt_img.Width() % 128) == 0);
   assert((dxt_img.Height() % 128) == 0);
@@ -47,77 +75,114 @@ static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img) {
   assert(endpoint_one->Width() == endpoint_two->Width());
   assert(endpoint_one->Height() == endpoint_two->Height());
 
-  auto initial_endpoint_pipeline =
-    Pipeline<RGB565Image, YCoCg667Image>
-    ::Create(RGB565toYCoCg667::New())
-    ->Chain(std::move(ImageSplit<YCoCg667>::New()));
-
-  auto ep1_planes = initial_endpoint_pipeline->Run(endpoint_one);
-  auto ep2_planes = initial_endpoint_pipeline->Run(endpoint_two);
-
-  std::cout << "Processing Y plane for EP 1... ";
-  auto ep1_y_cmp = RunDXTEndpointPipeline(std::get<0>(*ep1_planes));
-  std::cout << "Done. " << std::endl;
-
-  std::cout << "Processing Co plane for EP 1... ";
-  auto ep1_co_cmp = RunDXTEndpointPipeline(std::get<1>(*ep1_planes));
-  std::cout << "Done. " << std::endl;
-
-  std::cout << "Processing Cg plane for EP 1... ";
-  auto ep1_cg_cmp = RunDXTEndpointPipeline(std::get<2>(*ep1_planes));
-  std::cout << "Done. " << std::endl;
-
-  std::cout << "Processing Y plane for EP 2... ";
-  auto ep2_y_cmp = RunDXTEndpointPipeline(std::get<0>(*ep2_planes));
-  std::cout << "Done. " << std::endl;
-
-  std::cout << "Processing Co plane for EP 2... ";
-  auto ep2_co_cmp = RunDXTEndpointPipeline(std::get<1>(*ep2_planes));
-  std::cout << "Done. " << std::endl;
-
-  std::cout << "Processing Cg plane for EP 2... ";
-  auto ep2_cg_cmp = RunDXTEndpointPipeline(std::get<2>(*ep2_planes));
-  std::cout << "Done. " << std::endl;
-
-  auto cmp_pipeline =
-    Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
-    ::Create(ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols));
-
-  // Concatenate Y planes
-  ep1_y_cmp->insert(ep1_y_cmp->end(), ep2_y_cmp->begin(), ep2_y_cmp->end());
-  std::cout << "Compressing luma planes (" << ep1_y_cmp->size() << " bytes)...";
-  auto y_planes = cmp_pipeline->Run(ep1_y_cmp);
-  std::cout << "Done. (" << y_planes->size() << " bytes)" << std::endl;
-
-  // Concatenate Chroma planes
-  ep1_co_cmp->insert(ep1_co_cmp->end(), ep1_cg_cmp->begin(), ep1_cg_cmp->end());
-  ep1_co_cmp->insert(ep1_co_cmp->end(), ep2_co_cmp->begin(), ep2_co_cmp->end());
-  ep1_co_cmp->insert(ep1_co_cmp->end(), ep2_cg_cmp->begin(), ep2_cg_cmp->end());
-  std::cout << "Compressing chroma planes (" << ep1_co_cmp->size() << " bytes)...";
-  auto chroma_planes = cmp_pipeline->Run(ep1_co_cmp);
-  std::cout << "Done. (" << chroma_planes->size() << " bytes)" << std::endl;
-
-  std::unique_ptr<std::vector<uint8_t> > palette_data(
-    new std::vector<uint8_t>(std::move(dxt_img.PaletteData())));
-  size_t palette_data_size = palette_data->size();
-  std::cout << "Original palette data size: " << palette_data_size << std::endl;
+  auto to_ycocg = Pipeline<RGB565Image, PlanarYCoCg667Image>::Create(RGB565toYCoCg667::New());
+  auto ep1_ycocg = to_ycocg->Run(endpoint_one);
+  auto ep2_ycocg = to_ycocg->Run(endpoint_two);
+
+  // The planes are views into ep1_ycocg and ep2_ycocg, so those need to
+  // stay around until the endpoint pipelines are done with them.
+  auto splitter = YCoCg667Splitter::New();
+  auto ep1_planes = splitter->Run(ep1_ycocg);
+  auto ep2_planes = splitter->Run(ep2_ycocg);
+
+  // The six endpoint pipelines share their intermediate buffers. They only
+  // live as long as this image does, so encoding a large texture doesn't pin
+  // its planes for the rest of the process.
+  const std::shared_ptr<PipelineContext> ctx = std::make_shared<PipelineContext>();
+
+  // Every wavelet pipeline and every stream compression is independent until
+  // the final concatenation, so we run them as a small task graph: the six
+  // endpoint planes and the palette/index streams start right away, and the
+  // luma and chroma streams are compressed as soon as their planes are done.
+  // The tasks never wait on each other, only this thread does. They run on
+  // the same pool that the ANS encoders and the tiled endpoint pipelines
+  // split their work across, which ParallelFor allows. Without a pool every
+  // stage runs on this thread in order, which produces the same bytes.
+  auto compress = [pool](const ByteStream &in) {
+    auto cmp_pipeline =
+      Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+      ::Create(ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols, pool));
+    return std::move(cmp_pipeline->Run(in));
+  };
+
+  std::future<ByteStream> ep1_y_task = PushTask(pool, [&]() {
+    return RunDXTEndpointPipeline(std::move(std::get<0>(*ep1_planes)), pool, ctx);
+  });
+  std::future<ByteStream> ep1_co_task = PushTask(pool, [&]() {
+    return RunDXTEndpointPipeline(std::move(std::get<1>(*ep1_planes)), pool, ctx);
+  });
+  std::future<ByteStream> ep1_cg_task = PushTask(pool, [&]() {
+    return RunDXTEndpointPipeline(std::move(std::get<2>(*ep1_planes)), pool, ctx);
+  });
+  std::future<ByteStream> ep2_y_task = PushTask(pool, [&]() {
+    return RunDXTEndpointPipeline(std::move(std::get<0>(*ep2_planes)), pool, ctx);
+  });
+  std::future<ByteStream> ep2_co_task = PushTask(pool, [&]() {
+    return RunDXTEndpointPipeline(std::move(std::get<1>(*ep2_planes)), pool, ctx);
+  });
+  std::future<ByteStream> ep2_cg_task = PushTask(pool, [&]() {
+    return RunDXTEndpointPipeline(std::move(std::get<2>(*ep2_planes)), pool, ctx);
+  });
+
+  ByteStream palette_data(new std::vector<uint8_t>(std::move(dxt_img.PaletteData())));
+  const size_t palette_data_size = palette_data->size();
   static const size_t f =
     ans::ocl::kNumEncodedSymbols * ans::ocl::kThreadsPerEncodingGroup;
   size_t padding = ((palette_data_size + (f - 1)) / f) * f;
-  std::cout << "Padded palette data size: " << padding << std::endl;
   palette_data->resize(padding, 0);
+  std::future<ByteStream> palette_task = PushTask(pool, [&]() {
+    return compress(palette_data);
+  });
 
-  std::cout << "Compressing index palette... ";
-  auto palette_cmp = cmp_pipeline->Run(palette_data);
-  std::cout << "Done: " << palette_cmp->size() << " bytes" << std::endl;
+  ByteStream idx_data(new std::vector<uint8_t>(dxt_img.IndexDiffs()));
+  std::future<ByteStream> idx_task = PushTask(pool, [&]() {
+    return compress(idx_data);
+  });
 
-  std::unique_ptr<std::vector<uint8_t> > idx_data(
-    new std::vector<uint8_t>(dxt_img.IndexDiffs()));
+  // Concatenate Y planes
+  ByteStream y_data = ep1_y_task.get();
+  {
+    ByteStream ep2_y_cmp = ep2_y_task.get();
+    y_data->insert(y_data->end(), ep2_y_cmp->begin(), ep2_y_cmp->end());
+    ctx->Recycle(std::move(ep2_y_cmp));
+  }
+  std::future<ByteStream> y_task = PushTask(pool, [&]() {
+    return compress(y_data);
+  });
 
-  std::cout << "Original index differences size: " << idx_data->size() << std::endl;
-  std::cout << "Compressing index differences... ";
-  auto idx_cmp = cmp_pipeline->Run(idx_data);
-  std::cout << "Done: " << idx_cmp->size() << " bytes" << std::endl;
+  // Concatenate Chroma planes
+  ByteStream chroma_data = ep1_co_task.get();
+  {
+    ByteStream ep1_cg_cmp = ep1_cg_task.get();
+    ByteStream ep2_co_cmp = ep2_co_task.get();
+    ByteStream ep2_cg_cmp = ep2_cg_task.get();
+    chroma_data->insert(chroma_data->end(), ep1_cg_cmp->begin(), ep1_cg_cmp->end());
+    chroma_data->insert(chroma_data->end(), ep2_co_cmp->begin(), ep2_co_cmp->end());
+    chroma_data->insert(chroma_data->end(), ep2_cg_cmp->begin(), ep2_cg_cmp->end());
+    ctx->Recycle(std::move(ep1_cg_cmp));
+    ctx->Recycle(std::move(ep2_co_cmp));
+    ctx->Recycle(std::move(ep2_cg_cmp));
+  }
+  std::future<ByteStream> chroma_task = PushTask(pool, [&]() {
+    return compress(chroma_data);
+  });
+
+  ByteStream y_planes = y_task.get();
+  ByteStream chroma_planes = chroma_task.get();
+  ByteStream palette_cmp = palette_task.get();
+  ByteStream idx_cmp = idx_task.get();
+
+  if (verbose) {
+    std::cout << "Compressed luma planes (" << y_data->size() << " bytes) to "
+              << y_planes->size() << " bytes" << std::endl;
+    std::cout << "Compressed chroma planes (" << chroma_data->size() << " bytes) to "
+              << chroma_planes->size() << " bytes" << std::endl;
+    std::cout << "Original palette data size: " << palette_data_size << std::endl;
+    std::cout << "Padded palette data size: " << padding << std::endl;
+    std::cout << "Compressed index palette to " << palette_cmp->size() << " bytes" << std::endl;
+    std::cout << "Original index differences size: " << idx_data->size() << std::endl;
+    std::cout << "Compressed index differences to " << idx_cmp->size() << " bytes" << std::endl;
+  }
 
   GenTCHeader hdr;
   hdr.width = dxt_img.Width();
@@ -169,29 +234,64 @@ static std::vector<uint8_t> CompressDXTImage(const DXTImage &dxt_img) {
   std::cout << "Actual num bytes: " << idx_cmp->size() << std::endl;
 #endif
 
-  double bpp = static_cast<double>(result.size() * 8) /
-    static_cast<double>(dxt_img.Width() * dxt_img.Height());
-  std::cout << "Original DXT size: " <<
-	  (dxt_img.Width() * dxt_img.Height()) / 2 << std::endl;
-  std::cout << "Compressed DXT size: " << result.size()
-            << " (" << bpp << " bpp)" << std::endl;
+  if (verbose) {
+    double bpp = static_cast<double>(result.size() * 8) /
+      static_cast<double>(dxt_img.Width() * dxt_img.Height());
+    std::cout << "Original DXT size: " <<
+      (dxt_img.Width() * dxt_img.Height()) / 2 << std::endl;
+    std::cout << "Compressed DXT size: " << result.size()
+              << " (" << bpp << " bpp)" << std::endl;
+  }
 
   return std::move(result);
 }
 
-std::vector<uint8_t> CompressDXT(const char *filename, const char *cmp_fn) {
-  DXTImage dxt_img(filename, cmp_fn);
-  return std::move(CompressDXTImage(dxt_img));
+static std::vector<uint8_t> CompressDXTImage(DXTImage *dxt_img, const EncoderOptions &opts,
+                                             ThreadPool *pool) {
+  if (opts.max_palette_entries > 0) {
+    dxt_img->QuantizeIndexPalette(opts.max_palette_entries, opts.palette_seed, pool);
+  }
+
+  return std::move(CompressDXTImage(*dxt_img, opts.verbose, pool));
+}
+
+// One pool does all of the parallel work of an encode, from the initial BC1
+// compression to the entropy coding. A single thread doesn't need one.
+static std::unique_ptr<ThreadPool> CreateEncoderPool(const EncoderOptions &opts) {
+  const unsigned num_threads = (0 == opts.num_threads)
+    ? std::max(1U, std::thread::hardware_concurrency())
+    : opts.num_threads;
+
+  std::unique_ptr<ThreadPool> pool;
+  if (num_threads > 1) {
+    pool.reset(new ThreadPool(static_cast<int>(num_threads)));
+  }
+  return std::move(pool);
+}
+
+std::vector<uint8_t> CompressDXT(const char *filename, const char *cmp_fn,
+                                 const EncoderOptions &opts) {
+  std::unique_ptr<ThreadPool> pool = CreateEncoderPool(opts);
+  DXTImage dxt_img(filename, cmp_fn, opts.bc1_quality, pool.get());
+  return std::move(CompressDXTImage(&dxt_img, opts, pool.get()));
 }
 
 std::vector<uint8_t> CompressDXT(int width, int height, const std::vector<uint8_t> &rgb_data,
-                                 const std::vector<uint8_t> &dxt_data) {
-  DXTImage dxt_img(width, height, rgb_data, dxt_data);
-  return std::move(CompressDXTImage(dxt_img));
+                                 const std::vector<uint8_t> &dxt_data,
+                                 const EncoderOptions &opts) {
+  std::unique_ptr<ThreadPool> pool = CreateEncoderPool(opts);
+  DXTImage dxt_img(width, height, rgb_data, dxt_data, pool.get());
+  return std::move(CompressDXTImage(&dxt_img, opts, pool.get()));
 }
 
-std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img) {
-  return std::move(CompressDXTImage(dxt_img));
+std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img, const EncoderOptions &opts) {
+  std::unique_ptr<ThreadPool> pool = CreateEncoderPool(opts);
+  if (opts.max_palette_entries > 0) {
+    DXTImage quantized = dxt_img;
+    return std::move(CompressDXTImage(&quantized, opts, pool.get()));
+  }
+
+  return std::move(CompressDXTImage(dxt_img, opts.verbose, pool.get()));
 }
 
 }
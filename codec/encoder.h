@@ -8,13 +8,37 @@
 #include "dxt_image.h"
 
 namespace GenTC {
+  struct EncoderOptions {
+    // If non-zero, the index words of the blocks are quantized to at most
+    // this many clusters before encoding (see DXTImage::QuantizeIndexPalette)
+    size_t max_palette_entries = 0;
+
+    // Seed for the random choices made while quantizing the palette
+    uint32_t palette_seed = 0;
+
+    // How hard to search for the initial BC1 blocks when compressing an
+    // image that doesn't already come with its DXT data
+    EBC1Quality bc1_quality = eBC1Quality_PCA;
+
+    // Number of threads to encode with, or zero to use every hardware thread.
+    // A single thread runs every stage in order on the calling thread, and
+    // the result doesn't depend on this.
+    unsigned num_threads = 0;
+
+    // Print the size of every compressed stream
+    bool verbose = false;
+  };
+
   // Compresses the DXT texture with the given width and height into a
   // GPU decompressible stream.
-  std::vector<uint8_t> CompressDXT(const char *filename, const char *cmp_fn);
+  std::vector<uint8_t> CompressDXT(const char *filename, const char *cmp_fn,
+                                   const EncoderOptions &opts = EncoderOptions());
   std::vector<uint8_t> CompressDXT(int width, int height,
                                    const std::vector<uint8_t> &rgb_data,
-                                   const std::vector<uint8_t> &dxt_data);
-  std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img);
+                                   const std::vector<uint8_t> &dxt_data,
+                                   const EncoderOptions &opts = EncoderOptions());
+  std::vector<uint8_t> CompressDXT(const DXTImage &dxt_img,
+                                   const EncoderOptions &opts = EncoderOptions());
 }  // namespace GenTC
 
 #endif  // __TCAR_ENCODER_H__
@@ -1,14 +1,27 @@
 #include "entropy.h"
 
+#include <algorithm>
 #include <cmath>
 #include <numeric>
 #include <iostream>
 
-#include "ans_ocl.h"
+#include "ans.h"
 #include "data_stream.h"
+#include "histogram.h"
 
 namespace GenTC {
 
+static ans::Options GetByteEncoderOptions(ans::EType type, const std::vector<uint32_t> &counts) {
+  ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+  if (ans::eType_tANS == type) {
+    // Emit bits one at a time so that decoders can use packed tables
+    opts.type = ans::eType_tANS;
+    opts.b = 2;
+    opts.k = 1;
+  }
+  return opts;
+}
+
 ShortEncoder::EncodeUnit::ReturnType
 ShortEncoder::Encode::Run(const ShortEncoder::EncodeUnit::ArgType &in) const {
   assert(in->size() > 0);
@@ -102,7 +115,7 @@ ShortEncoder::Encode::Run(const ShortEncoder::EncodeUnit::ArgType &in) const {
 ShortEncoder::DecodeUnit::ReturnType
 ShortEncoder::Decode::Run(const ShortEncoder::DecodeUnit::ArgType &in) const {
   // Read header...
-  DataStream hdr(*(in.get()));
+  DataStream hdr(in->data(), in->size());
 
   std::vector<uint32_t> counts;
   counts.reserve(256);
@@ -128,19 +141,24 @@ ShortEncoder::Decode::Run(const ShortEncoder::DecodeUnit::ArgType &in) const {
     num_offsets * ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
 
   ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+  std::shared_ptr<const ans::DecodeTable> table = ans::DecodeTable::Create(opts);
 
   std::vector<uint8_t> symbols;
-  size_t last_offset = hdr.BytesRead();
+  symbols.reserve(num_symbols);
+
+  // Offsets are cumulative from the end of the header
+  const size_t data_start = hdr.BytesRead();
+  size_t last_offset = data_start;
   size_t symbols_read = 0;
   size_t group_idx = 0;
   while (symbols_read < num_symbols) {
-    size_t offset = last_offset + offsets[group_idx];
-    std::vector<uint8_t> interleaved_stream(in->begin() + last_offset,
-                                            in->begin() + offset);
+    size_t offset = data_start + offsets[group_idx];
+    assert(last_offset < offset && offset <= in->size());
 
     size_t symbols_to_read = ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
     std::vector<uint8_t> interleaved_symbols =
-      ans::DecodeInterleaved(interleaved_stream, symbols_to_read, opts,
+      ans::DecodeInterleaved(in->data() + last_offset, offset - last_offset,
+                             symbols_to_read, table,
                              ans::ocl::kThreadsPerEncodingGroup);
 
     symbols.insert(symbols.end(), interleaved_symbols.begin(), interleaved_symbols.end());
@@ -173,11 +191,7 @@ ShortEncoder::Decode::Run(const ShortEncoder::DecodeUnit::ArgType &in) const {
 
 ByteEncoder::Base::ReturnType
 ByteEncoder::EncodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
-  std::vector<uint32_t> counts(256, 0);
-
-  for (size_t i = 0; i < in->size(); ++i) {
-    counts[in->at(i)]++;
-  }
+  std::vector<uint32_t> counts = std::move(ans::CountSymbols(*in));
 
   // Determine size
   size_t non_zero_counts = 0;
@@ -190,47 +204,63 @@ ByteEncoder::EncodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
   counts.resize(non_zero_counts);
   counts = std::move(ans::ocl::NormalizeFrequencies(counts));
 
-  std::vector<size_t> offsets;
-
   const size_t num_symbols = in->size();
-  ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+  const ans::Options opts = GetByteEncoderOptions(_type, counts);
+  const ans::ocl::Codec codec(counts);
 
-  std::vector<uint8_t> encoded_stream;
-  size_t num_encoded_symbols = 0;
   const size_t num_symbols_to_encode_per_group = 
     ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-  size_t cum_offset = num_symbols / num_symbols_to_encode_per_group;
-  assert(cum_offset * num_symbols_to_encode_per_group == num_symbols);
-  cum_offset *= 4;
-
-  while (num_encoded_symbols < num_symbols) {
-    auto symbol_it = in->begin() + num_encoded_symbols;
-    std::vector<uint8_t> symbols_to_encode(symbol_it, symbol_it + num_symbols_to_encode_per_group);
-    std::vector<uint8_t> encoded_symbols = 
-      ans::EncodeInterleaved(symbols_to_encode, opts,
-                             ans::ocl::kThreadsPerEncodingGroup);
-
-    // Make sure that it's aligned to a multiple of four...
-    if (encoded_symbols.size() & 0x3) {
-
-      // ANS codec writes 16 bits at a time, so we should definitely be
-      // at least a multiple of two...
-      assert((encoded_symbols.size() & 1) == 0);
-
-      // If we *are* a multiple of two and *aren't* a multiple of four,
-      // then we just need to insert two bytes at the beginning since
-      // decoders read in reverse...
-      const uint8_t padding[2] = { 0, 0 };
-      encoded_symbols.insert(encoded_symbols.begin(), padding, padding + 2);
+  const size_t num_groups = num_symbols / num_symbols_to_encode_per_group;
+  assert(num_groups * num_symbols_to_encode_per_group == num_symbols);
+
+  // The groups all share the same frequencies, so they can be encoded
+  // independently of each other.
+  std::vector<std::vector<uint8_t> > encoded_groups(num_groups);
+  auto encode_groups = [&](size_t begin, size_t end) {
+    for (size_t group = begin; group < end; ++group) {
+      const uint8_t *symbols = in->data() + group * num_symbols_to_encode_per_group;
+      std::vector<uint8_t> encoded_symbols;
+      if (ans::eType_rANS == _type) {
+        encoded_symbols = codec.EncodeBlock(symbols, num_symbols_to_encode_per_group,
+                                            ans::ocl::kThreadsPerEncodingGroup);
+
+        // ANS codec writes 16 bits at a time, so we should definitely be
+        // at least a multiple of two...
+        assert((encoded_symbols.size() & 1) == 0);
+      } else {
+        std::vector<uint8_t> symbols_to_encode(symbols, symbols + num_symbols_to_encode_per_group);
+        encoded_symbols = ans::EncodeInterleaved(symbols_to_encode, opts,
+                                                 ans::ocl::kThreadsPerEncodingGroup);
+      }
+
+      // Make sure that it's aligned to a multiple of four. Decoders read in
+      // reverse, so we can just insert bytes at the beginning...
+      if (encoded_symbols.size() & 0x3) {
+        const uint8_t padding[3] = { 0, 0, 0 };
+        const size_t padding_sz = 4 - (encoded_symbols.size() & 0x3);
+        encoded_symbols.insert(encoded_symbols.begin(), padding, padding + padding_sz);
+      }
+
+      // Should be multiple of four now.
+      assert((encoded_symbols.size() & 0x3) == 0);
+      encoded_groups[group] = std::move(encoded_symbols);
     }
+  };
 
-    // Should be multiple of four now.
-    assert((encoded_symbols.size() & 0x3) == 0);
+  if (nullptr != _pool) {
+    ParallelFor(*_pool, num_groups, encode_groups);
+  } else {
+    encode_groups(0, num_groups);
+  }
 
-    cum_offset += encoded_symbols.size();
+  // Offsets point to the end of each group, relative to the start of the
+  // offset table.
+  std::vector<size_t> offsets;
+  offsets.reserve(num_groups);
+  size_t cum_offset = 4 * num_groups;
+  for (const auto &group : encoded_groups) {
+    cum_offset += group.size();
     offsets.push_back(cum_offset);
-    encoded_stream.insert(encoded_stream.end(), encoded_symbols.begin(), encoded_symbols.end());
-    num_encoded_symbols += num_symbols_to_encode_per_group;
   }
 
   DataStream hdr;
@@ -253,10 +283,13 @@ ByteEncoder::EncodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
   }
 
   std::vector<uint8_t> *result = new std::vector<uint8_t>;
+  result->reserve(hdr.GetData().size() + cum_offset - 4 * num_groups + 3);
   result->insert(result->end(), hdr.GetData().begin(), hdr.GetData().end());
 
   // Encode rANS data...
-  result->insert(result->end(), encoded_stream.begin(), encoded_stream.end());
+  for (const auto &group : encoded_groups) {
+    result->insert(result->end(), group.begin(), group.end());
+  }
 
   // Pad out to 4 bytes to match alignment of most GPUs...
   result->resize(((result->size() + 3) / 4) * 4, 0);
@@ -264,59 +297,112 @@ ByteEncoder::EncodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
   return std::move(std::unique_ptr<std::vector<uint8_t> >(result));
 }
 
+// Corrupt streams decode to nothing
+static ByteEncoder::Base::ReturnType EmptyBytes() {
+  return std::move(std::unique_ptr<std::vector<uint8_t> >(new std::vector<uint8_t>));
+}
+
 ByteEncoder::Base::ReturnType
 ByteEncoder::DecodeBytes::Run(const ByteEncoder::Base::ArgType &in) const {
-  DataStream hdr(*(in.get()));
-  size_t num_unique_symbols = 256;
+  static const size_t kNumUniqueSymbols = 256;
+  if (in->size() <= kNumUniqueSymbols * sizeof(uint16_t)) {
+    assert(!"Stream too small to hold the symbol frequencies!");
+    return EmptyBytes();
+  }
+
+  DataStream hdr(in->data(), in->size());
 
   std::vector<uint32_t> counts;
-  counts.reserve(num_unique_symbols);
+  counts.reserve(kNumUniqueSymbols);
 
-  for (size_t i = 0; i < num_unique_symbols; ++i) {
-    counts.push_back(hdr.ReadInt());
+  uint32_t total_count = 0;
+  for (size_t i = 0; i < kNumUniqueSymbols; ++i) {
+    counts.push_back(hdr.ReadShort());
+    total_count += counts.back();
   }
 
-  uint32_t num_offsets = hdr.ReadInt();
-
-  // Skip to next 512 byte boundary
-  size_t num_to_skip = (((hdr.BytesRead() + 511) / 512) * 512) - hdr.BytesRead();
-  for (size_t i = 0; i < num_to_skip; ++i) {
-    hdr.ReadByte();
+  if (total_count != ans::ocl::kANSTableSize) {
+    assert(!"Symbol frequencies aren't normalized!");
+    return EmptyBytes();
   }
 
-  std::vector<uint32_t> offsets;
-  offsets.reserve(num_offsets);
+  // The number of offsets isn't stored, but the last one points to the end
+  // of the stream. The offsets themselves are part of the stream, so there
+  // can't be more than a quarter as many of them as there are bytes.
+  const size_t data_start = hdr.BytesRead();
+  const size_t data_sz = in->size() - data_start;
+  const size_t max_offsets = data_sz / 4;
 
-  for (size_t i = 0; i < num_offsets; ++i) {
+  std::vector<uint32_t> offsets;
+  while (offsets.empty() || offsets.back() < data_sz) {
+    if (offsets.size() == max_offsets) {
+      assert(!"Group offsets run past the end of the stream!");
+      return EmptyBytes();
+    }
     offsets.push_back(hdr.ReadInt());
   }
 
-  ans::Options opts = ans::ocl::GetOpenCLOptions(counts);
+  if (offsets.back() != data_sz) {
+    assert(!"Last group doesn't end with the stream!");
+    return EmptyBytes();
+  }
 
-  std::vector<uint8_t> *result = new std::vector<uint8_t>;
-  const size_t num_symbols = num_offsets * ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-  size_t symbols_decoded = 0;
-  size_t group_idx = 0;
+  // Each group has to at least hold the final states of its streams, and the
+  // encoder pads every group to a multiple of four bytes.
+  const size_t num_offsets = offsets.size();
+  static const size_t kMinGroupSz = 4 * ans::ocl::kThreadsPerEncodingGroup;
   size_t last_offset = num_offsets * 4;
-  while (symbols_decoded < num_symbols) {
-    size_t offset = offsets[group_idx++];
-    auto start = in->begin() + last_offset;
-    auto end = in->begin() + offset;
-    std::vector<uint8_t> data(start, end);
+  for (size_t offset : offsets) {
+    if (offset < last_offset + kMinGroupSz || ((offset - last_offset) % 4) != 0) {
+      assert(!"Malformed group offsets!");
+      return EmptyBytes();
+    }
+    last_offset = offset;
+  }
 
-    size_t symbols_to_read = ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
-    std::vector<uint8_t> decoded = 
-      ans::DecodeInterleaved(data, symbols_to_read, opts,
-                             ans::ocl::kThreadsPerEncodingGroup);
+  const uint8_t *data = in->data() + data_start;
+
+  const size_t symbols_per_group = ans::ocl::kThreadsPerEncodingGroup * _symbols_per_thread;
+  const size_t num_symbols = num_offsets * symbols_per_group;
+  std::unique_ptr<std::vector<uint8_t> > result(new std::vector<uint8_t>(num_symbols));
+
+  // The SIMD decoder only handles the group size that the GPU uses, so
+  // anything else goes through the generic decoder.
+  if (ans::eType_tANS == _type || _symbols_per_thread != ans::ocl::kNumEncodedSymbols) {
+    std::shared_ptr<const ans::DecodeTable> table =
+      ans::DecodeTable::Create(GetByteEncoderOptions(_type, counts));
+
+    last_offset = num_offsets * 4;
+    for (size_t group_idx = 0; group_idx < num_offsets; ++group_idx) {
+      const size_t offset = offsets[group_idx];
+      std::vector<uint8_t> symbols =
+        ans::DecodeInterleaved(data + last_offset, offset - last_offset, symbols_per_group,
+                               table, ans::ocl::kThreadsPerEncodingGroup);
+      if (symbols.size() != symbols_per_group) {
+        return EmptyBytes();
+      }
+
+      std::copy(symbols.begin(), symbols.end(), result->begin() + group_idx * symbols_per_group);
+      last_offset = offset;
+    }
 
-    result->insert(result->end(), decoded.begin(), decoded.end());
-    symbols_decoded += decoded.size();
-    last_offset = offset;
+    return std::move(result);
   }
 
-  assert(symbols_decoded == num_symbols);
+  std::vector<uint32_t> table = ans::ocl::BuildDecodeTable(counts);
 
-  return std::move(std::unique_ptr<std::vector<uint8_t> >(result));
+  last_offset = num_offsets * 4;
+  for (size_t group_idx = 0; group_idx < num_offsets; ++group_idx) {
+    const size_t offset = offsets[group_idx];
+    if (!ans::ocl::DecodeGroup(table.data(), data + last_offset, offset - last_offset,
+                               result->data() + group_idx * symbols_per_group)) {
+      assert(!"Malformed rANS data!");
+      return EmptyBytes();
+    }
+    last_offset = offset;
+  }
+
+  return std::move(result);
 }
 
 }  // namespace GenTC
@@ -1,8 +1,10 @@
 #ifndef __TCAR_ENTROPY_H__
 #define __TCAR_ENTROPY_H__
 
+#include "ans.h"
 #include "pixel_traits.h"
 #include "pipeline.h"
+#include "thread_pool.h"
 
 #include <cassert>
 #include <cstdint>
@@ -17,40 +19,52 @@ namespace GenTC {
 // The values are rearranged such that blocks with 'block_length'
 // number of columns are linearized in order and placed on the stream
 template<typename T>
-class RearrangeStream : public PipelineUnit<std::vector<T>, std::vector<T> > {
+class RearrangeStream : public InPlacePipelineUnit<std::vector<T> >, public TileUnit<T, T> {
  public:
   typedef PipelineUnit<std::vector<T>, std::vector<T> > Base;
   static std::unique_ptr<Base> New(size_t row_length, size_t block_length) {
     return std::unique_ptr<Base>(new RearrangeStream<T>(row_length, block_length));
   }
 
-  typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
+  void RunInPlace(std::vector<T> *inout) const override {
     // Make sure we have some data
-    assert(in->size() > 0);
+    assert(inout->size() > 0);
 
     // Make sure our data is a multiple of the row length
-    assert((in->size() % _row_length) == 0);
+    assert((inout->size() % _row_length) == 0);
 
     // Make sure the number of rows is a multiple of the block length
-    assert(((in->size() / _row_length) % _block_length) == 0);
+    assert(((inout->size() / _row_length) % _block_length) == 0);
+
+    // Each band of block_length rows only gets shuffled around within
+    // itself, so we only need to keep a copy of one band at a time.
+    const size_t band_size = _row_length * _block_length;
+    std::vector<T> band(band_size);
 
-    std::vector<T> *result = new std::vector<T>;
-    result->reserve(in->size());
+    for (size_t j = 0; j < inout->size(); j += band_size) {
+      std::copy(inout->begin() + j, inout->begin() + j + band_size, band.begin());
 
-    size_t j = 0;
-    while (j < in->size()) {
+      T *out = inout->data() + j;
       for (size_t i = 0; i < _row_length; i += _block_length) {
         for (size_t y = 0; y < _block_length; ++y) {
           for (size_t x = 0; x < _block_length; ++x) {
-            size_t idx = j + y * _row_length + i + x;
-            result->push_back(in->at(idx));
+            *out++ = band[y * _row_length + i + x];
           }
         }
       }
-      j += _row_length * _block_length;
     }
+  }
 
-    return std::move(std::unique_ptr<std::vector<T> >(result));
+  // Rearranging a plane into tiles of the same size just puts each tile
+  // after the other.
+  bool SupportsTiles(size_t width, size_t height, size_t tile_dim) const override {
+    return width == _row_length && tile_dim == _block_length;
+  }
+
+  bool GroupsTiles() const override { return true; }
+
+  void RunTile(const T *in, T *out, size_t tile_dim) const override {
+    std::copy(in, in + tile_dim * tile_dim, out);
   }
 
  private:
@@ -66,7 +80,8 @@ class RearrangeStream : public PipelineUnit<std::vector<T>, std::vector<T> > {
 };
 
 template<typename From, typename To>
-class ReducePrecision : public PipelineUnit<std::vector<From>, std::vector<To> > {
+class ReducePrecision
+  : public PipelineUnit<std::vector<From>, std::vector<To> >, public TileUnit<From, To> {
   static_assert(PixelTraits::NumChannels<To>::value == 1,
                 "Only operates to single channel values");
   static_assert(PixelTraits::NumChannels<From>::value == 1,
@@ -78,13 +93,44 @@ public:
   }
 
   typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
-    std::vector<To> *result = new std::vector<To>;
-    result->reserve(in->size());
-    for (size_t i = 0; i < in->size(); ++i) {
-      assert(in->at(i) < (1ULL << (sizeof(To) * 8)));
-      result->push_back(static_cast<To>(in->at(i)));
+    typename Base::ReturnType result(new std::vector<To>);
+    Convert(*in, result.get());
+    return std::move(result);
+  }
+
+  typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                    PipelineContext *ctx) const override {
+    return std::move(ConsumeImpl(std::move(in), ctx, std::is_same<From, To>()));
+  }
+
+  void RunTile(const From *in, To *out, size_t tile_dim) const override {
+    for (size_t i = 0; i < tile_dim * tile_dim; ++i) {
+      assert(in[i] < (1ULL << (sizeof(To) * 8)));
+      out[i] = static_cast<To>(in[i]);
+    }
+  }
+
+ private:
+  static void Convert(const std::vector<From> &in, std::vector<To> *result) {
+    result->resize(in.size());
+    for (size_t i = 0; i < in.size(); ++i) {
+      assert(in[i] < (1ULL << (sizeof(To) * 8)));
+      (*result)[i] = static_cast<To>(in[i]);
     }
-    return std::move(std::unique_ptr<std::vector<To> >(result));
+  }
+
+  // Nothing to convert if the types are the same
+  static typename Base::ReturnType ConsumeImpl(typename Base::ArgType &&in,
+                                               PipelineContext *, std::true_type) {
+    return std::move(in);
+  }
+
+  static typename Base::ReturnType ConsumeImpl(typename Base::ArgType &&in,
+                                               PipelineContext *ctx, std::false_type) {
+    typename Base::ReturnType result = AcquireBuffer<std::vector<To> >(ctx);
+    Convert(*in, result.get());
+    RecycleBuffer(ctx, std::move(in));
+    return std::move(result);
   }
 };
 
@@ -125,31 +171,44 @@ class ByteEncoder {
  public:
   typedef PipelineUnit<std::vector<uint8_t>, std::vector<uint8_t> > Base;
 
-  static std::unique_ptr<Base> Encoder(size_t symbols_per_thread) {
-    return std::unique_ptr<Base>(new EncodeBytes(symbols_per_thread));
+  // Streams are rANS encoded by default, which is what the GPU decoder
+  // expects. tANS streams emit single bits so that they can be decoded using
+  // packed FSE-style tables on the CPU. The decoder must be created with the
+  // same type as the encoder.
+  //
+  // If a pool is given, the groups of interleaved streams are encoded on its
+  // threads. The output doesn't depend on whether or not a pool is used.
+  static std::unique_ptr<Base> Encoder(size_t symbols_per_thread, ThreadPool *pool = nullptr,
+                                       ans::EType type = ans::eType_rANS) {
+    return std::unique_ptr<Base>(new EncodeBytes(symbols_per_thread, pool, type));
   }
 
-  static std::unique_ptr<Base> Decoder(size_t symbols_per_thread) {
-    return std::unique_ptr<Base>(new DecodeBytes(symbols_per_thread));
+  static std::unique_ptr<Base> Decoder(size_t symbols_per_thread,
+                                       ans::EType type = ans::eType_rANS) {
+    return std::unique_ptr<Base>(new DecodeBytes(symbols_per_thread, type));
   }
 
  private:
   class EncodeBytes : public Base {
    public:
-    EncodeBytes(size_t spt) :Base(), _symbols_per_thread(spt) { }
+    EncodeBytes(size_t spt, ThreadPool *pool, ans::EType type)
+      : Base(), _symbols_per_thread(spt), _pool(pool), _type(type) { }
     Base::ReturnType Run(const Base::ArgType &in) const override;
     
    private:
     const size_t _symbols_per_thread;
+    ThreadPool *const _pool;
+    const ans::EType _type;
   };
 
   class DecodeBytes : public Base {
    public:
-    DecodeBytes(size_t spt) :Base(), _symbols_per_thread(spt) { }
+    DecodeBytes(size_t spt, ans::EType type) :Base(), _symbols_per_thread(spt), _type(type) { }
     Base::ReturnType Run(const Base::ArgType &in) const override;
 
    private:
     const size_t _symbols_per_thread;
+    const ans::EType _type;
   };
 };
 
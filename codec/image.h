@@ -6,98 +6,117 @@
 #include <array>
 #include <algorithm>
 #include <cassert>
+#include <memory>
 #include <numeric>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include "bits.h"
 #include "pixel_traits.h"
 
 namespace GenTC {
 
+// Images are packed most significant bit first.
+typedef ans::BufferedBitWriter<ans::eBitOrder_MSBFirst> ImageBitWriter;
+typedef ans::BufferedBitReader<ans::eBitOrder_MSBFirst> ImageBitReader;
+
 extern uint64_t ReadValue(const std::vector<uint8_t> &img_data, size_t *bit_offset, size_t prec);
 
+// Pixels are packed back to back, so every group of eight of them takes up
+// exactly as many bytes as there are bits in a pixel. Within a group, the
+// position of each pixel is a compile time constant, and each pixel comes out
+// of a single unaligned 64-bit load with a shift and a mask. Whatever doesn't
+// fill a whole group goes through the bit reader.
 template<typename T>
-struct ImageUnpacker {
-  static std::vector<T> go( const std::vector<uint8_t> &img_data, size_t width, size_t height) {
-    std::vector<T> result;
-    result.reserve(width * height);
-
-    static const int kNumChannels = PixelTraits::NumChannels<T>::value;
-    static_assert(kNumChannels == 1, "This better be true!");
-
-    size_t bit_offset = 0;
+void UnpackPixels(const uint8_t *data, size_t num_bytes, T *out, size_t count) {
+  typedef PixelTraits::PixelBits<T> Bits;
+  static const size_t kNumBits = Bits::kNumBits;
+
+  // Every pixel of the group has to fit in a single load after skipping the
+  // bits of the pixels before it in the same byte.
+  size_t num_groups = (kNumBits <= 57) ? count / 8 : 0;
+  static const size_t kGroupBytesRead = (7 * kNumBits) / 8 + sizeof(uint64_t);
+  if (num_bytes < kGroupBytesRead) {
+    num_groups = 0;
+  } else {
+    num_groups = std::min(num_groups, (num_bytes - kGroupBytesRead) / kNumBits + 1);
+  }
 
-    for (size_t y = 0; y < height; ++y) {
-      for (size_t x = 0; x < width; ++x) {
-        const size_t prec = PixelTraits::BitsUsed<T>::value;
-        T v = PixelTraits::ConvertUnsigned<T>::cvt(ReadValue(img_data, &bit_offset, prec));
-        result.push_back(v);
-      }
+  for (size_t g = 0; g < num_groups; ++g) {
+    const uint8_t *group = data + g * kNumBits;
+    T *group_out = out + 8 * g;
+    for (size_t i = 0; i < 8; ++i) {
+      const size_t bit = i * kNumBits;
+      const uint64_t word = ans::detail::LoadWord<ans::eBitOrder_MSBFirst>(group + bit / 8);
+      group_out[i] = Bits::unpack((word << (bit % 8)) >> (64 - kNumBits));
     }
- 
-    return std::move(result);
   }
-};
-
-template <typename T1, typename T2, typename T3>
-struct ImageUnpacker<std::tuple<T1, T2, T3> > {
-  typedef std::tuple<T1, T2, T3> PixelTy;
-  static std::vector<PixelTy> go( const std::vector<uint8_t> &img_data, size_t width, size_t height) {
-    std::vector<PixelTy> result;
-    result.reserve(width * height);
-
-    static const int kNumChannels = PixelTraits::NumChannels<PixelTy>::value;
-    static_assert(kNumChannels == 3, "Pixel3's should have 3 channels!");
 
-    size_t bit_offset = 0;
-    for (size_t y = 0; y < height; ++y) {
-      for (size_t x = 0; x < width; ++x) {
-
-        static const size_t prec1 = PixelTraits::BitsUsed<T1>::value;
-        static const size_t prec2 = PixelTraits::BitsUsed<T2>::value;
-        static const size_t prec3 = PixelTraits::BitsUsed<T3>::value;
-
-        T1 r = PixelTraits::ConvertUnsigned<T1>::cvt(ReadValue(img_data, &bit_offset, prec1));
-        T2 g = PixelTraits::ConvertUnsigned<T2>::cvt(ReadValue(img_data, &bit_offset, prec2));
-        T3 b = PixelTraits::ConvertUnsigned<T3>::cvt(ReadValue(img_data, &bit_offset, prec3));
-        PixelTy v = std::make_tuple(r, g, b);
+  ImageBitReader reader(data, num_bytes, 8 * num_groups * kNumBits);
+  for (size_t i = 8 * num_groups; i < count; ++i) {
+    out[i] = Bits::unpack(reader.ReadBits(static_cast<int>(kNumBits)));
+  }
+}
 
-        result.push_back(v);
+// The inverse of UnpackPixels. Each group of eight pixels is collected in a
+// 64-bit accumulator that gets stored a whole word at a time.
+template<typename T>
+std::vector<uint8_t> PackPixels(const T *pixels, size_t count) {
+  typedef PixelTraits::PixelBits<T> Bits;
+  static const size_t kNumBits = Bits::kNumBits;
+
+  // Leave room to store a whole word at the end of the last group
+  const size_t num_bytes = (count * kNumBits + 7) / 8;
+  std::vector<uint8_t> result(num_bytes + sizeof(uint64_t), 0);
+
+  const size_t num_groups = (kNumBits <= 57) ? count / 8 : 0;
+  for (size_t g = 0; g < num_groups; ++g) {
+    const T *group = pixels + 8 * g;
+    uint8_t *out = result.data() + g * kNumBits;
+
+    uint64_t accum = 0;
+    size_t num_bits = 0;
+    for (size_t i = 0; i < 8; ++i) {
+      const uint64_t bits = Bits::pack(group[i]);
+      if (num_bits + kNumBits <= 64) {
+        accum |= (bits << (64 - kNumBits)) >> num_bits;
+        num_bits += kNumBits;
+      } else {
+        const size_t spill = num_bits + kNumBits - 64;
+        accum |= bits >> spill;
+        ans::detail::StoreWord<ans::eBitOrder_MSBFirst>(out, accum);
+        out += sizeof(uint64_t);
+        accum = bits << (64 - spill);
+        num_bits = spill;
       }
     }
 
-    return std::move(result);
+    // The group ends on a byte boundary. Bytes past it get overwritten by
+    // the next group.
+    ans::detail::StoreWord<ans::eBitOrder_MSBFirst>(out, accum);
   }
-};
 
-template <typename T1, typename T2, typename T3, typename T4>
-struct ImageUnpacker<std::tuple<T1, T2, T3, T4> > {
-  typedef std::tuple<T1, T2, T3, T4> PixelTy;
-  static std::vector<PixelTy> go( const std::vector<uint8_t> &img_data, size_t width, size_t height) {
-    std::vector<PixelTy> result;
-    result.reserve(width * height);
-
-    static const int kNumChannels = PixelTraits::NumChannels<PixelTy>::value;
-    static_assert(kNumChannels == 4, "Pixel4's should have 4 channels!");
-
-    size_t bit_offset = 0;
-    for (size_t y = 0; y < height; ++y) {
-      for (size_t x = 0; x < width; ++x) {
+  if (8 * num_groups < count) {
+    ImageBitWriter w;
+    w.Reserve((count - 8 * num_groups) * kNumBits);
+    for (size_t i = 8 * num_groups; i < count; ++i) {
+      w.WriteBits(Bits::pack(pixels[i]), static_cast<int>(kNumBits));
+    }
 
-        static const size_t prec1 = PixelTraits::BitsUsed<T1>::value;
-        static const size_t prec2 = PixelTraits::BitsUsed<T2>::value;
-        static const size_t prec3 = PixelTraits::BitsUsed<T3>::value;
-        static const size_t prec4 = PixelTraits::BitsUsed<T4>::value;
+    const std::vector<uint8_t> tail = w.GetData();
+    std::copy(tail.begin(), tail.end(), result.begin() + num_groups * kNumBits);
+  }
 
-        T1 r = PixelTraits::ConvertUnsigned<T1>::cvt(ReadValue(img_data, &bit_offset, prec1));
-        T2 g = PixelTraits::ConvertUnsigned<T2>::cvt(ReadValue(img_data, &bit_offset, prec2));
-        T3 b = PixelTraits::ConvertUnsigned<T3>::cvt(ReadValue(img_data, &bit_offset, prec3));
-        T4 a = PixelTraits::ConvertUnsigned<T4>::cvt(ReadValue(img_data, &bit_offset, prec4));
-        PixelTy v = std::make_tuple(r, g, b, a);
-
-        result.push_back(v);
-      }
-    }
+  result.resize(num_bytes);
+  return std::move(result);
+}
 
+template<typename T>
+struct ImageUnpacker {
+  static std::vector<T> go( const std::vector<uint8_t> &img_data, size_t width, size_t height) {
+    std::vector<T> result(width * height);
+    UnpackPixels(img_data.data(), img_data.size(), result.data(), result.size());
     return std::move(result);
   }
 };
@@ -130,6 +149,26 @@ class Image {
 
   const std::vector<T> &GetPixels() const { return _pixels; }
 
+  // Rows are Width() pixels apart
+  T *MutablePixels() { return _pixels.data(); }
+
+  // Changes the dimensions of the image, keeping its storage if it's large
+  // enough. The pixels have unspecified values afterwards.
+  void Resize(size_t w, size_t h) {
+    _width = w;
+    _height = h;
+    _pixels.resize(w * h);
+  }
+
+  // Moves the pixels out of the image into *pixels and leaves the image
+  // empty. The old storage of *pixels is kept for a later Resize.
+  void SwapPixels(std::vector<T> *pixels) {
+    pixels->swap(_pixels);
+    _pixels.clear();
+    _width = 0;
+    _height = 0;
+  }
+
   Image<T> &operator=(const Image<T> &other) {
     _width = other._width;
     _height = other._width;
@@ -150,22 +189,152 @@ class Image {
   }
 
   std::vector<uint8_t> Pack() const {
-    size_t bit_offset = 0;
-    const size_t kPixelSize = ((PixelTraits::BitsUsed<T>::value + 7) / 8);
-    std::vector<uint8_t> result(Width() * Height() * kPixelSize, 0);
-    for (const auto &p : _pixels) {
-      assert(((bit_offset + 7) / 8) < result.size());
-      PixelTraits::BitPacker<T>::pack(p, result.data(), &bit_offset);
+    return std::move(PackPixels(_pixels.data(), _pixels.size()));
+  }
+
+ private:
+  size_t _width;
+  size_t _height;
+  std::vector<T> _pixels;
+};
+
+// A non-owning view of a single channel plane. Rows are stride values apart,
+// so views can point into the planes of a PlanarImage or into an Image.
+// Views are only valid for as long as the storage they point into.
+template <typename T>
+class ImageView {
+ public:
+  typedef typename std::remove_const<T>::type PixelType;
+
+  ImageView<T>(T *data, size_t w, size_t h, size_t stride)
+    : _data(data)
+    , _width(w)
+    , _height(h)
+    , _stride(stride) {
+    assert(_stride >= _width);
+  }
+
+  size_t Width() const { return _width; }
+  size_t Height() const { return _height; }
+  size_t Stride() const { return _stride; }
+
+  T *Data() const { return _data; }
+  T *Row(size_t y) const {
+    assert(y < Height());
+    return _data + y * _stride;
+  }
+
+  PixelType GetAt(size_t x, size_t y) const {
+    assert(x < Width());
+    assert(y < Height());
+    return _data[y * _stride + x];
+  }
+
+  void SetAt(size_t x, size_t y, PixelType pixel) const {
+    assert(x < Width());
+    assert(y < Height());
+    _data[y * _stride + x] = pixel;
+  }
+
+  // Copies the plane into an image of its own.
+  std::unique_ptr<Image<PixelType> > ToImage() const {
+    std::unique_ptr<Image<PixelType> > result(new Image<PixelType>(_width, _height));
+    for (size_t y = 0; y < _height; ++y) {
+      const T *row = Row(y);
+      for (size_t x = 0; x < _width; ++x) {
+        result->SetAt(x, y, row[x]);
+      }
     }
-    assert(((bit_offset + 7) / 8) <= result.size());
-    result.resize((bit_offset + 7) / 8);
     return std::move(result);
   }
 
  private:
+  T *_data;
   size_t _width;
   size_t _height;
-  std::vector<T> _pixels;
+  size_t _stride;
+};
+
+// Multi-channel images stored as one plane per channel in a single
+// allocation, as opposed to Image, which interleaves the channels. Planes
+// are padded out to whole cache lines, so loops over a single channel only
+// touch the values of that channel and can be vectorized.
+template <typename T>
+class PlanarImage { };
+
+template <typename T1, typename T2, typename T3>
+class PlanarImage<std::tuple<T1, T2, T3> > {
+ public:
+  typedef std::tuple<T1, T2, T3> PixelType;
+  static const size_t kNumChannels = PixelTraits::NumChannels<PixelType>::value;
+  static_assert(kNumChannels == 3, "Pixel3's should have 3 channels!");
+  static_assert(std::is_trivially_copyable<T1>::value &&
+                std::is_trivially_copyable<T2>::value &&
+                std::is_trivially_copyable<T3>::value,
+                "Planes are copied around as bytes!");
+
+  PlanarImage<PixelType>(size_t w, size_t h)
+    : _width(w)
+    , _height(h) {
+    _offsets[0] = 0;
+    _offsets[1] = PlaneEnd(_offsets[0], sizeof(T1));
+    _offsets[2] = PlaneEnd(_offsets[1], sizeof(T2));
+    _data.resize(PlaneEnd(_offsets[2], sizeof(T3)) / sizeof(uint64_t));
+
+    InitPlane<0>();
+    InitPlane<1>();
+    InitPlane<2>();
+  }
+
+  size_t Width() const { return _width; }
+  size_t Height() const { return _height; }
+
+  template<size_t I> ImageView<typename std::tuple_element<I, PixelType>::type> Plane() {
+    typedef typename std::tuple_element<I, PixelType>::type PlaneTy;
+    PlaneTy *data = reinterpret_cast<PlaneTy *>(
+      reinterpret_cast<uint8_t *>(_data.data()) + _offsets[I]);
+    return ImageView<PlaneTy>(data, _width, _height, _width);
+  }
+
+  template<size_t I> ImageView<const typename std::tuple_element<I, PixelType>::type> Plane() const {
+    typedef typename std::tuple_element<I, PixelType>::type PlaneTy;
+    const PlaneTy *data = reinterpret_cast<const PlaneTy *>(
+      reinterpret_cast<const uint8_t *>(_data.data()) + _offsets[I]);
+    return ImageView<const PlaneTy>(data, _width, _height, _width);
+  }
+
+  PixelType GetAt(size_t x, size_t y) const {
+    return std::make_tuple(Plane<0>().GetAt(x, y), Plane<1>().GetAt(x, y), Plane<2>().GetAt(x, y));
+  }
+
+  void SetAt(size_t x, size_t y, const PixelType &pixel) {
+    Plane<0>().SetAt(x, y, std::get<0>(pixel));
+    Plane<1>().SetAt(x, y, std::get<1>(pixel));
+    Plane<2>().SetAt(x, y, std::get<2>(pixel));
+  }
+
+ private:
+  static const size_t kPlaneAlignment = 64;
+
+  size_t PlaneEnd(size_t offset, size_t elem_sz) const {
+    const size_t end = offset + _width * _height * elem_sz;
+    return ((end + kPlaneAlignment - 1) / kPlaneAlignment) * kPlaneAlignment;
+  }
+
+  template<size_t I> void InitPlane() {
+    typedef typename std::tuple_element<I, PixelType>::type PlaneTy;
+    ImageView<PlaneTy> plane = Plane<I>();
+    for (size_t i = 0; i < _width * _height; ++i) {
+      new (plane.Data() + i) PlaneTy();
+    }
+  }
+
+  size_t _width;
+  size_t _height;
+  size_t _offsets[kNumChannels];
+
+  // Stored as words so that the allocation is aligned for every plane type.
+  std::vector<uint64_t> _data;
 };
 
 typedef std::tuple<uint8_t, uint8_t, uint8_t> RGB;
@@ -189,6 +358,7 @@ typedef Image<RGB> YCbCrImage;
 
 typedef std::tuple<UnsignedBits<6>, SignedBits<6>, SignedBits<7> > YCoCg667;
 typedef Image<YCoCg667> YCoCg667Image;
+typedef PlanarImage<YCoCg667> PlanarYCoCg667Image;
 
 }  // namespace GenTC
 
@@ -128,15 +128,23 @@ std::unique_ptr<RGBImage> Expand565::Run(const std::unique_ptr<RGB565Image> &in)
   return std::move(std::unique_ptr<RGBImage>(img));
 }
 
-std::unique_ptr<YCoCg667Image> RGB565toYCoCg667::Run(const std::unique_ptr<RGB565Image> &in) const {
+std::unique_ptr<PlanarYCoCg667Image> RGB565toYCoCg667::Run(const std::unique_ptr<RGB565Image> &in) const {
   const size_t w = in->Width();
   const size_t h = in->Height();
 
-  YCoCg667Image *img = new YCoCg667Image(w, h);
+  PlanarYCoCg667Image *img = new PlanarYCoCg667Image(w, h);
+  ImageView<UnsignedBits<6> > y_plane = img->Plane<0>();
+  ImageView<SignedBits<6> > co_plane = img->Plane<1>();
+  ImageView<SignedBits<7> > cg_plane = img->Plane<2>();
 
+  const RGB565 *src = in->GetPixels().data();
   for (size_t j = 0; j < h; ++j) {
+    UnsignedBits<6> *y_row = y_plane.Row(j);
+    SignedBits<6> *co_row = co_plane.Row(j);
+    SignedBits<7> *cg_row = cg_plane.Row(j);
+
     for (size_t i = 0; i < w; ++i) {
-      auto pixel = in->GetAt(i, j);
+      const RGB565 &pixel = src[j * w + i];
 
       assert(0 <= std::get<0>(pixel) && std::get<0>(pixel) < 32);
       assert(0 <= std::get<1>(pixel) && std::get<1>(pixel) < 64);
@@ -151,34 +159,38 @@ std::unique_ptr<YCoCg667Image> RGB565toYCoCg667::Run(const std::unique_ptr<RGB56
       int8_t ycocg[3];
       rgb565_to_ycocg667(rgb, ycocg);
 
-      YCoCg667 x;
-      std::get<0>(x) = ycocg[0];
-      std::get<1>(x) = ycocg[1];
-      std::get<2>(x) = ycocg[2];
-
-      img->SetAt(i, j, x);
+      y_row[i] = ycocg[0];
+      co_row[i] = ycocg[1];
+      cg_row[i] = ycocg[2];
     }
   }
 
-  return std::move(std::unique_ptr<YCoCg667Image>(img));
+  return std::move(std::unique_ptr<PlanarYCoCg667Image>(img));
 }
 
-std::unique_ptr<RGB565Image> YCoCg667toRGB565::Run(const std::unique_ptr<YCoCg667Image> &in) const {
+std::unique_ptr<RGB565Image> YCoCg667toRGB565::Run(const std::unique_ptr<PlanarYCoCg667Image> &in) const {
   std::vector<uint8_t> data;
   data.reserve(in->Width() * in->Height() * 2);
 
+  const PlanarYCoCg667Image &planar = *in;
+  ImageView<const UnsignedBits<6> > y_plane = planar.Plane<0>();
+  ImageView<const SignedBits<6> > co_plane = planar.Plane<1>();
+  ImageView<const SignedBits<7> > cg_plane = planar.Plane<2>();
+
   for (size_t j = 0; j < in->Height(); ++j) {
-    for (size_t i = 0; i < in->Height(); ++i) {
-      auto pixel = in->GetAt(i, j);
+    const UnsignedBits<6> *y_row = y_plane.Row(j);
+    const SignedBits<6> *co_row = co_plane.Row(j);
+    const SignedBits<7> *cg_row = cg_plane.Row(j);
 
-      assert(0 <= std::get<0>(pixel) && std::get<0>(pixel) < 64);
-      assert(-31 <= std::get<1>(pixel) && std::get<1>(pixel) < 32);
-      assert(-63 <= std::get<2>(pixel) && std::get<2>(pixel) < 64);
+    for (size_t i = 0; i < in->Width(); ++i) {
+      assert(0 <= y_row[i] && y_row[i] < 64);
+      assert(-31 <= co_row[i] && co_row[i] < 32);
+      assert(-63 <= cg_row[i] && cg_row[i] < 64);
 
       int8_t ycocg[3] = {
-          static_cast<int8_t>(std::get<0>(pixel)),
-          static_cast<int8_t>(std::get<1>(pixel)),
-          static_cast<int8_t>(std::get<2>(pixel)) };
+          static_cast<int8_t>(y_row[i]),
+          static_cast<int8_t>(co_row[i]),
+          static_cast<int8_t>(cg_row[i]) };
       int8_t rgb[3];
       ycocg667_to_rgb565(ycocg, rgb);
 
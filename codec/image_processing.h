@@ -2,12 +2,14 @@
 #define __TCAR_IMAGE_PROCESSING_H__
 
 #include "fast_dct.h"
+#include "integer_dct.h"
 #include "wavelet.h"
 
 #include "pipeline.h"
 #include "image.h"
 
 #include <array>
+#include <type_traits>
 
 #include <iostream>
 
@@ -35,26 +37,29 @@ class Expand565
   std::unique_ptr<RGBImage> Run(const std::unique_ptr<RGB565Image> &) const override;
 };
 
+// Converts to YCoCg with each channel in its own plane, since the
+// channels get compressed separately from here on.
 class RGB565toYCoCg667
-: public PipelineUnit<RGB565Image, YCoCg667Image> {
+: public PipelineUnit<RGB565Image, PlanarYCoCg667Image> {
  public:
-  typedef PipelineUnit<RGB565Image, YCoCg667Image> Base;
+  typedef PipelineUnit<RGB565Image, PlanarYCoCg667Image> Base;
   static std::unique_ptr<Base> New() { return std::unique_ptr<Base>(new RGB565toYCoCg667); }
-  std::unique_ptr<YCoCg667Image> Run(const std::unique_ptr<RGB565Image> &) const override;
+  std::unique_ptr<PlanarYCoCg667Image> Run(const std::unique_ptr<RGB565Image> &) const override;
 };
 
 class YCoCg667toRGB565
-: public PipelineUnit<YCoCg667Image, RGB565Image> {
+: public PipelineUnit<PlanarYCoCg667Image, RGB565Image> {
  public:
-  typedef PipelineUnit<YCoCg667Image, RGB565Image> Base;
+  typedef PipelineUnit<PlanarYCoCg667Image, RGB565Image> Base;
   static std::unique_ptr<Base> New() { return std::unique_ptr<Base>(new YCoCg667toRGB565); }
-  std::unique_ptr<RGB565Image> Run(const std::unique_ptr<YCoCg667Image> &) const override;
+  std::unique_ptr<RGB565Image> Run(const std::unique_ptr<PlanarYCoCg667Image> &) const override;
 };
 
 template<typename T>
 class Quantize8x8
   : public PipelineUnit < Image<T>, Image<T> > {
   static_assert(PixelTraits::NumChannels<T>::value == 1, "Can only quantize single channel images!");
+  static_assert(std::is_same<T, int16_t>::value, "Can only quantize 16 bit DCT coefficients!");
  public:
    typedef Image<T> ImageType;
    typedef PipelineUnit<Image<T>, Image<T>> Base;
@@ -85,24 +90,7 @@ class Quantize8x8
    public:
      Quantizer(QuantizeType ty) : Quantize8x8<T>(ty) { }
      std::unique_ptr<ImageType> Run(const std::unique_ptr<ImageType> &in) const override {
-       ImageType *result = new ImageType(in->Width(), in->Height());
-
-       assert((in->Width() % 8) == 0);
-       assert((in->Height() % 8) == 0);
-
-       for (size_t j = 0; j < in->Height(); j += 8) {
-         for (size_t i = 0; i < in->Width(); i += 8) {
-           for (size_t y = 0; y < 8; ++y) {
-             for (size_t x = 0; x < 8; ++x) {
-               T pixel = in->GetAt(i + x, j + y);
-               pixel /= static_cast<T>(_coeffs[y * 8 + x]);
-               result->SetAt(i + x, j + y, pixel);
-             }
-           }
-         }
-       }
-
-       return std::move(std::unique_ptr<ImageType>(result));
+       return std::move(this->ForEachBlock(in, QuantizeBlock8x8));
      }
    };
 
@@ -110,51 +98,37 @@ class Quantize8x8
    public:
      Dequantizer(QuantizeType ty) : Quantize8x8<T>(ty) { }
      std::unique_ptr<ImageType> Run(const std::unique_ptr<ImageType> &in) const override {
-       ImageType *result = new ImageType(in->Width(), in->Height());
-
-       assert((in->Width() % 8) == 0);
-       assert((in->Height() % 8) == 0);
-
-       for (size_t j = 0; j < in->Height(); j += 8) {
-         for (size_t i = 0; i < in->Width(); i += 8) {
-           for (size_t y = 0; y < 8; ++y) {
-             for (size_t x = 0; x < 8; ++x) {
-               T pixel = in->GetAt(i + x, j + y);
-               pixel *= static_cast<T>(_coeffs[y * 8 + x]);
-               result->SetAt(i + x, j + y, pixel);
-             }
-           }
-         }
-       }
-
-       return std::move(std::unique_ptr<ImageType>(result));
+       return std::move(this->ForEachBlock(in, DequantizeBlock8x8));
      }
    };
 
    Quantize8x8<T>(QuantizeType ty)
      : Base()
-     , _coeffs(ty == eQuantizeType_JPEGLuma ?
-               std::move(std::array<uint32_t, 64>
-                  {{ 16, 11, 10, 16, 24, 40, 51, 61,
-                     12, 12, 14, 19, 26, 58, 60, 55,
-                     14, 13, 16, 24, 40, 57, 69, 56,
-                     14, 17, 22, 29, 51, 87, 80, 62,
-                     18, 22, 37, 56, 68, 109, 103, 77,
-                     24, 35, 55, 64, 81, 104, 113, 92,
-                     49, 64, 78, 87, 103, 121, 120, 101,
-                     72, 92, 95, 98, 112, 100, 103, 99 }}) :
-               std::move(std::array<uint32_t, 64> {
-                   { 17, 18, 24, 47, 99, 99, 99, 99,
-                     18, 21, 26, 66, 99, 99, 99, 99,
-                     24, 26, 56, 99, 99, 99, 99, 99,
-                     47, 66, 99, 99, 99, 99, 99, 99,
-                     99, 99, 99, 99, 99, 99, 99, 99,
-                     99, 99, 99, 99, 99, 99, 99, 99,
-                     99, 99, 99, 99, 99, 99, 99, 99,
-                     99, 99, 99, 99, 99, 99, 99, 99 }})
-   ) { }
-
-   const std::array<uint32_t, 64> _coeffs;
+     , _quantization(DCTQuantization::Unscaled(
+         ty == eQuantizeType_JPEGLuma ? kJPEGLumaQuantization : kJPEGChromaQuantization)) { }
+
+   // Runs op on each 8x8 block of in, straight into the pixels of the result
+   typedef void (*BlockOp)(const int16_t *, size_t, const DCTQuantization &, int16_t *, size_t);
+   std::unique_ptr<ImageType> ForEachBlock(const std::unique_ptr<ImageType> &in, BlockOp op) const {
+     assert((in->Width() % 8) == 0);
+     assert((in->Height() % 8) == 0);
+
+     const size_t width = in->Width();
+     const size_t height = in->Height();
+     const T *src = in->GetPixels().data();
+
+     ImageType *result = new ImageType(width, height);
+     T *dst = result->MutablePixels();
+     for (size_t j = 0; j < height; j += 8) {
+       for (size_t i = 0; i < width; i += 8) {
+         op(src + j * width + i, width, _quantization, dst + j * width + i, width);
+       }
+     }
+
+     return std::move(std::unique_ptr<ImageType>(result));
+   }
+
+   const DCTQuantization _quantization;
 };
 
 template<typename T>
@@ -172,73 +146,65 @@ static void Transpose8x8(T *block) {
 }
 
 template<typename T>
-class ForwardDCT : PipelineUnit<Image<T>, SixteenBitImage > {
+class ForwardDCT : public PipelineUnit<Image<T>, SixteenBitImage > {
   static_assert(PixelTraits::NumChannels<T>::value == 1,
                 "DCT is a single-channel operation!");
+  static_assert(PixelTraits::BitsUsed<T>::value <= 8,
+                "The integer DCT only has room for eight bit samples!");
 public:
   typedef PipelineUnit<Image<T>, SixteenBitImage> Base;
 
   static std::unique_ptr<Base> New() {
-    return std::unique_ptr<Base>(new ForwardDCT<T>);
+    return std::unique_ptr<Base>(new ForwardDCT<T>(DCTQuantization()));
+  }
+
+  // These quantize the coefficients while they're still in registers, which
+  // saves a Quantize8x8 pass over the result.
+  static std::unique_ptr<Base> QuantizeJPEGLuma() {
+    return std::unique_ptr<Base>(new ForwardDCT<T>(DCTQuantization(kJPEGLumaQuantization)));
+  }
+
+  static std::unique_ptr<Base> QuantizeJPEGChroma() {
+    return std::unique_ptr<Base>(new ForwardDCT<T>(DCTQuantization(kJPEGChromaQuantization)));
   }
 
   typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
     assert(in->Width() % 8 == 0);
     assert(in->Height() % 8 == 0);
 
-    // Sixteen bit images are packed...
-    std::vector<uint8_t> result(in->Width() * in->Height() * 2);
-
-    for (uint32_t j = 0; j < in->Height(); j += 8) {
-      for (uint32_t i = 0; i < in->Width(); i += 8) {
-        float block[64];
-
-        // Read block
-        for (uint32_t y = 0; y < 8; ++y) {
-          for (uint32_t x = 0; x < 8; ++x) {
-            uint32_t idx = y * 8 + x;
-            block[idx] = static_cast<float>(in->GetAt(i + x, j + y));
-          }
-        }
-
-        // Run forward DCT...
-        for (int r = 0; r < 8; ++r) {
-          float *row = block + r * 8;
-          fdct(row, row);
-        }
-
-        // Transpose
-        Transpose8x8(block);
-
-        // Run forward DCT...
-        for (int r = 0; r < 8; ++r) {
-          float *row = block + r * 8;
-          fdct(row, row);
-        }
+    const size_t width = in->Width();
+    const size_t height = in->Height();
+    const std::vector<T> &pixels = in->GetPixels();
 
-        // Transpose
-        Transpose8x8(block);
+    // The transform works on samples centered around zero
+    const int16_t center = PixelTraits::IsSigned<T>::value ? 0 :
+      static_cast<int16_t>(1 << (PixelTraits::BitsUsed<T>::value - 1));
 
-        // Write block
+    SixteenBitImage *ret_img = new SixteenBitImage(width, height);
+    int16_t *coeffs = ret_img->MutablePixels();
+    for (size_t j = 0; j < height; j += 8) {
+      for (size_t i = 0; i < width; i += 8) {
+        int16_t block[64];
         for (size_t y = 0; y < 8; ++y) {
+          const T *row = pixels.data() + (j + y) * width + i;
           for (size_t x = 0; x < 8; ++x) {
-            size_t idx = y * 8 + x;
-
-            size_t dst_idx = ((j + y) * in->Width() + i + x) * 2;
-            uint8_t *ptr = result.data();
-
-            int16_t v = static_cast<int16_t>(block[idx]);
-            ptr[dst_idx + 0] = (v >> 8) & 0xFF;
-            ptr[dst_idx + 1] = v & 0xFF;
+            block[y * 8 + x] = static_cast<int16_t>(row[x]);
           }
         }
+
+        ForwardDCT8x8(block, 8, center, _quantization, coeffs + j * width + i, width);
       }
     }
 
-    SixteenBitImage *ret_img =
-      new SixteenBitImage(in->Width(), in->Height(), result);
     return std::move(typename Base::ReturnType(ret_img));
   }
+
+private:
+  explicit ForwardDCT(const DCTQuantization &quantization)
+    : Base()
+    , _quantization(quantization) { }
+
+  const DCTQuantization _quantization;
 };
 
 class InverseDCT : PipelineUnit<SixteenBitImage, AlphaImage> {
@@ -266,7 +232,8 @@ struct WaveletResultTy<T, false> {
 
 template <typename T, size_t BlockSize>
 class FWavelet2D : public PipelineUnit<Image<T>,
-  Image< typename WaveletResultTy<T, PixelTraits::BitsUsed<T>::value == 6 >::DstTy > > {
+  Image< typename WaveletResultTy<T, PixelTraits::BitsUsed<T>::value == 6 >::DstTy > >
+  , public TileUnit<T, typename WaveletResultTy<T, PixelTraits::BitsUsed<T>::value == 6 >::DstTy> {
 public:
   typedef WaveletResultTy< T, PixelTraits::BitsUsed<T>::value == 6 > ResultTy;
   static const size_t kNumSrcBits = PixelTraits::BitsUsed<T>::value;
@@ -289,19 +256,69 @@ public:
   }
 
   virtual typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
-    assert((in->Width() % BlockSize) == 0);
-    assert((in->Height() % BlockSize) == 0);
-    OutputImage *result = new OutputImage(in->Width(), in->Height());
+    typename Base::ReturnType result(new OutputImage);
+    Transform(*in, result.get());
+    return std::move(result);
+  }
+
+  virtual typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                            PipelineContext *ctx) const override {
+    typename Base::ReturnType result = AcquireBuffer<OutputImage>(ctx);
+    Transform(*in, result.get());
+    RecycleBuffer(ctx, std::move(in));
+    return std::move(result);
+  }
+
+  // Every block is transformed on its own, so tiles of one block each can
+  // go through the rest of a pipeline before the next one is transformed.
+  bool SupportsTiles(size_t width, size_t height, size_t tile_dim) const override {
+    return tile_dim == BlockSize;
+  }
+
+  void RunTile(const T *in, DstTy *out, size_t tile_dim) const override {
+    assert(tile_dim == BlockSize);
+    int16_t block[BlockSize * BlockSize];
+    for (size_t i = 0; i < BlockSize * BlockSize; ++i) {
+      assert(static_cast<int64_t>(in[i]) <= PixelTraits::Max<int16_t>::value);
+      assert(static_cast<int64_t>(in[i]) >= PixelTraits::Min<int16_t>::value);
+      block[i] = static_cast<int16_t>(in[i]);
+    }
+
+    TransformBlock(block);
+
+    for (size_t i = 0; i < BlockSize * BlockSize; ++i) {
+      assert(static_cast<DstTy>(block[i]) <= PixelTraits::Max<DstTy>::value);
+      assert(static_cast<DstTy>(block[i]) >= PixelTraits::Min<DstTy>::value);
+      out[i] = static_cast<DstTy>(block[i]);
+    }
+  }
 
-    for (size_t j = 0; j < in->Height(); j += BlockSize) {
-      for (size_t i = 0; i < in->Width(); i += BlockSize) {
-        std::vector<int16_t> block(BlockSize * BlockSize);
+ private:
+  static void TransformBlock(int16_t *block) {
+    static const size_t kRowBytes = sizeof(int16_t) * BlockSize;
+    int16_t scratch[BlockSize * BlockSize + BlockSize];
+    assert(WaveletScratchSize(BlockSize) <= sizeof(scratch) / sizeof(scratch[0]));
 
+    size_t dim = BlockSize;
+    while (dim > 1) {
+      ForwardWavelet2D(block, kRowBytes, block, kRowBytes, dim, scratch);
+      dim /= 2;
+    }
+  }
+
+  void Transform(const InputImage &in, OutputImage *result) const {
+    assert((in.Width() % BlockSize) == 0);
+    assert((in.Height() % BlockSize) == 0);
+    result->Resize(in.Width(), in.Height());
+
+    std::vector<int16_t> block(BlockSize * BlockSize);
+    for (size_t j = 0; j < in.Height(); j += BlockSize) {
+      for (size_t i = 0; i < in.Width(); i += BlockSize) {
         // Populate block
         for (size_t y = 0; y < BlockSize; ++y) {
           for (size_t x = 0; x < BlockSize; ++x) {
             size_t local_idx = y * BlockSize + x;
-            T pixel = in->GetAt(i + x, j + y);
+            T pixel = in.GetAt(i + x, j + y);
             assert(static_cast<int64_t>(pixel) <= PixelTraits::Max<int16_t>::value);
             assert(static_cast<int64_t>(pixel) >= PixelTraits::Min<int16_t>::value);
             block[local_idx] = static_cast<int16_t>(pixel);
@@ -309,12 +326,7 @@ public:
         }
 
         // Do transform
-        static const size_t kRowBytes = sizeof(int16_t) * BlockSize;
-        size_t dim = BlockSize;
-        while (dim > 1) {
-          ForwardWavelet2D(block.data(), kRowBytes, block.data(), kRowBytes, dim);
-          dim /= 2;
-        }
+        TransformBlock(block.data());
 
         // Output to image...
         for (size_t y = 0; y < BlockSize; ++y) {
@@ -327,8 +339,6 @@ public:
         }
       }
     }
-
-    return std::move(typename Base::ReturnType(result));
   }
 };
 
@@ -102,12 +102,44 @@ class ImageSplit<std::tuple<T1, T2, T3, T4> >
   }
 };
 
+// Planar images already store each channel separately, so splitting them
+// just hands out views of their planes. The views point into the input image
+// and are only valid for as long as it is alive.
+template <typename T1, typename T2, typename T3>
+class ImageSplit<PlanarImage<std::tuple<T1, T2, T3> > >
+  : public PipelineUnit<PlanarImage<std::tuple<T1, T2, T3> >,
+                        std::tuple<std::unique_ptr<ImageView<const T1> >,
+                                   std::unique_ptr<ImageView<const T2> >,
+                                   std::unique_ptr<ImageView<const T3> > > > {
+  typedef PlanarImage<std::tuple<T1, T2, T3> > ImageTy;
+ public:
+  typedef std::unique_ptr<ImageView<const T1> > I1Ty;
+  typedef std::unique_ptr<ImageView<const T2> > I2Ty;
+  typedef std::unique_ptr<ImageView<const T3> > I3Ty;
+  typedef PipelineUnit<ImageTy, std::tuple<I1Ty, I2Ty, I3Ty> > Base;
+  static std::unique_ptr<Base> New() {
+    return std::unique_ptr<Base>(new ImageSplit<ImageTy>());
+  }
+
+  typename Base::ReturnType Run(const std::unique_ptr<ImageTy> &in) const override {
+    const ImageTy &img = *in;
+
+    typename Base::ReturnValueType *result = new typename Base::ReturnValueType;
+    std::get<0>(*result) = I1Ty(new ImageView<const T1>(img.template Plane<0>()));
+    std::get<1>(*result) = I2Ty(new ImageView<const T2>(img.template Plane<1>()));
+    std::get<2>(*result) = I3Ty(new ImageView<const T3>(img.template Plane<2>()));
+
+    return std::move(typename Base::ReturnType(result));
+  }
+};
+
 typedef ImageSplit<RGB> RGBSplitter;
 typedef ImageSplit<RGBA> RGBASplitter;
 typedef ImageSplit<RGB> YCrCbSplitter;
+typedef ImageSplit<PlanarYCoCg667Image> YCoCg667Splitter;
 
 template<typename T>
-class Linearize : public PipelineUnit<Image<T>, std::vector<T> > {
+class Linearize : public PipelineUnit<Image<T>, std::vector<T> >, public TileUnit<T, T> {
  public:
   typedef PipelineUnit<Image<T>, std::vector<T> > Base;
   static std::unique_ptr<Base> New() { return std::unique_ptr<Base>(new Linearize<T>); }
@@ -122,6 +154,23 @@ class Linearize : public PipelineUnit<Image<T>, std::vector<T> > {
 
     return std::move(std::unique_ptr<std::vector<T> >(result));
   }
+
+  // The pixels are already linear, so just take them from the image. The
+  // image gets the storage of a recycled vector in exchange.
+  typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                    PipelineContext *ctx) const override {
+    assert(in->Width() > 0);
+    assert(in->Height() > 0);
+
+    typename Base::ReturnType result = AcquireBuffer<std::vector<T> >(ctx);
+    in->SwapPixels(result.get());
+    RecycleBuffer(ctx, std::move(in));
+    return std::move(result);
+  }
+
+  void RunTile(const T *in, T *out, size_t tile_dim) const override {
+    std::copy(in, in + tile_dim * tile_dim, out);
+  }
 };
 
 class DropAlpha : public PipelineUnit<RGBAImage, RGBImage> {
@@ -133,7 +182,8 @@ class DropAlpha : public PipelineUnit<RGBAImage, RGBImage> {
 
 template <typename T>
 class MakeUnsigned
-  : public PipelineUnit < Image<T>, Image<typename PixelTraits::UnsignedForSigned<T>::Ty > > {
+  : public PipelineUnit < Image<T>, Image<typename PixelTraits::UnsignedForSigned<T>::Ty > >
+  , public TileUnit<T, typename PixelTraits::UnsignedForSigned<T>::Ty> {
  public:
    typedef typename PixelTraits::UnsignedForSigned<T>::Ty DstTy;
    typedef Image<T> InputImage;
@@ -143,16 +193,35 @@ class MakeUnsigned
    static std::unique_ptr<Base> New() { return std::unique_ptr<Base>(new MakeUnsigned); }
 
    typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
-     OutputImage *result = new OutputImage(in->Width(), in->Height());
-     for (size_t y = 0; y < in->Height(); ++y) {
-       for (size_t x = 0; x < in->Width(); ++x) {
-         const T pixel = in->GetAt(x, y);
+     typename Base::ReturnType result(new OutputImage);
+     Convert(*in, result.get());
+     return std::move(result);
+   }
+
+   typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                     PipelineContext *ctx) const override {
+     typename Base::ReturnType result = AcquireBuffer<OutputImage>(ctx);
+     Convert(*in, result.get());
+     RecycleBuffer(ctx, std::move(in));
+     return std::move(result);
+   }
+
+   void RunTile(const T *in, DstTy *out, size_t tile_dim) const override {
+     for (size_t i = 0; i < tile_dim * tile_dim; ++i) {
+       out[i] = static_cast<DstTy>(PixelTraits::ToUnsigned<T>::cvt(in[i]));
+     }
+   }
+
+ private:
+   static void Convert(const InputImage &in, OutputImage *result) {
+     result->Resize(in.Width(), in.Height());
+     for (size_t y = 0; y < in.Height(); ++y) {
+       for (size_t x = 0; x < in.Width(); ++x) {
+         const T pixel = in.GetAt(x, y);
          const DstTy out = static_cast<DstTy>(PixelTraits::ToUnsigned<T>::cvt(pixel));
          result->SetAt(x, y, out);
        }
      }
-
-     return std::move(typename Base::ReturnType(result));
    }
 };
 
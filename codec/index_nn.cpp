@@ -0,0 +1,111 @@
+#include "index_nn.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace {
+
+// Below this many words it's faster to just look at all of them
+static const size_t kMaxBruteForceSize = 256;
+
+// Number of distances computed at a time during brute force searches
+static const size_t kBatchSize = 16;
+
+static uint32_t OrderSum(uint32_t orders) {
+  const uint32_t hi = (orders >> 1) & 0x55555555;
+  const uint32_t lo = orders & 0x55555555;
+  return 2 * GenTC::PopCount32(hi) + GenTC::PopCount32(lo);
+}
+
+}  // namespace
+
+namespace GenTC {
+
+IndexNearestNeighbors::IndexNearestNeighbors(const std::vector<uint32_t> &indices)
+  : _orders(indices.size())
+{
+  for (size_t i = 0; i < indices.size(); ++i) {
+    _orders[i] = IndicesToOrders(indices[i]);
+  }
+
+  if (_orders.size() <= kMaxBruteForceSize) {
+    return;
+  }
+
+  // Counting sort of the positions by the sum of their orders. This keeps
+  // the positions in each bucket in increasing order.
+  _bucket_start.assign(kNumSums + 1, 0);
+  for (uint32_t orders : _orders) {
+    _bucket_start[OrderSum(orders) + 1]++;
+  }
+
+  for (size_t s = 0; s < kNumSums; ++s) {
+    _bucket_start[s + 1] += _bucket_start[s];
+  }
+
+  std::vector<uint32_t> next(_bucket_start.begin(), _bucket_start.end() - 1);
+  _bucketed.resize(_orders.size());
+  for (size_t i = 0; i < _orders.size(); ++i) {
+    _bucketed[next[OrderSum(_orders[i])]++] = static_cast<uint32_t>(i);
+  }
+}
+
+size_t IndexNearestNeighbors::Nearest(uint32_t indices) const {
+  assert(!_orders.empty());
+  const uint32_t query = IndicesToOrders(indices);
+
+  uint32_t best_dist = std::numeric_limits<uint32_t>::max();
+  size_t best = 0;
+
+  if (_bucketed.empty()) {
+    const size_t num_orders = _orders.size();
+    for (size_t batch = 0; batch < num_orders; batch += kBatchSize) {
+      const size_t batch_sz = std::min(kBatchSize, num_orders - batch);
+
+      uint32_t dists[kBatchSize];
+      for (size_t i = 0; i < batch_sz; ++i) {
+        dists[i] = OrderDistance(query, _orders[batch + i]);
+      }
+
+      for (size_t i = 0; i < batch_sz; ++i) {
+        if (dists[i] < best_dist) {
+          best_dist = dists[i];
+          best = batch + i;
+        }
+      }
+    }
+
+    return best;
+  }
+
+  // Visit the buckets in order of how far their sums are from the query's,
+  // until the lower bound on the distance is larger than the best one so far.
+  const int query_sum = static_cast<int>(OrderSum(query));
+  for (int d = 0; d < static_cast<int>(kNumSums); ++d) {
+    if (static_cast<uint64_t>(d * d) > 16ULL * best_dist) {
+      break;
+    }
+
+    const int sums[2] = { query_sum - d, query_sum + d };
+    for (int i = 0; i < (d == 0 ? 1 : 2); ++i) {
+      const int s = sums[i];
+      if (s < 0 || s >= static_cast<int>(kNumSums)) {
+        continue;
+      }
+
+      for (uint32_t j = _bucket_start[s]; j < _bucket_start[s + 1]; ++j) {
+        const uint32_t pos = _bucketed[j];
+        const uint32_t dist = OrderDistance(query, _orders[pos]);
+        if (dist < best_dist || (dist == best_dist && pos < best)) {
+          best_dist = dist;
+          best = pos;
+        }
+      }
+    }
+  }
+
+  return best;
+}
+
+}  // namespace GenTC
@@ -0,0 +1,83 @@
+#ifndef __TCAR_INDEX_NN_H__
+#define __TCAR_INDEX_NN_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace GenTC {
+
+  inline uint32_t PopCount32(uint32_t x) {
+#ifdef _MSC_VER
+    return static_cast<uint32_t>(__popcnt(x));
+#else
+    return static_cast<uint32_t>(__builtin_popcount(x));
+#endif
+  }
+
+  // DXT indices are ordered like 0, 3, 1, 2 along the line between the two
+  // endpoints. This converts each 2-bit index of an interpolation word into
+  // its 2-bit position along that line.
+  inline uint32_t IndicesToOrders(uint32_t indices) {
+    // For index bits (i1, i0), the order bits are (i0, i1 ^ i0)
+    const uint32_t lo = indices & 0x55555555;
+    const uint32_t hi = (indices >> 1) & 0x55555555;
+    return (lo << 1) | (hi ^ lo);
+  }
+
+  // Returns the squared euclidean distance between two words of packed
+  // orders, i.e. sum((a_i - b_i)^2) over all 16 pixels. Writing each order
+  // as 2h + l, the square of the difference of each pair is
+  //
+  //   4 (ha - hb)^2 + (la - lb)^2 + 4 (ha - hb)(la - lb)
+  //
+  // and since every term in parenthesis is a difference of single bits, the
+  // sums are just popcounts of xors.
+  inline uint32_t OrderDistance(uint32_t a, uint32_t b) {
+    const uint32_t diff = a ^ b;
+    const uint32_t hi_diff = (diff >> 1) & 0x55555555;
+    const uint32_t lo_diff = diff & 0x55555555;
+    const uint32_t both = hi_diff & lo_diff;
+
+    // If both bits differ, then the cross term is positive iff h == l
+    const uint32_t mixed = (a ^ (a >> 1)) & 0x55555555;
+    return 4 * PopCount32(hi_diff) + PopCount32(lo_diff)
+      + 4 * PopCount32(both & ~mixed) - 4 * PopCount32(both & mixed);
+  }
+
+  // Exact nearest neighbor search over a fixed set of DXT interpolation
+  // words using OrderDistance. Small sets are searched by brute force, a
+  // batch of words at a time. Larger sets are bucketed by the sum of their
+  // orders: by Cauchy-Schwarz, the squared distance between two words is at
+  // least (sum(a) - sum(b))^2 / 16, which lets us stop looking at buckets
+  // that are too far away.
+  class IndexNearestNeighbors {
+   public:
+    explicit IndexNearestNeighbors(const std::vector<uint32_t> &indices);
+
+    size_t Size() const { return _orders.size(); }
+
+    // Returns the position in the original vector of the closest word to
+    // indices. Ties go to the earliest position. The set must not be empty.
+    size_t Nearest(uint32_t indices) const;
+
+   private:
+    static const size_t kNumSums = 16 * 3 + 1;
+
+    // Orders of each word, in the original order
+    std::vector<uint32_t> _orders;
+
+    // Positions of the words, grouped by the sum of their orders. The
+    // positions of the words with sum s are in [_bucket_start[s],
+    // _bucket_start[s + 1]).
+    std::vector<uint32_t> _bucketed;
+    std::vector<uint32_t> _bucket_start;
+  };
+
+}  // namespace GenTC
+
+#endif  // __TCAR_INDEX_NN_H__
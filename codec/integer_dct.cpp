@@ -0,0 +1,374 @@
+#include "integer_dct.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define GENTC_HAVE_SSE2 1
+#  include <emmintrin.h>
+#endif
+
+// This is the LLM DCT in 16 bit fixed point, as in the islow DCT of the IJG
+// JPEG library, arranged so that every rotation is a pair of multiplies
+// that can be done with a single pmaddwd. The first pass keeps two extra
+// bits of precision and the second pass removes them again. The result is
+// the orthonormal DCT scaled by eight.
+namespace {
+
+static const int kConstBits = 13;
+static const int kPass1Bits = 2;
+
+// The cosine terms as round(x * 2^kConstBits)
+static const int kFix_0_298631336 = 2446;
+static const int kFix_0_390180644 = 3196;
+static const int kFix_0_541196100 = 4433;
+static const int kFix_0_765366865 = 6270;
+static const int kFix_0_899976223 = 7373;
+static const int kFix_1_175875602 = 9633;
+static const int kFix_1_501321110 = 12299;
+static const int kFix_1_847759065 = 15137;
+static const int kFix_1_961570560 = 16069;
+static const int kFix_2_053119869 = 16819;
+static const int kFix_2_562915447 = 20995;
+static const int kFix_3_072711026 = 25172;
+
+// The even part: out2 = tmp13 * kEven2[0] + tmp12 * kEven2[1], etc.
+static const int kEven2[2] = { kFix_0_541196100 + kFix_0_765366865, kFix_0_541196100 };
+static const int kEven6[2] = { kFix_0_541196100, kFix_0_541196100 - kFix_1_847759065 };
+
+// The odd part: z3 and z4 are shared between the outputs, and each output
+// adds its own rotation of (tmp4, tmp7) or (tmp5, tmp6) to one of them.
+static const int kOddZ3[2] = { kFix_1_175875602 - kFix_1_961570560, kFix_1_175875602 };
+static const int kOddZ4[2] = { kFix_1_175875602, kFix_1_175875602 - kFix_0_390180644 };
+static const int kOdd7[2] = { kFix_0_298631336 - kFix_0_899976223, -kFix_0_899976223 };
+static const int kOdd1[2] = { -kFix_0_899976223, kFix_1_501321110 - kFix_0_899976223 };
+static const int kOdd5[2] = { kFix_2_053119869 - kFix_2_562915447, -kFix_2_562915447 };
+static const int kOdd3[2] = { -kFix_2_562915447, kFix_3_072711026 - kFix_2_562915447 };
+
+// fdct leaves each 1D coefficient scaled by sqrt(8) like we do, except for
+// coefficients 2, 3, 5 and 6, which it scales by two.
+static double FDCTScale(size_t k) {
+  return (k == 2 || k == 3 || k == 5 || k == 6) ? std::sqrt(0.5) : 1.0;
+}
+
+#ifdef GENTC_HAVE_SSE2
+
+// Products of 16 bit lanes that are kept in 32 bits
+struct WideLanes {
+  __m128i lo;
+  __m128i hi;
+};
+
+static inline WideLanes MulAdd(__m128i a, __m128i b, const int c[2]) {
+  const __m128i coeffs = _mm_set1_epi32(
+    static_cast<int>((static_cast<uint32_t>(c[1]) << 16) | (static_cast<uint32_t>(c[0]) & 0xFFFF)));
+
+  WideLanes result;
+  result.lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), coeffs);
+  result.hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), coeffs);
+  return result;
+}
+
+static inline WideLanes Add(const WideLanes &a, const WideLanes &b) {
+  WideLanes result;
+  result.lo = _mm_add_epi32(a.lo, b.lo);
+  result.hi = _mm_add_epi32(a.hi, b.hi);
+  return result;
+}
+
+static inline __m128i Descale(const WideLanes &x, int shift) {
+  const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  return _mm_packs_epi32(_mm_sra_epi32(_mm_add_epi32(x.lo, round), count),
+                         _mm_sra_epi32(_mm_add_epi32(x.hi, round), count));
+}
+
+static inline void Transpose8x8(__m128i r[8]) {
+  const __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+  const __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+  const __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+  const __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+  const __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+  const __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+  const __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+  const __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+  const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+  const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+  const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+  const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+  const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+  const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+  const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+  const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+  r[0] = _mm_unpacklo_epi64(b0, b4);
+  r[1] = _mm_unpackhi_epi64(b0, b4);
+  r[2] = _mm_unpacklo_epi64(b1, b5);
+  r[3] = _mm_unpackhi_epi64(b1, b5);
+  r[4] = _mm_unpacklo_epi64(b2, b6);
+  r[5] = _mm_unpackhi_epi64(b2, b6);
+  r[6] = _mm_unpacklo_epi64(b3, b7);
+  r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// Transforms the eight columns of the rows in d at once.
+static inline void DCTPass(__m128i d[8], bool first_pass) {
+  const __m128i tmp0 = _mm_add_epi16(d[0], d[7]);
+  const __m128i tmp7 = _mm_sub_epi16(d[0], d[7]);
+  const __m128i tmp1 = _mm_add_epi16(d[1], d[6]);
+  const __m128i tmp6 = _mm_sub_epi16(d[1], d[6]);
+  const __m128i tmp2 = _mm_add_epi16(d[2], d[5]);
+  const __m128i tmp5 = _mm_sub_epi16(d[2], d[5]);
+  const __m128i tmp3 = _mm_add_epi16(d[3], d[4]);
+  const __m128i tmp4 = _mm_sub_epi16(d[3], d[4]);
+
+  const __m128i tmp10 = _mm_add_epi16(tmp0, tmp3);
+  const __m128i tmp13 = _mm_sub_epi16(tmp0, tmp3);
+  const __m128i tmp11 = _mm_add_epi16(tmp1, tmp2);
+  const __m128i tmp12 = _mm_sub_epi16(tmp1, tmp2);
+
+  const int shift = first_pass ? kConstBits - kPass1Bits : kConstBits + kPass1Bits;
+  if (first_pass) {
+    d[0] = _mm_slli_epi16(_mm_add_epi16(tmp10, tmp11), kPass1Bits);
+    d[4] = _mm_slli_epi16(_mm_sub_epi16(tmp10, tmp11), kPass1Bits);
+  } else {
+    const __m128i round = _mm_set1_epi16(1 << (kPass1Bits - 1));
+    d[0] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(tmp10, round), tmp11), kPass1Bits);
+    d[4] = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(tmp10, tmp11), round), kPass1Bits);
+  }
+
+  d[2] = Descale(MulAdd(tmp13, tmp12, kEven2), shift);
+  d[6] = Descale(MulAdd(tmp13, tmp12, kEven6), shift);
+
+  const __m128i z3 = _mm_add_epi16(tmp4, tmp6);
+  const __m128i z4 = _mm_add_epi16(tmp5, tmp7);
+  const WideLanes rz3 = MulAdd(z3, z4, kOddZ3);
+  const WideLanes rz4 = MulAdd(z3, z4, kOddZ4);
+
+  d[7] = Descale(Add(MulAdd(tmp4, tmp7, kOdd7), rz3), shift);
+  d[1] = Descale(Add(MulAdd(tmp4, tmp7, kOdd1), rz4), shift);
+  d[5] = Descale(Add(MulAdd(tmp5, tmp6, kOdd5), rz4), shift);
+  d[3] = Descale(Add(MulAdd(tmp5, tmp6, kOdd3), rz3), shift);
+}
+
+// Computes sign(c) * trunc(|c| * (r + 1) / 2^16) for each lane.
+static inline __m128i Quantize(__m128i c, __m128i r) {
+  const __m128i sign = _mm_srai_epi16(c, 15);
+  const __m128i abs_c = _mm_sub_epi16(_mm_xor_si128(c, sign), sign);
+
+  const __m128i prod_lo16 = _mm_mullo_epi16(abs_c, r);
+  const __m128i prod_hi16 = _mm_mulhi_epu16(abs_c, r);
+  const __m128i zero = _mm_setzero_si128();
+
+  __m128i lo = _mm_unpacklo_epi16(prod_lo16, prod_hi16);
+  __m128i hi = _mm_unpackhi_epi16(prod_lo16, prod_hi16);
+  lo = _mm_srli_epi32(_mm_add_epi32(lo, _mm_unpacklo_epi16(abs_c, zero)), 16);
+  hi = _mm_srli_epi32(_mm_add_epi32(hi, _mm_unpackhi_epi16(abs_c, zero)), 16);
+
+  const __m128i q = _mm_packs_epi32(lo, hi);
+  return _mm_sub_epi16(_mm_xor_si128(q, sign), sign);
+}
+
+#else  // GENTC_HAVE_SSE2
+
+static inline int Descale(int x, int shift) {
+  return (x + (1 << (shift - 1))) >> shift;
+}
+
+// Same as the SIMD version, on the eight values d[0], d[stride], ...
+static void DCTPass(int16_t *d, size_t stride, bool first_pass) {
+  const int tmp0 = d[0 * stride] + d[7 * stride];
+  const int tmp7 = d[0 * stride] - d[7 * stride];
+  const int tmp1 = d[1 * stride] + d[6 * stride];
+  const int tmp6 = d[1 * stride] - d[6 * stride];
+  const int tmp2 = d[2 * stride] + d[5 * stride];
+  const int tmp5 = d[2 * stride] - d[5 * stride];
+  const int tmp3 = d[3 * stride] + d[4 * stride];
+  const int tmp4 = d[3 * stride] - d[4 * stride];
+
+  const int tmp10 = tmp0 + tmp3;
+  const int tmp13 = tmp0 - tmp3;
+  const int tmp11 = tmp1 + tmp2;
+  const int tmp12 = tmp1 - tmp2;
+
+  const int shift = first_pass ? kConstBits - kPass1Bits : kConstBits + kPass1Bits;
+  if (first_pass) {
+    d[0 * stride] = static_cast<int16_t>((tmp10 + tmp11) << kPass1Bits);
+    d[4 * stride] = static_cast<int16_t>((tmp10 - tmp11) << kPass1Bits);
+  } else {
+    d[0 * stride] = static_cast<int16_t>(Descale(tmp10 + tmp11, kPass1Bits));
+    d[4 * stride] = static_cast<int16_t>(Descale(tmp10 - tmp11, kPass1Bits));
+  }
+
+  d[2 * stride] = static_cast<int16_t>(Descale(tmp13 * kEven2[0] + tmp12 * kEven2[1], shift));
+  d[6 * stride] = static_cast<int16_t>(Descale(tmp13 * kEven6[0] + tmp12 * kEven6[1], shift));
+
+  const int z3 = tmp4 + tmp6;
+  const int z4 = tmp5 + tmp7;
+  const int rz3 = z3 * kOddZ3[0] + z4 * kOddZ3[1];
+  const int rz4 = z3 * kOddZ4[0] + z4 * kOddZ4[1];
+
+  d[7 * stride] = static_cast<int16_t>(Descale(tmp4 * kOdd7[0] + tmp7 * kOdd7[1] + rz3, shift));
+  d[1 * stride] = static_cast<int16_t>(Descale(tmp4 * kOdd1[0] + tmp7 * kOdd1[1] + rz4, shift));
+  d[5 * stride] = static_cast<int16_t>(Descale(tmp5 * kOdd5[0] + tmp6 * kOdd5[1] + rz4, shift));
+  d[3 * stride] = static_cast<int16_t>(Descale(tmp5 * kOdd3[0] + tmp6 * kOdd3[1] + rz3, shift));
+}
+
+static inline int16_t Quantize(int16_t c, uint16_t r) {
+  const uint32_t abs_c = static_cast<uint32_t>(c < 0 ? -c : c);
+  const uint32_t q = std::min<uint32_t>((abs_c * (static_cast<uint32_t>(r) + 1)) >> 16, 32767);
+  return static_cast<int16_t>(c < 0 ? -static_cast<int>(q) : static_cast<int>(q));
+}
+
+#endif  // GENTC_HAVE_SSE2
+
+}  // namespace
+
+namespace GenTC {
+
+const std::array<uint32_t, 64> kJPEGLumaQuantization = {{
+  16, 11, 10, 16, 24, 40, 51, 61,
+  12, 12, 14, 19, 26, 58, 60, 55,
+  14, 13, 16, 24, 40, 57, 69, 56,
+  14, 17, 22, 29, 51, 87, 80, 62,
+  18, 22, 37, 56, 68, 109, 103, 77,
+  24, 35, 55, 64, 81, 104, 113, 92,
+  49, 64, 78, 87, 103, 121, 120, 101,
+  72, 92, 95, 98, 112, 100, 103, 99
+}};
+
+const std::array<uint32_t, 64> kJPEGChromaQuantization = {{
+  17, 18, 24, 47, 99, 99, 99, 99,
+  18, 21, 26, 66, 99, 99, 99, 99,
+  24, 26, 56, 99, 99, 99, 99, 99,
+  47, 66, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99
+}};
+
+DCTQuantization::DCTQuantization() {
+  std::array<uint32_t, 64> steps;
+  steps.fill(1);
+  *this = DCTQuantization(steps);
+}
+
+DCTQuantization::DCTQuantization(const std::array<uint32_t, 64> &steps) {
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < 8; ++x) {
+      const size_t idx = y * 8 + x;
+      assert(steps[idx] > 0);
+
+      const double r = 65536.0 * FDCTScale(y) * FDCTScale(x) / static_cast<double>(steps[idx]);
+      const double clamped = std::max(1.0, std::min(65536.0, std::floor(r + 0.5)));
+      _reciprocals[idx] = static_cast<uint16_t>(clamped - 1.0);
+      _steps[idx] = static_cast<uint16_t>(std::min<uint32_t>(steps[idx], 0xFFFF));
+    }
+  }
+}
+
+DCTQuantization DCTQuantization::Unscaled(const std::array<uint32_t, 64> &steps) {
+  DCTQuantization result(steps);
+  for (size_t idx = 0; idx < 64; ++idx) {
+    const uint32_t r = (65536 + steps[idx] - 1) / steps[idx];
+    result._reciprocals[idx] = static_cast<uint16_t>(r - 1);
+  }
+
+  return result;
+}
+
+void ForwardDCT8x8(const int16_t *src, size_t src_stride, int16_t center,
+                   const DCTQuantization &quantization,
+                   int16_t *dst, size_t dst_stride) {
+  // Centering the samples keeps every intermediate value in 16 bits. It
+  // only changes the DC coefficient, by 64 * center.
+  const int dc_offset = 64 * static_cast<int>(center);
+  const uint16_t *reciprocals = quantization.Reciprocals();
+
+#ifdef GENTC_HAVE_SSE2
+  const __m128i center_lanes = _mm_set1_epi16(center);
+  __m128i rows[8];
+  for (size_t y = 0; y < 8; ++y) {
+    const __m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + y * src_stride));
+    rows[y] = _mm_sub_epi16(row, center_lanes);
+  }
+
+  // Do all the columns at once, then all the rows at once. The transposes
+  // put the values of each row in the same lane of each register.
+  DCTPass(rows, true);
+  Transpose8x8(rows);
+  DCTPass(rows, false);
+  Transpose8x8(rows);
+
+  const int dc = _mm_extract_epi16(rows[0], 0);
+  rows[0] = _mm_insert_epi16(rows[0], static_cast<int16_t>(dc + dc_offset), 0);
+
+  for (size_t y = 0; y < 8; ++y) {
+    const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reciprocals + y * 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + y * dst_stride), Quantize(rows[y], r));
+  }
+#else
+  int16_t block[64];
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < 8; ++x) {
+      block[y * 8 + x] = static_cast<int16_t>(src[y * src_stride + x] - center);
+    }
+  }
+
+  for (size_t x = 0; x < 8; ++x) {
+    DCTPass(block + x, 8, true);
+  }
+
+  for (size_t y = 0; y < 8; ++y) {
+    DCTPass(block + y * 8, 1, false);
+  }
+
+  block[0] = static_cast<int16_t>(block[0] + dc_offset);
+
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < 8; ++x) {
+      dst[y * dst_stride + x] = Quantize(block[y * 8 + x], reciprocals[y * 8 + x]);
+    }
+  }
+#endif
+}
+
+void QuantizeBlock8x8(const int16_t *src, size_t src_stride,
+                      const DCTQuantization &quantization,
+                      int16_t *dst, size_t dst_stride) {
+  const uint16_t *reciprocals = quantization.Reciprocals();
+  for (size_t y = 0; y < 8; ++y) {
+#ifdef GENTC_HAVE_SSE2
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + y * src_stride));
+    const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reciprocals + y * 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + y * dst_stride), Quantize(c, r));
+#else
+    for (size_t x = 0; x < 8; ++x) {
+      dst[y * dst_stride + x] = Quantize(src[y * src_stride + x], reciprocals[y * 8 + x]);
+    }
+#endif
+  }
+}
+
+void DequantizeBlock8x8(const int16_t *src, size_t src_stride,
+                        const DCTQuantization &quantization,
+                        int16_t *dst, size_t dst_stride) {
+  const uint16_t *steps = quantization.Steps();
+  for (size_t y = 0; y < 8; ++y) {
+#ifdef GENTC_HAVE_SSE2
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + y * src_stride));
+    const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(steps + y * 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + y * dst_stride), _mm_mullo_epi16(c, s));
+#else
+    for (size_t x = 0; x < 8; ++x) {
+      const uint32_t c = static_cast<uint16_t>(src[y * src_stride + x]);
+      dst[y * dst_stride + x] = static_cast<int16_t>(static_cast<uint16_t>(c * steps[y * 8 + x]));
+    }
+#endif
+  }
+}
+
+}  // namespace GenTC
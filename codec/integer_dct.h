@@ -0,0 +1,67 @@
+#ifndef __TCAR_INTEGER_DCT_H__
+#define __TCAR_INTEGER_DCT_H__
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+
+namespace GenTC {
+
+// Quantization steps of an 8x8 block of DCT coefficients in row major order
+extern const std::array<uint32_t, 64> kJPEGLumaQuantization;
+extern const std::array<uint32_t, 64> kJPEGChromaQuantization;
+
+// The reciprocals of the quantization steps of an 8x8 block of DCT
+// coefficients. The integer DCT scales each coefficient a little
+// differently than fdct in fast_dct.h does, and that difference is folded
+// into the reciprocals too, so that quantizing costs a single multiply.
+class DCTQuantization {
+ public:
+  // Leaves the coefficients unquantized.
+  DCTQuantization();
+  explicit DCTQuantization(const std::array<uint32_t, 64> &steps);
+
+  // For coefficients that have already been transformed, such as the output
+  // of an unquantized ForwardDCT8x8. No scale is folded into the reciprocals,
+  // and they are rounded up so that quantizing matches integer division
+  // whenever |c| * step < 2^16.
+  static DCTQuantization Unscaled(const std::array<uint32_t, 64> &steps);
+
+  // Each coefficient c becomes trunc(c * (r + 1) / 2^16), where r is the
+  // reciprocal. Storing r instead of r + 1 lets a step of one fit in 16 bits.
+  const uint16_t *Reciprocals() const { return _reciprocals.data(); }
+
+  // The steps themselves, for dequantizing.
+  const uint16_t *Steps() const { return _steps.data(); }
+
+ private:
+  std::array<uint16_t, 64> _reciprocals;
+  std::array<uint16_t, 64> _steps;
+};
+
+// Transforms the rows and columns of the 8x8 block at src like fdct does,
+// divides each coefficient by its quantization step, and stores the results
+// truncated towards zero at dst. The strides are in values, not bytes. The
+// transform runs in 16 bit fixed point, so every sample minus center has to
+// be in [-128, 127]. Before truncation the coefficients are within about one
+// of the float transform.
+extern void ForwardDCT8x8(const int16_t *src, size_t src_stride, int16_t center,
+                          const DCTQuantization &quantization,
+                          int16_t *dst, size_t dst_stride);
+
+// Quantizes the 8x8 block of coefficients at src the same way that
+// ForwardDCT8x8 does, and stores the results at dst. The strides are in
+// values, not bytes, and src may equal dst.
+extern void QuantizeBlock8x8(const int16_t *src, size_t src_stride,
+                             const DCTQuantization &quantization,
+                             int16_t *dst, size_t dst_stride);
+
+// Multiplies each value of the 8x8 block at src by its quantization step,
+// wrapping around in 16 bits, and stores the results at dst.
+extern void DequantizeBlock8x8(const int16_t *src, size_t src_stride,
+                               const DCTQuantization &quantization,
+                               int16_t *dst, size_t dst_stride);
+
+}  // namespace GenTC
+
+#endif  // __TCAR_INTEGER_DCT_H__
@@ -2,9 +2,87 @@
 #define __TCAR_PIPELINE_H__
 
 #include <memory>
+#include <mutex>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
 
 namespace GenTC {
 
+// A pool of intermediate results that pipelines can hand back and reuse, so
+// that running the same pipeline over and over (e.g. once per plane of
+// every texture in a batch) doesn't allocate and page fault fresh buffers
+// for every stage. Buffers are kept by type, and only for types that some
+// unit has asked for, up to kMaxBuffersPerType each. Buffers come back with
+// whatever contents they had, so units need to resize and overwrite them.
+// Safe to share between threads.
+class PipelineContext {
+ public:
+  static const size_t kMaxBuffersPerType = 8;
+
+  PipelineContext() : _num_allocations(0) { }
+
+  template<typename T> std::unique_ptr<T> Acquire() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<std::unique_ptr<BufferBase> > &buffers = _buffers[std::type_index(typeid(T))];
+    if (buffers.empty()) {
+      _num_allocations++;
+      return std::unique_ptr<T>(new T);
+    }
+
+    std::unique_ptr<T> result = std::move(static_cast<Buffer<T> *>(buffers.back().get())->value);
+    buffers.pop_back();
+    return std::move(result);
+  }
+
+  template<typename T> void Recycle(std::unique_ptr<T> buffer) {
+    if (!buffer) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _buffers.find(std::type_index(typeid(T)));
+    if (it == _buffers.end() || it->second.size() >= kMaxBuffersPerType) {
+      return;
+    }
+
+    it->second.push_back(std::unique_ptr<BufferBase>(new Buffer<T>(std::move(buffer))));
+  }
+
+  // Number of buffers that Acquire couldn't find in the pool
+  size_t NumAllocations() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _num_allocations;
+  }
+
+ private:
+  struct BufferBase {
+    virtual ~BufferBase() { }
+  };
+
+  template<typename T> struct Buffer : public BufferBase {
+    explicit Buffer(std::unique_ptr<T> &&v) : value(std::move(v)) { }
+    std::unique_ptr<T> value;
+  };
+
+  mutable std::mutex _mutex;
+  std::unordered_map<std::type_index, std::vector<std::unique_ptr<BufferBase> > > _buffers;
+  size_t _num_allocations;
+};
+
+// Units may be run without a context, in which case these just allocate
+// and free as usual.
+template<typename T> std::unique_ptr<T> AcquireBuffer(PipelineContext *ctx) {
+  return ctx ? std::move(ctx->Acquire<T>()) : std::unique_ptr<T>(new T);
+}
+
+template<typename T> void RecycleBuffer(PipelineContext *ctx, std::unique_ptr<T> &&buffer) {
+  if (ctx) {
+    ctx->Recycle(std::move(buffer));
+  }
+}
+
 template<typename InType, typename OutType>
 class PipelineUnit {
  public:
@@ -17,6 +95,59 @@ class PipelineUnit {
   virtual ~PipelineUnit<InType, OutType>() { }
   
   virtual ReturnType Run(const ArgType &in) const = 0;
+
+  // Same as Run, but the input is no longer needed by anyone else. Units
+  // that can write their output over their input, or that can take their
+  // output from the context and give their input back to it, override this.
+  // The context may be null.
+  virtual ReturnType Consume(ArgType &&in, PipelineContext *ctx) const {
+    return Run(in);
+  }
+};
+
+// Units whose output is their input transformed in place. Running one of
+// these on a consumed input doesn't allocate anything.
+template<typename Type>
+class InPlacePipelineUnit : public PipelineUnit<Type, Type> {
+ public:
+  typedef PipelineUnit<Type, Type> Base;
+
+  virtual void RunInPlace(Type *inout) const = 0;
+
+  typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
+    typename Base::ReturnType result(new Type(*in));
+    RunInPlace(result.get());
+    return std::move(result);
+  }
+
+  typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                    PipelineContext *) const override {
+    RunInPlace(in.get());
+    return std::move(in);
+  }
+};
+
+// Units that can also run on one square tile of a plane at a time, because
+// each value of a tile in their output only depends on the same tile of
+// their input. Tiles are stored row major. See TiledPipeline.
+template<typename InElem, typename OutElem>
+class TileUnit {
+ public:
+  static const size_t kMaxTileDim = 32;
+
+  virtual ~TileUnit<InElem, OutElem>() { }
+
+  // Whether the unit can run on tile_dim x tile_dim tiles of a plane with
+  // the given dimensions
+  virtual bool SupportsTiles(size_t width, size_t height, size_t tile_dim) const {
+    return true;
+  }
+
+  // Whether the unit lays out its output one whole tile after another,
+  // rather than keeping each value where it was in the plane
+  virtual bool GroupsTiles() const { return false; }
+
+  virtual void RunTile(const InElem *in, OutElem *out, size_t tile_dim) const = 0;
 };
 
 template<typename InType, typename IntermediateType, typename OutType>
@@ -33,6 +164,11 @@ class PipelineChain : public PipelineUnit<InType, OutType> {
     return std::move(_second->Run(_first->Run(in)));
   }
 
+  typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                    PipelineContext *ctx) const override {
+    return std::move(_second->Consume(_first->Consume(std::move(in), ctx), ctx));
+  }
+
  private:
   std::unique_ptr<PipelineUnit<InType, IntermediateType> > _first;
   std::unique_ptr<PipelineUnit<IntermediateType, OutType> > _second;
@@ -43,7 +179,15 @@ class Pipeline {
  public:
   static std::unique_ptr<Pipeline<InType, OutType> >
     Create(std::unique_ptr<PipelineUnit<InType, OutType> > &&unit) {
-    return std::move(std::unique_ptr<Pipeline<InType, OutType> >(new Pipeline(std::move(unit))));
+    return std::move(Create(std::move(unit), std::make_shared<PipelineContext>()));
+  }
+
+  // Creates a pipeline that shares its buffers with other pipelines
+  static std::unique_ptr<Pipeline<InType, OutType> >
+    Create(std::unique_ptr<PipelineUnit<InType, OutType> > &&unit,
+           const std::shared_ptr<PipelineContext> &ctx) {
+    return std::move(std::unique_ptr<Pipeline<InType, OutType> >(
+      new Pipeline(std::move(unit), ctx)));
   }
 
   template<typename NextType> std::unique_ptr<Pipeline<InType, NextType> >
@@ -52,18 +196,36 @@ class Pipeline {
     typedef Pipeline<InType, NextType> OutputType;
     std::unique_ptr<typename ChainType::Base> chain =
       std::unique_ptr<typename ChainType::Base>(new ChainType(std::move(_alg), std::move(next)));
-    return std::move(OutputType::Create(std::move(chain)));
+    return std::move(OutputType::Create(std::move(chain), _ctx));
   }
 
   std::unique_ptr<OutType> Run(const std::unique_ptr<InType> &in) {
     return _alg->Run(in);
   }
 
+  // Runs the pipeline on an input that it's free to overwrite or recycle.
+  // Intermediate results go back into the pipeline's context as soon as
+  // the next unit is done with them, so at most two of them are alive at
+  // any time.
+  std::unique_ptr<OutType> Run(std::unique_ptr<InType> &&in) {
+    return _alg->Consume(std::move(in), _ctx.get());
+  }
+
+  // Hands a result of Run back to the pipeline to reuse its storage.
+  void Recycle(std::unique_ptr<OutType> &&out) {
+    _ctx->Recycle(std::move(out));
+  }
+
+  const std::shared_ptr<PipelineContext> &Context() const { return _ctx; }
+
  private:
-  Pipeline<InType, OutType>(std::unique_ptr<PipelineUnit<InType, OutType> > &&unit)
-    : _alg(std::move(unit)) { }
+  Pipeline<InType, OutType>(std::unique_ptr<PipelineUnit<InType, OutType> > &&unit,
+                            const std::shared_ptr<PipelineContext> &ctx)
+    : _alg(std::move(unit))
+    , _ctx(ctx) { }
 
   std::unique_ptr<PipelineUnit<InType, OutType> > _alg;
+  std::shared_ptr<PipelineContext> _ctx;
 };
 
 template<typename Type>
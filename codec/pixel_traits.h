@@ -6,6 +6,7 @@
 #include <cstdlib>
 #include <limits>
 #include <tuple>
+#include <type_traits>
 
 namespace GenTC {
 
@@ -191,56 +192,111 @@ struct ConvertUnsigned<SignedBits<NumBits> > {
 
 ////////////////////////////////////////////////////////////
 
+// Writes the bits used by each channel to a bit writer, e.g. an
+// ans::BufferedBitWriter.
 template <typename T>
 struct BitPacker {
-  static void pack(T p, uint8_t *dst, size_t *bit_offset) {
-    const int num_bits = static_cast<int>(BitsUsed<T>::value);
-    const uint64_t x = static_cast<uint64_t>(p);
-    uint8_t *byte_to_write = dst + (*bit_offset / 8);
-    int bits_to_write = static_cast<int>(num_bits);
-    while (bits_to_write > 0) {
-      const int local_offset = static_cast<int>(*bit_offset % 8);
-      const int bits_to_write_in_byte = static_cast<int>(8 - local_offset);
-
-      uint8_t bits = 0;
-      if (bits_to_write_in_byte >= bits_to_write) {
-        int shift = bits_to_write_in_byte - bits_to_write;
-        assert(shift < 8);
-        bits = static_cast<uint8_t>(x << shift);
-        *bit_offset += bits_to_write;
-      } else {
-        int shift = bits_to_write - bits_to_write_in_byte;
-        bits = static_cast<uint8_t>(x >> shift);
-        *bit_offset += bits_to_write_in_byte;
-      }
+  template <typename WriterTy>
+  static void pack(T p, WriterTy *w) {
+    w->WriteBits(static_cast<uint64_t>(p), static_cast<int>(BitsUsed<T>::value));
+  }
+};
 
-      assert(bits < (1 << bits_to_write_in_byte));
+template <typename T1, typename T2, typename T3>
+struct BitPacker<std::tuple<T1, T2, T3> > {
+  template <typename WriterTy>
+  static void pack(std::tuple<T1, T2, T3> p, WriterTy *w) {
+    BitPacker<T1>::pack(std::get<0>(p), w);
+    BitPacker<T2>::pack(std::get<1>(p), w);
+    BitPacker<T3>::pack(std::get<2>(p), w);
+  }
+};
 
-      *byte_to_write &= ~(((1 << bits_to_write_in_byte) - 1) - 1);
-      *byte_to_write |= bits;
+template <typename T1, typename T2, typename T3, typename T4>
+struct BitPacker<std::tuple<T1, T2, T3, T4> > {
+  template <typename WriterTy>
+  static void pack(std::tuple<T1, T2, T3, T4> p, WriterTy *w) {
+    BitPacker<T1>::pack(std::get<0>(p), w);
+    BitPacker<T2>::pack(std::get<1>(p), w);
+    BitPacker<T3>::pack(std::get<2>(p), w);
+    BitPacker<T4>::pack(std::get<3>(p), w);
+  }
+};
 
-      bits_to_write -= bits_to_write_in_byte;
-      ++byte_to_write;
-    }
+////////////////////////////////////////////////////////////
+
+// Converts pixels to and from the bits that they're packed into, with the
+// first channel in the most significant bits. Unlike going through a bit
+// writer one channel at a time, this doesn't branch on the values, so that
+// whole words of pixels can be packed and unpacked with shifts and masks.
+template <typename T>
+struct PixelBits {
+  static const size_t kNumBits = BitsUsed<T>::value;
+  static const uint64_t kMask = (kNumBits >= 64) ? ~0ULL : ((1ULL << (kNumBits & 63)) - 1);
+
+  static uint64_t pack(T p) {
+    return static_cast<uint64_t>(p) & kMask;
+  }
+
+  static T unpack(uint64_t x) {
+    return unpack(x, std::integral_constant<bool, IsSigned<T>::value>());
+  }
+
+ private:
+  static T unpack(uint64_t x, std::false_type) {
+    return static_cast<T>(x & kMask);
+  }
+
+  // Sign extend by moving the top bit into the sign bit and back
+  static T unpack(uint64_t x, std::true_type) {
+    static const size_t kUnusedBits = 64 - kNumBits;
+    return static_cast<T>(static_cast<int64_t>(x << kUnusedBits) >> kUnusedBits);
   }
 };
 
 template <typename T1, typename T2, typename T3>
-struct BitPacker<std::tuple<T1, T2, T3> > {
-  static void pack(std::tuple<T1, T2, T3> p, uint8_t *dst, size_t *bit_offset) {
-    BitPacker<T1>::pack(std::get<0>(p), dst, bit_offset);
-    BitPacker<T2>::pack(std::get<1>(p), dst, bit_offset);
-    BitPacker<T3>::pack(std::get<2>(p), dst, bit_offset);
+struct PixelBits<std::tuple<T1, T2, T3> > {
+  static const size_t kNumBits = BitsUsed<std::tuple<T1, T2, T3> >::value;
+  static_assert(kNumBits <= 64, "Pixel doesn't fit in a word!");
+
+  static uint64_t pack(const std::tuple<T1, T2, T3> &p) {
+    return (PixelBits<T1>::pack(std::get<0>(p)) << (PixelBits<T2>::kNumBits + PixelBits<T3>::kNumBits))
+      | (PixelBits<T2>::pack(std::get<1>(p)) << PixelBits<T3>::kNumBits)
+      | PixelBits<T3>::pack(std::get<2>(p));
+  }
+
+  static std::tuple<T1, T2, T3> unpack(uint64_t x) {
+    return std::make_tuple(
+      PixelBits<T1>::unpack(x >> (PixelBits<T2>::kNumBits + PixelBits<T3>::kNumBits)),
+      PixelBits<T2>::unpack(x >> PixelBits<T3>::kNumBits),
+      PixelBits<T3>::unpack(x));
   }
 };
 
 template <typename T1, typename T2, typename T3, typename T4>
-struct BitPacker<std::tuple<T1, T2, T3, T4> > {
-  static void pack(std::tuple<T1, T2, T3, T4> p, uint8_t *dst, size_t *bit_offset) {
-    BitPacker<T1>::pack(std::get<0>(p), dst, bit_offset);
-    BitPacker<T2>::pack(std::get<1>(p), dst, bit_offset);
-    BitPacker<T3>::pack(std::get<2>(p), dst, bit_offset);
-    BitPacker<T4>::pack(std::get<3>(p), dst, bit_offset);
+struct PixelBits<std::tuple<T1, T2, T3, T4> > {
+  static const size_t kNumBits = BitsUsed<std::tuple<T1, T2, T3, T4> >::value;
+  static_assert(kNumBits <= 64, "Pixel doesn't fit in a word!");
+
+  static uint64_t pack(const std::tuple<T1, T2, T3, T4> &p) {
+    static const size_t kShift1 = PixelBits<T2>::kNumBits + PixelBits<T3>::kNumBits + PixelBits<T4>::kNumBits;
+    static const size_t kShift2 = PixelBits<T3>::kNumBits + PixelBits<T4>::kNumBits;
+    static const size_t kShift3 = PixelBits<T4>::kNumBits;
+    return (PixelBits<T1>::pack(std::get<0>(p)) << kShift1)
+      | (PixelBits<T2>::pack(std::get<1>(p)) << kShift2)
+      | (PixelBits<T3>::pack(std::get<2>(p)) << kShift3)
+      | PixelBits<T4>::pack(std::get<3>(p));
+  }
+
+  static std::tuple<T1, T2, T3, T4> unpack(uint64_t x) {
+    static const size_t kShift1 = PixelBits<T2>::kNumBits + PixelBits<T3>::kNumBits + PixelBits<T4>::kNumBits;
+    static const size_t kShift2 = PixelBits<T3>::kNumBits + PixelBits<T4>::kNumBits;
+    static const size_t kShift3 = PixelBits<T4>::kNumBits;
+    return std::make_tuple(
+      PixelBits<T1>::unpack(x >> kShift1),
+      PixelBits<T2>::unpack(x >> kShift2),
+      PixelBits<T3>::unpack(x >> kShift3),
+      PixelBits<T4>::unpack(x));
   }
 };
 
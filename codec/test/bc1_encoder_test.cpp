@@ -0,0 +1,170 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <array>
+#include <random>
+#include <vector>
+
+#include "bc1_encoder.h"
+
+#define STB_DXT_IMPLEMENTATION
+#include "stb_dxt.h"
+
+static void DecodeColor(uint16_t c, int out[3]) {
+  const int r = (c >> 11) & 0x1F;
+  const int g = (c >> 5) & 0x3F;
+  const int b = c & 0x1F;
+  out[0] = (r << 3) | (r >> 2);
+  out[1] = (g << 2) | (g >> 4);
+  out[2] = (b << 3) | (b >> 2);
+}
+
+static uint32_t BlockError(const uint8_t pixels[48], uint64_t block) {
+  const uint16_t c0 = static_cast<uint16_t>(block & 0xFFFF);
+  const uint16_t c1 = static_cast<uint16_t>((block >> 16) & 0xFFFF);
+
+  int palette[4][3];
+  DecodeColor(c0, palette[0]);
+  DecodeColor(c1, palette[1]);
+  for (int i = 0; i < 3; ++i) {
+    if (c0 > c1) {
+      palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+      palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    } else {
+      palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+      palette[3][i] = 0;
+    }
+  }
+
+  uint32_t err = 0;
+  for (int i = 0; i < 16; ++i) {
+    const int idx = static_cast<int>((block >> (32 + 2 * i)) & 0x3);
+    for (int j = 0; j < 3; ++j) {
+      const int d = static_cast<int>(pixels[3 * i + j]) - palette[idx][j];
+      err += static_cast<uint32_t>(d * d);
+    }
+  }
+
+  return err;
+}
+
+// Blocks with a gradient between two random colors plus some noise, which
+// is roughly what blocks of natural images look like.
+static std::vector<uint8_t> RandomBlocks(size_t num_blocks, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<int> color(0, 255);
+  std::uniform_int_distribution<int> noise(-8, 8);
+
+  std::vector<uint8_t> result(48 * num_blocks);
+  for (size_t b = 0; b < num_blocks; ++b) {
+    int a[3], c[3];
+    for (int j = 0; j < 3; ++j) {
+      a[j] = color(gen);
+      c[j] = color(gen);
+    }
+
+    for (int i = 0; i < 16; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        int x = (a[j] * (15 - i) + c[j] * i) / 15 + noise(gen);
+        result[48 * b + 3 * i + j] = static_cast<uint8_t>(std::max(0, std::min(255, x)));
+      }
+    }
+  }
+
+  return std::move(result);
+}
+
+TEST(BC1Encoder, EncodesSolidBlocksWithinRounding) {
+  // Every solid gray block plus a few colors that aren't on the 565 grid
+  std::vector<std::array<uint8_t, 3> > colors;
+  for (int i = 0; i < 256; ++i) {
+    colors.push_back({ { static_cast<uint8_t>(i), static_cast<uint8_t>(i), static_cast<uint8_t>(i) } });
+  }
+  colors.push_back({ { 13, 200, 77 } });
+  colors.push_back({ { 255, 1, 129 } });
+
+  for (const auto &c : colors) {
+    uint8_t pixels[48];
+    for (int i = 0; i < 16; ++i) {
+      pixels[3 * i + 0] = c[0];
+      pixels[3 * i + 1] = c[1];
+      pixels[3 * i + 2] = c[2];
+    }
+
+    for (int q = 0; q < GenTC::kNumBC1Qualities; ++q) {
+      const uint64_t block = GenTC::CompressBC1Block(pixels, static_cast<GenTC::EBC1Quality>(q));
+
+      // The interpolants can hit every 8-bit value up to the rounding of the
+      // decoder, so each channel of each pixel should be off by at most one.
+      EXPECT_LE(BlockError(pixels, block), 16U * 3U)
+        << "Color: " << int(c[0]) << ", " << int(c[1]) << ", " << int(c[2]);
+    }
+  }
+}
+
+TEST(BC1Encoder, HigherQualitiesHaveLessError) {
+  const size_t kNumBlocks = 2000;
+  const std::vector<uint8_t> pixels = RandomBlocks(kNumBlocks, 0);
+
+  uint64_t errors[GenTC::kNumBC1Qualities] = { 0 };
+  uint64_t stb_error = 0;
+  for (size_t b = 0; b < kNumBlocks; ++b) {
+    const uint8_t *blk = pixels.data() + 48 * b;
+    for (int q = 0; q < GenTC::kNumBC1Qualities; ++q) {
+      const uint64_t block = GenTC::CompressBC1Block(blk, static_cast<GenTC::EBC1Quality>(q));
+
+      // We should never go into three color mode for blocks that aren't solid
+      EXPECT_GT(block & 0xFFFF, (block >> 16) & 0xFFFF);
+      errors[q] += BlockError(blk, block);
+    }
+
+    uint8_t rgba[64];
+    for (int i = 0; i < 16; ++i) {
+      rgba[4 * i + 0] = blk[3 * i + 0];
+      rgba[4 * i + 1] = blk[3 * i + 1];
+      rgba[4 * i + 2] = blk[3 * i + 2];
+      rgba[4 * i + 3] = 0xFF;
+    }
+
+    uint64_t stb_block;
+    stb_compress_dxt_block(reinterpret_cast<unsigned char *>(&stb_block), rgba, 0, STB_DXT_HIGHQUAL);
+    stb_error += BlockError(blk, stb_block);
+  }
+
+  EXPECT_LE(errors[GenTC::eBC1Quality_PCA], errors[GenTC::eBC1Quality_RangeFit]);
+  EXPECT_LE(errors[GenTC::eBC1Quality_ClusterFit], errors[GenTC::eBC1Quality_PCA]);
+
+  // The default quality should be at least as good as what we used before
+  EXPECT_LE(errors[GenTC::eBC1Quality_PCA], stb_error);
+}
+
+TEST(BC1Encoder, CompressesImagesDeterministically) {
+  const int kWidth = 64;
+  const int kHeight = 48;
+
+  // Lay out the random blocks as an image
+  const std::vector<uint8_t> blocks = RandomBlocks((kWidth / 4) * (kHeight / 4), 1);
+  std::vector<uint8_t> img(kWidth * kHeight * 3);
+  for (int by = 0; by < kHeight / 4; ++by) {
+    for (int bx = 0; bx < kWidth / 4; ++bx) {
+      const uint8_t *blk = blocks.data() + 48 * (by * (kWidth / 4) + bx);
+      for (int row = 0; row < 4; ++row) {
+        std::copy(blk + 12 * row, blk + 12 * (row + 1),
+                  img.begin() + ((by * 4 + row) * kWidth + bx * 4) * 3);
+      }
+    }
+  }
+
+  for (int q = 0; q < GenTC::kNumBC1Qualities; ++q) {
+    const GenTC::EBC1Quality quality = static_cast<GenTC::EBC1Quality>(q);
+    const std::vector<uint64_t> serial = GenTC::CompressBC1(img.data(), kWidth, kHeight, quality);
+    ASSERT_EQ(blocks.size() / 48, serial.size());
+
+    for (size_t b = 0; b < serial.size(); ++b) {
+      EXPECT_EQ(GenTC::CompressBC1Block(blocks.data() + 48 * b, quality), serial[b]);
+    }
+
+    GenTC::ThreadPool pool(4);
+    EXPECT_EQ(serial, GenTC::CompressBC1(img.data(), kWidth, kHeight, quality, &pool));
+  }
+}
@@ -0,0 +1,127 @@
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <vector>
+
+#include "encoder.h"
+#include "cpu_decoder.h"
+#include "dxt_image.h"
+#include "test_config.h"
+
+TEST(GenTC, CanCompressAndDecompressImageOnCPU) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+
+  GenTC::ThreadPool pool(4);
+  GenTC::DXTImage cmp_img = std::move(GenTC::DecompressDXTCPU(cmp_data, pool));
+
+  ASSERT_EQ(dxt_img.Width(), cmp_img.Width());
+  ASSERT_EQ(dxt_img.Height(), cmp_img.Height());
+
+  const std::vector<GenTC::PhysicalDXTBlock> &blks = dxt_img.PhysicalBlocks();
+  ASSERT_EQ(blks.size(), cmp_img.PhysicalBlocks().size());
+  for (size_t i = 0; i < blks.size(); ++i) {
+    EXPECT_EQ(blks[i].dxt_block, cmp_img.PhysicalBlocks()[i].dxt_block) << "Index: " << i;
+  }
+}
+
+TEST(GenTC, CPUDecoderDoesNotDependOnThreadCount) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+
+  GenTC::ThreadPool serial(1);
+  GenTC::ThreadPool parallel(8);
+  std::vector<uint8_t> a = GenTC::DecompressDXTBufferCPU(cmp_data, serial);
+  std::vector<uint8_t> b = GenTC::DecompressDXTBufferCPU(cmp_data, parallel);
+  EXPECT_EQ(a, b);
+}
+
+TEST(GenTC, CPUDecoderRejectsMalformedStreams) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  const std::vector<uint8_t> cmp_data = std::move(GenTC::CompressDXT(dxt_img));
+
+  GenTC::ThreadPool pool(4);
+  ASSERT_FALSE(GenTC::DecompressDXTBufferCPU(cmp_data, pool).empty());
+
+  GenTC::GenTCHeader hdr;
+  hdr.LoadFrom(cmp_data.data());
+
+  // Reassembles the stream with a different header
+  auto with_header = [&cmp_data](const GenTC::GenTCHeader &h) {
+    std::vector<uint8_t> data(cmp_data);
+    memcpy(data.data(), &h, sizeof(h));
+    return data;
+  };
+
+  std::vector<std::vector<uint8_t> > bad_data;
+
+  // Nothing but the header, and truncated streams
+  bad_data.push_back(std::vector<uint8_t>(cmp_data.begin(), cmp_data.begin() + sizeof(hdr)));
+  bad_data.push_back(std::vector<uint8_t>(cmp_data.begin(), cmp_data.begin() + cmp_data.size() / 2));
+  bad_data.push_back(std::vector<uint8_t>(cmp_data.begin(), cmp_data.end() - 1));
+
+  // Bad dimensions
+  {
+    GenTC::GenTCHeader h = hdr;
+    h.width = 0;
+    bad_data.push_back(with_header(h));
+
+    h = hdr;
+    h.height += 4;
+    bad_data.push_back(with_header(h));
+
+    h = hdr;
+    h.width = 1 << 30;
+    h.height = 1 << 30;
+    bad_data.push_back(with_header(h));
+  }
+
+  // Bad stream sizes
+  {
+    GenTC::GenTCHeader h = hdr;
+    h.y_cmp_sz = 0xFFFFFFFF;
+    bad_data.push_back(with_header(h));
+
+    h = hdr;
+    h.palette_bytes += 4;
+    bad_data.push_back(with_header(h));
+
+    h = hdr;
+    h.indices_sz = 4;
+    bad_data.push_back(with_header(h));
+  }
+
+  // Corrupted group offsets and frequencies
+  {
+    const size_t ans_start = sizeof(hdr) + 4 * 512;
+
+    std::vector<uint8_t> data(cmp_data);
+    memset(data.data() + ans_start, 0xFF, 4);
+    bad_data.push_back(data);
+
+    data = cmp_data;
+    memset(data.data() + ans_start, 0, 4);
+    bad_data.push_back(data);
+
+    data = cmp_data;
+    data[sizeof(hdr)] ^= 0x01;
+    bad_data.push_back(data);
+  }
+
+  for (size_t i = 0; i < bad_data.size(); ++i) {
+    EXPECT_TRUE(GenTC::DecompressDXTBufferCPU(bad_data[i], pool).empty()) << "Index: " << i;
+
+    GenTC::DXTImage img = std::move(GenTC::DecompressDXTCPU(bad_data[i], pool));
+    EXPECT_EQ(0, img.Width()) << "Index: " << i;
+    EXPECT_EQ(0, img.Height()) << "Index: " << i;
+  }
+}
@@ -0,0 +1,142 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "dxt_image.h"
+#include "test_config.h"
+
+TEST(DXTImage, PaletteIndicesReproduceBlocks) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  const std::vector<GenTC::PhysicalDXTBlock> &blks = dxt_img.PhysicalBlocks();
+  const std::vector<uint8_t> &idx_diffs = dxt_img.IndexDiffs();
+  const std::vector<uint8_t> palette = dxt_img.PaletteData();
+  ASSERT_EQ(blks.size(), idx_diffs.size());
+  ASSERT_EQ(0U, palette.size() % 4);
+
+  int last_index = 0;
+  for (size_t i = 0; i < blks.size(); ++i) {
+    last_index += static_cast<int>(idx_diffs[i]) - 128;
+    ASSERT_LE(0, last_index);
+    ASSERT_GT(static_cast<int>(palette.size() / 4), last_index);
+
+    uint32_t interpolation;
+    memcpy(&interpolation, palette.data() + 4 * last_index, sizeof(interpolation));
+    EXPECT_EQ(blks[i].interpolation, interpolation) << "Index: " << i;
+  }
+}
+
+TEST(DXTImage, ReencodeIsDeterministic) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  // The bands of blocks shouldn't depend on the threads that search them
+  GenTC::ThreadPool pool(4);
+  GenTC::DXTImage a(fname.c_str(), NULL);
+  GenTC::DXTImage b(fname.c_str(), NULL, GenTC::eBC1Quality_PCA, &pool);
+  EXPECT_EQ(a.IndexDiffs(), b.IndexDiffs());
+  EXPECT_EQ(a.PaletteData(), b.PaletteData());
+
+  ASSERT_EQ(a.PhysicalBlocks().size(), b.PhysicalBlocks().size());
+  for (size_t i = 0; i < a.PhysicalBlocks().size(); ++i) {
+    EXPECT_EQ(a.PhysicalBlocks()[i].dxt_block, b.PhysicalBlocks()[i].dxt_block);
+  }
+}
+
+TEST(DXTImage, CountsBlocks) {
+  typedef std::pair<uint32_t, size_t> Res;
+
+  // Enough blocks to be split across several threads, with a few ties in
+  // the counts to make sure that they're ordered consistently.
+  std::vector<GenTC::PhysicalDXTBlock> blocks(300000);
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    blocks[i].ep1 = static_cast<uint16_t>(i);
+    blocks[i].ep2 = 0;
+    blocks[i].interpolation = static_cast<uint32_t>((i * 7919) % 1013) * 0x01010101U;
+  }
+
+  std::vector<Res> expected;
+  for (const auto &b : blocks) {
+    bool found = false;
+    for (auto &r : expected) {
+      if (r.first == b.interpolation) {
+        r.second++;
+        found = true;
+        break;
+      }
+    }
+
+    if (!found) {
+      expected.push_back(std::make_pair(b.interpolation, 1));
+    }
+  }
+
+  std::sort(expected.begin(), expected.end(), [](const Res &a, const Res &b) {
+    return std::greater<size_t>()(a.second, b.second);
+  });
+
+  EXPECT_EQ(expected, GenTC::CountBlocks(blocks));
+
+  GenTC::ThreadPool pool(4);
+  EXPECT_EQ(expected, GenTC::CountBlocks(blocks, &pool));
+}
+
+TEST(DXTImage, QuantizesIndexPalette) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  const size_t num_unique = GenTC::CountBlocks(dxt_img.PhysicalBlocks()).size();
+
+  GenTC::DXTImage quantized = dxt_img;
+  quantized.QuantizeIndexPalette(64, 1234);
+  EXPECT_LT(GenTC::CountBlocks(quantized.PhysicalBlocks()).size(), num_unique);
+  EXPECT_LT(quantized.PaletteData().size(), dxt_img.PaletteData().size());
+
+  // The palette and index deltas still describe every block
+  const std::vector<uint8_t> palette = quantized.PaletteData();
+  int last_index = 0;
+  for (size_t i = 0; i < quantized.PhysicalBlocks().size(); ++i) {
+    last_index += static_cast<int>(quantized.IndexDiffs()[i]) - 128;
+    ASSERT_LE(0, last_index);
+    ASSERT_GT(static_cast<int>(palette.size() / 4), last_index);
+
+    uint32_t interpolation;
+    memcpy(&interpolation, palette.data() + 4 * last_index, sizeof(interpolation));
+    ASSERT_EQ(quantized.PhysicalBlocks()[i].interpolation, interpolation) << "Index: " << i;
+  }
+
+  // Same seed, same result, no matter how many threads do the work
+  GenTC::ThreadPool pool(4);
+  GenTC::DXTImage again = dxt_img;
+  again.QuantizeIndexPalette(64, 1234, &pool);
+  EXPECT_EQ(quantized.PaletteData(), again.PaletteData());
+  EXPECT_EQ(quantized.IndexDiffs(), again.IndexDiffs());
+}
+
+TEST(DXTImage, ReassignIndicesIsDeterministic) {
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage serial(fname.c_str(), NULL);
+  GenTC::DXTImage orig = serial;
+  serial.ReassignIndices(10);
+
+  // The blocks propose their new indices in parallel, but the result should
+  // be the same as doing everything on one thread.
+  for (int num_threads : { 1, 3, 8 }) {
+    GenTC::ThreadPool pool(num_threads);
+    GenTC::DXTImage parallel = orig;
+    parallel.ReassignIndices(10, &pool);
+
+    ASSERT_EQ(serial.PhysicalBlocks().size(), parallel.PhysicalBlocks().size());
+    for (size_t i = 0; i < serial.PhysicalBlocks().size(); ++i) {
+      ASSERT_EQ(serial.PhysicalBlocks()[i].dxt_block, parallel.PhysicalBlocks()[i].dxt_block)
+        << "Threads: " << num_threads << ", Index: " << i;
+    }
+  }
+}
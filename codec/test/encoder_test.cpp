@@ -0,0 +1,37 @@
+#include "gtest/gtest.h"
+
+#include <vector>
+
+#include "encoder.h"
+#include "dxt_image.h"
+#include "test_config.h"
+
+static std::vector<uint8_t> CompressWithThreads(const GenTC::DXTImage &dxt_img,
+                                                GenTC::EncoderOptions opts,
+                                                unsigned num_threads) {
+  opts.num_threads = num_threads;
+  return std::move(GenTC::CompressDXT(dxt_img, opts));
+}
+
+TEST(Encoder, CompressionDoesNotDependOnThreadCount) {
+  // The encoder runs its stages as a task graph, but neither the order in
+  // which the tasks finish nor the number of threads should show up in the
+  // output. With one thread every stage runs in order.
+  std::string dir(CODEC_TEST_DIR);
+  std::string fname = dir + std::string("/") + std::string("test1.png");
+
+  GenTC::DXTImage dxt_img(fname.c_str(), NULL);
+  GenTC::EncoderOptions opts;
+  std::vector<uint8_t> serial = CompressWithThreads(dxt_img, opts, 1);
+  ASSERT_FALSE(serial.empty());
+
+  for (unsigned num_threads : { 2, 4, 8 }) {
+    EXPECT_EQ(serial, CompressWithThreads(dxt_img, opts, num_threads))
+      << "Number of threads: " << num_threads;
+  }
+
+  // Quantizing the index palette shares the encoder's pool too
+  opts.max_palette_entries = 256;
+  serial = CompressWithThreads(dxt_img, opts, 1);
+  EXPECT_EQ(serial, CompressWithThreads(dxt_img, opts, 8));
+}
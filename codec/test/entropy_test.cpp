@@ -0,0 +1,266 @@
+#include "gtest/gtest.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "ans.h"
+#include "entropy.h"
+#include "pipeline.h"
+
+TEST(Entropy, CanEncodeAndDecodeBytes) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+
+  const size_t num_groups = 5;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<uint8_t> > symbols(new std::vector<uint8_t>);
+  symbols->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    // Skew the distribution so that the groups compress to different sizes
+    int r = rand() % 100;
+    symbols->push_back(static_cast<uint8_t>(r < 80 ? 128 + (r % 3) : rand() % 256));
+  }
+
+  auto encoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols));
+  auto decoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Decoder(ans::ocl::kNumEncodedSymbols));
+
+  auto encoded = encoder->Run(symbols);
+  ASSERT_LT(encoded->size(), symbols->size());
+
+  auto decoded = decoder->Run(encoded);
+  ASSERT_EQ(decoded->size(), symbols->size());
+  for (size_t i = 0; i < symbols->size(); ++i) {
+    EXPECT_EQ(decoded->at(i), symbols->at(i)) << "Index: " << i;
+  }
+}
+
+TEST(Entropy, CanEncodeAndDecodeTANSBytes) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+
+  const size_t num_groups = 3;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<uint8_t> > symbols(new std::vector<uint8_t>);
+  symbols->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    int r = rand() % 100;
+    symbols->push_back(static_cast<uint8_t>(r < 80 ? 128 + (r % 3) : rand() % 256));
+  }
+
+  auto encoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols, nullptr, ans::eType_tANS));
+  auto decoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Decoder(ans::ocl::kNumEncodedSymbols, ans::eType_tANS));
+
+  auto encoded = encoder->Run(symbols);
+  ASSERT_LT(encoded->size(), symbols->size());
+
+  auto decoded = decoder->Run(encoded);
+  ASSERT_EQ(decoded->size(), symbols->size());
+  for (size_t i = 0; i < symbols->size(); ++i) {
+    EXPECT_EQ(decoded->at(i), symbols->at(i)) << "Index: " << i;
+  }
+}
+
+TEST(Entropy, ParallelByteEncodingMatchesSerial) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+
+  const size_t num_groups = 37;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<uint8_t> > symbols(new std::vector<uint8_t>);
+  symbols->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    int r = rand() % 100;
+    symbols->push_back(static_cast<uint8_t>(r < 70 ? 60 + (r % 5) : rand() % 256));
+  }
+
+  GenTC::ThreadPool pool(4);
+  auto serial = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols));
+  auto parallel = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols, &pool));
+
+  auto expected = serial->Run(symbols);
+  auto encoded = parallel->Run(symbols);
+  EXPECT_EQ(*expected, *encoded);
+}
+
+TEST(Entropy, CanDecodeOtherGroupSizes) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+
+  // Only groups of kNumEncodedSymbols per thread go through the SIMD decoder
+  const size_t symbols_per_thread = 16;
+  const size_t num_groups = 4;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * symbols_per_thread;
+
+  std::unique_ptr<std::vector<uint8_t> > symbols(new std::vector<uint8_t>);
+  symbols->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    int r = rand() % 100;
+    symbols->push_back(static_cast<uint8_t>(r < 80 ? 128 + (r % 3) : rand() % 256));
+  }
+
+  auto encoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(symbols_per_thread));
+  auto decoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Decoder(symbols_per_thread));
+
+  auto encoded = encoder->Run(symbols);
+  auto decoded = decoder->Run(encoded);
+  EXPECT_EQ(*symbols, *decoded);
+}
+
+TEST(Entropy, RejectsCorruptByteStreams) {
+  srand(0);
+
+  const size_t num_groups = 3;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<uint8_t> > symbols(new std::vector<uint8_t>);
+  symbols->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    symbols->push_back(static_cast<uint8_t>(rand() % 16));
+  }
+
+  auto encoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols));
+  auto decoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Decoder(ans::ocl::kNumEncodedSymbols));
+
+  const std::unique_ptr<std::vector<uint8_t> > encoded = encoder->Run(symbols);
+  ASSERT_EQ(*symbols, *decoder->Run(encoded));
+
+  // The offsets to the end of each group follow the 256 16-bit frequencies
+  const size_t offsets_start = 512;
+  uint32_t offsets[num_groups];
+  memcpy(offsets, encoded->data() + offsets_start, sizeof(offsets));
+
+  std::vector<std::vector<uint8_t> > corrupt;
+
+  // Cut off in the middle of the offsets and in the middle of the groups
+  corrupt.push_back(std::vector<uint8_t>(encoded->begin(), encoded->begin() + offsets_start + 6));
+  corrupt.push_back(std::vector<uint8_t>(encoded->begin(), encoded->end() - 64));
+
+  // Offsets that never reach the end of the stream, go past it, or go back
+  std::vector<uint32_t> bad_offsets[] = {
+    { 0, 0, 0 },
+    { offsets[0], offsets[1], offsets[2] + 4 },
+    { offsets[1], offsets[0], offsets[2] },
+    { offsets[0], offsets[0] + 2, offsets[2] },
+  };
+  for (const auto &bad : bad_offsets) {
+    std::vector<uint8_t> stream = *encoded;
+    memcpy(stream.data() + offsets_start, bad.data(), sizeof(offsets));
+    corrupt.push_back(stream);
+  }
+
+  // Frequencies that don't add up to the table size
+  std::vector<uint8_t> bad_counts = *encoded;
+  bad_counts[0] ^= 0x80;
+  corrupt.push_back(bad_counts);
+
+  for (const auto &stream : corrupt) {
+    std::unique_ptr<std::vector<uint8_t> > in(new std::vector<uint8_t>(stream));
+    std::unique_ptr<std::vector<uint8_t> > decoded;
+    EXPECT_DEBUG_DEATH(decoded = decoder->Run(in), "");
+#ifdef NDEBUG
+    EXPECT_TRUE(decoded->empty());
+#endif
+  }
+}
+
+TEST(Entropy, RejectsTruncatedGroups) {
+  srand(0);
+
+  const size_t num_groups = 2;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * ans::ocl::kNumEncodedSymbols;
+
+  std::unique_ptr<std::vector<uint8_t> > symbols(new std::vector<uint8_t>);
+  symbols->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    symbols->push_back(static_cast<uint8_t>(rand() % 16));
+  }
+
+  auto encoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Encoder(ans::ocl::kNumEncodedSymbols));
+  auto decoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ByteEncoder::Decoder(ans::ocl::kNumEncodedSymbols));
+
+  const std::unique_ptr<std::vector<uint8_t> > encoded = encoder->Run(symbols);
+  ASSERT_EQ(*symbols, *decoder->Run(encoded));
+
+  const size_t offsets_start = 512;
+  uint32_t offsets[num_groups];
+  memcpy(offsets, encoded->data() + offsets_start, sizeof(offsets));
+
+  // Remove words from the front of the first group and fix up the offsets so
+  // that they still pass validation. Only the group's decoder can notice that
+  // it runs out of words.
+  for (uint32_t removed : { 4, 16, 256 }) {
+    std::unique_ptr<std::vector<uint8_t> > truncated(new std::vector<uint8_t>(*encoded));
+    const size_t group_start = offsets_start + sizeof(offsets);
+    truncated->erase(truncated->begin() + group_start, truncated->begin() + group_start + removed);
+    for (size_t i = 0; i < num_groups; ++i) {
+      const uint32_t offset = offsets[i] - removed;
+      memcpy(truncated->data() + offsets_start + 4 * i, &offset, sizeof(offset));
+    }
+
+    std::unique_ptr<std::vector<uint8_t> > decoded;
+    EXPECT_DEBUG_DEATH(decoded = decoder->Run(truncated), "");
+#ifdef NDEBUG
+    EXPECT_TRUE(decoded->empty()) << "Removed bytes: " << removed;
+#endif
+  }
+}
+
+TEST(Entropy, CanEncodeAndDecodeShorts) {
+  // Make sure to initialize the random number generator
+  // with a known value in order to make it deterministic
+  srand(0);
+
+  const size_t symbols_per_thread = 16;
+  const size_t num_groups = 3;
+  const size_t num_symbols =
+    num_groups * ans::ocl::kThreadsPerEncodingGroup * symbols_per_thread;
+
+  std::unique_ptr<std::vector<int16_t> > vals(new std::vector<int16_t>);
+  vals->reserve(num_symbols);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    int r = rand() % 100;
+    if (r < 5) {
+      vals->push_back(static_cast<int16_t>(200 + rand() % 1000));
+    } else {
+      vals->push_back(static_cast<int16_t>((rand() % 21) - 10));
+    }
+  }
+
+  auto encoder = GenTC::Pipeline<std::vector<int16_t>, std::vector<uint8_t> >
+    ::Create(GenTC::ShortEncoder::Encoder(symbols_per_thread));
+  auto decoder = GenTC::Pipeline<std::vector<uint8_t>, std::vector<int16_t> >
+    ::Create(GenTC::ShortEncoder::Decoder(symbols_per_thread));
+
+  auto encoded = encoder->Run(vals);
+  auto decoded = decoder->Run(encoded);
+  ASSERT_EQ(decoded->size(), vals->size());
+  for (size_t i = 0; i < vals->size(); ++i) {
+    EXPECT_EQ(decoded->at(i), vals->at(i)) << "Index: " << i;
+  }
+}
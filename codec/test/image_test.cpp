@@ -1,8 +1,13 @@
 #include <cstdint>
+#include <random>
 
+#include "entropy.h"
 #include "image.h"
+#include "image_processing.h"
 #include "image_utils.h"
 #include "pipeline.h"
+#include "thread_pool.h"
+#include "tiled_pipeline.h"
 #include "gtest/gtest.h"
 
 TEST(Image, CanReadPackedBytes) {
@@ -111,6 +116,49 @@ TEST(Image, CanRepackRGB565) {
   }
 }
 
+// Packs and unpacks random pixels of every count up to a few groups of
+// words, and checks that they match going one channel at a time through the
+// bit writer and reader.
+template<typename T>
+static void CheckPixelPacking(uint32_t seed) {
+  typedef GenTC::PixelTraits::PixelBits<T> Bits;
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<uint64_t> dist;
+
+  for (size_t count = 0; count <= 70; ++count) {
+    std::vector<T> pixels;
+    for (size_t i = 0; i < count; ++i) {
+      pixels.push_back(Bits::unpack(dist(gen)));
+    }
+
+    GenTC::ImageBitWriter w;
+    for (const auto &p : pixels) {
+      GenTC::PixelTraits::BitPacker<T>::pack(p, &w);
+    }
+    const std::vector<uint8_t> expected = w.GetData();
+
+    const std::vector<uint8_t> packed = GenTC::PackPixels(pixels.data(), count);
+    ASSERT_EQ(expected, packed) << "Count: " << count;
+
+    std::vector<T> unpacked(count);
+    GenTC::UnpackPixels(packed.data(), packed.size(), unpacked.data(), count);
+    ASSERT_EQ(pixels, unpacked) << "Count: " << count;
+  }
+}
+
+TEST(Image, PacksWholeWordsOfPixels) {
+  CheckPixelPacking<GenTC::UnsignedBits<1> >(0);
+  CheckPixelPacking<GenTC::UnsignedBits<2> >(1);
+  CheckPixelPacking<GenTC::UnsignedBits<5> >(2);
+  CheckPixelPacking<GenTC::UnsignedBits<6> >(3);
+  CheckPixelPacking<GenTC::SignedBits<7> >(4);
+  CheckPixelPacking<uint8_t>(5);
+  CheckPixelPacking<int16_t>(6);
+  CheckPixelPacking<GenTC::RGB565>(7);
+  CheckPixelPacking<GenTC::YCoCg667>(8);
+  CheckPixelPacking<GenTC::RGBA>(9);
+}
+
 TEST(Image, CanSplitImage) {
   std::unique_ptr<GenTC::RGBImage> img(new GenTC::RGBImage(4, 4,
   { 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0x00, 
@@ -142,3 +190,266 @@ TEST(Image, CanSplitImage) {
     }
   }
 }
+
+typedef GenTC::Image<GenTC::UnsignedBits<6> > SixBitImage;
+typedef GenTC::Pipeline<SixBitImage, std::vector<uint8_t> > EndpointPipeline;
+
+static std::unique_ptr<SixBitImage> RandomSixBitImage(size_t w, size_t h, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<uint64_t> dist(0, 63);
+
+  std::unique_ptr<SixBitImage> img(new SixBitImage(w, h));
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      img->SetAt(x, y, dist(gen));
+    }
+  }
+  return std::move(img);
+}
+
+// The same units that the encoder runs on each endpoint plane
+static std::unique_ptr<EndpointPipeline> CreateEndpointPipeline(size_t width) {
+  return std::move(GenTC::Pipeline<SixBitImage, GenTC::Image<int8_t> >
+    ::Create(GenTC::FWavelet2D<GenTC::UnsignedBits<6>, 32>::New())
+    ->Chain(GenTC::MakeUnsigned<int8_t>::New())
+    ->Chain(GenTC::Linearize<uint8_t>::New())
+    ->Chain(GenTC::RearrangeStream<uint8_t>::New(width, 32))
+    ->Chain(GenTC::ReducePrecision<uint8_t, uint8_t>::New()));
+}
+
+TEST(Image, ConsumingPipelineMatchesCopyingPipeline) {
+  const size_t kWidth = 128;
+  const size_t kHeight = 64;
+  auto pipeline = CreateEndpointPipeline(kWidth);
+
+  for (uint32_t seed = 0; seed < 3; ++seed) {
+    std::unique_ptr<SixBitImage> img = RandomSixBitImage(kWidth, kHeight, seed);
+    std::unique_ptr<std::vector<uint8_t> > expected = pipeline->Run(img);
+    ASSERT_EQ(kWidth * kHeight, expected->size());
+
+    std::unique_ptr<std::vector<uint8_t> > consumed = pipeline->Run(std::move(img));
+    EXPECT_EQ(*expected, *consumed);
+
+    pipeline->Recycle(std::move(consumed));
+  }
+}
+
+TEST(Image, PipelineReusesRecycledBuffers) {
+  const size_t kWidth = 64;
+  const size_t kHeight = 64;
+  auto pipeline = CreateEndpointPipeline(kWidth);
+
+  std::unique_ptr<std::vector<uint8_t> > first =
+    pipeline->Run(RandomSixBitImage(kWidth, kHeight, 0));
+  pipeline->Recycle(std::move(first));
+  const size_t num_allocations = pipeline->Context()->NumAllocations();
+  EXPECT_GT(num_allocations, 0U);
+
+  // Once every intermediate buffer has been handed back, running the
+  // pipeline again shouldn't need any new ones.
+  for (uint32_t seed = 1; seed < 4; ++seed) {
+    std::unique_ptr<std::vector<uint8_t> > result =
+      pipeline->Run(RandomSixBitImage(kWidth, kHeight, seed));
+    ASSERT_EQ(kWidth * kHeight, result->size());
+    pipeline->Recycle(std::move(result));
+  }
+
+  EXPECT_EQ(num_allocations, pipeline->Context()->NumAllocations());
+}
+
+TEST(Image, InPlaceUnitsReuseTheirInput) {
+  auto rearrange = GenTC::RearrangeStream<uint8_t>::New(4, 2);
+
+  std::unique_ptr<std::vector<uint8_t> > in(new std::vector<uint8_t>(16));
+  for (size_t i = 0; i < in->size(); ++i) {
+    (*in)[i] = static_cast<uint8_t>(i);
+  }
+
+  const std::vector<uint8_t> expected = { 0, 1, 4, 5, 2, 3, 6, 7, 8, 9, 12, 13, 10, 11, 14, 15 };
+  EXPECT_EQ(expected, *rearrange->Run(in));
+
+  const std::vector<uint8_t> *storage = in.get();
+  std::unique_ptr<std::vector<uint8_t> > out = rearrange->Consume(std::move(in), nullptr);
+  EXPECT_EQ(storage, out.get());
+  EXPECT_EQ(expected, *out);
+}
+
+static std::unique_ptr<GenTC::TiledPipeline<SixBitImage, std::vector<uint8_t> > >
+CreateTiledEndpointPipeline(size_t width, size_t block_length) {
+  return std::move(GenTC::TiledPipeline<SixBitImage, GenTC::Image<int8_t> >
+    ::Create(GenTC::FWavelet2D<GenTC::UnsignedBits<6>, 32>::New())
+    ->Chain(GenTC::MakeUnsigned<int8_t>::New())
+    ->Chain(GenTC::Linearize<uint8_t>::New())
+    ->Chain(GenTC::RearrangeStream<uint8_t>::New(width, block_length))
+    ->Chain(GenTC::ReducePrecision<uint8_t, uint8_t>::New()));
+}
+
+TEST(Image, TiledPipelineMatchesPipeline) {
+  const size_t kWidth = 128;
+  const size_t kHeight = 96;
+  auto pipeline = CreateEndpointPipeline(kWidth);
+  auto tiled = CreateTiledEndpointPipeline(kWidth, 32);
+  EXPECT_TRUE(tiled->IsTiled());
+
+  GenTC::ThreadPool pool(4);
+  auto serial_unit = tiled->Build(32, nullptr);
+  auto parallel_unit = tiled->Build(32, &pool);
+
+  for (uint32_t seed = 0; seed < 3; ++seed) {
+    std::unique_ptr<SixBitImage> img = RandomSixBitImage(kWidth, kHeight, seed);
+    std::unique_ptr<std::vector<uint8_t> > expected = pipeline->Run(img);
+
+    EXPECT_EQ(*expected, *serial_unit->Run(img));
+    EXPECT_EQ(*expected, *parallel_unit->Run(img));
+
+    GenTC::PipelineContext ctx;
+    EXPECT_EQ(*expected, *parallel_unit->Consume(std::move(img), &ctx));
+  }
+}
+
+template<typename T>
+class CopyImage : public GenTC::PipelineUnit<GenTC::Image<T>, GenTC::Image<T> > {
+ public:
+  typedef GenTC::PipelineUnit<GenTC::Image<T>, GenTC::Image<T> > Base;
+  static std::unique_ptr<Base> New() { return std::unique_ptr<Base>(new CopyImage<T>); }
+  typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
+    return std::move(typename Base::ReturnType(new GenTC::Image<T>(*in)));
+  }
+};
+
+TEST(Image, TiledPipelineFallsBackToWholeImages) {
+  const size_t kWidth = 64;
+  const size_t kHeight = 64;
+  std::unique_ptr<SixBitImage> img = RandomSixBitImage(kWidth, kHeight, 0);
+
+  // Rearranging into blocks that aren't the size of the tiles can't be done
+  // one tile at a time.
+  auto pipeline = GenTC::Pipeline<SixBitImage, GenTC::Image<int8_t> >
+    ::Create(GenTC::FWavelet2D<GenTC::UnsignedBits<6>, 32>::New())
+    ->Chain(GenTC::MakeUnsigned<int8_t>::New())
+    ->Chain(GenTC::Linearize<uint8_t>::New())
+    ->Chain(GenTC::RearrangeStream<uint8_t>::New(kWidth, 16))
+    ->Chain(GenTC::ReducePrecision<uint8_t, uint8_t>::New());
+  auto tiled = CreateTiledEndpointPipeline(kWidth, 16);
+  EXPECT_EQ(*pipeline->Run(img), *tiled->Build(32, nullptr)->Run(img));
+
+  // Neither can units that don't know about tiles
+  auto untiled = GenTC::TiledPipeline<SixBitImage, GenTC::Image<int8_t> >
+    ::Create(GenTC::FWavelet2D<GenTC::UnsignedBits<6>, 32>::New())
+    ->Chain(CopyImage<int8_t>::New())
+    ->Chain(GenTC::MakeUnsigned<int8_t>::New())
+    ->Chain(GenTC::Linearize<uint8_t>::New())
+    ->Chain(GenTC::RearrangeStream<uint8_t>::New(kWidth, 32))
+    ->Chain(GenTC::ReducePrecision<uint8_t, uint8_t>::New());
+  EXPECT_FALSE(untiled->IsTiled());
+  EXPECT_EQ(*CreateEndpointPipeline(kWidth)->Run(img), *untiled->Build(32, nullptr)->Run(img));
+}
+
+TEST(Image, TiledPipelineOnlyGroupsTilesOnce) {
+  const size_t kWidth = 128;
+  const size_t kHeight = 64;
+  std::unique_ptr<SixBitImage> img = RandomSixBitImage(kWidth, kHeight, 0);
+
+  // Rearranging an already rearranged stream moves the tiles around again,
+  // which running each tile through the chain can't do.
+  for (size_t block_length : { 32, 16 }) {
+    auto pipeline = GenTC::Pipeline<SixBitImage, GenTC::Image<int8_t> >
+      ::Create(GenTC::FWavelet2D<GenTC::UnsignedBits<6>, 32>::New())
+      ->Chain(GenTC::MakeUnsigned<int8_t>::New())
+      ->Chain(GenTC::Linearize<uint8_t>::New())
+      ->Chain(GenTC::RearrangeStream<uint8_t>::New(kWidth, 32))
+      ->Chain(GenTC::RearrangeStream<uint8_t>::New(kWidth, block_length));
+    auto tiled = GenTC::TiledPipeline<SixBitImage, GenTC::Image<int8_t> >
+      ::Create(GenTC::FWavelet2D<GenTC::UnsignedBits<6>, 32>::New())
+      ->Chain(GenTC::MakeUnsigned<int8_t>::New())
+      ->Chain(GenTC::Linearize<uint8_t>::New())
+      ->Chain(GenTC::RearrangeStream<uint8_t>::New(kWidth, 32))
+      ->Chain(GenTC::RearrangeStream<uint8_t>::New(kWidth, block_length));
+    EXPECT_EQ(*pipeline->Run(img), *tiled->Build(32, nullptr)->Run(img))
+      << "Block length: " << block_length;
+  }
+}
+
+static std::unique_ptr<GenTC::RGB565Image> RandomRGB565Image(size_t w, size_t h, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<uint64_t> five_bits(0, 31);
+  std::uniform_int_distribution<uint64_t> six_bits(0, 63);
+
+  std::unique_ptr<GenTC::RGB565Image> img(new GenTC::RGB565Image(w, h));
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      img->SetAt(x, y, GenTC::RGB565(five_bits(gen), six_bits(gen), five_bits(gen)));
+    }
+  }
+  return std::move(img);
+}
+
+TEST(Image, CanSplitPlanarImageWithoutCopying) {
+  const size_t kWidth = 48;
+  const size_t kHeight = 20;
+  std::unique_ptr<GenTC::RGB565Image> img = RandomRGB565Image(kWidth, kHeight, 0);
+
+  auto ycocg = GenTC::Pipeline<GenTC::RGB565Image, GenTC::PlanarYCoCg667Image>
+    ::Create(GenTC::RGB565toYCoCg667::New())->Run(img);
+  ASSERT_EQ(kWidth, ycocg->Width());
+  ASSERT_EQ(kHeight, ycocg->Height());
+
+  // The conversion is lossless
+  auto rgb = GenTC::Pipeline<GenTC::PlanarYCoCg667Image, GenTC::RGB565Image>
+    ::Create(GenTC::YCoCg667toRGB565::New())->Run(ycocg);
+  EXPECT_EQ(img->GetPixels(), rgb->GetPixels());
+
+  auto planes = GenTC::YCoCg667Splitter::New()->Run(ycocg);
+  const GenTC::PlanarYCoCg667Image &planar = *ycocg;
+  EXPECT_EQ(planar.Plane<0>().Data(), std::get<0>(*planes)->Data());
+  EXPECT_EQ(planar.Plane<1>().Data(), std::get<1>(*planes)->Data());
+  EXPECT_EQ(planar.Plane<2>().Data(), std::get<2>(*planes)->Data());
+
+  for (size_t y = 0; y < kHeight; ++y) {
+    for (size_t x = 0; x < kWidth; ++x) {
+      GenTC::YCoCg667 pixel = ycocg->GetAt(x, y);
+      EXPECT_EQ(std::get<0>(pixel), std::get<0>(*planes)->GetAt(x, y));
+      EXPECT_EQ(std::get<1>(pixel), std::get<1>(*planes)->GetAt(x, y));
+      EXPECT_EQ(std::get<2>(pixel), std::get<2>(*planes)->GetAt(x, y));
+    }
+  }
+
+  // Writing to a plane shows up in the pixels of the image
+  ycocg->Plane<2>().SetAt(3, 4, GenTC::SignedBits<7>(-17));
+  EXPECT_EQ(-17, std::get<2>(ycocg->GetAt(3, 4)));
+  EXPECT_EQ(-17, std::get<2>(*planes)->GetAt(3, 4));
+}
+
+TEST(Image, TiledPipelineRunsOnViews) {
+  const size_t kWidth = 128;
+  const size_t kHeight = 64;
+  std::unique_ptr<SixBitImage> img = RandomSixBitImage(kWidth, kHeight, 0);
+
+  // Put the image in the middle plane so that it doesn't start the allocation
+  typedef std::tuple<GenTC::UnsignedBits<6>, GenTC::UnsignedBits<6>, GenTC::UnsignedBits<6> > Pixel666;
+  GenTC::PlanarImage<Pixel666> planar(kWidth, kHeight);
+  for (size_t y = 0; y < kHeight; ++y) {
+    for (size_t x = 0; x < kWidth; ++x) {
+      planar.Plane<1>().SetAt(x, y, img->GetAt(x, y));
+    }
+  }
+
+  typedef GenTC::ImageView<const GenTC::UnsignedBits<6> > SixBitView;
+  const GenTC::PlanarImage<Pixel666> &const_planar = planar;
+  std::unique_ptr<std::vector<uint8_t> > expected = CreateEndpointPipeline(kWidth)->Run(img);
+
+  GenTC::ThreadPool pool(4);
+  auto tiled = CreateTiledEndpointPipeline(kWidth, 32);
+  auto unit = tiled->Build<SixBitView>(32, &pool);
+  std::unique_ptr<SixBitView> view(new SixBitView(const_planar.Plane<1>()));
+  EXPECT_EQ(*expected, *unit->Run(view));
+
+  GenTC::PipelineContext ctx;
+  EXPECT_EQ(*expected, *unit->Consume(std::move(view), &ctx));
+
+  // Views that can't be tiled get copied into an image
+  auto untiled = CreateTiledEndpointPipeline(kWidth, 16);
+  auto untiled_unit = untiled->Build<SixBitView>(32, nullptr);
+  view.reset(new SixBitView(const_planar.Plane<1>()));
+  EXPECT_EQ(*untiled->Build(32, nullptr)->Run(img), *untiled_unit->Run(view));
+}
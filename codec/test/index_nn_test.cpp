@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+
+#include <random>
+#include <vector>
+
+#include "index_nn.h"
+
+static uint32_t NaiveOrderDistance(uint32_t a, uint32_t b) {
+  // The indices are ordered like 0, 3, 1, 2
+  static const int idx_to_order[4] = { 0, 3, 1, 2 };
+
+  uint32_t dist = 0;
+  for (int i = 0; i < 16; ++i) {
+    int x = idx_to_order[(a >> (2 * i)) & 0x3];
+    int y = idx_to_order[(b >> (2 * i)) & 0x3];
+    dist += static_cast<uint32_t>((x - y) * (x - y));
+  }
+
+  return dist;
+}
+
+static size_t NaiveNearest(const std::vector<uint32_t> &words, uint32_t query) {
+  size_t best = 0;
+  for (size_t i = 1; i < words.size(); ++i) {
+    if (NaiveOrderDistance(words[i], query) < NaiveOrderDistance(words[best], query)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+TEST(IndexNN, ComputesOrderDistance) {
+  // Every pair of single pixel indices
+  for (uint32_t a = 0; a < 4; ++a) {
+    for (uint32_t b = 0; b < 4; ++b) {
+      EXPECT_EQ(NaiveOrderDistance(a, b),
+                GenTC::OrderDistance(GenTC::IndicesToOrders(a), GenTC::IndicesToOrders(b)))
+        << "a: " << a << ", b: " << b;
+    }
+  }
+
+  EXPECT_EQ(16U * 9U, GenTC::OrderDistance(GenTC::IndicesToOrders(0x00000000),
+                                           GenTC::IndicesToOrders(0x55555555)));
+
+  std::mt19937 gen(0);
+  for (int i = 0; i < 10000; ++i) {
+    const uint32_t a = static_cast<uint32_t>(gen());
+    const uint32_t b = static_cast<uint32_t>(gen());
+    ASSERT_EQ(NaiveOrderDistance(a, b),
+              GenTC::OrderDistance(GenTC::IndicesToOrders(a), GenTC::IndicesToOrders(b)));
+  }
+}
+
+static void TestNearest(size_t num_words) {
+  std::mt19937 gen(static_cast<uint32_t>(num_words));
+  std::vector<uint32_t> words(num_words);
+  for (auto &w : words) {
+    w = static_cast<uint32_t>(gen());
+  }
+
+  // Add some duplicates to check that ties go to the first word
+  words.push_back(words[num_words / 2]);
+  words.push_back(words[0]);
+
+  GenTC::IndexNearestNeighbors nn(words);
+  ASSERT_EQ(words.size(), nn.Size());
+
+  for (size_t i = 0; i < words.size(); ++i) {
+    ASSERT_EQ(NaiveNearest(words, words[i]), nn.Nearest(words[i]));
+  }
+
+  for (int i = 0; i < 1000; ++i) {
+    // Queries near existing words as well as random ones
+    uint32_t query = static_cast<uint32_t>(gen());
+    if (i & 1) {
+      query = words[query % words.size()] ^ (1U << (query >> 27));
+    }
+
+    ASSERT_EQ(NaiveNearest(words, query), nn.Nearest(query)) << "Query: " << query;
+  }
+}
+
+TEST(IndexNN, FindsNearestInSmallSets) {
+  TestNearest(1);
+  TestNearest(17);
+  TestNearest(200);
+}
+
+TEST(IndexNN, FindsNearestInLargeSets) {
+  TestNearest(300);
+  TestNearest(5000);
+}
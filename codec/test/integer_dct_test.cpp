@@ -0,0 +1,212 @@
+#include "gtest/gtest.h"
+
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "fast_dct.h"
+#include "image_processing.h"
+#include "integer_dct.h"
+
+// What ForwardDCT used to compute: fdct on the rows and columns in floating
+// point, followed by dividing by the quantization steps.
+static std::array<float, 64> ReferenceDCT(const int16_t *block, const std::array<uint32_t, 64> &steps) {
+  float tmp[64];
+  for (size_t i = 0; i < 64; ++i) {
+    tmp[i] = static_cast<float>(block[i]);
+  }
+
+  for (size_t y = 0; y < 8; ++y) {
+    GenTC::fdct(tmp + y * 8, tmp + y * 8);
+  }
+
+  std::array<float, 64> result;
+  for (size_t x = 0; x < 8; ++x) {
+    float col[8];
+    for (size_t y = 0; y < 8; ++y) {
+      col[y] = tmp[y * 8 + x];
+    }
+
+    GenTC::fdct(col, col);
+    for (size_t y = 0; y < 8; ++y) {
+      result[y * 8 + x] = col[y] / static_cast<float>(steps[y * 8 + x]);
+    }
+  }
+
+  return result;
+}
+
+// Random blocks of eight bit samples, plus the blocks with the largest
+// coefficients that eight bit samples can produce.
+static std::vector<std::array<int16_t, 64> > TestBlocks() {
+  std::vector<std::array<int16_t, 64> > blocks;
+
+  std::array<int16_t, 64> b;
+  b.fill(0);
+  blocks.push_back(b);
+  b.fill(255);
+  blocks.push_back(b);
+
+  for (size_t i = 0; i < 64; ++i) {
+    b[i] = ((i / 8 + i % 8) % 2) ? 255 : 0;
+  }
+  blocks.push_back(b);
+
+  for (size_t i = 0; i < 64; ++i) {
+    b[i] = (i % 8 < 4) ? 255 : 0;
+  }
+  blocks.push_back(b);
+
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> dist(0, 255);
+  for (int n = 0; n < 2000; ++n) {
+    for (size_t i = 0; i < 64; ++i) {
+      b[i] = static_cast<int16_t>(dist(gen));
+    }
+    blocks.push_back(b);
+  }
+
+  return std::move(blocks);
+}
+
+// Both transforms round differently and then truncate, so without
+// quantization they can be two apart.
+static void ExpectMatchesReference(const std::array<uint32_t, 64> &steps, int tolerance) {
+  const GenTC::DCTQuantization quantization(steps);
+  for (const auto &block : TestBlocks()) {
+    int16_t result[64];
+    GenTC::ForwardDCT8x8(block.data(), 8, 128, quantization, result, 8);
+
+    const std::array<float, 64> expected = ReferenceDCT(block.data(), steps);
+    for (size_t i = 0; i < 64; ++i) {
+      EXPECT_LE(std::abs(static_cast<int>(result[i]) - static_cast<int>(expected[i])), tolerance)
+        << "Coefficient " << i << ": " << result[i] << " vs " << expected[i];
+    }
+  }
+}
+
+TEST(IntegerDCT, MatchesFloatTransform) {
+  std::array<uint32_t, 64> steps;
+  steps.fill(1);
+  ExpectMatchesReference(steps, 2);
+}
+
+TEST(IntegerDCT, QuantizesLikeFloatTransform) {
+  ExpectMatchesReference(GenTC::kJPEGLumaQuantization, 1);
+  ExpectMatchesReference(GenTC::kJPEGChromaQuantization, 1);
+
+  std::array<uint32_t, 64> steps;
+  for (size_t i = 0; i < 64; ++i) {
+    steps[i] = static_cast<uint32_t>(8 + 37 * i);
+  }
+  ExpectMatchesReference(steps, 1);
+}
+
+TEST(IntegerDCT, HandlesStridesAndCenters) {
+  const size_t kStride = 13;
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<int> dist(-32, 31);
+
+  // Signed six bit samples don't need to be centered
+  std::vector<int16_t> src(8 * kStride, 0x7FFF);
+  int16_t block[64];
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < 8; ++x) {
+      block[y * 8 + x] = src[y * kStride + x] = static_cast<int16_t>(dist(gen));
+    }
+  }
+
+  const GenTC::DCTQuantization quantization(GenTC::kJPEGLumaQuantization);
+  int16_t expected[64];
+  GenTC::ForwardDCT8x8(block, 8, 0, quantization, expected, 8);
+
+  std::vector<int16_t> dst(8 * kStride, 0x7FFF);
+  GenTC::ForwardDCT8x8(src.data(), kStride, 0, quantization, dst.data(), kStride);
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < kStride; ++x) {
+      if (x < 8) {
+        EXPECT_EQ(expected[y * 8 + x], dst[y * kStride + x]);
+      } else {
+        EXPECT_EQ(0x7FFF, dst[y * kStride + x]);
+      }
+    }
+  }
+
+  // Shifting the samples only changes the DC coefficient
+  int16_t shifted[64];
+  int16_t shifted_result[64];
+  for (size_t i = 0; i < 64; ++i) {
+    shifted[i] = block[i] + 100;
+  }
+  GenTC::ForwardDCT8x8(shifted, 8, 100, GenTC::DCTQuantization(), shifted_result, 8);
+  GenTC::ForwardDCT8x8(block, 8, 0, GenTC::DCTQuantization(), expected, 8);
+  for (size_t i = 1; i < 64; ++i) {
+    EXPECT_EQ(expected[i], shifted_result[i]);
+  }
+  EXPECT_EQ(expected[0] + 6400, shifted_result[0]);
+}
+
+TEST(IntegerDCT, FusesQuantizationIntoPipeline) {
+  const size_t kWidth = 32;
+  const size_t kHeight = 24;
+
+  std::mt19937 gen(2);
+  std::uniform_int_distribution<int> dist(0, 255);
+  std::unique_ptr<GenTC::AlphaImage> img(new GenTC::AlphaImage(kWidth, kHeight));
+  for (size_t y = 0; y < kHeight; ++y) {
+    for (size_t x = 0; x < kWidth; ++x) {
+      img->SetAt(x, y, static_cast<uint8_t>(dist(gen)));
+    }
+  }
+
+  auto fused = GenTC::ForwardDCT<GenTC::Alpha>::QuantizeJPEGLuma()->Run(img);
+  auto coeffs = GenTC::ForwardDCT<GenTC::Alpha>::New()->Run(img);
+  auto quantized = GenTC::Quantize8x8<int16_t>::QuantizeJPEGLuma()->Run(coeffs);
+
+  ASSERT_EQ(kWidth, fused->Width());
+  ASSERT_EQ(kHeight, fused->Height());
+  for (size_t y = 0; y < kHeight; ++y) {
+    for (size_t x = 0; x < kWidth; ++x) {
+      // Each block should be transformed on its own
+      int16_t block[64];
+      for (size_t i = 0; i < 64; ++i) {
+        block[i] = img->GetAt((x & ~7) + i % 8, (y & ~7) + i / 8);
+      }
+
+      const std::array<float, 64> expected = ReferenceDCT(block, GenTC::kJPEGLumaQuantization);
+      const int16_t coeff = fused->GetAt(x, y);
+      EXPECT_LE(std::abs(coeff - static_cast<int>(expected[(y % 8) * 8 + x % 8])), 1);
+      EXPECT_LE(std::abs(coeff - quantized->GetAt(x, y)), 1);
+    }
+  }
+}
+
+TEST(IntegerDCT, QuantizesImagesLikeIntegerDivision) {
+  const size_t kWidth = 16;
+  const size_t kHeight = 24;
+
+  // Small enough that the reciprocals match integer division exactly
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<int> dist(-500, 500);
+  std::unique_ptr<GenTC::SixteenBitImage> img(new GenTC::SixteenBitImage(kWidth, kHeight));
+  for (size_t y = 0; y < kHeight; ++y) {
+    for (size_t x = 0; x < kWidth; ++x) {
+      img->SetAt(x, y, static_cast<int16_t>(dist(gen)));
+    }
+  }
+
+  auto quantized = GenTC::Quantize8x8<int16_t>::QuantizeJPEGChroma()->Run(img);
+  auto dequantized = GenTC::Quantize8x8<int16_t>::DequantizeJPEGChroma()->Run(quantized);
+  ASSERT_EQ(kWidth, dequantized->Width());
+  ASSERT_EQ(kHeight, dequantized->Height());
+  for (size_t y = 0; y < kHeight; ++y) {
+    for (size_t x = 0; x < kWidth; ++x) {
+      const int step = static_cast<int>(GenTC::kJPEGChromaQuantization[(y % 8) * 8 + x % 8]);
+      const int expected = img->GetAt(x, y) / step;
+      EXPECT_EQ(expected, quantized->GetAt(x, y));
+      EXPECT_EQ(expected * step, dequantized->GetAt(x, y));
+    }
+  }
+}
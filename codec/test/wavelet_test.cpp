@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include <cmath>
+#include <random>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -183,3 +185,100 @@ TEST(Wavelet, Recursive2DWavelet) {
     EXPECT_EQ(out[i], xs[i]) << "At index: " << i;
   }
 }
+
+// The 2D transforms as a composition of the 1D ones: columns then rows going
+// forward, and rows then columns going backward.
+static std::vector<int16_t> Reference2D(const std::vector<int16_t> &xs, size_t dim, bool forward) {
+  std::vector<int16_t> result(xs);
+  std::vector<int16_t> in(dim), out(dim);
+
+  auto do_columns = [&]() {
+    for (size_t x = 0; x < dim; ++x) {
+      for (size_t y = 0; y < dim; ++y) {
+        in[y] = result[y * dim + x];
+      }
+
+      if (forward) {
+        GenTC::ForwardWavelet1D(in.data(), out.data(), dim);
+      } else {
+        GenTC::InverseWavelet1D(in.data(), out.data(), dim);
+      }
+
+      for (size_t y = 0; y < dim; ++y) {
+        result[y * dim + x] = out[y];
+      }
+    }
+  };
+
+  auto do_rows = [&]() {
+    for (size_t y = 0; y < dim; ++y) {
+      std::copy(result.begin() + y * dim, result.begin() + (y + 1) * dim, in.begin());
+      if (forward) {
+        GenTC::ForwardWavelet1D(in.data(), result.data() + y * dim, dim);
+      } else {
+        GenTC::InverseWavelet1D(in.data(), result.data() + y * dim, dim);
+      }
+    }
+  };
+
+  if (forward) {
+    do_columns();
+    do_rows();
+  } else {
+    do_rows();
+    do_columns();
+  }
+
+  return std::move(result);
+}
+
+static void Check2DMatchesReference(int16_t min_val, int16_t max_val) {
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> dist(min_val, max_val);
+
+  for (size_t dim = 1; dim <= 33; ++dim) {
+    std::vector<int16_t> xs(dim * dim);
+    for (auto &x : xs) {
+      x = static_cast<int16_t>(dist(gen));
+    }
+
+    for (int forward = 0; forward < 2; ++forward) {
+      const std::vector<int16_t> expected = Reference2D(xs, dim, forward != 0);
+
+      // Write into a block with a larger stride than the source
+      const size_t kStride = dim + 3;
+      std::vector<int16_t> out(kStride * dim, 0);
+      std::vector<int16_t> in_place(xs);
+      std::vector<int16_t> scratch(GenTC::WaveletScratchSize(dim));
+      if (forward) {
+        GenTC::ForwardWavelet2D(xs.data(), dim * sizeof(int16_t),
+                                out.data(), kStride * sizeof(int16_t), dim);
+        GenTC::ForwardWavelet2D(in_place.data(), dim * sizeof(int16_t),
+                                in_place.data(), dim * sizeof(int16_t), dim, scratch.data());
+      } else {
+        GenTC::InverseWavelet2D(xs.data(), dim * sizeof(int16_t),
+                                out.data(), kStride * sizeof(int16_t), dim);
+        GenTC::InverseWavelet2D(in_place.data(), dim * sizeof(int16_t),
+                                in_place.data(), dim * sizeof(int16_t), dim, scratch.data());
+      }
+
+      for (size_t y = 0; y < dim; ++y) {
+        for (size_t x = 0; x < dim; ++x) {
+          ASSERT_EQ(expected[y * dim + x], out[y * kStride + x])
+            << "Dim: " << dim << " Forward: " << forward << " At: " << x << ", " << y;
+          ASSERT_EQ(expected[y * dim + x], in_place[y * dim + x])
+            << "Dim: " << dim << " Forward: " << forward << " At: " << x << ", " << y;
+        }
+      }
+    }
+  }
+}
+
+TEST(Wavelet, Matches1DTransformsOnPixels) {
+  Check2DMatchesReference(-128, 127);
+}
+
+TEST(Wavelet, Matches1DTransformsWhenOverflowing) {
+  // Sums of neighbors don't fit in 16 bits here, and the results wrap around
+  Check2DMatchesReference(-32768, 32767);
+}
@@ -0,0 +1,94 @@
+#ifndef __TCAR_THREAD_POOL_H__
+#define __TCAR_THREAD_POOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "ctpl/ctpl_stl.h"
+
+namespace GenTC {
+
+  typedef ctpl::thread_pool ThreadPool;
+
+  // Splits [0, num_items) into contiguous ranges and calls fn(begin, end) for
+  // each of them on the threads in the pool. Blocks until every range has been
+  // processed. The calling thread works through the ranges too, and only waits
+  // on ranges that another thread has already started, so this may be called
+  // from one of the pool's own threads without deadlocking.
+  template<typename F>
+  void ParallelFor(ThreadPool &pool, size_t num_items, const F &fn) {
+    if (0 == num_items) {
+      return;
+    }
+
+    // A few more ranges than threads so that uneven work still balances out.
+    const size_t num_threads = static_cast<size_t>(std::max(1, pool.size()));
+    const size_t max_ranges = std::min(num_items, 4 * num_threads);
+    if (1 == max_ranges || 0 == pool.size()) {
+      fn(static_cast<size_t>(0), num_items);
+      return;
+    }
+
+    const size_t range_sz = (num_items + max_ranges - 1) / max_ranges;
+    const size_t num_ranges = (num_items + range_sz - 1) / range_sz;
+
+    // Helpers may not start until after we return, in which case they find
+    // that every range is taken and never touch fn. Anything that they do
+    // touch is kept alive by the shared state.
+    struct State {
+      std::atomic<size_t> next_range;
+      std::mutex mutex;
+      std::condition_variable all_done;
+      size_t num_done;
+    };
+
+    std::shared_ptr<State> state = std::make_shared<State>();
+    state->next_range = 0;
+    state->num_done = 0;
+
+    auto run_ranges = [state, &fn, num_items, range_sz, num_ranges]() {
+      size_t num_run = 0;
+      for (size_t r = state->next_range++; r < num_ranges; r = state->next_range++) {
+        fn(r * range_sz, std::min(num_items, (r + 1) * range_sz));
+        num_run++;
+      }
+
+      if (num_run > 0) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->num_done += num_run;
+        if (num_ranges == state->num_done) {
+          state->all_done.notify_all();
+        }
+      }
+    };
+
+    const size_t num_helpers = std::min(num_threads, num_ranges - 1);
+    for (size_t i = 0; i < num_helpers; ++i) {
+      pool.push([run_ranges](int) { run_ranges(); });
+    }
+
+    run_ranges();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->all_done.wait(lock, [&state, num_ranges]() { return num_ranges == state->num_done; });
+  }
+
+  // Same as above, but without a pool everything runs on the calling thread.
+  template<typename F>
+  void ParallelFor(ThreadPool *pool, size_t num_items, const F &fn) {
+    if (nullptr == pool) {
+      if (num_items > 0) {
+        fn(static_cast<size_t>(0), num_items);
+      }
+      return;
+    }
+
+    ParallelFor(*pool, num_items, fn);
+  }
+
+}  // namespace GenTC
+
+#endif  // __TCAR_THREAD_POOL_H__
@@ -0,0 +1,311 @@
+#ifndef __TCAR_TILED_PIPELINE_H__
+#define __TCAR_TILED_PIPELINE_H__
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "image.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+namespace GenTC {
+
+// The values that a tile of each pipeline type is made of
+template<typename T> struct TileElement;
+
+template<typename T> struct TileElement<Image<T> > {
+  typedef T Ty;
+};
+
+template<typename T> struct TileElement<ImageView<const T> > {
+  typedef T Ty;
+};
+
+template<typename T> struct TileElement<std::vector<T> > {
+  typedef T Ty;
+};
+
+namespace detail {
+
+  // Where the pixels of a plane are and how far apart its rows are
+  template<typename T> const T *PlaneData(const Image<T> &img) { return img.GetPixels().data(); }
+  template<typename T> size_t PlaneStride(const Image<T> &img) { return img.Width(); }
+  template<typename T> const T *PlaneData(const ImageView<const T> &view) { return view.Data(); }
+  template<typename T> size_t PlaneStride(const ImageView<const T> &view) { return view.Stride(); }
+
+  // Runs the whole image units on a plane. Views need to be copied into an
+  // image first, since that's what the units take.
+  template<typename T, typename OutType> std::unique_ptr<OutType>
+  RunWhole(const PipelineUnit<Image<T>, OutType> &unit, const std::unique_ptr<Image<T> > &in) {
+    return std::move(unit.Run(in));
+  }
+
+  template<typename T, typename OutType> std::unique_ptr<OutType>
+  RunWhole(const PipelineUnit<Image<T>, OutType> &unit, const std::unique_ptr<ImageView<const T> > &in) {
+    return std::move(unit.Run(in->ToImage()));
+  }
+
+  template<typename T, typename OutType> std::unique_ptr<OutType>
+  ConsumeWhole(const PipelineUnit<Image<T>, OutType> &unit, std::unique_ptr<Image<T> > &&in,
+               PipelineContext *ctx) {
+    return std::move(unit.Consume(std::move(in), ctx));
+  }
+
+  template<typename T, typename OutType> std::unique_ptr<OutType>
+  ConsumeWhole(const PipelineUnit<Image<T>, OutType> &unit, std::unique_ptr<ImageView<const T> > &&in,
+               PipelineContext *ctx) {
+    return std::move(unit.Consume(in->ToImage(), ctx));
+  }
+
+  // Same as PipelineChain, but the units are shared with the tile chain.
+  template<typename InType, typename IntermediateType, typename OutType>
+  class SharedPipelineChain : public PipelineUnit<InType, OutType> {
+   public:
+    typedef PipelineUnit<InType, OutType> Base;
+    SharedPipelineChain(const std::shared_ptr<PipelineUnit<InType, IntermediateType> > &a,
+                        const std::shared_ptr<PipelineUnit<IntermediateType, OutType> > &b)
+      : Base()
+      , _first(a)
+      , _second(b) { }
+
+    typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
+      return std::move(_second->Run(_first->Run(in)));
+    }
+
+    typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                      PipelineContext *ctx) const override {
+      return std::move(_second->Consume(_first->Consume(std::move(in), ctx), ctx));
+    }
+
+   private:
+    std::shared_ptr<PipelineUnit<InType, IntermediateType> > _first;
+    std::shared_ptr<PipelineUnit<IntermediateType, OutType> > _second;
+  };
+
+  // Runs two tile units back to back on a tile that stays on the stack.
+  template<typename InElem, typename MidElem, typename OutElem>
+  class TileUnitChain : public TileUnit<InElem, OutElem> {
+   public:
+    typedef TileUnit<InElem, OutElem> Base;
+    TileUnitChain(const std::shared_ptr<TileUnit<InElem, MidElem> > &a,
+                  const std::shared_ptr<TileUnit<MidElem, OutElem> > &b)
+      : Base()
+      , _first(a)
+      , _second(b) { }
+
+    // Once a unit has grouped the tiles, the next grouping unit would move
+    // whole tiles around in the stream rather than values within a tile, so
+    // chains can only group once.
+    bool SupportsTiles(size_t width, size_t height, size_t tile_dim) const override {
+      return !(_first->GroupsTiles() && _second->GroupsTiles())
+        && _first->SupportsTiles(width, height, tile_dim)
+        && _second->SupportsTiles(width, height, tile_dim);
+    }
+
+    bool GroupsTiles() const override {
+      return _first->GroupsTiles() || _second->GroupsTiles();
+    }
+
+    void RunTile(const InElem *in, OutElem *out, size_t tile_dim) const override {
+      assert(tile_dim <= Base::kMaxTileDim);
+      MidElem tile[Base::kMaxTileDim * Base::kMaxTileDim];
+      _first->RunTile(in, tile, tile_dim);
+      _second->RunTile(tile, out, tile_dim);
+    }
+
+   private:
+    std::shared_ptr<TileUnit<InElem, MidElem> > _first;
+    std::shared_ptr<TileUnit<MidElem, OutElem> > _second;
+  };
+
+  // Runs a chain of tile units over a whole plane, a tile at a time,
+  // falling back to the whole image units when the chain can't be tiled.
+  // The plane is either an Image or a view of one.
+  template<typename InType, typename OutPixel>
+  class TiledPipelineUnit : public PipelineUnit<InType, std::vector<OutPixel> > {
+   public:
+    typedef typename TileElement<InType>::Ty InPixel;
+    typedef PipelineUnit<InType, std::vector<OutPixel> > Base;
+    typedef PipelineUnit<Image<InPixel>, std::vector<OutPixel> > WholeUnitType;
+    typedef TileUnit<InPixel, OutPixel> TileUnitType;
+
+    TiledPipelineUnit(const std::shared_ptr<WholeUnitType> &whole,
+                      const std::shared_ptr<TileUnitType> &tile,
+                      size_t tile_dim, ThreadPool *pool)
+      : Base()
+      , _whole(whole)
+      , _tile(tile)
+      , _tile_dim(tile_dim)
+      , _pool(pool)
+    {
+      assert(_tile_dim > 0 && _tile_dim <= TileUnitType::kMaxTileDim);
+    }
+
+    typename Base::ReturnType Run(const typename Base::ArgType &in) const override {
+      if (!CanTile(*in)) {
+        return std::move(RunWhole(*_whole, in));
+      }
+
+      typename Base::ReturnType result(new std::vector<OutPixel>);
+      RunTiles(*in, result.get());
+      return std::move(result);
+    }
+
+    typename Base::ReturnType Consume(typename Base::ArgType &&in,
+                                      PipelineContext *ctx) const override {
+      if (!CanTile(*in)) {
+        return std::move(ConsumeWhole(*_whole, std::move(in), ctx));
+      }
+
+      typename Base::ReturnType result = AcquireBuffer<std::vector<OutPixel> >(ctx);
+      RunTiles(*in, result.get());
+      RecycleBuffer(ctx, std::move(in));
+      return std::move(result);
+    }
+
+   private:
+    bool CanTile(const InType &in) const {
+      return _tile
+        && in.Width() > 0 && in.Height() > 0
+        && (in.Width() % _tile_dim) == 0
+        && (in.Height() % _tile_dim) == 0
+        && _tile->SupportsTiles(in.Width(), in.Height(), _tile_dim);
+    }
+
+    void RunTiles(const InType &in, std::vector<OutPixel> *out) const {
+      const size_t width = in.Width();
+      const size_t stride = PlaneStride(in);
+      const size_t tiles_x = width / _tile_dim;
+      const size_t tiles_y = in.Height() / _tile_dim;
+      const size_t tile_sz = _tile_dim * _tile_dim;
+      const bool grouped = _tile->GroupsTiles();
+      out->resize(width * in.Height());
+
+      const InPixel *src = PlaneData(in);
+      OutPixel *dst = out->data();
+      auto run_tiles = [&](size_t begin, size_t end) {
+        InPixel in_tile[TileUnitType::kMaxTileDim * TileUnitType::kMaxTileDim];
+        OutPixel out_tile[TileUnitType::kMaxTileDim * TileUnitType::kMaxTileDim];
+        for (size_t tile_idx = begin; tile_idx < end; ++tile_idx) {
+          const size_t x = (tile_idx % tiles_x) * _tile_dim;
+          const size_t y = (tile_idx / tiles_x) * _tile_dim;
+          for (size_t row = 0; row < _tile_dim; ++row) {
+            const InPixel *src_row = src + (y + row) * stride + x;
+            std::copy(src_row, src_row + _tile_dim, in_tile + row * _tile_dim);
+          }
+
+          _tile->RunTile(in_tile, out_tile, _tile_dim);
+
+          if (grouped) {
+            std::copy(out_tile, out_tile + tile_sz, dst + tile_idx * tile_sz);
+          } else {
+            for (size_t row = 0; row < _tile_dim; ++row) {
+              const OutPixel *tile_row = out_tile + row * _tile_dim;
+              std::copy(tile_row, tile_row + _tile_dim, dst + (y + row) * width + x);
+            }
+          }
+        }
+      };
+
+      if (nullptr == _pool) {
+        run_tiles(0, tiles_x * tiles_y);
+      } else {
+        ParallelFor(*_pool, tiles_x * tiles_y, run_tiles);
+      }
+    }
+
+    std::shared_ptr<WholeUnitType> _whole;
+    std::shared_ptr<TileUnitType> _tile;
+    size_t _tile_dim;
+    ThreadPool *_pool;
+  };
+
+}  // namespace detail
+
+// Builds a chain of units like Pipeline does, but runs them one tile of the
+// input plane at a time when every unit in the chain is also a TileUnit.
+// Each tile then goes through the entire chain while it's still in cache,
+// instead of every unit streaming the whole plane through memory. If some
+// unit can't be tiled, or the plane doesn't split into whole tiles, the
+// units run on the whole image like they would in a Pipeline.
+//
+// The built unit can also take views of the input planes, such as the ones
+// that ImageSplit returns for planar images, in which case the tiles are read
+// straight out of the viewed storage without copying the plane.
+template<typename InType, typename OutType>
+class TiledPipeline {
+ public:
+  typedef typename TileElement<InType>::Ty InElem;
+  typedef typename TileElement<OutType>::Ty OutElem;
+
+  static std::unique_ptr<TiledPipeline<InType, OutType> >
+    Create(std::unique_ptr<PipelineUnit<InType, OutType> > &&unit) {
+    std::shared_ptr<PipelineUnit<InType, OutType> > whole(std::move(unit));
+    std::shared_ptr<TileUnit<InElem, OutElem> > tile =
+      std::dynamic_pointer_cast<TileUnit<InElem, OutElem> >(whole);
+    return std::move(std::unique_ptr<TiledPipeline<InType, OutType> >(
+      new TiledPipeline<InType, OutType>(whole, tile)));
+  }
+
+  template<typename NextType> std::unique_ptr<TiledPipeline<InType, NextType> >
+    Chain(std::unique_ptr<PipelineUnit<OutType, NextType> > &&next) {
+    typedef typename TileElement<NextType>::Ty NextElem;
+    typedef TiledPipeline<InType, NextType> OutputType;
+
+    std::shared_ptr<PipelineUnit<OutType, NextType> > next_whole(std::move(next));
+    std::shared_ptr<TileUnit<OutElem, NextElem> > next_tile =
+      std::dynamic_pointer_cast<TileUnit<OutElem, NextElem> >(next_whole);
+
+    std::shared_ptr<PipelineUnit<InType, NextType> > whole =
+      std::make_shared<detail::SharedPipelineChain<InType, OutType, NextType> >(
+        _whole, next_whole);
+
+    std::shared_ptr<TileUnit<InElem, NextElem> > tile;
+    if (_tile && next_tile) {
+      tile = std::make_shared<detail::TileUnitChain<InElem, OutElem, NextElem> >(
+        _tile, next_tile);
+    }
+
+    return std::move(std::unique_ptr<OutputType>(new OutputType(whole, tile)));
+  }
+
+  // Whether every unit in the chain can run on tiles
+  bool IsTiled() const { return static_cast<bool>(_tile); }
+
+  // Returns a unit that runs the chain on tile_dim x tile_dim tiles of an
+  // image, spread across the threads of pool if there is one. The pool must
+  // not be the one that the unit itself runs on. SrcType is either InType
+  // or a view of the same pixels.
+  template<typename SrcType = InType>
+  std::unique_ptr<PipelineUnit<SrcType, OutType> > Build(size_t tile_dim, ThreadPool *pool) const {
+    static_assert(std::is_same<InType, Image<InElem> >::value,
+                  "Tiled pipelines must start with an image!");
+    static_assert(std::is_same<SrcType, Image<InElem> >::value ||
+                  std::is_same<SrcType, ImageView<const InElem> >::value,
+                  "Tiled pipelines can only run on images or views of them!");
+    static_assert(std::is_same<OutType, std::vector<OutElem> >::value,
+                  "Tiled pipelines must end with a stream of values!");
+
+    typedef detail::TiledPipelineUnit<SrcType, OutElem> UnitType;
+    return std::move(std::unique_ptr<PipelineUnit<SrcType, OutType> >(
+      new UnitType(_whole, _tile, tile_dim, pool)));
+  }
+
+ private:
+  template<typename I, typename O> friend class TiledPipeline;
+
+  TiledPipeline<InType, OutType>(const std::shared_ptr<PipelineUnit<InType, OutType> > &whole,
+                                 const std::shared_ptr<TileUnit<InElem, OutElem> > &tile)
+    : _whole(whole)
+    , _tile(tile) { }
+
+  std::shared_ptr<PipelineUnit<InType, OutType> > _whole;
+  std::shared_ptr<TileUnit<InElem, OutElem> > _tile;
+};
+
+}  // namespace GenTC
+
+#endif  // __TCAR_TILED_PIPELINE_H__
@@ -2,6 +2,11 @@
 
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define GENTC_HAVE_SSE2 1
+#  include <emmintrin.h>
+#endif
+
 // Returns a normalized index in the given range by ping-ponging
 // across boundaries...
 //
@@ -14,14 +19,183 @@ static int NormalizeIndex(int idx, int range) {
   return (x ^ mask) + (mask & 1);
 }
 
-static void Transpose(int16_t *img, size_t dim, size_t rowbytes) {
-  uint8_t *bytes = reinterpret_cast<uint8_t *>(img);
-  for (size_t y = 0; y < dim; ++y) {
-    for (size_t x = y + 1; x < dim; ++x) {
-      int16_t *v1 = reinterpret_cast<int16_t *>(bytes + y * rowbytes);
-      int16_t *v2 = reinterpret_cast<int16_t *>(bytes + x * rowbytes);
-      std::swap(v1[x], v2[y]);
-    }
+// Every step of the lifting scheme has the form
+//
+//   out[i] = x[i] + kSign * ((a[i] + b[i] + kBias) / 2^kShift)
+//
+// where a and b are the neighbors of x. The 2D transforms line up the
+// neighbors of whole runs of values, so each step is done over contiguous
+// arrays that can be processed eight values at a time. The math is done
+// with 32 bit ints and truncated back to 16 bits just like the 1D
+// transforms do it, so that the results match them bit for bit.
+template<int kSign, int kBias, int kShift>
+static void LiftRow(const int16_t *x, const int16_t *a, const int16_t *b, int16_t *out, size_t n) {
+  size_t i = 0;
+
+#ifdef GENTC_HAVE_SSE2
+  const __m128i bias = _mm_set1_epi32(kBias);
+  auto lift = [&bias](__m128i xv, __m128i av, __m128i bv) {
+    const __m128i t = _mm_add_epi32(_mm_add_epi32(av, bv), bias);
+
+    // Division rounds towards zero, so negative values need a bias
+    const __m128i round = _mm_srli_epi32(_mm_srai_epi32(t, 31), 32 - kShift);
+    const __m128i q = _mm_srai_epi32(_mm_add_epi32(t, round), kShift);
+    const __m128i r = kSign > 0 ? _mm_add_epi32(xv, q) : _mm_sub_epi32(xv, q);
+
+    // Keep the low 16 bits without saturating
+    return _mm_srai_epi32(_mm_slli_epi32(r, 16), 16);
+  };
+
+  auto lo = [](__m128i v) { return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16); };
+  auto hi = [](__m128i v) { return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16); };
+
+  for (; i + 8 <= n; i += 8) {
+    const __m128i xv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i));
+    const __m128i av = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    const __m128i bv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+
+    const __m128i r_lo = lift(lo(xv), lo(av), lo(bv));
+    const __m128i r_hi = lift(hi(xv), hi(av), hi(bv));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(r_lo, r_hi));
+  }
+#endif
+
+  for (; i < n; ++i) {
+    const int t = static_cast<int>(a[i]) + static_cast<int>(b[i]) + kBias;
+    out[i] = static_cast<int16_t>(x[i] + kSign * (t / (1 << kShift)));
+  }
+}
+
+static void Predict(const int16_t *x, const int16_t *a, const int16_t *b, int16_t *out, size_t n) {
+  LiftRow<-1, 0, 1>(x, a, b, out, n);
+}
+
+static void Update(const int16_t *x, const int16_t *a, const int16_t *b, int16_t *out, size_t n) {
+  LiftRow<1, 2, 2>(x, a, b, out, n);
+}
+
+static void UndoPredict(const int16_t *x, const int16_t *a, const int16_t *b, int16_t *out, size_t n) {
+  LiftRow<1, 0, 1>(x, a, b, out, n);
+}
+
+static void UndoUpdate(const int16_t *x, const int16_t *a, const int16_t *b, int16_t *out, size_t n) {
+  LiftRow<-1, 2, 2>(x, a, b, out, n);
+}
+
+// With len samples there are num_low = len - len / 2 even samples and
+// num_high = len / 2 odd ones. Reflecting the signal at its ends means that
+// the k-th odd sample sits between the even samples k and k + 1, except for
+// the last odd one of an even length signal, which sees the last even sample
+// on both sides. Likewise, the k-th even sample sits between the high
+// coefficients k - 1 and k, except for the first one, and the last one of an
+// odd length signal. These helpers give the neighbors with that reflection.
+static size_t NextEven(size_t k, size_t num_low) { return (k + 1 < num_low) ? k + 1 : k; }
+static size_t PrevHigh(size_t k) { return (k > 0) ? k - 1 : 0; }
+static size_t NextHigh(size_t k, size_t num_high) { return (k < num_high) ? k : k - 1; }
+
+// Transforms a single row. The samples are deinterleaved into tmp so that
+// the interior of each lifting step runs over contiguous arrays, and only
+// the samples at the boundaries need their neighbors reflected.
+static void ForwardRow(const int16_t *src, int16_t *dst, size_t len, int16_t *tmp) {
+  const size_t num_low = len - (len / 2);
+  const size_t num_high = len / 2;
+
+  int16_t *even = tmp;
+  int16_t *odd = tmp + num_low;
+  for (size_t k = 0; k < num_high; ++k) {
+    even[k] = src[2 * k];
+    odd[k] = src[2 * k + 1];
+  }
+  if (num_low > num_high) {
+    even[num_high] = src[2 * num_high];
+  }
+
+  int16_t *low = dst;
+  int16_t *high = dst + num_low;
+
+  const size_t num_interior = (num_low > num_high) ? num_high : num_high - 1;
+  Predict(odd, even, even + 1, high, num_interior);
+  for (size_t k = num_interior; k < num_high; ++k) {
+    Predict(odd + k, even + k, even + NextEven(k, num_low), high + k, 1);
+  }
+
+  Update(even, high, high, low, 1);
+  Update(even + 1, high, high + 1, low + 1, num_high - 1);
+  for (size_t k = num_high; k < num_low; ++k) {
+    Update(even + k, high + PrevHigh(k), high + NextHigh(k, num_high), low + k, 1);
+  }
+}
+
+static void InverseRow(const int16_t *src, int16_t *dst, size_t len, int16_t *tmp) {
+  const size_t num_low = len - (len / 2);
+  const size_t num_high = len / 2;
+
+  const int16_t *low = src;
+  const int16_t *high = src + num_low;
+
+  int16_t *even = tmp;
+  int16_t *odd = tmp + num_low;
+
+  UndoUpdate(low, high, high, even, 1);
+  UndoUpdate(low + 1, high, high + 1, even + 1, num_high - 1);
+  for (size_t k = num_high; k < num_low; ++k) {
+    UndoUpdate(low + k, high + PrevHigh(k), high + NextHigh(k, num_high), even + k, 1);
+  }
+
+  const size_t num_interior = (num_low > num_high) ? num_high : num_high - 1;
+  UndoPredict(high, even, even + 1, odd, num_interior);
+  for (size_t k = num_interior; k < num_high; ++k) {
+    UndoPredict(high + k, even + k, even + NextEven(k, num_low), odd + k, 1);
+  }
+
+  for (size_t k = 0; k < num_high; ++k) {
+    dst[2 * k] = even[k];
+    dst[2 * k + 1] = odd[k];
+  }
+  if (num_low > num_high) {
+    dst[2 * num_high] = even[num_high];
+  }
+}
+
+// Transforms all of the columns at once by running each lifting step on
+// whole rows. The result goes into the dim x dim array dst.
+static void ForwardColumns(const uint8_t *src, size_t src_rowbytes, int16_t *dst, size_t dim) {
+  const size_t num_low = dim - (dim / 2);
+  const size_t num_high = dim / 2;
+  auto src_row = [src, src_rowbytes](size_t y) {
+    return reinterpret_cast<const int16_t *>(src + y * src_rowbytes);
+  };
+
+  int16_t *low = dst;
+  int16_t *high = dst + num_low * dim;
+  for (size_t k = 0; k < num_high; ++k) {
+    Predict(src_row(2 * k + 1), src_row(2 * k), src_row(2 * NextEven(k, num_low)),
+            high + k * dim, dim);
+  }
+
+  for (size_t k = 0; k < num_low; ++k) {
+    Update(src_row(2 * k), high + PrevHigh(k) * dim, high + NextHigh(k, num_high) * dim,
+           low + k * dim, dim);
+  }
+}
+
+static void InverseColumns(const int16_t *src, uint8_t *dst, size_t dst_rowbytes, size_t dim) {
+  const size_t num_low = dim - (dim / 2);
+  const size_t num_high = dim / 2;
+  auto dst_row = [dst, dst_rowbytes](size_t y) {
+    return reinterpret_cast<int16_t *>(dst + y * dst_rowbytes);
+  };
+
+  const int16_t *low = src;
+  const int16_t *high = src + num_low * dim;
+  for (size_t k = 0; k < num_low; ++k) {
+    UndoUpdate(low + k * dim, high + PrevHigh(k) * dim, high + NextHigh(k, num_high) * dim,
+               dst_row(2 * k), dim);
+  }
+
+  for (size_t k = 0; k < num_high; ++k) {
+    UndoPredict(high + k * dim, dst_row(2 * k), dst_row(2 * NextEven(k, num_low)),
+                dst_row(2 * k + 1), dim);
   }
 }
 
@@ -96,62 +270,61 @@ void InverseWavelet1D(const int16_t *src, int16_t *dst, size_t len) {
 
 void ForwardWavelet2D(const int16_t *src, size_t src_rowbytes,
                       int16_t *dst, size_t dst_rowbytes, size_t dim) {
-  // Allocate a bit of scratch memory
-  std::vector<int16_t> scratch(src, src + dim * dim);
-  const uint8_t *src_bytes = reinterpret_cast<const uint8_t *>(src);
-  uint8_t *dst_bytes = reinterpret_cast<uint8_t *>(dst);
-
-  // Copy src into scratch
-  for (size_t row = 0; row < dim; ++row) {
-    const int16_t *img = reinterpret_cast<const int16_t *>(src_bytes + row * src_rowbytes);
-    memcpy(scratch.data() + row*dim, img, sizeof(scratch[0]) * dim);
-  }
+  std::vector<int16_t> scratch(WaveletScratchSize(dim));
+  ForwardWavelet2D(src, src_rowbytes, dst, dst_rowbytes, dim, scratch.data());
+}
 
-  // Do all the columns, store into dst
-  Transpose(scratch.data(), dim, sizeof(scratch[0]) * dim);
+void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
+                      int16_t *dst, size_t dst_rowbytes, size_t dim) {
+  std::vector<int16_t> scratch(WaveletScratchSize(dim));
+  InverseWavelet2D(src, src_rowbytes, dst, dst_rowbytes, dim, scratch.data());
+}
 
-  for (size_t col = 0; col < dim; ++col) {
-    int16_t *img = reinterpret_cast<int16_t *>(dst_bytes + col*dst_rowbytes);
-    ForwardWavelet1D(scratch.data() + col*dim, img, dim);
+void ForwardWavelet2D(const int16_t *src, size_t src_rowbytes,
+                      int16_t *dst, size_t dst_rowbytes, size_t dim, int16_t *scratch) {
+  if (dim == 0) {
+    return;
   }
 
-  // Copy dst back into scratch
-  for (size_t row = 0; row < dim; ++row) {
-    const int16_t *img = reinterpret_cast<const int16_t *>(dst_bytes + row * dst_rowbytes);
-    memcpy(scratch.data() + row*dim, img, sizeof(scratch[0]) * dim);
+  if (dim == 1) {
+    dst[0] = src[0];
+    return;
   }
 
-  Transpose(scratch.data(), dim, sizeof(scratch[0]) * dim);
+  // Do all the columns first, then all the rows of the result. The rows
+  // are only written to dst once we're done reading src, so the two may
+  // be the same.
+  int16_t *tmp = scratch + dim * dim;
+  ForwardColumns(reinterpret_cast<const uint8_t *>(src), src_rowbytes, scratch, dim);
 
-  // Go through and do all the rows
+  uint8_t *dst_bytes = reinterpret_cast<uint8_t *>(dst);
   for (size_t row = 0; row < dim; ++row) {
-    int16_t *dst_img = reinterpret_cast<int16_t *>(dst_bytes + row*dst_rowbytes);
-    ForwardWavelet1D(scratch.data() + row * dim, dst_img, dim);
+    int16_t *dst_img = reinterpret_cast<int16_t *>(dst_bytes + row * dst_rowbytes);
+    ForwardRow(scratch + row * dim, dst_img, dim, tmp);
   }
 }
 
-extern void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
-                             int16_t *dst, size_t dst_rowbytes, size_t dim) {
-  // Allocate a bit of scratch memory
-  std::vector<int16_t> scratch(dim * dim);
-  const uint8_t *src_bytes = reinterpret_cast<const uint8_t *>(src);
-  uint8_t *dst_bytes = reinterpret_cast<uint8_t *>(dst);
-
-  // Do all the rows, store into scratch
-  for (size_t row = 0; row < dim; ++row) {
-    const int16_t *src_img = reinterpret_cast<const int16_t *>(src_bytes + row * src_rowbytes);
-    InverseWavelet1D(src_img, scratch.data() + row * dim, dim);
+void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
+                      int16_t *dst, size_t dst_rowbytes, size_t dim, int16_t *scratch) {
+  if (dim == 0) {
+    return;
   }
 
-  Transpose(scratch.data(), dim, sizeof(scratch[0]) * dim);
+  if (dim == 1) {
+    dst[0] = src[0];
+    return;
+  }
 
-  // Do all the cols, store into dst
-  for (size_t col = 0; col < dim; ++col) {
-    int16_t *dst_img = reinterpret_cast<int16_t *>(dst_bytes + col * dst_rowbytes);
-    InverseWavelet1D(scratch.data() + col * dim, dst_img, dim);
+  // Undo the rows first and then the columns, the reverse of the forward
+  // transform.
+  int16_t *tmp = scratch + dim * dim;
+  const uint8_t *src_bytes = reinterpret_cast<const uint8_t *>(src);
+  for (size_t row = 0; row < dim; ++row) {
+    const int16_t *src_img = reinterpret_cast<const int16_t *>(src_bytes + row * src_rowbytes);
+    InverseRow(src_img, scratch + row * dim, dim, tmp);
   }
 
-  Transpose(dst, dim, dst_rowbytes);
+  InverseColumns(scratch, reinterpret_cast<uint8_t *>(dst), dst_rowbytes, dim);
 }
 
-}
+}  // namespace GenTC
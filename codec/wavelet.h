@@ -15,12 +15,29 @@ extern size_t ForwardWavelet1D(const int16_t *src, int16_t *dst, size_t len);
 
 extern void InverseWavelet1D(const int16_t *src, int16_t *dst, size_t len);
 
+// Performs one level of the 2D transform on a dim x dim block by
+// transforming the columns and then the rows. Gives the same results as
+// running the 1D transforms on each of them. The source and destination may
+// be the same block.
 extern void ForwardWavelet2D(const int16_t *src, size_t src_rowbytes,
                              int16_t *dst, size_t dst_rowbytes, size_t dim);
 
 extern void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
                              int16_t *dst, size_t dst_rowbytes, size_t dim);
 
+// The number of values of scratch memory that the 2D transforms need.
+inline size_t WaveletScratchSize(size_t dim) { return dim * dim + dim; }
+
+// Same as above, but with scratch memory of at least WaveletScratchSize(dim)
+// values from the caller, so that it can be reused across blocks and levels.
+extern void ForwardWavelet2D(const int16_t *src, size_t src_rowbytes,
+                             int16_t *dst, size_t dst_rowbytes, size_t dim,
+                             int16_t *scratch);
+
+extern void InverseWavelet2D(const int16_t *src, size_t src_rowbytes,
+                             int16_t *dst, size_t dst_rowbytes, size_t dim,
+                             int16_t *scratch);
+
 }  // namespace GenTC
 
 #endif  // __TCAR_WAVELET_H__